@@ -289,10 +289,12 @@ void Soundscape_AddFile( const char* szFile )
 
 void C_SoundscapeSystem::AddSoundScapeFile( const char* filename )
 {
-	KeyValues* script = new KeyValues( filename );
 #ifndef _XBOX
-	if( script->LoadFromFile( filesystem, filename ) )
+	// the scripts are only looked up until shutdown, so they go in one arena each
+	KeyValues* script = KeyValues::LoadFromFileReadOnly( filesystem, filename );
+	if( script )
 #else
+	KeyValues* script = new KeyValues( filename );
 	if( filesystem->LoadKeyValues( *script, IFileSystem::TYPE_SOUNDSCAPE, filename, "GAME" ) )
 #endif
 	{
@@ -312,7 +314,7 @@ void C_SoundscapeSystem::AddSoundScapeFile( const char* filename )
 		// Keep pointer around so we can delete it at exit
 		m_SoundscapeScripts.AddToTail( script );
 	}
-	else
+	else if( script )
 	{
 		script->deleteThis();
 	}
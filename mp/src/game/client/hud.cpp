@@ -422,36 +422,33 @@ void CHud::Init( void )
 
 	m_bHudTexturesLoaded = false;
 
-	KeyValues* kv = new KeyValues( "layout" );
+	KeyValues* kv = KeyValues::LoadFromFileReadOnly( filesystem, "scripts/HudLayout.res" );
 	if( kv )
 	{
-		if( kv->LoadFromFile( filesystem, "scripts/HudLayout.res" ) )
+		int numelements = m_HudList.Size();
+
+		for( int i = 0; i < numelements; i++ )
 		{
-			int numelements = m_HudList.Size();
+			CHudElement* element = m_HudList[i];
 
-			for( int i = 0; i < numelements; i++ )
+			vgui::Panel* pPanel = dynamic_cast<vgui::Panel*>( element );
+			if( !pPanel )
 			{
-				CHudElement* element = m_HudList[i];
-
-				vgui::Panel* pPanel = dynamic_cast<vgui::Panel*>( element );
-				if( !pPanel )
-				{
-					Msg( "Non-vgui hud element %s\n", m_HudList[i]->GetName() );
-					continue;
-				}
+				Msg( "Non-vgui hud element %s\n", m_HudList[i]->GetName() );
+				continue;
+			}
 
-				KeyValues* key = kv->FindKey( pPanel->GetName(), false );
-				if( !key )
-				{
-					Msg( "Hud element '%s' doesn't have an entry '%s' in scripts/HudLayout.res\n", m_HudList[i]->GetName(), pPanel->GetName() );
-				}
+			KeyValues* key = kv->FindKey( pPanel->GetName(), false );
+			if( !key )
+			{
+				Msg( "Hud element '%s' doesn't have an entry '%s' in scripts/HudLayout.res\n", m_HudList[i]->GetName(), pPanel->GetName() );
+			}
 
-				// Note:  When a panel is parented to the module root, it's "parent" is returned as NULL.
-				if( !element->IsParentedToClientDLLRootPanel() &&
-						!pPanel->GetParent() )
-				{
-					DevMsg( "Hud element '%s'/'%s' doesn't have a parent\n", m_HudList[i]->GetName(), pPanel->GetName() );
-				}
+			// Note:  When a panel is parented to the module root, it's "parent" is returned as NULL.
+			if( !element->IsParentedToClientDLLRootPanel() &&
+					!pPanel->GetParent() )
+			{
+				DevMsg( "Hud element '%s'/'%s' doesn't have a parent\n", m_HudList[i]->GetName(), pPanel->GetName() );
 			}
 		}
 
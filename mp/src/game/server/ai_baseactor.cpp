@@ -1679,7 +1679,7 @@ void CAI_BaseActor::MaintainLookTargets( float flInterval )
 		PlayExpressionForState( GetState() );
 	}
 
-	CUtlVector<CAI_InterestTarget_t*> active;
+	CUtlVectorPooled<CAI_InterestTarget_t*> active;
 	// clean up random look targets
 	for( i = 0; i < m_randomLookQueue.Count(); i++ )
 	{
@@ -588,7 +588,7 @@ bool CAI_MoveProbe::TestGroundMove( const Vector& vecActualStart, const Vector&
 	float distStartToIgnoreGround = ( pctToCheckStandPositions == 100 ) ? pMoveTrace->flTotalDist : pMoveTrace->flTotalDist * ( pctToCheckStandPositions * 0.01 );
 	bool bTryNavIgnore = ( ( vecActualStart - GetLocalOrigin() ).Length2DSqr() < 0.1 && fabsf( vecActualStart.z - GetLocalOrigin().z ) < checkStepArgs.stepHeight * 0.5 );
 
-	CUtlVector<CBaseEntity*> ignoredEntities;
+	CUtlVectorPooled<CBaseEntity*> ignoredEntities;
 
 	for( ;; )
 	{
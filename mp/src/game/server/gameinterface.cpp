@@ -89,6 +89,7 @@
 #include "tier3/tier3.h"
 #include "serverbenchmark_base.h"
 #include "querycache.h"
+#include "tier1/sizeclassalloc.h"
 #ifdef MAPBASE
 	#include "world.h"
 #endif
@@ -1292,6 +1293,26 @@ void CServerGameDLL::GameServerSteamAPIShutdown( void )
 #endif
 }
 
+CON_COMMAND( mem_sizeclass_stats, "Print how many allocations the pooled temporary containers kept off the heap" )
+{
+	if( !UTIL_IsCommandIssuedByServerAdmin() )
+	{
+		return;
+	}
+
+	SizeClassAllocStats_t total, frame;
+	CSizeClassAllocator::GetStats( total );
+	CSizeClassAllocator::GetFrameStats( frame );
+
+	// every alloc that didn't need a new chunk or go to the heap for a big block never touched the heap
+	Msg( "Size-class pools, total: %lld allocs, %lld frees, %lld chunk allocs, %lld large allocs, %lld heap allocs removed\n",
+		 ( long long )total.m_nAllocs, ( long long )total.m_nFrees, ( long long )total.m_nChunkAllocs, ( long long )total.m_nLargeAllocs,
+		 ( long long )( total.m_nAllocs - total.m_nChunkAllocs - total.m_nLargeAllocs ) );
+	Msg( "Size-class pools, last frame: %lld allocs, %lld chunk allocs, %lld large allocs, %lld heap allocs removed\n",
+		 ( long long )frame.m_nAllocs, ( long long )frame.m_nChunkAllocs, ( long long )frame.m_nLargeAllocs,
+		 ( long long )( frame.m_nAllocs - frame.m_nChunkAllocs - frame.m_nLargeAllocs ) );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Called at the start of every game frame
 //-----------------------------------------------------------------------------
@@ -1392,6 +1413,8 @@ void CServerGameDLL::GameFrame( bool simulating )
 	// Any entities that detect network state changes on a timer do it here.
 	g_NetworkPropertyEventMgr.FireEvents();
 
+	CSizeClassAllocator::EndFrame();
+
 	gpGlobals->frametime = oldframetime;
 }
 
@@ -126,6 +126,7 @@ void CLogicExternalData::LoadFile()
 	}
 
 	m_pRoot = new KeyValues( m_iszFile );
+	m_pRoot->UsesChildIndex( true );
 	m_pRoot->LoadFromFile( g_pFullFileSystem, m_iszFile, "MOD" );
 
 	// This shold work even if the file didn't load.
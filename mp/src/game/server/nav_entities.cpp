@@ -291,7 +291,7 @@ void CFuncNavCost::UpdateAllNavCostDecoration( void )
 		Extent extent;
 		extent.Init( cost );
 
-		CUtlVector< CNavArea* > overlapVector;
+		CUtlVectorPooled< CNavArea* > overlapVector;
 		TheNavMesh->CollectAreasOverlappingExtent( extent, &overlapVector );
 
 		Ray_t ray;
@@ -673,8 +673,8 @@ public:
 	/**
 	 * Populate the given vector with all navigation areas that overlap the given extent.
 	 */
-	template< typename NavAreaType >
-	void CollectAreasOverlappingExtent( const Extent& extent, CUtlVector< NavAreaType* >* outVector )
+	template< typename NavAreaType, typename A >
+	void CollectAreasOverlappingExtent( const Extent& extent, CUtlVector< NavAreaType*, A >* outVector )
 	{
 		if( !m_grid.Count() )
 		{
@@ -792,7 +792,8 @@ inline void SearchSurroundingAreas( CNavArea* startArea, ISearchSurroundingAreas
  * Areas in the collection will be "marked", returning true for IsMarked().
  * Each area in the collection's GetCostSoFar() will be approximate travel distance from 'startArea'.
  */
-inline void CollectSurroundingAreas( CUtlVector< CNavArea* >* nearbyAreaVector, CNavArea* startArea, float travelDistanceLimit = 1500.0f, float maxStepUpLimit = StepHeight, float maxDropDownLimit = 100.0f )
+template< typename A >
+inline void CollectSurroundingAreas( CUtlVector< CNavArea*, A >* nearbyAreaVector, CNavArea* startArea, float travelDistanceLimit = 1500.0f, float maxStepUpLimit = StepHeight, float maxDropDownLimit = 100.0f )
 {
 	nearbyAreaVector->RemoveAll();
 
@@ -1005,7 +1006,7 @@ void SelectSeparatedShuffleSet( int maxCount, float minSeparation, const CUtlVec
 
 	outVector->RemoveAll();
 
-	CUtlVector< T* > shuffledVector;
+	CUtlVectorPooled< T* > shuffledVector;
 
 	int i, j;
 
@@ -1031,7 +1032,7 @@ void SelectSeparatedShuffleSet( int maxCount, float minSeparation, const CUtlVec
 	{
 		T* area = shuffledVector[i];
 
-		CUtlVector< CNavArea* > nearVector;
+		CUtlVectorPooled< CNavArea* > nearVector;
 		CollectSurroundingAreas( &nearVector, area, minSeparation, 2.0f * StepHeight, 2.0f * StepHeight );
 
 		for( j = 0; j < i; ++j )
@@ -557,6 +557,7 @@ public:
 			Q_strncpy( szFullName, pFile, sizeof( szFullName ) );
 		}
 		KeyValues* pkvFile = new KeyValues( "MapEdit" );
+		pkvFile->UsesChildIndex( true );
 		if( pkvFile->LoadFromFile( filesystem, szFullName, "MOD" ) )
 		{
 			Msg( "MapEdit: Loading MapEdit data from %s. \n", szFullName );
@@ -856,6 +857,7 @@ void CC_MapEdit_Print( const CCommand& args )
 	if( szFullName && filesystem->FileExists( szFullName ) )
 	{
 		KeyValues* pkvFile = new KeyValues( "MapEdit" );
+		pkvFile->UsesChildIndex( true );
 		if( pkvFile->LoadFromFile( filesystem, szFullName, "MOD" ) )
 		{
 			Msg( "MapEdit: Printing MapEdit data from %s. \n", szFullName );
@@ -62,8 +62,8 @@ int GetAttachTypeFromString( const char* pszString )
 void GetParticleManifest( CUtlVector<CUtlString>& list )
 {
 	// Open the manifest file, and read the particles specified inside it
-	KeyValues* manifest = new KeyValues( PARTICLES_MANIFEST_FILE );
-	if( manifest->LoadFromFile( filesystem, PARTICLES_MANIFEST_FILE, "GAME" ) )
+	KeyValues* manifest = KeyValues::LoadFromFileReadOnly( filesystem, PARTICLES_MANIFEST_FILE, "GAME" );
+	if( manifest )
 	{
 		for( KeyValues* sub = manifest->GetFirstSubKey(); sub != NULL; sub = sub->GetNextKey() )
 		{
@@ -75,13 +75,13 @@ void GetParticleManifest( CUtlVector<CUtlString>& list )
 
 			Warning( "CParticleMgr::Init:  Manifest '%s' with bogus file type '%s', expecting 'file'\n", PARTICLES_MANIFEST_FILE, sub->GetName() );
 		}
+
+		manifest->deleteThis();
 	}
 	else
 	{
 		Warning( "PARTICLE SYSTEM: Unable to load manifest file '%s'\n", PARTICLES_MANIFEST_FILE );
 	}
-
-	manifest->deleteThis();
 }
 
 
@@ -184,8 +184,8 @@ void ParseParticleEffectsMap( const char* pMapName, bool bLoadSheets, IFileList*
 	}
 
 	// Open the manifest file, and read the particles specified inside it
-	KeyValuesAD manifest( szMapManifestFilename );
-	if( manifest->LoadFromFile( filesystem, szMapManifestFilename, "GAME" ) )
+	KeyValuesAD manifest( KeyValues::LoadFromFileReadOnly( filesystem, szMapManifestFilename, "GAME" ) );
+	if( manifest )
 	{
 		DevMsg( "Successfully loaded particle effects manifest '%s' for map '%s'\n", szMapManifestFilename, pMapName );
 		for( KeyValues* sub = manifest->GetFirstSubKey(); sub != NULL; sub = sub->GetNextKey() )
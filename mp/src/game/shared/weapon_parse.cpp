@@ -173,8 +173,8 @@ void PrecacheFileWeaponInfoDatabase( IFileSystem* fs, const unsigned char* pICEK
 		return;
 	}
 
-	KeyValues* manifest = new KeyValues( "weaponscripts" );
-	if( manifest->LoadFromFile( fs, "scripts/weapon_manifest.txt", "GAME" ) )
+	KeyValues* manifest = KeyValues::LoadFromFileReadOnly( fs, "scripts/weapon_manifest.txt", "GAME" );
+	if( manifest )
 	{
 		for( KeyValues* sub = manifest->GetFirstSubKey(); sub != NULL ; sub = sub->GetNextKey() )
 		{
@@ -197,8 +197,8 @@ void PrecacheFileWeaponInfoDatabase( IFileSystem* fs, const unsigned char* pICEK
 				Error( "Expecting 'file', got %s\n", sub->GetName() );
 			}
 		}
+		manifest->deleteThis();
 	}
-	manifest->deleteThis();
 }
 
 KeyValues* ReadEncryptedKVFile( IFileSystem* fs, const char* szFilenameWithoutExtension, const unsigned char* pICEKey, bool bForceReadEncryptedFile /*= false*/ )
@@ -215,6 +215,7 @@ KeyValues* ReadEncryptedKVFile( IFileSystem* fs, const char* szFilenameWithoutEx
 
 	// Open the weapon data file, and abort if we can't
 	KeyValues* pKV = new KeyValues( "WeaponDatafile" );
+	pKV->UsesChildIndex( true );
 
 	Q_snprintf( szFullName, sizeof( szFullName ), "%s.txt", szFilenameWithoutExtension );
 
@@ -430,6 +430,25 @@ ChunkFileResult_t CChunkFile::Open( const char* pszFileName, ChunkFileOpenMode_t
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Opens a file for reading that was already run through
+//			TokenReader::Tokenize, which can happen on any thread.
+// Input  : pszFileName - Path of the file, for error messages.
+//			pTokens, nSize - The recorded tokens, they must outlive the read.
+// Output : Returns ChunkFile_Ok on success, ChunkFile_OpenFail on failure.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CChunkFile::OpenTokens( const char* pszFileName, const void* pTokens, int nSize )
+{
+	if( !m_TokenReader.OpenTokens( pszFileName, pTokens, nSize ) )
+	{
+		return( ChunkFile_OpenFail );
+	}
+
+	m_nCurrentDepth = 0;
+	return( ChunkFile_Ok );
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Removes the topmost set of chunk handlers.
 //-----------------------------------------------------------------------------
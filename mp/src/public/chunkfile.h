@@ -123,6 +123,7 @@ public:
 	~CChunkFile( void );
 
 	ChunkFileResult_t Open( const char* pszFileName, ChunkFileOpenMode_t eMode );
+	ChunkFileResult_t OpenTokens( const char* pszFileName, const void* pTokens, int nSize );
 	ChunkFileResult_t Close( void );
 	const char* GetErrorText( ChunkFileResult_t eResult );
 
@@ -10,6 +10,8 @@
 #include <mathlib/lightdesc.h>
 #include <assert.h>
 #include <tier1/utlvector.h>
+#include <tier1/mappedfile.h>
+#include <tier1/checksum_md5.h>
 #include <mathlib/mathlib.h>
 #include <bspfile.h>
 
@@ -41,6 +43,18 @@ public:
 
 };
 
+// Two bundles of FourRays traced together by Trace8Rays. The halves are kept as FourRays so
+// either one can be handed to the 4 wide code and to transparency callbacks.
+class EightRays
+{
+public:
+	FourRays half[2];
+
+	// returns the direction sign mask shared by all 8 rays, or -1 if they can not be traced as
+	// a bundle.
+	int CalculateDirectionSignMask( void ) const;
+};
+
 /// The format a triangle is stored in for intersections. size of this structure is important.
 /// This structure can be in one of two forms. Before the ray tracing environment is set up, the
 /// ProjectedEdgeEquations hold the coordinates of the 3 vertices, for facilitating bounding box
@@ -133,6 +147,11 @@ struct CacheOptimizedTriangle
 #define KDNODE_STATE_ZSPLIT 2								// this node is a zsplit
 #define KDNODE_STATE_LEAF 3									// this node is a leaf
 
+// traversal limits shared by the 4 and 8 wide tracers
+#define MAILBOX_HASH_SIZE 256
+#define MAX_TREE_DEPTH 21
+#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
+
 struct CacheOptimizedKDNode
 {
 	// this is the cache intensive data structure. "Tricks" are used to fit it into 8 bytes:
@@ -220,6 +239,8 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_SERIAL_TREE_GENERATION 8				// build the kd-tree with the original single threaded RefineNode
+#define RTE_FLAGS_NO_AVX 16									// never use the 8 wide AVX traversal
 
 enum RayTraceLightingMode_t
 {
@@ -258,6 +279,7 @@ class RayTracingEnvironment
 {
 public:
 	uint32 Flags;											// RTE_FLAGS_xxx above
+	int m_nBuildThreads;									// threads used to build the kd-tree, 0 for one per cpu
 	Vector m_MinBound;
 	Vector m_MaxBound;
 
@@ -268,12 +290,15 @@ public:
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
+	CMappedFile m_TreeCache;								//< backs OptimizedKDTree and
+	// TriangleIndexList when they were loaded from a cache file
 
 public:
 	RayTracingEnvironment() : OptimizedTriangleList( 1024 )
 	{
 		BackgroundColor.DuplicateVector( Vector( 1, 0, 0 ) );		// red
 		Flags = 0;
+		m_nBuildThreads = 0;
 	}
 
 
@@ -298,6 +323,15 @@ public:
 	// SetupAccelerationStructure to prepare for tracing
 	void SetupAccelerationStructure( void );
 
+	// same as above, but reuses the tree stored in pCacheFile if it was built from the same
+	// triangles, and stores the new tree there otherwise. A tree loaded from the cache is
+	// mapped read-only. returns true if the cache was used.
+	bool SetupAccelerationStructure( const char* pCacheFile );
+
+	void CalculateTriangleListHash( MD5Value_t& key );
+	bool LoadAccelerationStructure( const char* pCacheFile, const MD5Value_t& key );
+	void SaveAccelerationStructure( const char* pCacheFile, const MD5Value_t& key );
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -311,6 +345,17 @@ public:
 					 RayTracingResult* rslt_out,
 					 int32 skip_id = -1, ITransparentTriangleCallback* pCallback = NULL );
 
+	// 8 wide version of the above. on cpus with AVX, both halves walk the tree as one packet
+	// when all 8 rays share direction signs, otherwise this falls back to Trace4Rays for each
+	// half. TMin, TMax and rslt_out hold one entry per half, as does ppCallbacks when given;
+	// a callback only ever sees the rays of its own half.
+	void Trace8Rays( const EightRays& rays, const fltx4* TMin, const fltx4* TMax,
+					 RayTracingResult* rslt_out,
+					 int32 skip_id = -1, ITransparentTriangleCallback* const* ppCallbacks = NULL );
+
+	// true if Trace8Rays will use the AVX traversal for bundles it can keep together
+	bool CanTrace8Wide( void ) const;
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources( void );
 
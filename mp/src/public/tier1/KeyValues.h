@@ -39,6 +39,7 @@ class CUtlBuffer;
 class Color;
 typedef void* FileHandle_t;
 class CKeyValuesGrowableStringTable;
+class CKeyValuesArena;
 
 //-----------------------------------------------------------------------------
 // Purpose: Simple recursive data access class
@@ -138,6 +139,9 @@ public:
 	// File access. Set UsesEscapeSequences true, if resource file/buffer uses Escape Sequences (eg \n, \t)
 	void UsesEscapeSequences( bool state ); // default false
 	void UsesConditionals( bool state ); // default true
+	// Set UsesChildIndex true to look up children by name in a hash once a key has many of them,
+	// instead of walking the whole list. Keys created under this one inherit the setting.
+	void UsesChildIndex( bool state ); // default false
 	bool LoadFromFile( IBaseFileSystem* filesystem, const char* resourceName, const char* pathID = NULL, bool refreshCache = false );
 	bool SaveToFile( IBaseFileSystem* filesystem, const char* resourceName, const char* pathID = NULL, bool sortKeys = false, bool bAllowEmptyString = false, bool bCacheResult = false );
 
@@ -147,6 +151,15 @@ public:
 	// Read from a utlbuffer...
 	bool LoadFromBuffer( char const* resourceName, CUtlBuffer& buf, IBaseFileSystem* pFileSystem = NULL, const char* pPathID = NULL );
 
+	// Read only loads, for big files that are only queried. All the keys and strings go in one
+	// arena and string values point into the arena's copy of the file where they can. deleteThis()
+	// on the returned root frees the whole tree at once; keys under it can be read, and new keys
+	// added, but not removed or deleted on their own. Don't hand these trees to other modules.
+	// Files that use #include or #base are loaded the regular way. Returns NULL if the file
+	// can't be read or loaded; like LoadFromFile, syntax errors only cut the tree short.
+	static KeyValues* LoadFromFileReadOnly( IBaseFileSystem* filesystem, const char* resourceName, const char* pathID = NULL );
+	static KeyValues* LoadFromBufferReadOnly( char const* resourceName, const char* pBuffer, IBaseFileSystem* pFileSystem = NULL, const char* pPathID = NULL );
+
 	// Find a keyValue, create it if it is not found.
 	// Set bCreate to true to create the key if it doesn't already exist (which ensures a valid pointer will be returned)
 	KeyValues* FindKey( const char* keyName, bool bCreate = false );
@@ -303,7 +316,7 @@ private:
 	/// This avoids the O(N^2) behaviour when adding children in sequence to KV,
 	/// when CreateKey() wil have to re-locate the end of the list each time.  This happens,
 	/// for example, every time we load any KV file whatsoever.
-	KeyValues* CreateKeyUsingKnownLastChild( const char* keyName, KeyValues* pLastChild );
+	KeyValues* CreateKeyUsingKnownLastChild( const char* keyName, KeyValues* pLastChild, CKeyValuesArena* pArena = NULL );
 	void AddSubkeyUsingKnownLastChild( KeyValues* pSubKey, KeyValues* pLastChild );
 
 	void CopyKeyValuesFromRecursive( const KeyValues& src );
@@ -319,7 +332,8 @@ private:
 	void SaveKeyToFile( KeyValues* dat, IBaseFileSystem* filesystem, FileHandle_t f, CUtlBuffer* pBuf, int indentLevel, bool sortKeys, bool bAllowEmptyString );
 	void WriteConvertedString( IBaseFileSystem* filesystem, FileHandle_t f, CUtlBuffer* pBuf, const char* pszString );
 
-	void RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& buf );
+	bool LoadFromBufferInternal( char const* resourceName, CUtlBuffer& buf, IBaseFileSystem* pFileSystem, const char* pPathID, CKeyValuesArena* pArena );
+	void RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& buf, CKeyValuesArena* pArena = NULL );
 
 	// For handling #include "filename"
 	void AppendIncludedKeys( CUtlVector< KeyValues* >& includedKeys );
@@ -335,11 +349,19 @@ private:
 
 	void Init();
 	const char* ReadToken( CUtlBuffer& buf, bool& wasQuoted, bool& wasConditional );
+	const char* ReadTokenInPlace( CUtlBuffer& buf, bool& wasQuoted, bool& wasConditional );
 	void WriteIndents( IBaseFileSystem* filesystem, FileHandle_t f, CUtlBuffer* pBuf, int indentLevel );
 
 	void FreeAllocatedValue();
 	void AllocateValueBlock( int size );
 
+	// Optional symbol -> first child lookup, see UsesChildIndex
+	bool FindKeyInChildIndex( int keySymbol, KeyValues*& pFound, KeyValues*& pLastChild ) const;
+	void BuildChildIndex() const;
+	void AppendToChildIndex( KeyValues* pSubkey, KeyValues* pPrevLastChild );
+	void InvalidateChildIndex();
+	void InvalidateParentChildIndex();
+
 	int m_iKeyName;	// keyname is a symbol defined in KeyValuesSystem
 
 	// These are needed out of the union because the API returns string pointers
@@ -358,12 +380,16 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	mutable char m_nFlags; // KV_* bits in KeyValues.cpp, takes the place of unused[1] so the layout doesn't change
 
 	KeyValues* m_pPeer;	// pointer to next key in list
 	KeyValues* m_pSub;	// pointer to Start of a new sub key list
 	KeyValues* m_pChain;// Search here if it's not in our list
 
+	friend class CKeyValuesArena;
+	friend class CKeyValuesBinaryCache;
+	friend struct KeyValuesChildIndex_t;
+
 private:
 	// Statics to implement the optional growable string table
 	// Function pointers that will determine which mode we are in
@@ -0,0 +1,68 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Memory mapping of a whole file, so large caches can be used in
+//			place instead of being read into a buffer first.
+//
+//=============================================================================
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+#ifdef _WIN32
+	#pragma once
+#endif
+
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+
+
+class CMappedFile
+{
+public:
+	CMappedFile();
+	~CMappedFile();
+
+	// Maps the whole file. Fails on missing or empty files. A copy on write
+	// mapping can be written to, the pages that are written get private copies
+	// and the file itself is never changed.
+	bool Open( const char* pFilename, bool bCopyOnWrite = false );
+	void Close();
+
+	// True if pFilename is the file that's mapped, however it's named. The mapped
+	// file can't be overwritten while the mapping is open.
+	bool IsSameFile( const char* pFilename ) const;
+
+	bool IsOpen() const
+	{
+		return m_pBase != NULL;
+	}
+	const void* Base() const
+	{
+		return m_pBase;
+	}
+	void* WritableBase()
+	{
+		Assert( m_bCopyOnWrite || !m_pBase );
+		return m_pBase;
+	}
+	int64 Size() const
+	{
+		return m_nSize;
+	}
+
+private:
+	// Not copyable, the mapping is owned by this object
+	CMappedFile( const CMappedFile& );
+	CMappedFile& operator=( const CMappedFile& );
+
+	void*	m_pBase;
+	int64	m_nSize;
+	bool	m_bCopyOnWrite;
+#ifdef _WIN32
+	void*	m_hFile;
+	void*	m_hMapping;
+#else
+	int		m_nFile;
+#endif
+};
+
+#endif // MAPPEDFILE_H
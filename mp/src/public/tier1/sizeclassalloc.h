@@ -0,0 +1,58 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Thread-local, size-class pooled allocator for short lived
+//			containers. Each thread keeps a free list per size class and only
+//			goes to a shared depot, under a lock, when a list runs dry or gets
+//			too long. Memory is carved out of 64KB chunks that are kept for the
+//			life of the process, so it is meant for temporaries that churn, not
+//			for big long lived buffers.
+//
+// $NoKeywords: $
+//===========================================================================//
+
+#ifndef SIZECLASSALLOC_H
+#define SIZECLASSALLOC_H
+
+#ifdef _WIN32
+	#pragma once
+#endif
+
+#include "tier0/platform.h"
+
+
+// Requests bigger than the largest size class go to the heap
+#define SIZECLASS_MAX_SIZE		4096
+
+struct SizeClassAllocStats_t
+{
+	int64	m_nAllocs;			// everything handed out, pooled or not
+	int64	m_nFrees;
+	int64	m_nChunkAllocs;		// chunks the depot took from the heap
+	int64	m_nLargeAllocs;		// bigger than SIZECLASS_MAX_SIZE, passed to the heap
+};
+
+
+class CSizeClassAllocator
+{
+public:
+	static void*	Alloc( size_t nSize );
+	static void		Free( void* pMem );
+
+	// Usable bytes of a block, at least what was asked for
+	static size_t	GetSize( void* pMem );
+
+	// Gives the calling thread's free lists back to the depot. Call it before
+	// a worker thread exits, its cache is reused by the next thread.
+	static void		ReleaseThreadCache();
+
+	// Closes the current frame for GetFrameStats
+	static void		EndFrame();
+
+	// Totals over all threads since startup, and over the last frame. The per-thread
+	// counts are 32 bits, call GetStats or EndFrame before a thread makes 4G allocs.
+	static void		GetStats( SizeClassAllocStats_t& stats );
+	static void		GetFrameStats( SizeClassAllocStats_t& stats );
+};
+
+
+#endif // SIZECLASSALLOC_H
@@ -17,7 +17,8 @@
 
 //-----------------------------------------------------------------------------
 // Purpose: Allocates memory for strings, checking for duplicates first,
-//			reusing exising strings if duplicate found.
+//			reusing exising strings if duplicate found. Strings are compared
+//			without case, through an open addressing hash.
 //-----------------------------------------------------------------------------
 
 class CStringPool
@@ -35,9 +36,19 @@ public:
 	const char* Find( const char* pszValue );
 
 protected:
-	typedef CUtlRBTree<const char*, unsigned short> CStrSet;
+	// A slot in the hash, empty when m_pString is NULL
+	struct HashSlot_t
+	{
+		const char*		m_pString;
+		unsigned int	m_nHash;
+	};
+
+	int FindSlot( const char* pszValue, unsigned int nHash ) const;
+	void ResizeHash( int nSlots );
 
-	CStrSet m_Strings;
+	// power of two sized, never more than half full
+	CUtlVector<HashSlot_t> m_Strings;
+	int m_nCount;
 };
 
 //-----------------------------------------------------------------------------
@@ -29,6 +29,8 @@
 
 #include <assert.h>
 
+class CUtlBuffer;
+
 
 typedef enum
 {
@@ -57,6 +59,17 @@ public:
 	TokenReader();
 
 	bool Open( const char* pszFilename );
+
+	// Reads the tokens Tokenize() recorded instead of a file. pTokens is not copied
+	// and has to stay around until Close().
+	bool OpenTokens( const char* pszFilename, const void* pTokens, int nSize );
+
+	// Runs the file through the tokenizer and records the tokens, so files can be
+	// tokenized on other threads and read with OpenTokens() any number of times.
+	// A range [nStart, nEnd) of the file can be tokenized on its own if it starts and
+	// ends between tokens; the tokens of consecutive ranges can be appended to each other.
+	static bool Tokenize( const char* pszFilename, CUtlBuffer& tokens, int nStart = 0, int nEnd = -1, int nStartLine = 1 );
+
 	trtoken_t NextToken( char* pszStore, int nSize );
 	trtoken_t NextTokenDynamic( char** ppszStore );
 	void Close();
@@ -75,6 +88,7 @@ private:
 	inline int operator=( TokenReader const& );
 
 	trtoken_t GetString( char* pszStore, int nSize );
+	trtoken_t NextRecordedToken( char* pszStore, int nSize );
 	bool SkipWhiteSpace( void );
 
 	int m_nLine;
@@ -84,6 +98,10 @@ private:
 	char m_szStuffed[128];
 	bool m_bStuffed;
 	trtoken_t m_eStuffed;
+
+	const unsigned char* m_pTokens;	// recorded tokens, NULL when reading the file
+	int m_nTokensSize;
+	int m_nTokenPos;
 };
 
 
@@ -18,6 +18,7 @@
 #include <string.h>
 #include "tier0/platform.h"
 #include "mathlib/mathlib.h"
+#include "tier1/sizeclassalloc.h"
 
 #include "tier0/memalloc.h"
 #include "tier0/memdbgon.h"
@@ -1278,6 +1279,209 @@ void CUtlMemoryAligned<T, nAlignment>::Purge()
 	}
 }
 
+//-----------------------------------------------------------------------------
+// The CUtlMemoryPooled class:
+// A dynamic memory class that allocates from the thread-local size-class pools,
+// for temporary containers that are filled and thrown away over and over
+//-----------------------------------------------------------------------------
+template< typename T >
+class CUtlMemoryPooled
+{
+public:
+	// constructor, destructor
+	CUtlMemoryPooled( int nGrowSize = 0, int nInitSize = 0 ) : m_pMemory( NULL ), m_nAllocationCount( 0 )
+	{
+		if( nInitSize )
+		{
+			EnsureCapacity( nInitSize );
+		}
+	}
+	CUtlMemoryPooled( T* pMemory, int numElements ) : m_pMemory( NULL ), m_nAllocationCount( 0 )
+	{
+		// external memory can't go back to the pools
+		Assert( 0 );
+	}
+	~CUtlMemoryPooled()
+	{
+		Purge();
+	}
+
+	// Can we use this index?
+	bool IsIdxValid( int i ) const
+	{
+		return ( uint32 )i < ( uint32 )m_nAllocationCount;
+	}
+	static int InvalidIndex()
+	{
+		return -1;
+	}
+
+	// Gets the base address
+	T* Base()
+	{
+		return m_pMemory;
+	}
+	const T* Base() const
+	{
+		return m_pMemory;
+	}
+
+	// element access
+	T& operator[]( int i )
+	{
+		Assert( IsIdxValid( i ) );
+		return Base()[i];
+	}
+	const T& operator[]( int i ) const
+	{
+		Assert( IsIdxValid( i ) );
+		return Base()[i];
+	}
+	T& Element( int i )
+	{
+		Assert( IsIdxValid( i ) );
+		return Base()[i];
+	}
+	const T& Element( int i ) const
+	{
+		Assert( IsIdxValid( i ) );
+		return Base()[i];
+	}
+
+	// Attaches the buffer to external memory....
+	void SetExternalBuffer( T* pMemory, int numElements )
+	{
+		Assert( 0 );
+	}
+
+	void Swap( CUtlMemoryPooled< T >& mem )
+	{
+		V_swap( m_pMemory, mem.m_pMemory );
+		V_swap( m_nAllocationCount, mem.m_nAllocationCount );
+	}
+
+	int NumAllocated() const
+	{
+		return m_nAllocationCount;
+	}
+	int Count() const
+	{
+		return m_nAllocationCount;
+	}
+
+	// Grows the memory, so that at least allocated + num elements are allocated
+	void Grow( int num = 1 )
+	{
+		Assert( num > 0 );
+		ReAlloc( UtlMemory_CalcNewAllocationCount( m_nAllocationCount, 0, m_nAllocationCount + num, sizeof( T ) ) );
+	}
+
+	// Makes sure we've got at least this much memory
+	void EnsureCapacity( int num )
+	{
+		if( m_nAllocationCount < num )
+		{
+			ReAlloc( num );
+		}
+	}
+
+	// Memory deallocation
+	void Purge()
+	{
+		CSizeClassAllocator::Free( m_pMemory );
+		m_pMemory = NULL;
+		m_nAllocationCount = 0;
+	}
+
+	// Purge all but the given number of elements
+	void Purge( int numElements )
+	{
+		Assert( numElements >= 0 );
+		if( numElements == 0 )
+		{
+			Purge();
+		}
+		else if( numElements < m_nAllocationCount )
+		{
+			ReAlloc( numElements );
+		}
+	}
+
+	// is the memory externally allocated?
+	bool IsExternallyAllocated() const
+	{
+		return false;
+	}
+
+	// Set the size by which the memory grows
+	void SetGrowSize( int size )							{}
+
+	class Iterator_t
+	{
+	public:
+		Iterator_t( int i ) : index( i ) {}
+		int index;
+		bool operator==( const Iterator_t it ) const
+		{
+			return index == it.index;
+		}
+		bool operator!=( const Iterator_t it ) const
+		{
+			return index != it.index;
+		}
+	};
+	Iterator_t First() const
+	{
+		return Iterator_t( IsIdxValid( 0 ) ? 0 : InvalidIndex() );
+	}
+	Iterator_t Next( const Iterator_t& it ) const
+	{
+		return Iterator_t( IsIdxValid( it.index + 1 ) ? it.index + 1 : InvalidIndex() );
+	}
+	int GetIndex( const Iterator_t& it ) const
+	{
+		return it.index;
+	}
+	bool IsIdxAfter( int i, const Iterator_t& it ) const
+	{
+		return i > it.index;
+	}
+	bool IsValidIterator( const Iterator_t& it ) const
+	{
+		return IsIdxValid( it.index );
+	}
+	Iterator_t InvalidIterator() const
+	{
+		return Iterator_t( InvalidIndex() );
+	}
+
+private:
+	// The elements are moved with memcpy, as CUtlMemory does with realloc.
+	// Whatever the size class has room for past num is used too.
+	void ReAlloc( int num )
+	{
+		T* pMemory = ( T* )CSizeClassAllocator::Alloc( num * sizeof( T ) );
+		if( !pMemory )
+		{
+			Error( "CUtlMemoryPooled: out of memory allocating %d elements\n", num );
+			return;
+		}
+
+		int nCopy = MIN( num, m_nAllocationCount );
+		if( nCopy )
+		{
+			memcpy( pMemory, m_pMemory, nCopy * sizeof( T ) );
+		}
+		CSizeClassAllocator::Free( m_pMemory );
+
+		m_pMemory = pMemory;
+		m_nAllocationCount = CSizeClassAllocator::GetSize( pMemory ) / sizeof( T );
+	}
+
+	T* m_pMemory;
+	int m_nAllocationCount;
+};
+
 #include "tier0/memdbgoff.h"
 
 #endif // UTLMEMORY_H
@@ -102,9 +102,10 @@ protected:
 //    a static version of this class for creating global strings, but this
 //    class can also be instanced to create local symbol tables.
 //
-//    This class stores the strings in a series of string pools. The first
-//    two bytes of each string are decorated with a hash to speed up
-//	  comparisons.
+//    This class stores the strings in a series of string pools. Symbols are
+//    handed out in the order the strings are added, and are found through an
+//    open addressing hash of the strings that keeps each string's hash next to
+//    its symbol, so most probes never touch the string itself.
 //-----------------------------------------------------------------------------
 
 class CUtlSymbolTable
@@ -117,7 +118,8 @@ public:
 	// Finds and/or creates a symbol based on the string
 	CUtlSymbol AddString( const char* pString );
 
-	// Finds the symbol for pString
+	// Finds the symbol for pString. Doesn't change the table, so any number of
+	// threads can Find at once as long as nothing is being added.
 	CUtlSymbol Find( const char* pString ) const;
 
 	// Look up the string associated with a particular symbol
@@ -128,7 +130,7 @@ public:
 
 	int GetNumStrings( void ) const
 	{
-		return m_Lookup.Count();
+		return m_Strings.Count();
 	}
 
 	// We store one of these at the beginning of every string to speed
@@ -156,23 +158,11 @@ protected:
 		unsigned short m_iOffset;	// Index into the string pool.
 	};
 
-	class CLess
+	// A slot in the hash, empty when m_Id is UTL_INVAL_SYMBOL
+	struct HashSlot_t
 	{
-	public:
-		CLess( int ignored = 0 ) {} // permits default initialization to NULL in CUtlRBTree
-		bool operator!() const
-		{
-			return false;
-		}
-		bool operator()( const CStringPoolIndex& left, const CStringPoolIndex& right ) const;
-	};
-
-	// Stores the symbol lookup
-	class CTree : public CUtlRBTree<CStringPoolIndex, unsigned short, CLess>
-	{
-	public:
-		CTree( int growSize, int initSize ) : CUtlRBTree<CStringPoolIndex, unsigned short, CLess>( growSize, initSize ) {}
-		friend class CUtlSymbolTable::CLess; // Needed to allow CLess to calculate pointer to symbol table
+		unsigned int	m_nHash;
+		UtlSymId_t		m_Id;
 	};
 
 	struct StringPool_t
@@ -182,11 +172,13 @@ protected:
 		char m_Data[1];
 	};
 
-	CTree m_Lookup;
+	// where the string of each symbol is
+	CUtlVector<CStringPoolIndex> m_Strings;
+
+	// power of two sized, never more than half full
+	CUtlVector<HashSlot_t> m_HashSlots;
 
 	bool m_bInsensitive;
-	mutable unsigned short m_nUserSearchStringHash;
-	mutable const char* m_pUserSearchString;
 
 	// stores the string data
 	CUtlVector<StringPool_t*> m_StringPools;
@@ -194,11 +186,9 @@ protected:
 private:
 	int FindPoolWithSpace( int len ) const;
 	const char* StringFromIndex( const CStringPoolIndex& index ) const;
-	const char* DecoratedStringFromIndex( const CStringPoolIndex& index ) const;
-
-	friend class CLess;
-	friend class CSymbolHash;
-
+	unsigned int HashString( const char* pString ) const;
+	int FindSlot( const char* pString, unsigned int nHash ) const;
+	void ResizeHash( int nSlots );
 };
 
 class CUtlSymbolTableMT :  public CUtlSymbolTable
@@ -209,19 +199,28 @@ public:
 	{
 	}
 
+	// Strings that are already in the table only need the read lock
 	CUtlSymbol AddString( const char* pString )
 	{
+		m_lock.LockForRead();
+		CUtlSymbol result = CUtlSymbolTable::Find( pString );
+		m_lock.UnlockRead();
+		if( result.IsValid() || !pString )
+		{
+			return result;
+		}
+
 		m_lock.LockForWrite();
-		CUtlSymbol result = CUtlSymbolTable::AddString( pString );
+		result = CUtlSymbolTable::AddString( pString );
 		m_lock.UnlockWrite();
 		return result;
 	}
 
 	CUtlSymbol Find( const char* pString ) const
 	{
-		m_lock.LockForWrite();
+		m_lock.LockForRead();
 		CUtlSymbol result = CUtlSymbolTable::Find( pString );
-		m_lock.UnlockWrite();
+		m_lock.UnlockRead();
 		return result;
 	}
 
@@ -309,6 +309,22 @@ public:
 };
 
 
+//-----------------------------------------------------------------------------
+// The CUtlVectorPooled class:
+// A array class for temporaries, allocates from the thread-local size-class
+// pools (see sizeclassalloc.h) instead of the global heap
+//-----------------------------------------------------------------------------
+template< class T >
+class CUtlVectorPooled : public CUtlVector< T, CUtlMemoryPooled<T> >
+{
+	typedef CUtlVector< T, CUtlMemoryPooled<T> > BaseClass;
+public:
+
+	// constructor, destructor
+	explicit CUtlVectorPooled( int growSize = 0, int initSize = 0 ) : BaseClass( growSize, initSize ) {}
+};
+
+
 //-----------------------------------------------------------------------------
 // The CUtlVectorUltra Conservative class:
 // A array class with a very conservative allocation scheme, with customizable allocator
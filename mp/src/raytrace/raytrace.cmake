@@ -7,6 +7,8 @@ set(
 	"${RAYTRACE_DIR}/raytrace.cpp"
 	"${RAYTRACE_DIR}/trace2.cpp"
 	"${RAYTRACE_DIR}/trace3.cpp"
+	"${RAYTRACE_DIR}/trace8.cpp"
+	"${RAYTRACE_DIR}/treecache.cpp"
 )
 
 add_library(raytrace STATIC ${RAYTRACE_SOURCE_FILES})
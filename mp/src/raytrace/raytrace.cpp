@@ -4,6 +4,7 @@
 #include "raytrace.h"
 #include <filesystem_tools.h>
 #include <cmdlib.h>
+#include <tier0/threadtools.h>
 #include <stdio.h>
 
 static bool SameSign( float a, float b )
@@ -288,10 +289,6 @@ int CacheOptimizedTriangle::ClassifyAgainstAxisSplit( int split_plane, float spl
 	return PLANECHECK_STRADDLING;
 }
 
-#define MAILBOX_HASH_SIZE 256
-#define MAX_TREE_DEPTH 21
-#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
-
 struct NodeToVisit
 {
 	CacheOptimizedKDNode const* node;
@@ -935,20 +932,665 @@ void RayTracingEnvironment::RefineNode( int node_number, int32 const* tri_list,
 }
 
 
-void RayTracingEnvironment::SetupAccelerationStructure( void )
+//-----------------------------------------------------------------------------
+// Parallel kd-tree builder.
+//
+// Uses the same cost model and termination rules as RefineNode, but finds
+// splits without the per-candidate pass over every triangle: large nodes use
+// binned SAH with the binning spread over threads, small nodes sweep every
+// vertex coordinate as a candidate (a superset of the ones RefineNode tries).
+// Once a node is small enough its whole subtree is built as an independent
+// task into private arrays, which are stitched onto the tree at the end in
+// creation order, so the result doesn't depend on the thread count.
+//-----------------------------------------------------------------------------
+#define KDBUILD_BINS				64		// candidate planes per axis for binned nodes
+#define KDBUILD_BINNED_MIN_TRIS		128		// nodes at least this big use binned SAH
+#define KDBUILD_TASK_MAX_TRIS		4096	// subtrees this small are built as one task
+#define KDBUILD_BIN_CHUNK			16384	// triangles per binning work item
+#define KDBUILD_MAX_THREADS			64
+
+struct KDSplit_t
+{
+	int		m_nAxis;
+	float	m_flClassifyValue;		// what the triangles are classified against
+	float	m_flValue;				// the plane stored in the node, after growing empty sides
+	float	m_flCost;
+	int		m_nLeft, m_nRight, m_nBoth;
+};
+
+struct KDSubtree_t
+{
+	int		m_nNode;				// node in the main tree that is the root of this subtree
+	Vector	m_Mins, m_Maxs;
+	int		m_nDepth;
+	CUtlVector<int32>	m_Tris;
+
+	// local results, [0] is m_nNode and local child indices start at 1
+	CUtlVector<CacheOptimizedKDNode>	m_Nodes;
+	CUtlVector<int32>					m_Indices;
+};
+
+struct KDBinCounts_t
+{
+	int		m_nMinCount[3][KDBUILD_BINS];		// triangles with this many planes <= their min
+	int		m_nMaxCount[3][KDBUILD_BINS];		// triangles with this many planes < their max
+	int		m_nPlanar[3][KDBUILD_BINS];			// flat triangles lying exactly on a plane
+	float	m_flMin[3], m_flMax[3];
+};
+
+struct KDBinJob_t
+{
+	int32 const*	m_pTris;
+	int				m_nTris;
+	float			m_flPlanes[3][KDBUILD_BINS];	// [1..KDBUILD_BINS-1] are used
+	CUtlVector<KDBinCounts_t>	m_Counts;			// per chunk of triangles
+};
+
+class CKDTreeBuilder;
+struct KDParallelFor_t
+{
+	CKDTreeBuilder*	m_pBuilder;
+	void ( CKDTreeBuilder::*m_pFn )( int );
+	int				m_nItems;
+	long volatile	m_nNext;
+};
+
+static unsigned KDBuildThreadFn( void* pParam );
+
+static int FloatCompare( const void* a, const void* b )
+{
+	float fa = *( const float* )a;
+	float fb = *( const float* )b;
+	return ( fa < fb ) ? -1 : ( ( fa > fb ) ? 1 : 0 );
+}
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder( RayTracingEnvironment* pEnv, int nThreads );
+	~CKDTreeBuilder();
+
+	void Build();
+
+	void BuildSubtree( int iTask );
+	void BinChunkParallel( int iChunk );
+
+private:
+	void Refine( KDSubtree_t* pTree, int node_number, int32 const* tri_list, int ntris,
+				 Vector MinBound, Vector MaxBound, int depth );
+	void MakeLeaf( KDSubtree_t* pTree, int node_number, int32 const* tri_list, int ntris,
+				   const Vector& MinBound, const Vector& MaxBound );
+
+	void BinChunk( KDBinJob_t& job, int iChunk );
+	void FindSplitBinned( int32 const* tri_list, int ntris, const Vector& MinBound, const Vector& MaxBound,
+						  bool bParallel, KDSplit_t& best );
+	void FindSplitSweep( int32 const* tri_list, int ntris, const Vector& MinBound, const Vector& MaxBound,
+						 KDSplit_t& best );
+	void TrySplit( int axis, float split_value, int nleft, int nright, int nboth,
+				   float min_coord, float max_coord, const Vector& MinBound, const Vector& MaxBound,
+				   KDSplit_t& best );
+
+	void ParallelFor( int nItems, void ( CKDTreeBuilder::*pFn )( int ) );
+
+	RayTracingEnvironment*		m_pEnv;
+	int							m_nThreads;
+
+	// per triangle bounds, so nothing has to touch the triangles themselves
+	CUtlVector<Vector>			m_TriMins;
+	CUtlVector<Vector>			m_TriMaxs;
+
+	CUtlVector<KDSubtree_t*>	m_Subtrees;
+	CUtlVector<int>				m_SubtreeOrder;		// biggest first
+
+	KDBinJob_t*					m_pBinJob;		// node at the top of the tree being binned by all threads
+};
+
+
+static unsigned KDBuildThreadFn( void* pParam )
+{
+	KDParallelFor_t* pWork = ( KDParallelFor_t* )pParam;
+	for( ;; )
+	{
+		int i = ThreadInterlockedIncrement( &pWork->m_nNext ) - 1;
+		if( i >= pWork->m_nItems )
+		{
+			break;
+		}
+		( pWork->m_pBuilder->*pWork->m_pFn )( i );
+	}
+	return 0;
+}
+
+
+CKDTreeBuilder::CKDTreeBuilder( RayTracingEnvironment* pEnv, int nThreads )
+{
+	m_pEnv = pEnv;
+	m_nThreads = nThreads;
+	if( m_nThreads <= 0 )
+	{
+		m_nThreads = GetCPUInformation()->m_nLogicalProcessors;
+	}
+	m_nThreads = clamp( m_nThreads, 1, KDBUILD_MAX_THREADS );
+
+	int ntris = pEnv->OptimizedTriangleList.Count();
+	m_TriMins.SetCount( ntris );
+	m_TriMaxs.SetCount( ntris );
+	for( int t = 0; t < ntris; t++ )
+	{
+		CacheOptimizedTriangle const& tri = pEnv->OptimizedTriangleList[t];
+		for( int c = 0; c < 3; c++ )
+		{
+			m_TriMins[t][c] = min( tri.Vertex( 0 )[c], min( tri.Vertex( 1 )[c], tri.Vertex( 2 )[c] ) );
+			m_TriMaxs[t][c] = max( tri.Vertex( 0 )[c], max( tri.Vertex( 1 )[c], tri.Vertex( 2 )[c] ) );
+		}
+	}
+
+	m_pBinJob = NULL;
+}
+
+CKDTreeBuilder::~CKDTreeBuilder()
+{
+	m_Subtrees.PurgeAndDeleteElements();
+}
+
+
+void CKDTreeBuilder::ParallelFor( int nItems, void ( CKDTreeBuilder::*pFn )( int ) )
+{
+	KDParallelFor_t work;
+	work.m_pBuilder = this;
+	work.m_pFn = pFn;
+	work.m_nItems = nItems;
+	work.m_nNext = 0;
+
+	ThreadHandle_t threads[KDBUILD_MAX_THREADS];
+	int nThreads = min( m_nThreads, nItems );
+	int nStarted = 0;
+	for( int i = 1; i < nThreads; i++ )
+	{
+		threads[nStarted] = CreateSimpleThread( KDBuildThreadFn, &work );
+		if( threads[nStarted] )
+		{
+			nStarted++;
+		}
+	}
+
+	// the calling thread works too, and finishes everything if no threads could be started
+	KDBuildThreadFn( &work );
+
+	for( int i = 0; i < nStarted; i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+}
+
+
+// Same cost as CalculateCostsOfSplit, including growing an empty side
+void CKDTreeBuilder::TrySplit( int axis, float split_value, int nleft, int nright, int nboth,
+							   float min_coord, float max_coord, const Vector& MinBound, const Vector& MaxBound,
+							   KDSplit_t& best )
+{
+	float classify_value = split_value;
+	if( nleft && ( nboth == 0 ) && ( nright == 0 ) )
+	{
+		split_value = max_coord;
+	}
+	if( nright && ( nboth == 0 ) && ( nleft == 0 ) )
+	{
+		split_value = min_coord;
+	}
+
+	Vector LeftMins = MinBound;
+	Vector LeftMaxes = MaxBound;
+	Vector RightMins = MinBound;
+	Vector RightMaxes = MaxBound;
+	LeftMaxes[axis] = split_value;
+	RightMins[axis] = split_value;
+	float SA_L = BoxSurfaceArea( LeftMins, LeftMaxes );
+	float SA_R = BoxSurfaceArea( RightMins, RightMaxes );
+	float ISA = 1.0 / BoxSurfaceArea( MinBound, MaxBound );
+	float cost_of_split = COST_OF_TRAVERSAL + COST_OF_INTERSECTION * ( nboth +
+						  ( SA_L * ISA * ( nleft ) ) + ( SA_R * ISA * ( nright ) ) );
+
+	if( cost_of_split < best.m_flCost )
+	{
+		best.m_nAxis = axis;
+		best.m_flClassifyValue = classify_value;
+		best.m_flValue = split_value;
+		best.m_flCost = cost_of_split;
+		best.m_nLeft = nleft;
+		best.m_nRight = nright;
+		best.m_nBoth = nboth;
+	}
+}
+
+
+// Number of planes in a sorted list that are <= v (or < v when bStrict)
+static inline int CountPlanesBelow( const float* planes, float v, bool bStrict )
+{
+	int lo = 1, hi = KDBUILD_BINS;
+	while( lo < hi )
+	{
+		int mid = ( lo + hi ) >> 1;
+		if( bStrict ? ( planes[mid] < v ) : ( planes[mid] <= v ) )
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+void CKDTreeBuilder::BinChunkParallel( int iChunk )
+{
+	BinChunk( *m_pBinJob, iChunk );
+}
+
+void CKDTreeBuilder::BinChunk( KDBinJob_t& job, int iChunk )
+{
+	KDBinCounts_t& counts = job.m_Counts[iChunk];
+	memset( &counts, 0, sizeof( counts ) );
+	for( int c = 0; c < 3; c++ )
+	{
+		counts.m_flMin[c] = 1.0e23;
+		counts.m_flMax[c] = -1.0e23;
+	}
+
+	int first = iChunk * KDBUILD_BIN_CHUNK;
+	int last = min( first + KDBUILD_BIN_CHUNK, job.m_nTris );
+	for( int t = first; t < last; t++ )
+	{
+		const Vector& tmin = m_TriMins[job.m_pTris[t]];
+		const Vector& tmax = m_TriMaxs[job.m_pTris[t]];
+		for( int c = 0; c < 3; c++ )
+		{
+			counts.m_flMin[c] = min( counts.m_flMin[c], tmin[c] );
+			counts.m_flMax[c] = max( counts.m_flMax[c], tmax[c] );
+
+			int nMinBin = CountPlanesBelow( job.m_flPlanes[c], tmin[c], false );
+			int nMaxBin = CountPlanesBelow( job.m_flPlanes[c], tmax[c], true );
+			counts.m_nMinCount[c][nMinBin]++;
+			counts.m_nMaxCount[c][nMaxBin]++;
+
+			// a flat triangle sitting on a plane goes right of it instead of left
+			if( tmin[c] == tmax[c] )
+			{
+				for( int b = nMaxBin + 1; b <= nMinBin; b++ )
+				{
+					counts.m_nPlanar[c][b]++;
+				}
+			}
+		}
+	}
+}
+
+void CKDTreeBuilder::FindSplitBinned( int32 const* tri_list, int ntris, const Vector& MinBound, const Vector& MaxBound,
+									  bool bParallel, KDSplit_t& best )
+{
+	KDBinJob_t job;
+	job.m_pTris = tri_list;
+	job.m_nTris = ntris;
+	for( int c = 0; c < 3; c++ )
+	{
+		job.m_flPlanes[c][0] = MinBound[c];
+		for( int b = 1; b < KDBUILD_BINS; b++ )
+		{
+			job.m_flPlanes[c][b] = MinBound[c] + ( MaxBound[c] - MinBound[c] ) * ( ( float )b / KDBUILD_BINS );
+		}
+	}
+
+	int nChunks = ( ntris + KDBUILD_BIN_CHUNK - 1 ) / KDBUILD_BIN_CHUNK;
+	job.m_Counts.SetCount( nChunks );
+	if( bParallel && nChunks > 1 )
+	{
+		m_pBinJob = &job;
+		ParallelFor( nChunks, &CKDTreeBuilder::BinChunkParallel );
+		m_pBinJob = NULL;
+	}
+	else
+	{
+		for( int i = 0; i < nChunks; i++ )
+		{
+			BinChunk( job, i );
+		}
+	}
+
+	// merge in chunk order so the result is independent of the thread count
+	KDBinCounts_t& total = job.m_Counts[0];
+	for( int i = 1; i < nChunks; i++ )
+	{
+		const KDBinCounts_t& counts = job.m_Counts[i];
+		for( int c = 0; c < 3; c++ )
+		{
+			total.m_flMin[c] = min( total.m_flMin[c], counts.m_flMin[c] );
+			total.m_flMax[c] = max( total.m_flMax[c], counts.m_flMax[c] );
+			for( int b = 0; b < KDBUILD_BINS; b++ )
+			{
+				total.m_nMinCount[c][b] += counts.m_nMinCount[c][b];
+				total.m_nMaxCount[c][b] += counts.m_nMaxCount[c][b];
+				total.m_nPlanar[c][b] += counts.m_nPlanar[c][b];
+			}
+		}
+	}
+
+	for( int c = 0; c < 3; c++ )
+	{
+		// right of plane b: min >= plane, i.e. min bin >= b. left: max <= plane, i.e. max bin < b,
+		// minus the flat triangles on the plane
+		int nright = ntris;
+		int nmaxbelow = 0;
+		for( int b = 1; b < KDBUILD_BINS; b++ )
+		{
+			nright -= total.m_nMinCount[c][b - 1];
+			nmaxbelow += total.m_nMaxCount[c][b - 1];
+			int nleft = nmaxbelow - total.m_nPlanar[c][b];
+			TrySplit( c, job.m_flPlanes[c][b], nleft, nright, ntris - nleft - nright,
+					  total.m_flMin[c], total.m_flMax[c], MinBound, MaxBound, best );
+		}
+	}
+}
+
+
+void CKDTreeBuilder::FindSplitSweep( int32 const* tri_list, int ntris, const Vector& MinBound, const Vector& MaxBound,
+									 KDSplit_t& best )
+{
+	float* mins = ( float* )stackalloc( ntris * sizeof( float ) );
+	float* maxs = ( float* )stackalloc( ntris * sizeof( float ) );
+	float* flats = ( float* )stackalloc( ntris * sizeof( float ) );
+	float* candidates = ( float* )stackalloc( ( 3 * ntris + 1 ) * sizeof( float ) );
+
+	for( int axis = 0; axis < 3; axis++ )
+	{
+		int nflats = 0;
+		int ncandidates = 0;
+		candidates[ncandidates++] = 0.5 * ( MinBound[axis] + MaxBound[axis] );
+		for( int t = 0; t < ntris; t++ )
+		{
+			mins[t] = m_TriMins[tri_list[t]][axis];
+			maxs[t] = m_TriMaxs[tri_list[t]][axis];
+			if( mins[t] == maxs[t] )
+			{
+				flats[nflats++] = mins[t];
+			}
+
+			// every vertex inside the node is a candidate, like RefineNode's sampled ones
+			CacheOptimizedTriangle const& tri = m_pEnv->OptimizedTriangleList[tri_list[t]];
+			for( int tv = 0; tv < 3; tv++ )
+			{
+				float v = tri.Vertex( tv )[axis];
+				if( ( v <= MaxBound[axis] ) && ( v >= MinBound[axis] ) )
+				{
+					candidates[ncandidates++] = v;
+				}
+			}
+		}
+
+		qsort( mins, ntris, sizeof( float ), FloatCompare );
+		qsort( maxs, ntris, sizeof( float ), FloatCompare );
+		qsort( flats, nflats, sizeof( float ), FloatCompare );
+		qsort( candidates, ncandidates, sizeof( float ), FloatCompare );
+
+		float min_coord = mins[0];
+		float max_coord = maxs[ntris - 1];
+
+		int nminbelow = 0, nmaxatorbelow = 0, nflatbelow = 0, nflatatorbelow = 0;
+		for( int i = 0; i < ncandidates; i++ )
+		{
+			float split_value = candidates[i];
+			if( i && split_value == candidates[i - 1] )
+			{
+				continue;
+			}
+
+			while( nminbelow < ntris && mins[nminbelow] < split_value )
+			{
+				nminbelow++;
+			}
+			while( nmaxatorbelow < ntris && maxs[nmaxatorbelow] <= split_value )
+			{
+				nmaxatorbelow++;
+			}
+			while( nflatbelow < nflats && flats[nflatbelow] < split_value )
+			{
+				nflatbelow++;
+			}
+			while( nflatatorbelow < nflats && flats[nflatatorbelow] <= split_value )
+			{
+				nflatatorbelow++;
+			}
+
+			int nright = ntris - nminbelow;
+			int nleft = nmaxatorbelow - ( nflatatorbelow - nflatbelow );
+			TrySplit( axis, split_value, nleft, nright, ntris - nleft - nright,
+					  min_coord, max_coord, MinBound, MaxBound, best );
+		}
+	}
+}
+
+
+void CKDTreeBuilder::MakeLeaf( KDSubtree_t* pTree, int node_number, int32 const* tri_list, int ntris,
+							   const Vector& MinBound, const Vector& MaxBound )
+{
+	CUtlVector<CacheOptimizedKDNode>& nodes = pTree ? pTree->m_Nodes : m_pEnv->OptimizedKDTree;
+	CUtlVector<int32>& indices = pTree ? pTree->m_Indices : m_pEnv->TriangleIndexList;
+
+	nodes[node_number].Children = KDNODE_STATE_LEAF + ( indices.Count() << 2 );
+	nodes[node_number].SetNumberOfTrianglesInLeafNode( ntris );
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	indices.AddMultipleToTail( ntris, tri_list );
+}
+
+
+void CKDTreeBuilder::Refine( KDSubtree_t* pTree, int node_number, int32 const* tri_list, int ntris,
+							 Vector MinBound, Vector MaxBound, int depth )
+{
+	if( !pTree && ntris <= KDBUILD_TASK_MAX_TRIS )
+	{
+		// small enough to hand the whole subtree to a thread
+		KDSubtree_t* pSubtree = new KDSubtree_t;
+		pSubtree->m_nNode = node_number;
+		pSubtree->m_Mins = MinBound;
+		pSubtree->m_Maxs = MaxBound;
+		pSubtree->m_nDepth = depth;
+		pSubtree->m_Tris.AddMultipleToTail( ntris, tri_list );
+		m_Subtrees.AddToTail( pSubtree );
+		return;
+	}
+
+	if( ntris < 3 )											// never split empty lists
+	{
+		MakeLeaf( pTree, node_number, tri_list, ntris, MinBound, MaxBound );
+		return;
+	}
+
+	KDSplit_t best;
+	memset( &best, 0, sizeof( best ) );
+	best.m_flCost = 1.0e23;
+	if( ntris >= KDBUILD_BINNED_MIN_TRIS )
+	{
+		FindSplitBinned( tri_list, ntris, MinBound, MaxBound, pTree == NULL, best );
+	}
+	else
+	{
+		FindSplitSweep( tri_list, ntris, MinBound, MaxBound, best );
+	}
+
+	float cost_of_no_split = COST_OF_INTERSECTION * ntris;
+	if( ( cost_of_no_split <= best.m_flCost ) || NEVER_SPLIT || ( depth > MAX_TREE_DEPTH ) )
+	{
+		MakeLeaf( pTree, node_number, tri_list, ntris, MinBound, MaxBound );
+		return;
+	}
+
+	int split_plane = best.m_nAxis;
+	int32* new_triangle_list = new int32[ntris];
+
+	Vector LeftMins = MinBound;
+	Vector LeftMaxes = MaxBound;
+	Vector RightMins = MinBound;
+	Vector RightMaxes = MaxBound;
+	LeftMaxes[split_plane] = best.m_flValue;
+	RightMins[split_plane] = best.m_flValue;
+
+	// same layout as RefineNode: left, then straddling, then right from the end
+	int n_left_output = 0;
+	int n_both_output = 0;
+	int n_right_output = 0;
+	for( int t = 0; t < ntris; t++ )
+	{
+		int tnum = tri_list[t];
+		if( m_TriMins[tnum][split_plane] >= best.m_flClassifyValue )
+		{
+			n_right_output++;
+			new_triangle_list[ntris - n_right_output] = tnum;
+		}
+		else if( m_TriMaxs[tnum][split_plane] <= best.m_flClassifyValue )
+		{
+			new_triangle_list[n_left_output++] = tnum;
+		}
+		else
+		{
+			new_triangle_list[best.m_nLeft + n_both_output] = tnum;
+			n_both_output++;
+		}
+	}
+	Assert( n_left_output == best.m_nLeft && n_right_output == best.m_nRight && n_both_output == best.m_nBoth );
+
+	CUtlVector<CacheOptimizedKDNode>& nodes = pTree ? pTree->m_Nodes : m_pEnv->OptimizedKDTree;
+	int left_child = nodes.Count();
+	int right_child = left_child + 1;
+	nodes[node_number].Children = split_plane + ( left_child << 2 );
+	nodes[node_number].SplittingPlaneValue = best.m_flValue;
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	CacheOptimizedKDNode newnode;
+	nodes.AddToTail( newnode );
+	nodes.AddToTail( newnode );
+
+	if( ( ntris < 20 ) && ( ( best.m_nLeft == 0 ) || ( best.m_nRight == 0 ) ) )
+	{
+		depth += 100;
+	}
+	Refine( pTree, left_child, new_triangle_list, best.m_nLeft + best.m_nBoth, LeftMins, LeftMaxes, depth + 1 );
+	Refine( pTree, right_child, new_triangle_list + best.m_nLeft, best.m_nRight + best.m_nBoth,
+			RightMins, RightMaxes, depth + 1 );
+	delete[] new_triangle_list;
+}
+
+
+void CKDTreeBuilder::BuildSubtree( int iTask )
 {
+	KDSubtree_t* pTree = m_Subtrees[m_SubtreeOrder[iTask]];
 	CacheOptimizedKDNode root;
-	OptimizedKDTree.AddToTail( root );
-	int32* root_triangle_list = new int32[OptimizedTriangleList.Count()];
-	for( int t = 0; t < OptimizedTriangleList.Count(); t++ )
+	pTree->m_Nodes.AddToTail( root );
+	Refine( pTree, 0, pTree->m_Tris.Base(), pTree->m_Tris.Count(), pTree->m_Mins, pTree->m_Maxs, pTree->m_nDepth );
+	pTree->m_Tris.Purge();
+}
+
+
+static int SubtreeSizeCompare( const void* a, const void* b )
+{
+	const KDSubtree_t* pA = *( const KDSubtree_t* const* )a;
+	const KDSubtree_t* pB = *( const KDSubtree_t* const* )b;
+	return pB->m_Tris.Count() - pA->m_Tris.Count();
+}
+
+void CKDTreeBuilder::Build()
+{
+	CUtlVector<CacheOptimizedKDNode>& tree = m_pEnv->OptimizedKDTree;
+	CUtlVector<int32>& indices = m_pEnv->TriangleIndexList;
+
+	int ntris = m_pEnv->OptimizedTriangleList.Count();
+	int32* root_triangle_list = new int32[ntris];
+	for( int t = 0; t < ntris; t++ )
 	{
 		root_triangle_list[t] = t;
 	}
-	CalculateTriangleListBounds( root_triangle_list, OptimizedTriangleList.Count(), m_MinBound,
-								 m_MaxBound );
-	RefineNode( 0, root_triangle_list, OptimizedTriangleList.Count(), m_MinBound, m_MaxBound, 0 );
+	m_pEnv->CalculateTriangleListBounds( root_triangle_list, ntris, m_pEnv->m_MinBound, m_pEnv->m_MaxBound );
+
+	// top of the tree, with the binning of each node spread over the threads
+	CacheOptimizedKDNode root;
+	tree.AddToTail( root );
+	Refine( NULL, 0, root_triangle_list, ntris, m_pEnv->m_MinBound, m_pEnv->m_MaxBound, 0 );
 	delete[] root_triangle_list;
 
+	// everything below it, a subtree per task, biggest first
+	CUtlVector<KDSubtree_t*> sorted;
+	sorted.CopyArray( m_Subtrees.Base(), m_Subtrees.Count() );
+	qsort( sorted.Base(), sorted.Count(), sizeof( KDSubtree_t* ), SubtreeSizeCompare );
+	m_SubtreeOrder.SetCount( sorted.Count() );
+	for( int i = 0; i < sorted.Count(); i++ )
+	{
+		m_SubtreeOrder[i] = m_Subtrees.Find( sorted[i] );
+	}
+	ParallelFor( m_Subtrees.Count(), &CKDTreeBuilder::BuildSubtree );
+
+	// stitch the subtrees on in the order they were created
+	for( int i = 0; i < m_Subtrees.Count(); i++ )
+	{
+		KDSubtree_t* pTree = m_Subtrees[i];
+		int nodeBase = tree.Count() - 1;		// local node k > 0 lands at nodeBase + k
+		int indexBase = indices.Count();
+		for( int k = 0; k < pTree->m_Nodes.Count(); k++ )
+		{
+			CacheOptimizedKDNode node = pTree->m_Nodes[k];
+			if( node.NodeType() == KDNODE_STATE_LEAF )
+			{
+				node.Children = KDNODE_STATE_LEAF + ( ( node.TriangleIndexStart() + indexBase ) << 2 );
+			}
+			else
+			{
+				node.Children = node.NodeType() + ( ( node.LeftChild() + nodeBase ) << 2 );
+			}
+
+			if( k == 0 )
+			{
+				tree[pTree->m_nNode] = node;
+			}
+			else
+			{
+				tree.AddToTail( node );
+			}
+		}
+		indices.AddMultipleToTail( pTree->m_Indices.Count(), pTree->m_Indices.Base() );
+
+		delete pTree;
+		m_Subtrees[i] = NULL;
+	}
+	m_Subtrees.RemoveAll();
+}
+
+
+void RayTracingEnvironment::SetupAccelerationStructure( void )
+{
+	if( Flags & RTE_FLAGS_SERIAL_TREE_GENERATION )
+	{
+		CacheOptimizedKDNode root;
+		OptimizedKDTree.AddToTail( root );
+		int32* root_triangle_list = new int32[OptimizedTriangleList.Count()];
+		for( int t = 0; t < OptimizedTriangleList.Count(); t++ )
+		{
+			root_triangle_list[t] = t;
+		}
+		CalculateTriangleListBounds( root_triangle_list, OptimizedTriangleList.Count(), m_MinBound,
+									 m_MaxBound );
+		RefineNode( 0, root_triangle_list, OptimizedTriangleList.Count(), m_MinBound, m_MaxBound, 0 );
+		delete[] root_triangle_list;
+	}
+	else
+	{
+		CKDTreeBuilder builder( this, m_nBuildThreads );
+		builder.Build();
+	}
+
 	// now, convert all triangles to "intersection format"
 	for( int i = 0; i < OptimizedTriangleList.Count(); i++ )
 	{
@@ -0,0 +1,324 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: 8 wide version of Trace4Rays for cpus with AVX. Two bundles of
+//			FourRays that share direction signs walk the kd-tree together, so
+//			each node and triangle is fetched and tested once for all 8 rays.
+//			Only the functions in here that are marked AVX_FUNCTION use AVX,
+//			and they are only ever called once CheckAVXTechnology says so.
+//
+//=============================================================================//
+
+#include "raytrace.h"
+#include <tier1/processor_detect.h>
+#include <immintrin.h>
+
+#if defined( __GNUC__ )
+#define AVX_FUNCTION __attribute__(( target( "avx" ) ))
+#else
+#define AVX_FUNCTION
+#endif
+
+
+int EightRays::CalculateDirectionSignMask( void ) const
+{
+	int msk = half[0].CalculateDirectionSignMask();
+	if( msk == -1 || msk != half[1].CalculateDirectionSignMask() )
+	{
+		return -1;
+	}
+	return msk;
+}
+
+
+static bool HasAVX( void )
+{
+	static bool s_bHasAVX = CheckAVXTechnology();
+	return s_bHasAVX;
+}
+
+bool RayTracingEnvironment::CanTrace8Wide( void ) const
+{
+	return !( Flags & RTE_FLAGS_NO_AVX ) && HasAVX();
+}
+
+
+struct NodeToVisit8
+{
+	CacheOptimizedKDNode const* node;
+	__m256 TMin;
+	__m256 TMax;
+};
+
+static AVX_FUNCTION FORCEINLINE __m256 Combine( const fltx4& lo, const fltx4& hi )
+{
+	return _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), hi, 1 );
+}
+
+static AVX_FUNCTION FORCEINLINE fltx4 GetHalf( const __m256& v, int h )
+{
+	return h ? _mm256_extractf128_ps( v, 1 ) : _mm256_castps256_ps128( v );
+}
+
+static AVX_FUNCTION FORCEINLINE __m256 SetHalf( const __m256& v, const fltx4& x, int h )
+{
+	return h ? _mm256_insertf128_ps( v, x, 1 ) : _mm256_insertf128_ps( v, x, 0 );
+}
+
+static AVX_FUNCTION FORCEINLINE __m256 Select( const __m256& old, const __m256& val, const __m256& mask )
+{
+	return _mm256_or_ps( _mm256_and_ps( val, mask ), _mm256_andnot_ps( mask, old ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// Same traversal and intersection math as Trace4Rays, lane for lane, so the
+// closest hit of each ray is the one the 4 wide code finds.
+//-----------------------------------------------------------------------------
+static AVX_FUNCTION void Trace8RaysAVX( RayTracingEnvironment* pEnv, const EightRays& rays,
+										const fltx4* pTMin, const fltx4* pTMax, int DirectionSignMask,
+										RayTracingResult* rslt_out, int32 skip_id,
+										ITransparentTriangleCallback* const* ppCallbacks )
+{
+	rays.half[0].Check();
+	rays.half[1].Check();
+
+	FourVectors OneOverRayDir[2] = { rays.half[0].direction, rays.half[1].direction };
+	OneOverRayDir[0].MakeReciprocalSaturate();
+	OneOverRayDir[1].MakeReciprocalSaturate();
+
+	__m256 origin[3], direction[3], invdir[3];
+	for( int c = 0; c < 3; c++ )
+	{
+		origin[c] = Combine( rays.half[0].origin[c], rays.half[1].origin[c] );
+		direction[c] = Combine( rays.half[0].direction[c], rays.half[1].direction[c] );
+		invdir[c] = Combine( OneOverRayDir[0][c], OneOverRayDir[1][c] );
+	}
+
+	__m256 HitIds = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+	__m256 HitDistance = _mm256_set1_ps( 1.0e23 );
+	__m256 NormalX = _mm256_setzero_ps();
+	__m256 NormalY = _mm256_setzero_ps();
+	__m256 NormalZ = _mm256_setzero_ps();
+
+	const __m256 Epsilons = _mm256_set1_ps( 1.0e-10 );
+	const __m256 NegativeEpsilons = _mm256_set1_ps( -1.0e-10 );
+	const __m256 Zeros = Epsilons;		// FourZeros in raytrace.cpp is 1e-10 as well
+	const __m256 Ones = _mm256_set1_ps( 1.0 );
+
+	// now, clip rays against bounding box
+	__m256 TMin = Combine( pTMin[0], pTMin[1] );
+	__m256 TMax = Combine( pTMax[0], pTMax[1] );
+	for( int c = 0; c < 3; c++ )
+	{
+		__m256 isect_min_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( pEnv->m_MinBound[c] ), origin[c] ), invdir[c] );
+		__m256 isect_max_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( pEnv->m_MaxBound[c] ), origin[c] ), invdir[c] );
+		TMin = _mm256_max_ps( TMin, _mm256_min_ps( isect_min_t, isect_max_t ) );
+		TMax = _mm256_min_ps( TMax, _mm256_max_ps( isect_min_t, isect_max_t ) );
+	}
+
+	if( _mm256_movemask_ps( _mm256_cmp_ps( TMin, TMax, _CMP_LE_OS ) ) )
+	{
+		int32 mailboxids[MAILBOX_HASH_SIZE];				// used to avoid redundant triangle tests
+		memset( mailboxids, 0xff, sizeof( mailboxids ) );
+
+		int front_idx[3], back_idx[3];						// based on ray direction, whether to
+		// visit left or right node first
+		for( int c = 0; c < 3; c++ )
+		{
+			back_idx[c] = ( DirectionSignMask & ( 1 << c ) ) ? 0 : 1;
+			front_idx[c] = 1 - back_idx[c];
+		}
+
+		NodeToVisit8 NodeQueue[MAX_NODE_STACK_LEN];
+		CacheOptimizedKDNode const* CurNode = &( pEnv->OptimizedKDTree[0] );
+		NodeToVisit8* stack_ptr = &NodeQueue[MAX_NODE_STACK_LEN];
+		while( 1 )
+		{
+			while( CurNode->NodeType() != KDNODE_STATE_LEAF )	// traverse until next leaf
+			{
+				int split_plane_number = CurNode->NodeType();
+				CacheOptimizedKDNode const* FrontChild = &( pEnv->OptimizedKDTree[CurNode->LeftChild()] );
+
+				__m256 dist_to_sep_plane =					// dist=(split-org)/dir
+					_mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( CurNode->SplittingPlaneValue ),
+												  origin[split_plane_number] ), invdir[split_plane_number] );
+				__m256 active = _mm256_cmp_ps( TMin, TMax, _CMP_LE_OS );
+
+				__m256 hits_front = _mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMin, _CMP_GE_OS ) );
+				if( !_mm256_movemask_ps( hits_front ) )
+				{
+					// missed the front. only traverse back
+					CurNode = FrontChild + back_idx[split_plane_number];
+					TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+				}
+				else
+				{
+					__m256 hits_back = _mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMax, _CMP_LE_OS ) );
+					if( !_mm256_movemask_ps( hits_back ) )
+					{
+						// missed the back - only need to traverse front node
+						CurNode = FrontChild + front_idx[split_plane_number];
+						TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+					}
+					else
+					{
+						// at least some rays hit both nodes. must push far, traverse near
+						Assert( stack_ptr > NodeQueue );
+						--stack_ptr;
+						stack_ptr->node = FrontChild + back_idx[split_plane_number];
+						stack_ptr->TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+						stack_ptr->TMax = TMax;
+						CurNode = FrontChild + front_idx[split_plane_number];
+						TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+					}
+				}
+			}
+
+			// hit a leaf! must do intersection check
+			int ntris = CurNode->NumberOfTrianglesInLeaf();
+			if( ntris )
+			{
+				int32 const* tlist = &( pEnv->TriangleIndexList[CurNode->TriangleIndexStart()] );
+				do
+				{
+					int tnum = *( tlist++ );
+					int mbox_slot = tnum & ( MAILBOX_HASH_SIZE - 1 );
+					TriIntersectData_t const* tri = &( pEnv->OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+					if( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == skip_id ) )
+					{
+						continue;
+					}
+					mailboxids[mbox_slot] = tnum;
+
+					// compute plane intersection
+					__m256 Nx = _mm256_set1_ps( tri->m_flNx );
+					__m256 Ny = _mm256_set1_ps( tri->m_flNy );
+					__m256 Nz = _mm256_set1_ps( tri->m_flNz );
+
+					__m256 DDotN = _mm256_mul_ps( direction[0], Nx );
+					DDotN = _mm256_add_ps( _mm256_mul_ps( direction[1], Ny ), DDotN );
+					DDotN = _mm256_add_ps( _mm256_mul_ps( direction[2], Nz ), DDotN );
+
+					// mask off zero or near zero (ray parallel to surface)
+					__m256 did_hit = _mm256_or_ps( _mm256_cmp_ps( DDotN, Epsilons, _CMP_GT_OS ),
+												   _mm256_cmp_ps( DDotN, NegativeEpsilons, _CMP_LT_OS ) );
+
+					__m256 ODotN = _mm256_mul_ps( origin[0], Nx );
+					ODotN = _mm256_add_ps( _mm256_mul_ps( origin[1], Ny ), ODotN );
+					ODotN = _mm256_add_ps( _mm256_mul_ps( origin[2], Nz ), ODotN );
+					__m256 numerator = _mm256_sub_ps( _mm256_set1_ps( tri->m_flD ), ODotN );
+
+					__m256 isect_t = _mm256_div_ps( numerator, DDotN );
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, Zeros, _CMP_GT_OS ) );
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, HitDistance, _CMP_LT_OS ) );
+
+					if( !_mm256_movemask_ps( did_hit ) )
+					{
+						continue;
+					}
+
+					// now, check 3 edges
+					__m256 hitc1 = _mm256_add_ps( origin[tri->m_nCoordSelect0],
+												  _mm256_mul_ps( isect_t, direction[tri->m_nCoordSelect0] ) );
+					__m256 hitc2 = _mm256_add_ps( origin[tri->m_nCoordSelect1],
+												  _mm256_mul_ps( isect_t, direction[tri->m_nCoordSelect1] ) );
+
+					// do barycentric coordinate check
+					__m256 B0 = _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+					B0 = _mm256_add_ps( B0, _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+					B0 = _mm256_add_ps( B0, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[2] ) );
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B0, Zeros, _CMP_GE_OS ) );
+
+					__m256 B1 = _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+					B1 = _mm256_add_ps( B1, _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[4] ), hitc2 ) );
+					B1 = _mm256_add_ps( B1, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[5] ) );
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B1, Zeros, _CMP_GE_OS ) );
+
+					__m256 B2 = _mm256_add_ps( B1, B0 );
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B2, Ones, _CMP_LE_OS ) );
+
+					int hitmask = _mm256_movemask_ps( did_hit );
+					if( !hitmask )
+					{
+						continue;
+					}
+
+					// if the triangle is transparent, let the callback of each half that hit it
+					// decide, in the same 1, 2, 0 barycentric order Trace4Rays uses
+					if( ( tri->m_nFlags & FCACHETRI_TRANSPARENT ) && ppCallbacks )
+					{
+						__m256 b2 = _mm256_sub_ps( Ones, B2 );
+						for( int h = 0; h < 2; h++ )
+						{
+							if( !ppCallbacks[h] || !( ( hitmask >> ( 4 * h ) ) & 0xF ) )
+							{
+								continue;
+							}
+
+							fltx4 halfHit = GetHalf( did_hit, h );
+							fltx4 halfB0 = GetHalf( B0, h );
+							fltx4 halfB1 = GetHalf( B1, h );
+							fltx4 halfb2 = GetHalf( b2, h );
+							if( ppCallbacks[h]->VisitTriangle_ShouldContinue( *tri, rays.half[h], &halfHit, &halfB1, &halfb2, &halfB0, tnum ) )
+							{
+								halfHit = Four_Zeros;
+							}
+							did_hit = SetHalf( did_hit, halfHit, h );
+						}
+					}
+
+					// now, set the hit_id and closest_hit fields for any enabled rays
+					HitIds = Select( HitIds, _mm256_castsi256_ps( _mm256_set1_epi32( tnum ) ), did_hit );
+					HitDistance = Select( HitDistance, isect_t, did_hit );
+					NormalX = Select( NormalX, Nx, did_hit );
+					NormalY = Select( NormalY, Ny, did_hit );
+					NormalZ = Select( NormalZ, Nz, did_hit );
+				}
+				while( --ntris );
+
+				// now, check if all rays have terminated
+				if( !_mm256_movemask_ps( _mm256_cmp_ps( TMax, HitDistance, _CMP_LE_OS ) ) )
+				{
+					break;
+				}
+			}
+
+			if( stack_ptr == &NodeQueue[MAX_NODE_STACK_LEN] )
+			{
+				break;
+			}
+			// pop stack!
+			CurNode = stack_ptr->node;
+			TMin = stack_ptr->TMin;
+			TMax = stack_ptr->TMax;
+			stack_ptr++;
+		}
+	}
+
+	for( int h = 0; h < 2; h++ )
+	{
+		StoreAlignedSIMD( ( float* ) rslt_out[h].HitIds, GetHalf( HitIds, h ) );
+		rslt_out[h].HitDistance = GetHalf( HitDistance, h );
+		rslt_out[h].surface_normal.x = GetHalf( NormalX, h );
+		rslt_out[h].surface_normal.y = GetHalf( NormalY, h );
+		rslt_out[h].surface_normal.z = GetHalf( NormalZ, h );
+	}
+}
+
+
+void RayTracingEnvironment::Trace8Rays( const EightRays& rays, const fltx4* TMin, const fltx4* TMax,
+										RayTracingResult* rslt_out,
+										int32 skip_id, ITransparentTriangleCallback* const* ppCallbacks )
+{
+	int msk = rays.CalculateDirectionSignMask();
+	if( msk != -1 && CanTrace8Wide() )
+	{
+		Trace8RaysAVX( this, rays, TMin, TMax, msk, rslt_out, skip_id, ppCallbacks );
+		return;
+	}
+
+	for( int h = 0; h < 2; h++ )
+	{
+		Trace4Rays( rays.half[h], TMin[h], TMax[h], &rslt_out[h], skip_id, ppCallbacks ? ppCallbacks[h] : NULL );
+	}
+}
@@ -0,0 +1,165 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Cache of the built kd-tree, keyed by the triangles it was built
+//			from. A repeat compile of an unchanged map maps the tree straight
+//			out of the cache file instead of rebuilding it.
+//
+//=============================================================================//
+
+#include "raytrace.h"
+#include <cmdlib.h>
+#include <stdio.h>
+
+
+#define KDTREECACHE_ID		(('C'<<24)+('T'<<16)+('D'<<8)+'K')
+#define KDTREECACHE_VERSION	2		// bump when the tree builder changes
+
+struct kdtreecacheheader_t
+{
+	int			id;
+	int			version;
+	MD5Value_t	key;
+	int			numnodes;
+	int			numindices;
+	int			numtris;
+	float		mins[3];
+	float		maxs[3];
+	int			unused;		// keeps the node array 16 byte aligned
+};
+
+
+void RayTracingEnvironment::CalculateTriangleListHash( MD5Value_t& key )
+{
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+
+	// anything that changes the layout of what we store has to change the key too
+	int format[4] = { KDTREECACHE_VERSION, sizeof( CacheOptimizedKDNode ), sizeof( CacheOptimizedTriangle ), ( int )Flags };
+	MD5Update( &ctx, ( unsigned char* )format, sizeof( format ) );
+
+	int ntris = OptimizedTriangleList.Count();
+	MD5Update( &ctx, ( unsigned char* )&ntris, sizeof( ntris ) );
+	for( int i = 0; i < ntris; i++ )
+	{
+		const TriGeometryData_t& tri = OptimizedTriangleList[i].m_Data.m_GeometryData;
+		MD5Update( &ctx, ( unsigned char* )&tri.m_nTriangleID, sizeof( tri.m_nTriangleID ) );
+		MD5Update( &ctx, ( unsigned char* )tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+		MD5Update( &ctx, ( unsigned char* )&tri.m_nFlags, sizeof( tri.m_nFlags ) );
+	}
+
+	MD5Final( key.bits, &ctx );
+}
+
+
+bool RayTracingEnvironment::LoadAccelerationStructure( const char* pCacheFile, const MD5Value_t& key )
+{
+	if( !m_TreeCache.Open( pCacheFile ) )
+	{
+		return false;
+	}
+
+	const kdtreecacheheader_t* pHeader = ( const kdtreecacheheader_t* )m_TreeCache.Base();
+	if( m_TreeCache.Size() < ( int64 )sizeof( kdtreecacheheader_t ) ||
+			pHeader->id != KDTREECACHE_ID || pHeader->version != KDTREECACHE_VERSION ||
+			pHeader->key != key || pHeader->numtris != OptimizedTriangleList.Count() )
+	{
+		m_TreeCache.Close();
+		return false;
+	}
+
+	int64 size = sizeof( kdtreecacheheader_t ) +
+				 ( int64 )pHeader->numnodes * sizeof( CacheOptimizedKDNode ) +
+				 ( int64 )pHeader->numindices * sizeof( int32 ) +
+				 ( int64 )pHeader->numtris * sizeof( CacheOptimizedTriangle );
+	if( pHeader->numnodes <= 0 || pHeader->numindices < 0 || m_TreeCache.Size() != size )
+	{
+		Warning( "Ignoring truncated kd-tree cache %s\n", pCacheFile );
+		m_TreeCache.Close();
+		return false;
+	}
+
+	// the nodes and the index list are used in place
+	byte* pData = ( byte* )( pHeader + 1 );
+	CUtlVector<CacheOptimizedKDNode> nodes( ( CacheOptimizedKDNode* )pData, pHeader->numnodes, pHeader->numnodes );
+	OptimizedKDTree.Swap( nodes );
+	pData += pHeader->numnodes * sizeof( CacheOptimizedKDNode );
+
+	CUtlVector<int32> indices( ( int32* )pData, pHeader->numindices, pHeader->numindices );
+	TriangleIndexList.Swap( indices );
+	pData += pHeader->numindices * sizeof( int32 );
+
+	// the triangles live in a block vector, so they get copied over the ones we were given
+	const CacheOptimizedTriangle* pTris = ( const CacheOptimizedTriangle* )pData;
+	for( int i = 0; i < pHeader->numtris; i++ )
+	{
+		OptimizedTriangleList[i] = pTris[i];
+	}
+
+	m_MinBound.Init( pHeader->mins[0], pHeader->mins[1], pHeader->mins[2] );
+	m_MaxBound.Init( pHeader->maxs[0], pHeader->maxs[1], pHeader->maxs[2] );
+	return true;
+}
+
+
+void RayTracingEnvironment::SaveAccelerationStructure( const char* pCacheFile, const MD5Value_t& key )
+{
+	FILE* fp = fopen( pCacheFile, "wb" );
+	if( !fp )
+	{
+		Warning( "Couldn't write kd-tree cache %s\n", pCacheFile );
+		return;
+	}
+
+	kdtreecacheheader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.version = KDTREECACHE_VERSION;
+	header.key = key;
+	header.numnodes = OptimizedKDTree.Count();
+	header.numindices = TriangleIndexList.Count();
+	header.numtris = OptimizedTriangleList.Count();
+	for( int i = 0; i < 3; i++ )
+	{
+		header.mins[i] = m_MinBound[i];
+		header.maxs[i] = m_MaxBound[i];
+	}
+
+	// the id is filled in last so a partially written file is never used
+	bool bOk = fwrite( &header, sizeof( header ), 1, fp ) == 1;
+	bOk = bOk && fwrite( OptimizedKDTree.Base(), sizeof( CacheOptimizedKDNode ), header.numnodes, fp ) == ( size_t )header.numnodes;
+	bOk = bOk && fwrite( TriangleIndexList.Base(), sizeof( int32 ), header.numindices, fp ) == ( size_t )header.numindices;
+	for( int i = 0; bOk && i < header.numtris; i++ )
+	{
+		bOk = fwrite( &OptimizedTriangleList[i], sizeof( CacheOptimizedTriangle ), 1, fp ) == 1;
+	}
+
+	if( bOk )
+	{
+		header.id = KDTREECACHE_ID;
+		bOk = fseek( fp, 0, SEEK_SET ) == 0 && fwrite( &header, sizeof( header ), 1, fp ) == 1;
+	}
+
+	fclose( fp );
+
+	if( !bOk )
+	{
+		Warning( "Couldn't write kd-tree cache %s\n", pCacheFile );
+		remove( pCacheFile );
+	}
+}
+
+
+bool RayTracingEnvironment::SetupAccelerationStructure( const char* pCacheFile )
+{
+	MD5Value_t key;
+	CalculateTriangleListHash( key );
+
+	if( LoadAccelerationStructure( pCacheFile, key ) )
+	{
+		return true;
+	}
+
+	SetupAccelerationStructure();
+	SaveAccelerationStructure( pCacheFile, key );
+	return false;
+}
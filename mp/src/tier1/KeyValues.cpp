@@ -24,8 +24,12 @@
 #include <stdlib.h>
 #include "tier0/dbg.h"
 #include "tier0/mem.h"
+#include "tier0/threadtools.h"
 #include "utlbuffer.h"
 #include "utlhash.h"
+#include "generichash.h"
+#include "mappedfile.h"
+#include "utlmap.h"
 #include "utlvector.h"
 #include "utlqueue.h"
 #include "UtlSortVector.h"
@@ -51,6 +55,613 @@ static char s_pTokenBuf[KEYVALUES_TOKEN_SIZE];
 #define INTERNALWRITE( pData, len ) InternalWrite( filesystem, f, pBuf, pData, len )
 
 
+// Keys that UsesChildIndex get a hash from symbol to their first child of that
+// name once a lookup has walked this many children. The hashes live in a table
+// on the side so KeyValues keeps the layout other modules were built with, the
+// flags byte only says whether a key has one or is in the list of one that does.
+#define KEYVALUES_CHILD_INDEX_MIN	16
+
+// m_nFlags
+#define KV_CHILD_INDEX_ENABLED		0x01
+#define KV_CHILD_INDEX_BUILT		0x02
+#define KV_ARENA_KEY				0x04	// lives in a CKeyValuesArena, never deleted on its own
+#define KV_ARENA_ROOT				0x08	// deleteThis() frees the arena
+#define KV_VALUE_BORROWED			0x10	// m_sValue is arena memory
+#define KV_CHILD_INDEXED			0x20	// in the child list of a key with a built index
+
+struct KeyValuesChildIndex_t
+{
+	int						m_nCount;
+	KeyValues*				m_pLastChild;
+	CUtlVector<KeyValues*>	m_Slots;	// open addressing, power of two, NULL is empty
+	CUtlVector<KeyValues*>	m_Children;	// all of them, flagged KV_CHILD_INDEXED
+
+	// s_ChildIndexLock must be held for write
+	void AddChild( const KeyValues* pParent, KeyValues* pChild );
+	static void Remove( int iMapIndex );
+};
+
+// Lookups only read, so they share the lock. Children don't know their parent, the
+// second map is how SetNextKey or renaming a KV_CHILD_INDEXED key finds the one
+// index that has to go.
+static CThreadSpinRWLock s_ChildIndexLock;
+static CUtlMap<const KeyValues*, KeyValuesChildIndex_t*, int> s_ChildIndexes( DefLessFunc( const KeyValues* ) );
+static CUtlMap<const KeyValues*, const KeyValues*, int> s_ChildIndexParents( DefLessFunc( const KeyValues* ) );
+
+
+// Memory for the keys and strings of a tree loaded with LoadFromBufferReadOnly.
+// The first block holds this header, the root and the arena's copy of the file,
+// which string values point into. Keys and strings that don't fit go in more
+// blocks, and everything goes at once when the root is deleted.
+#define KEYVALUES_ARENA_BLOCK_SIZE	( 64 * 1024 )
+
+// placement new below
+#include "tier0/memdbgoff.h"
+
+class CKeyValuesArena
+{
+public:
+	static CKeyValuesArena* Create( const char* pRootName, int nBufferSize )
+	{
+		int nSize = RootOffset() + ALIGN_VALUE( sizeof( KeyValues ), 16 ) + nBufferSize + 1;
+		void* pMem = malloc( nSize );
+		CKeyValuesArena* pArena = ::new( pMem ) CKeyValuesArena;
+		pArena->m_pBuffer = ( char* )pMem + RootOffset() + ALIGN_VALUE( sizeof( KeyValues ), 16 );
+		pArena->m_nBufferSize = nBufferSize;
+		pArena->m_pBuffer[nBufferSize] = 0;
+
+		KeyValues* pRoot = ::new( ( char* )pMem + RootOffset() ) KeyValues( pRootName );
+		pRoot->m_nFlags |= KV_ARENA_KEY;
+		pArena->m_Keys.AddToTail( pRoot );
+		return pArena;
+	}
+
+	static CKeyValuesArena* FromRoot( KeyValues* pRoot )
+	{
+		Assert( pRoot->m_nFlags & KV_ARENA_ROOT );
+		return ( CKeyValuesArena* )( ( char* )pRoot - RootOffset() );
+	}
+
+	KeyValues* GetRoot()
+	{
+		return m_Keys[0];
+	}
+
+	char* GetBuffer()
+	{
+		return m_pBuffer;
+	}
+
+	// A binary cache file the keys' values can point into, closed with the arena
+	CMappedFile& GetMappedFile()
+	{
+		return m_MappedFile;
+	}
+
+	KeyValues* AllocKey( const char* pName )
+	{
+		KeyValues* pKey = ::new( Alloc( sizeof( KeyValues ) ) ) KeyValues( pName );
+		pKey->m_nFlags |= KV_ARENA_KEY;
+		m_Keys.AddToTail( pKey );
+		return pKey;
+	}
+
+	// Strings that are already in the buffer are used where they are
+	char* AllocString( const char* pString, int nLen )
+	{
+		if( pString >= m_pBuffer && pString + nLen <= m_pBuffer + m_nBufferSize )
+		{
+			return ( char* )pString;
+		}
+
+		char* pCopy = ( char* )Alloc( nLen + 1 );
+		Q_memcpy( pCopy, pString, nLen + 1 );
+		return pCopy;
+	}
+
+	void Free()
+	{
+		// parents were allocated before their children, so by the time a key is
+		// destructed it has been unlinked from its peers. That leaves each key to
+		// free only what was added to it after the load.
+		for( int i = 0; i < m_Keys.Count(); i++ )
+		{
+			m_Keys[i]->~KeyValues();
+		}
+
+		while( m_pBlocks )
+		{
+			Block_t* pNext = m_pBlocks->m_pNext;
+			free( m_pBlocks );
+			m_pBlocks = pNext;
+		}
+
+		this->~CKeyValuesArena();
+		free( this );
+	}
+
+private:
+	struct Block_t
+	{
+		Block_t*	m_pNext;
+		int			m_nUsed;
+		int			m_nSize;
+	};
+
+	CKeyValuesArena() : m_pBuffer( NULL ), m_nBufferSize( 0 ), m_pBlocks( NULL )
+	{
+	}
+
+	static int RootOffset()
+	{
+		return ALIGN_VALUE( sizeof( CKeyValuesArena ), 16 );
+	}
+
+	void* Alloc( int nSize )
+	{
+		nSize = ALIGN_VALUE( nSize, 8 );
+		if( !m_pBlocks || m_pBlocks->m_nUsed + nSize > m_pBlocks->m_nSize )
+		{
+			int nBlockSize = max( nSize, KEYVALUES_ARENA_BLOCK_SIZE );
+			Block_t* pBlock = ( Block_t* )malloc( ALIGN_VALUE( sizeof( Block_t ), 16 ) + nBlockSize );
+			pBlock->m_pNext = m_pBlocks;
+			pBlock->m_nUsed = 0;
+			pBlock->m_nSize = nBlockSize;
+			m_pBlocks = pBlock;
+		}
+
+		void* pMem = ( char* )m_pBlocks + ALIGN_VALUE( sizeof( Block_t ), 16 ) + m_pBlocks->m_nUsed;
+		m_pBlocks->m_nUsed += nSize;
+		return pMem;
+	}
+
+	char*					m_pBuffer;
+	int						m_nBufferSize;
+	Block_t*				m_pBlocks;
+	CUtlVector<KeyValues*>	m_Keys;		// in the order they were allocated, the root first
+	CMappedFile				m_MappedFile;
+};
+
+#include "tier0/memdbgon.h"
+
+
+// Parsed text files are cached on disk with -kvbinarycache, so a file that hasn't
+// changed is mapped in instead of tokenized again. There is one cache file per text
+// file, named by a hash of its path; the header holds a hash of the text, and a
+// cache file that doesn't match is overwritten the next time the text is parsed.
+// A cache file is the header, the key names, the keys in depth first order and
+// the string values. Read only trees point straight into the mapping.
+#define KEYVALUES_CACHE_ID			MAKEID( 'K', 'V', 'B', 'C' )
+#define KEYVALUES_CACHE_VERSION		1
+#define KEYVALUES_CACHE_DIR			"kvcache"
+#define KEYVALUES_CACHE_PATHID		"DEFAULT_WRITE_PATH"
+#define KEYVALUES_CACHE_MIN_SIZE	4096	// smaller files are quicker to parse than to map
+
+// flags that change what the text parses to
+#define KEYVALUES_CACHE_ESCAPES			0x01
+#define KEYVALUES_CACHE_CONDITIONALS	0x02
+#define KEYVALUES_CACHE_PLATFORM_SHIFT	8
+
+struct KeyValuesCacheHeader_t
+{
+	int		m_nId;
+	int		m_nVersion;
+	uint64	m_nSourceHash;
+	int		m_nSourceSize;
+	int		m_nFlags;
+	int		m_nNames;
+	int		m_nNamesOffset;		// int offsets into the strings
+	int		m_nKeys;
+	int		m_nKeysOffset;
+	int		m_nStringBytes;
+	int		m_nStringsOffset;	// 8 byte aligned for the uint64 values
+};
+
+struct KeyValuesCacheKey_t
+{
+	int		m_iName;
+	int		m_iFirstChild;		// -1 for none
+	int		m_iNextPeer;		// -1 for none
+	int		m_iDataType;
+	union
+	{
+		int		m_iValue;
+		float	m_flValue;
+		int		m_nStringOffset;
+	};
+};
+
+class CKeyValuesBinaryCache
+{
+public:
+	static bool IsEnabled()
+	{
+		static bool s_bEnabled = CommandLine()->FindParm( "-kvbinarycache" ) != 0;
+		return s_bEnabled;
+	}
+
+	// Files that pull in other files, or whose conditionals can change while the
+	// game runs, aren't cached. The platform ones are part of the flags.
+	static bool CanCache( const KeyValues* pRoot, const char* pBuffer, int nLen )
+	{
+		if( nLen < KEYVALUES_CACHE_MIN_SIZE || pRoot->m_pSub || pRoot->m_pPeer )
+		{
+			return false;
+		}
+
+		if( Q_stristr( pBuffer, "#include" ) || Q_stristr( pBuffer, "#base" ) )
+		{
+			return false;
+		}
+
+		if( pRoot->m_bEvaluateConditionals &&
+			( V_strstr( pBuffer, "[%" ) || V_strstr( pBuffer, "[!%" ) || V_strstr( pBuffer, "[-" ) ||
+			  V_strstr( pBuffer, "[!-" ) || Q_stristr( pBuffer, "$DECK" ) ) )
+		{
+			return false;
+		}
+		return true;
+	}
+
+	CKeyValuesBinaryCache( const KeyValues* pRoot, const char* pResourceName, const char* pPathID, const char* pBuffer, int nLen )
+	{
+		m_nFlags = ( pRoot->m_bHasEscapeSequences ? KEYVALUES_CACHE_ESCAPES : 0 ) |
+				   ( pRoot->m_bEvaluateConditionals ? KEYVALUES_CACHE_CONDITIONALS : 0 );
+		int nPlatform = ( IsX360() ? 0x01 : 0 ) | ( IsPC() ? 0x02 : 0 ) | ( IsWindows() ? 0x04 : 0 ) |
+						( IsOSX() ? 0x08 : 0 ) | ( IsLinux() ? 0x10 : 0 ) | ( IsPosix() ? 0x20 : 0 );
+		m_nFlags |= nPlatform << KEYVALUES_CACHE_PLATFORM_SHIFT;
+
+		m_nSourceSize = nLen;
+		m_nSourceHash = MurmurHash64( pBuffer, nLen, m_nFlags );
+
+		// the same file through another path ID can be another file
+		char szPath[MAX_PATH * 2];
+		Q_snprintf( szPath, sizeof( szPath ), "%s:%s", pPathID ? pPathID : "", pResourceName );
+		Q_FixSlashes( szPath, '/' );
+		Q_strlower( szPath );
+		uint64 nPathHash = MurmurHash64( szPath, Q_strlen( szPath ), m_nFlags );
+		Q_snprintf( m_szFileName, sizeof( m_szFileName ), KEYVALUES_CACHE_DIR "/%016llx.kvb", ( unsigned long long )nPathHash );
+	}
+
+	// Maps the cache file for this text, false if there isn't a good one
+	bool Open( IBaseFileSystem* pFileSystem, CMappedFile& file )
+	{
+		char szFullPath[MAX_PATH];
+		if( !( ( IFileSystem* )pFileSystem )->RelativePathToFullPath_safe( m_szFileName, KEYVALUES_CACHE_PATHID, szFullPath ) )
+		{
+			return false;
+		}
+
+		if( !file.Open( szFullPath ) )
+		{
+			return false;
+		}
+
+		if( !IsValid( file.Base(), file.Size() ) )
+		{
+			DevMsg( "KeyValues: ignoring out of date cache file %s\n", m_szFileName );
+			file.Close();
+			return false;
+		}
+		return true;
+	}
+
+	// pRoot gets the first key in the file and the rest are its peers, like LoadFromBuffer
+	static void Build( KeyValues* pRoot, const void* pImage, CKeyValuesArena* pArena )
+	{
+		const KeyValuesCacheHeader_t* pHeader = ( const KeyValuesCacheHeader_t* )pImage;
+		const KeyValuesCacheKey_t* pKeys = ( const KeyValuesCacheKey_t* )( ( const byte* )pImage + pHeader->m_nKeysOffset );
+
+		KeyValues* pPrevious = NULL;
+		for( int i = 0; i != -1; i = pKeys[i].m_iNextPeer )
+		{
+			KeyValues* pKey = pRoot;
+			if( pPrevious )
+			{
+				// same format as the root, like the peers LoadFromBuffer makes
+				const char* pName = GetName( pImage, pKeys[i].m_iName );
+				pKey = pArena ? pArena->AllocKey( pName ) : new KeyValues( pName );
+				pKey->UsesEscapeSequences( pRoot->m_bHasEscapeSequences != 0 );
+				pKey->UsesConditionals( pRoot->m_bEvaluateConditionals != 0 );
+				pKey->UsesChildIndex( ( pRoot->m_nFlags & KV_CHILD_INDEX_ENABLED ) != 0 );
+				pPrevious->m_pPeer = pKey;
+			}
+			else
+			{
+				pKey->SetName( GetName( pImage, pKeys[i].m_iName ) );
+			}
+
+			BuildKey( pKey, pImage, i, pArena );
+			pPrevious = pKey;
+		}
+	}
+
+	void Write( IBaseFileSystem* pFileSystem, const KeyValues* pRoot )
+	{
+		CUtlVector<KeyValuesCacheKey_t> keys;
+		CUtlMap<int, int> names( DefLessFunc( int ) );
+		CUtlVector<int> nameOffsets;
+		CUtlBuffer strings;
+
+		int iPrevious = -1;
+		for( const KeyValues* pKey = pRoot; pKey; pKey = pKey->m_pPeer )
+		{
+			int iKey = AddKey( pKey, keys, names, nameOffsets, strings );
+			if( iKey == -1 )
+			{
+				return;
+			}
+			if( iPrevious != -1 )
+			{
+				keys[iPrevious].m_iNextPeer = iKey;
+			}
+			iPrevious = iKey;
+		}
+
+		KeyValuesCacheHeader_t header;
+		memset( &header, 0, sizeof( header ) );
+		header.m_nId = KEYVALUES_CACHE_ID;
+		header.m_nVersion = KEYVALUES_CACHE_VERSION;
+		header.m_nSourceHash = m_nSourceHash;
+		header.m_nSourceSize = m_nSourceSize;
+		header.m_nFlags = m_nFlags;
+		header.m_nNames = nameOffsets.Count();
+		header.m_nNamesOffset = sizeof( header );
+		header.m_nKeys = keys.Count();
+		header.m_nKeysOffset = header.m_nNamesOffset + nameOffsets.Count() * sizeof( int );
+		header.m_nStringBytes = strings.TellPut();
+		header.m_nStringsOffset = ALIGN_VALUE( header.m_nKeysOffset + keys.Count() * sizeof( KeyValuesCacheKey_t ), 8 );
+
+		CUtlBuffer buf;
+		buf.Put( &header, sizeof( header ) );
+		buf.Put( nameOffsets.Base(), nameOffsets.Count() * sizeof( int ) );
+		buf.Put( keys.Base(), keys.Count() * sizeof( KeyValuesCacheKey_t ) );
+		while( buf.TellPut() < header.m_nStringsOffset )
+		{
+			buf.PutChar( 0 );
+		}
+		buf.Put( strings.Base(), strings.TellPut() );
+
+		// written under another name first so a half written file is never mapped
+		char szTempName[MAX_PATH];
+		Q_snprintf( szTempName, sizeof( szTempName ), "%s.tmp", m_szFileName );
+		IFileSystem* pFullFileSystem = ( IFileSystem* )pFileSystem;
+		pFullFileSystem->CreateDirHierarchy( KEYVALUES_CACHE_DIR, KEYVALUES_CACHE_PATHID );
+		if( !pFileSystem->WriteFile( szTempName, KEYVALUES_CACHE_PATHID, buf ) )
+		{
+			return;
+		}
+
+		// replaces the cache file of an older version of the text
+		pFullFileSystem->RemoveFile( m_szFileName, KEYVALUES_CACHE_PATHID );
+		if( !pFullFileSystem->RenameFile( szTempName, m_szFileName, KEYVALUES_CACHE_PATHID ) )
+		{
+			pFullFileSystem->RemoveFile( szTempName, KEYVALUES_CACHE_PATHID );
+		}
+	}
+
+private:
+	static const char* GetName( const void* pImage, int iName )
+	{
+		const KeyValuesCacheHeader_t* pHeader = ( const KeyValuesCacheHeader_t* )pImage;
+		const int* pNames = ( const int* )( ( const byte* )pImage + pHeader->m_nNamesOffset );
+		return ( const char* )pImage + pHeader->m_nStringsOffset + pNames[iName];
+	}
+
+	static void BuildKey( KeyValues* pKey, const void* pImage, int iKey, CKeyValuesArena* pArena )
+	{
+		const KeyValuesCacheHeader_t* pHeader = ( const KeyValuesCacheHeader_t* )pImage;
+		const KeyValuesCacheKey_t& key = ( ( const KeyValuesCacheKey_t* )( ( const byte* )pImage + pHeader->m_nKeysOffset ) )[iKey];
+		const char* pStrings = ( const char* )pImage + pHeader->m_nStringsOffset;
+
+		pKey->m_iDataType = key.m_iDataType;
+		switch( key.m_iDataType )
+		{
+			case KeyValues::TYPE_STRING:
+			case KeyValues::TYPE_UINT64:
+			{
+				const char* pValue = pStrings + key.m_nStringOffset;
+				int nSize = key.m_iDataType == KeyValues::TYPE_STRING ? Q_strlen( pValue ) + 1 : sizeof( uint64 );
+				if( pArena )
+				{
+					pKey->m_sValue = ( char* )pValue;
+					pKey->m_nFlags |= KV_VALUE_BORROWED;
+				}
+				else
+				{
+					pKey->m_sValue = new char[nSize];
+					Q_memcpy( pKey->m_sValue, pValue, nSize );
+				}
+				break;
+			}
+
+			case KeyValues::TYPE_INT:
+				pKey->m_iValue = key.m_iValue;
+				break;
+
+			case KeyValues::TYPE_FLOAT:
+				pKey->m_flValue = key.m_flValue;
+				break;
+		}
+
+		KeyValues* pLastChild = NULL;
+		for( int i = key.m_iFirstChild; i != -1; )
+		{
+			const KeyValuesCacheKey_t* pChild = ( const KeyValuesCacheKey_t* )( ( const byte* )pImage + pHeader->m_nKeysOffset ) + i;
+			pLastChild = pKey->CreateKeyUsingKnownLastChild( GetName( pImage, pChild->m_iName ), pLastChild, pArena );
+			BuildKey( pLastChild, pImage, i, pArena );
+			i = pChild->m_iNextPeer;
+		}
+	}
+
+	// names maps key symbols to their index in nameOffsets
+	static int AddKey( const KeyValues* pKey, CUtlVector<KeyValuesCacheKey_t>& keys, CUtlMap<int, int>& names, CUtlVector<int>& nameOffsets, CUtlBuffer& strings )
+	{
+		int iKey = keys.AddToTail();
+		memset( &keys[iKey], 0, sizeof( KeyValuesCacheKey_t ) );
+		keys[iKey].m_iFirstChild = -1;
+		keys[iKey].m_iNextPeer = -1;
+		keys[iKey].m_iDataType = pKey->m_iDataType;
+
+		int iName = names.Find( pKey->m_iKeyName );
+		if( iName == names.InvalidIndex() )
+		{
+			iName = names.Insert( pKey->m_iKeyName, nameOffsets.AddToTail( strings.TellPut() ) );
+			strings.PutString( pKey->GetName() );
+		}
+		keys[iKey].m_iName = names[iName];
+
+		switch( pKey->m_iDataType )
+		{
+			case KeyValues::TYPE_NONE:
+				break;
+
+			case KeyValues::TYPE_STRING:
+				keys[iKey].m_nStringOffset = strings.TellPut();
+				strings.PutString( pKey->m_sValue ? pKey->m_sValue : "" );
+				break;
+
+			case KeyValues::TYPE_UINT64:
+				while( strings.TellPut() & 7 )
+				{
+					strings.PutChar( 0 );
+				}
+				keys[iKey].m_nStringOffset = strings.TellPut();
+				strings.Put( pKey->m_sValue, sizeof( uint64 ) );
+				break;
+
+			case KeyValues::TYPE_INT:
+				keys[iKey].m_iValue = pKey->m_iValue;
+				break;
+
+			case KeyValues::TYPE_FLOAT:
+				keys[iKey].m_flValue = pKey->m_flValue;
+				break;
+
+			default:
+				// the text parser never makes the other types
+				return -1;
+		}
+
+		int iPrevious = -1;
+		for( const KeyValues* pChild = pKey->m_pSub; pChild; pChild = pChild->m_pPeer )
+		{
+			int iChild = AddKey( pChild, keys, names, nameOffsets, strings );
+			if( iChild == -1 )
+			{
+				return -1;
+			}
+			if( iPrevious == -1 )
+			{
+				keys[iKey].m_iFirstChild = iChild;
+			}
+			else
+			{
+				keys[iPrevious].m_iNextPeer = iChild;
+			}
+			iPrevious = iChild;
+		}
+		return iKey;
+	}
+
+	// Every key has to be reached exactly once, from an earlier key, no deeper
+	// than the text parser goes, and everything it points at has to be in the file
+	bool IsValid( const void* pImage, int64 nSize ) const
+	{
+		const KeyValuesCacheHeader_t* pHeader = ( const KeyValuesCacheHeader_t* )pImage;
+		if( nSize < ( int64 )sizeof( KeyValuesCacheHeader_t ) || pHeader->m_nId != KEYVALUES_CACHE_ID || pHeader->m_nVersion != KEYVALUES_CACHE_VERSION ||
+			pHeader->m_nSourceHash != m_nSourceHash || pHeader->m_nSourceSize != m_nSourceSize || pHeader->m_nFlags != m_nFlags )
+		{
+			return false;
+		}
+
+		if( pHeader->m_nNames < 1 || pHeader->m_nKeys < 1 || pHeader->m_nStringBytes < 1 ||
+			pHeader->m_nNamesOffset != sizeof( KeyValuesCacheHeader_t ) ||
+			pHeader->m_nKeysOffset != pHeader->m_nNamesOffset + pHeader->m_nNames * ( int64 )sizeof( int ) ||
+			pHeader->m_nStringsOffset != ALIGN_VALUE( pHeader->m_nKeysOffset + pHeader->m_nKeys * ( int64 )sizeof( KeyValuesCacheKey_t ), 8 ) ||
+			nSize != pHeader->m_nStringsOffset + ( int64 )pHeader->m_nStringBytes )
+		{
+			return false;
+		}
+
+		const int* pNames = ( const int* )( ( const byte* )pImage + pHeader->m_nNamesOffset );
+		const KeyValuesCacheKey_t* pKeys = ( const KeyValuesCacheKey_t* )( ( const byte* )pImage + pHeader->m_nKeysOffset );
+		const char* pStrings = ( const char* )pImage + pHeader->m_nStringsOffset;
+		if( pStrings[pHeader->m_nStringBytes - 1] != 0 )
+		{
+			return false;
+		}
+
+		for( int i = 0; i < pHeader->m_nNames; i++ )
+		{
+			if( pNames[i] < 0 || pNames[i] >= pHeader->m_nStringBytes )
+			{
+				return false;
+			}
+		}
+
+		// depth + 1 of every key, 0 until it's reached
+		CUtlVector<int> depth;
+		depth.SetCount( pHeader->m_nKeys );
+		memset( depth.Base(), 0, depth.Count() * sizeof( int ) );
+		depth[0] = 1;
+		for( int i = 0; i < pHeader->m_nKeys; i++ )
+		{
+			const KeyValuesCacheKey_t& key = pKeys[i];
+			if( !depth[i] || depth[i] > 100 || key.m_iName < 0 || key.m_iName >= pHeader->m_nNames )
+			{
+				return false;
+			}
+
+			int links[2] = { key.m_iFirstChild, key.m_iNextPeer };
+			for( int l = 0; l < 2; l++ )
+			{
+				if( links[l] == -1 )
+				{
+					continue;
+				}
+				if( links[l] <= i || links[l] >= pHeader->m_nKeys || depth[links[l]] )
+				{
+					return false;
+				}
+				depth[links[l]] = depth[i] + ( l == 0 );
+			}
+
+			switch( key.m_iDataType )
+			{
+				case KeyValues::TYPE_NONE:
+				case KeyValues::TYPE_INT:
+				case KeyValues::TYPE_FLOAT:
+					break;
+
+				case KeyValues::TYPE_STRING:
+					if( key.m_nStringOffset < 0 || key.m_nStringOffset >= pHeader->m_nStringBytes )
+					{
+						return false;
+					}
+					break;
+
+				case KeyValues::TYPE_UINT64:
+					if( key.m_nStringOffset < 0 || ( key.m_nStringOffset & 7 ) || key.m_nStringOffset + ( int64 )sizeof( uint64 ) > pHeader->m_nStringBytes )
+					{
+						return false;
+					}
+					break;
+
+				default:
+					return false;
+			}
+		}
+		return true;
+	}
+
+	uint64	m_nSourceHash;
+	int		m_nSourceSize;
+	int		m_nFlags;
+	char	m_szFileName[MAX_PATH];
+};
+
+
 // a simple class to keep track of a stack of valid parsed symbols
 const int MAX_ERROR_STACK = 64;
 class CKeyValuesErrorStack
@@ -479,8 +1090,7 @@ void KeyValues::Init()
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
 
-	// for future proof
-	memset( unused, 0, sizeof( unused ) );
+	m_nFlags = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -498,24 +1108,48 @@ KeyValues::~KeyValues()
 //-----------------------------------------------------------------------------
 void KeyValues::RemoveEverything()
 {
+	// a key going away or being overwritten in place changes its parent's list
+	InvalidateParentChildIndex();
+	InvalidateChildIndex();
+
+	// arena keys are only unlinked, they go with their arena
 	KeyValues* dat;
 	KeyValues* datNext = NULL;
 	for( dat = m_pSub; dat != NULL; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		if( !( dat->m_nFlags & KV_ARENA_KEY ) )
+		{
+			delete dat;
+		}
 	}
 
 	for( dat = m_pPeer; dat && dat != this; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		if( !( dat->m_nFlags & KV_ARENA_KEY ) )
+		{
+			delete dat;
+		}
 	}
 
-	delete [] m_sValue;
+	FreeAllocatedValue();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees the string values, unless they belong to an arena
+//-----------------------------------------------------------------------------
+void KeyValues::FreeAllocatedValue()
+{
+	if( !( m_nFlags & KV_VALUE_BORROWED ) )
+	{
+		delete [] m_sValue;
+	}
 	m_sValue = NULL;
+	m_nFlags &= ~KV_VALUE_BORROWED;
+
 	delete [] m_wsValue;
 	m_wsValue = NULL;
 }
@@ -654,6 +1288,91 @@ const char* KeyValues::ReadToken( CUtlBuffer& buf, bool& wasQuoted, bool& wasCon
 #pragma warning (default:4706)
 
 
+//-----------------------------------------------------------------------------
+// Purpose: ReadToken for read only loads. Quoted strings without escapes, and
+//			tokens that end in whitespace, are terminated where they are in buf
+//			(the arena's copy of the file) instead of being copied out.
+//			Everything else goes through ReadToken.
+//-----------------------------------------------------------------------------
+const char* KeyValues::ReadTokenInPlace( CUtlBuffer& buf, bool& wasQuoted, bool& wasConditional )
+{
+	wasQuoted = false;
+	wasConditional = false;
+
+	if( !buf.IsValid() )
+	{
+		return NULL;
+	}
+
+	// eating white spaces and remarks loop
+	while( true )
+	{
+		buf.EatWhiteSpace();
+		if( !buf.IsValid() )
+		{
+			return NULL;    // file ends after reading whitespaces
+		}
+
+		// stop if it's not a comment; a new token starts here
+		if( !buf.EatCPPComment() )
+		{
+			break;
+		}
+	}
+
+	char* c = ( char* )buf.PeekGet( sizeof( char ), 0 );
+	if( !c )
+	{
+		return NULL;
+	}
+
+	char* pEnd;
+	bool bConditional = false;
+	if( *c == '\"' )
+	{
+		for( pEnd = c + 1; *pEnd && *pEnd != '\"'; pEnd++ )
+		{
+			if( *pEnd == '\\' && m_bHasEscapeSequences )
+			{
+				return ReadToken( buf, wasQuoted, wasConditional );
+			}
+		}
+
+		if( *pEnd != '\"' )
+		{
+			return ReadToken( buf, wasQuoted, wasConditional );
+		}
+		wasQuoted = true;
+	}
+	else
+	{
+		bool bConditionalStart = false;
+		for( pEnd = c; *pEnd && *pEnd != '"' && *pEnd != '{' && *pEnd != '}' && !isspace( *pEnd ); pEnd++ )
+		{
+			if( *pEnd == '[' )
+			{
+				bConditionalStart = true;
+			}
+			if( *pEnd == ']' && bConditionalStart )
+			{
+				bConditional = true;
+			}
+		}
+
+		// control characters are tokens themselves and have to stay in the buffer
+		if( pEnd == c || !isspace( *pEnd ) )
+		{
+			return ReadToken( buf, wasQuoted, wasConditional );
+		}
+	}
+
+	*pEnd = 0;
+	buf.SeekGet( CUtlBuffer::SEEK_CURRENT, pEnd + 1 - c );
+	wasConditional = bConditional;
+	return wasQuoted ? c + 1 : c;
+}
+
+
 
 //-----------------------------------------------------------------------------
 // Purpose: if parser should translate escape sequences ( /n, /t etc), set to true
@@ -673,6 +1392,23 @@ void KeyValues::UsesConditionals( bool state )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: if lookups should hash the children once there are many of them
+//-----------------------------------------------------------------------------
+void KeyValues::UsesChildIndex( bool state )
+{
+	if( state )
+	{
+		m_nFlags |= KV_CHILD_INDEX_ENABLED;
+	}
+	else
+	{
+		InvalidateChildIndex();
+		m_nFlags &= ~KV_CHILD_INDEX_ENABLED;
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Load keyValues from disk
 //-----------------------------------------------------------------------------
@@ -752,7 +1488,28 @@ bool KeyValues::LoadFromFile( IBaseFileSystem* filesystem, const char* resourceN
 	{
 		buffer[fileSize] = 0; // null terminate file as EOF
 		buffer[fileSize + 1] = 0; // double NULL terminating in case this is a unicode file
-		bRetOK = LoadFromBuffer( resourceName, buffer, filesystem );
+
+		if( CKeyValuesBinaryCache::IsEnabled() && CKeyValuesBinaryCache::CanCache( this, buffer, fileSize ) )
+		{
+			CKeyValuesBinaryCache cache( this, resourceName, pathID, buffer, fileSize );
+			CMappedFile mappedFile;
+			if( cache.Open( filesystem, mappedFile ) )
+			{
+				CKeyValuesBinaryCache::Build( this, mappedFile.Base(), NULL );
+			}
+			else
+			{
+				bRetOK = LoadFromBuffer( resourceName, buffer, filesystem );
+				if( bRetOK )
+				{
+					cache.Write( filesystem, this );
+				}
+			}
+		}
+		else
+		{
+			bRetOK = LoadFromBuffer( resourceName, buffer, filesystem );
+		}
 	}
 
 	// The cache relies on the KeyValuesSystem string table, which will only be valid if we're
@@ -1006,15 +1763,264 @@ void KeyValues::SaveKeyToFile( KeyValues* dat, IBaseFileSystem* filesystem, File
 //-----------------------------------------------------------------------------
 KeyValues* KeyValues::FindKey( int keySymbol ) const
 {
-	for( KeyValues* dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	KeyValues* dat;
+	KeyValues* pLastChild;
+	if( FindKeyInChildIndex( keySymbol, dat, pLastChild ) )
+	{
+		return dat;
+	}
+
+	int nWalked = 0;
+	for( dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
 	{
+		++nWalked;
 		if( dat->m_iKeyName == keySymbol )
 		{
-			return dat;
+			break;
+		}
+	}
+
+	if( nWalked >= KEYVALUES_CHILD_INDEX_MIN && ( m_nFlags & KV_CHILD_INDEX_ENABLED ) )
+	{
+		BuildChildIndex();
+	}
+
+	return dat;
+}
+
+//-----------------------------------------------------------------------------
+// Child index helpers
+//-----------------------------------------------------------------------------
+static inline unsigned int ChildIndexHash( int keySymbol )
+{
+	unsigned int h = ( unsigned int )keySymbol * 2654435761u;
+	return h ^ ( h >> 16 );
+}
+
+// Only the first child with a name goes in, that's the one FindKey returns
+static void ChildIndexInsert( KeyValuesChildIndex_t* pIndex, KeyValues* pChild )
+{
+	unsigned int nMask = pIndex->m_Slots.Count() - 1;
+	int keySymbol = pChild->GetNameSymbol();
+	for( unsigned int i = ChildIndexHash( keySymbol ); ; i++ )
+	{
+		KeyValues*& pSlot = pIndex->m_Slots[i & nMask];
+		if( !pSlot )
+		{
+			pSlot = pChild;
+			pIndex->m_nCount++;
+			return;
+		}
+		if( pSlot->GetNameSymbol() == keySymbol )
+		{
+			return;
+		}
+	}
+}
+
+static void ChildIndexResize( KeyValuesChildIndex_t* pIndex, int nSlots )
+{
+	CUtlVector<KeyValues*> oldSlots;
+	oldSlots.Swap( pIndex->m_Slots );
+
+	pIndex->m_Slots.SetCount( nSlots );
+	memset( pIndex->m_Slots.Base(), 0, nSlots * sizeof( KeyValues* ) );
+	pIndex->m_nCount = 0;
+	for( int i = 0; i < oldSlots.Count(); i++ )
+	{
+		if( oldSlots[i] )
+		{
+			ChildIndexInsert( pIndex, oldSlots[i] );
+		}
+	}
+}
+
+void KeyValuesChildIndex_t::AddChild( const KeyValues* pParent, KeyValues* pChild )
+{
+	m_Children.AddToTail( pChild );
+	pChild->m_nFlags |= KV_CHILD_INDEXED;
+	s_ChildIndexParents.InsertOrReplace( pChild, pParent );
+}
+
+// Deletes the index and takes its children out of s_ChildIndexParents
+void KeyValuesChildIndex_t::Remove( int iMapIndex )
+{
+	const KeyValues* pParent = s_ChildIndexes.Key( iMapIndex );
+	KeyValuesChildIndex_t* pIndex = s_ChildIndexes[iMapIndex];
+	for( int i = 0; i < pIndex->m_Children.Count(); i++ )
+	{
+		KeyValues* pChild = pIndex->m_Children[i];
+		int iParent = s_ChildIndexParents.Find( pChild );
+		if( iParent != s_ChildIndexParents.InvalidIndex() && s_ChildIndexParents[iParent] == pParent )
+		{
+			s_ChildIndexParents.RemoveAt( iParent );
+			pChild->m_nFlags &= ~KV_CHILD_INDEXED;
+		}
+	}
+
+	pParent->m_nFlags &= ~KV_CHILD_INDEX_BUILT;
+	delete pIndex;
+	s_ChildIndexes.RemoveAt( iMapIndex );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Looks a child up in the index. Returns false if there is no usable
+//			index, otherwise pFound is the child (or NULL) and pLastChild the
+//			last child in the list.
+//-----------------------------------------------------------------------------
+bool KeyValues::FindKeyInChildIndex( int keySymbol, KeyValues*& pFound, KeyValues*& pLastChild ) const
+{
+	if( !( m_nFlags & KV_CHILD_INDEX_BUILT ) )
+	{
+		return false;
+	}
+
+	bool bUsable = false;
+	s_ChildIndexLock.LockForRead();
+	int iMapIndex = s_ChildIndexes.Find( this );
+	if( iMapIndex != s_ChildIndexes.InvalidIndex() )
+	{
+		const KeyValuesChildIndex_t* pIndex = s_ChildIndexes[iMapIndex];
+		unsigned int nMask = pIndex->m_Slots.Count() - 1;
+
+		pFound = NULL;
+		for( unsigned int i = ChildIndexHash( keySymbol ); pIndex->m_Slots[i & nMask]; i++ )
+		{
+			if( pIndex->m_Slots[i & nMask]->m_iKeyName == keySymbol )
+			{
+				pFound = pIndex->m_Slots[i & nMask];
+				break;
+			}
+		}
+		pLastChild = pIndex->m_pLastChild;
+		bUsable = true;
+	}
+	s_ChildIndexLock.UnlockRead();
+
+	return bUsable;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: (Re)builds the index. Lookups are const and several threads may
+//			read the same keys, so this is safe against other builds.
+//-----------------------------------------------------------------------------
+void KeyValues::BuildChildIndex() const
+{
+	KeyValuesChildIndex_t* pIndex = new KeyValuesChildIndex_t;
+	pIndex->m_pLastChild = NULL;
+
+	int nChildren = 0;
+	for( KeyValues* dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		pIndex->m_pLastChild = dat;
+		++nChildren;
+	}
+
+	int nSlots = KEYVALUES_CHILD_INDEX_MIN * 2;
+	while( nSlots < nChildren * 2 )
+	{
+		nSlots *= 2;
+	}
+	ChildIndexResize( pIndex, nSlots );
+	for( KeyValues* dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		ChildIndexInsert( pIndex, dat );
+	}
+	pIndex->m_Children.EnsureCapacity( nChildren );
+
+	s_ChildIndexLock.LockForWrite();
+	int iMapIndex = s_ChildIndexes.Find( this );
+	if( iMapIndex != s_ChildIndexes.InvalidIndex() )
+	{
+		KeyValuesChildIndex_t::Remove( iMapIndex );
+	}
+	for( KeyValues* dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		pIndex->AddChild( this, dat );
+	}
+	s_ChildIndexes.Insert( this, pIndex );
+	m_nFlags |= KV_CHILD_INDEX_BUILT;
+	s_ChildIndexLock.UnlockWrite();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Keeps the index up to date when pSubkey was just added after
+//			pPrevLastChild, or drops it if it doesn't match the list anymore
+//-----------------------------------------------------------------------------
+void KeyValues::AppendToChildIndex( KeyValues* pSubkey, KeyValues* pPrevLastChild )
+{
+	if( !( m_nFlags & KV_CHILD_INDEX_BUILT ) )
+	{
+		return;
+	}
+
+	s_ChildIndexLock.LockForWrite();
+	int iMapIndex = s_ChildIndexes.Find( this );
+	if( iMapIndex != s_ChildIndexes.InvalidIndex() )
+	{
+		KeyValuesChildIndex_t* pIndex = s_ChildIndexes[iMapIndex];
+		if( pIndex->m_pLastChild == pPrevLastChild )
+		{
+			if( ( pIndex->m_nCount + 1 ) * 2 > pIndex->m_Slots.Count() )
+			{
+				ChildIndexResize( pIndex, pIndex->m_Slots.Count() * 2 );
+			}
+			ChildIndexInsert( pIndex, pSubkey );
+			pIndex->AddChild( this, pSubkey );
+			pIndex->m_pLastChild = pSubkey;
+			s_ChildIndexLock.UnlockWrite();
+			return;
 		}
+
+		KeyValuesChildIndex_t::Remove( iMapIndex );
+	}
+	m_nFlags &= ~KV_CHILD_INDEX_BUILT;
+	s_ChildIndexLock.UnlockWrite();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Drops the index, the next lookup that walks enough children rebuilds it
+//-----------------------------------------------------------------------------
+void KeyValues::InvalidateChildIndex()
+{
+	if( !( m_nFlags & KV_CHILD_INDEX_BUILT ) )
+	{
+		return;
+	}
+
+	s_ChildIndexLock.LockForWrite();
+	int iMapIndex = s_ChildIndexes.Find( this );
+	if( iMapIndex != s_ChildIndexes.InvalidIndex() )
+	{
+		KeyValuesChildIndex_t::Remove( iMapIndex );
+	}
+	m_nFlags &= ~KV_CHILD_INDEX_BUILT;
+	s_ChildIndexLock.UnlockWrite();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Drops the index of the key whose child list this key is in, for
+//			changes to the list that don't go through the parent
+//-----------------------------------------------------------------------------
+void KeyValues::InvalidateParentChildIndex()
+{
+	if( !( m_nFlags & KV_CHILD_INDEXED ) )
+	{
+		return;
 	}
 
-	return NULL;
+	s_ChildIndexLock.LockForWrite();
+	int iParent = s_ChildIndexParents.Find( this );
+	if( iParent != s_ChildIndexParents.InvalidIndex() )
+	{
+		int iMapIndex = s_ChildIndexes.Find( s_ChildIndexParents[iParent] );
+		if( iMapIndex != s_ChildIndexes.InvalidIndex() )
+		{
+			KeyValuesChildIndex_t::Remove( iMapIndex );
+		}
+	}
+	m_nFlags &= ~KV_CHILD_INDEXED;
+	s_ChildIndexLock.UnlockWrite();
 }
 
 //-----------------------------------------------------------------------------
@@ -1055,15 +2061,25 @@ KeyValues* KeyValues::FindKey( const char* keyName, bool bCreate )
 
 	KeyValues* lastItem = NULL;
 	KeyValues* dat;
-	// find the searchStr in the current peer list
-	for( dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	if( !FindKeyInChildIndex( iSearchStr, dat, lastItem ) )
 	{
-		lastItem = dat;	// record the last item looked at (for if we need to append to the end of the list)
+		// find the searchStr in the current peer list
+		int nWalked = 0;
+		for( dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+		{
+			lastItem = dat;	// record the last item looked at (for if we need to append to the end of the list)
+			++nWalked;
+
+			// symbol compare
+			if( dat->m_iKeyName == iSearchStr )
+			{
+				break;
+			}
+		}
 
-		// symbol compare
-		if( dat->m_iKeyName == iSearchStr )
+		if( nWalked >= KEYVALUES_CHILD_INDEX_MIN && ( m_nFlags & KV_CHILD_INDEX_ENABLED ) )
 		{
-			break;
+			BuildChildIndex();
 		}
 	}
 
@@ -1083,6 +2099,7 @@ KeyValues* KeyValues::FindKey( const char* keyName, bool bCreate )
 
 			dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 );	// use same format as parent
 			dat->UsesConditionals( m_bEvaluateConditionals != 0 );
+			dat->UsesChildIndex( ( m_nFlags & KV_CHILD_INDEX_ENABLED ) != 0 );
 
 			// insert new key at end of list
 			if( lastItem )
@@ -1094,6 +2111,7 @@ KeyValues* KeyValues::FindKey( const char* keyName, bool bCreate )
 				m_pSub = dat;
 			}
 			dat->m_pPeer = NULL;
+			AppendToChildIndex( dat, lastItem );
 
 			// a key graduates to be a submsg as soon as it's m_pSub is set
 			// this should be the only place m_pSub is set
@@ -1155,13 +2173,14 @@ KeyValues* KeyValues::CreateKey( const char* keyName )
 }
 
 //-----------------------------------------------------------------------------
-KeyValues* KeyValues::CreateKeyUsingKnownLastChild( const char* keyName, KeyValues* pLastChild )
+KeyValues* KeyValues::CreateKeyUsingKnownLastChild( const char* keyName, KeyValues* pLastChild, CKeyValuesArena* pArena )
 {
 	// Create a new key
-	KeyValues* dat = new KeyValues( keyName );
+	KeyValues* dat = pArena ? pArena->AllocKey( keyName ) : new KeyValues( keyName );
 
 	dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // use same format as parent does
 	dat->UsesConditionals( m_bEvaluateConditionals != 0 );
+	dat->UsesChildIndex( ( m_nFlags & KV_CHILD_INDEX_ENABLED ) != 0 );
 
 	// add into subkey list
 	AddSubkeyUsingKnownLastChild( dat, pLastChild );
@@ -1197,8 +2216,10 @@ void KeyValues::AddSubkeyUsingKnownLastChild( KeyValues* pSubkey, KeyValues* pLa
 //			Assert( pTempDat == pLastChild );
 //		#endif
 
-		pLastChild->SetNextKey( pSubkey );
+		pLastChild->m_pPeer = pSubkey;
 	}
+
+	AppendToChildIndex( pSubkey, pLastChild );
 }
 
 
@@ -1224,7 +2245,8 @@ void KeyValues::AddSubKey( KeyValues* pSubkey )
 			pTempDat = pTempDat->GetNextKey();
 		}
 
-		pTempDat->SetNextKey( pSubkey );
+		pTempDat->m_pPeer = pSubkey;
+		AppendToChildIndex( pSubkey, pTempDat );
 	}
 }
 
@@ -1240,6 +2262,8 @@ void KeyValues::RemoveSubKey( KeyValues* subKey )
 		return;
 	}
 
+	InvalidateChildIndex();
+
 	// check the list pointer
 	if( m_pSub == subKey )
 	{
@@ -1292,6 +2316,7 @@ KeyValues* KeyValues::FindLastSubKey()
 //-----------------------------------------------------------------------------
 void KeyValues::SetNextKey( KeyValues* pDat )
 {
+	InvalidateParentChildIndex();
 	m_pPeer = pDat;
 }
 
@@ -1651,11 +2676,8 @@ void KeyValues::SetColor( const char* keyName, Color value )
 
 void KeyValues::SetStringValue( char const* strValue )
 {
-	// delete the old value
-	delete [] m_sValue;
-	// make sure we're not storing the WSTRING  - as we're converting over to STRING
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+	FreeAllocatedValue();
 
 	if( !strValue )
 	{
@@ -1685,11 +2707,8 @@ void KeyValues::SetString( const char* keyName, const char* value )
 			return;
 		}
 
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		if( !value )
 		{
@@ -1714,11 +2733,8 @@ void KeyValues::SetWString( const char* keyName, const wchar_t* value )
 	KeyValues* dat = FindKey( keyName, true );
 	if( dat )
 	{
-		// delete the old value
-		delete [] dat->m_wsValue;
-		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
-		dat->m_sValue = NULL;
+		// delete the old value, and make sure we're not storing the STRING - as we're converting over to WSTRING
+		dat->FreeAllocatedValue();
 
 		if( !value )
 		{
@@ -1758,11 +2774,8 @@ void KeyValues::SetUint64( const char* keyName, uint64 value )
 
 	if( dat )
 	{
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		dat->m_sValue = new char[sizeof( uint64 )];
 		*( ( uint64* )dat->m_sValue ) = value;
@@ -1786,7 +2799,14 @@ void KeyValues::SetFloat( const char* keyName, float value )
 
 void KeyValues::SetName( const char* setName )
 {
-	m_iKeyName = s_pfGetSymbolForString( setName, true );
+	HKeySymbol iKeyName = s_pfGetSymbolForString( setName, true );
+
+	// renaming a key can change what its parent's index should find
+	if( m_iKeyName != iKeyName )
+	{
+		InvalidateParentChildIndex();
+	}
+	m_iKeyName = iKeyName;
 }
 
 //-----------------------------------------------------------------------------
@@ -1937,8 +2957,10 @@ void KeyValues::CopyKeyValue( const KeyValues& src, size_t tmpBufferSizeB, char*
 
 KeyValues& KeyValues::operator=( const KeyValues& src )
 {
+	char nArenaFlags = m_nFlags & ( KV_ARENA_KEY | KV_ARENA_ROOT );
 	RemoveEverything();
 	Init();	// reset all values
+	m_nFlags |= nArenaFlags;
 	CopyKeyValuesFromRecursive( src );
 	return *this;
 }
@@ -1951,6 +2973,7 @@ void KeyValues::CopySubkeys( KeyValues* pParent ) const
 {
 	// recursively copy subkeys
 	// Also maintain ordering....
+	pParent->InvalidateChildIndex();
 	KeyValues* pPrev = NULL;
 	for( KeyValues* sub = m_pSub; sub != NULL; sub = sub->m_pPeer )
 	{
@@ -1981,6 +3004,7 @@ KeyValues* KeyValues::MakeCopy( void ) const
 
 	newKeyValue->UsesEscapeSequences( m_bHasEscapeSequences != 0 );
 	newKeyValue->UsesConditionals( m_bEvaluateConditionals != 0 );
+	newKeyValue->UsesChildIndex( ( m_nFlags & KV_CHILD_INDEX_ENABLED ) != 0 );
 
 	// copy data
 	newKeyValue->m_iDataType = m_iDataType;
@@ -2053,7 +3077,7 @@ KeyValues* KeyValues::MakeCopy( bool copySiblings ) const
 	KeyValues* curDest = rootDest;
 	while( curSrc )
 	{
-		curDest->SetNextKey( curSrc->MakeCopy() );
+		curDest->m_pPeer = curSrc->MakeCopy();
 		curDest = curDest->GetNextKey();
 		curSrc = curSrc->GetNextKey();
 	}
@@ -2085,7 +3109,16 @@ bool KeyValues::IsEmpty( const char* keyName )
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
-	delete m_pSub;
+	InvalidateChildIndex();
+	if( m_pSub && ( m_pSub->m_nFlags & KV_ARENA_KEY ) )
+	{
+		// arena keys go with their arena
+		m_pSub->RemoveEverything();
+	}
+	else
+	{
+		delete m_pSub;
+	}
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
 }
@@ -2109,6 +3142,16 @@ KeyValues::types_t KeyValues::GetDataType( const char* keyName )
 //-----------------------------------------------------------------------------
 void KeyValues::deleteThis()
 {
+	if( m_nFlags & KV_ARENA_KEY )
+	{
+		AssertMsg( m_nFlags & KV_ARENA_ROOT, "KeyValues::deleteThis() on a key in a read only tree, delete the root instead" );
+		if( m_nFlags & KV_ARENA_ROOT )
+		{
+			CKeyValuesArena::FromRoot( this )->Free();
+		}
+		return;
+	}
+
 	delete this;
 }
 
@@ -2181,6 +3224,7 @@ void KeyValues::ParseIncludedKeys( char const* resourceName, const char* filetoi
 
 	newKV->UsesEscapeSequences( m_bHasEscapeSequences != 0 );	// use same format as parent
 	newKV->UsesConditionals( m_bEvaluateConditionals != 0 );
+	newKV->UsesChildIndex( ( m_nFlags & KV_CHILD_INDEX_ENABLED ) != 0 );
 
 	if( newKV->LoadFromFile( pFileSystem, fullpath, pPathID ) )
 	{
@@ -2348,6 +3392,15 @@ bool EvaluateConditional( const char* str )
 // Read from a buffer...
 //-----------------------------------------------------------------------------
 bool KeyValues::LoadFromBuffer( char const* resourceName, CUtlBuffer& buf, IBaseFileSystem* pFileSystem, const char* pPathID )
+{
+	return LoadFromBufferInternal( resourceName, buf, pFileSystem, pPathID, NULL );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: With pArena the keys are put in the arena, and this returns false
+//			for #include and #base which the arena can't merge
+//-----------------------------------------------------------------------------
+bool KeyValues::LoadFromBufferInternal( char const* resourceName, CUtlBuffer& buf, IBaseFileSystem* pFileSystem, const char* pPathID, CKeyValuesArena* pArena )
 {
 	KeyValues* pPreviousKey = NULL;
 	KeyValues* pCurrentKey = this;
@@ -2367,6 +3420,12 @@ bool KeyValues::LoadFromBuffer( char const* resourceName, CUtlBuffer& buf, IBase
 			break;
 		}
 
+		if( pArena && ( !Q_stricmp( s, "#include" ) || !Q_stricmp( s, "#base" ) ) )
+		{
+			g_KeyValuesErrorStack.SetFilename( "" );
+			return false;
+		}
+
 		if( !Q_stricmp( s, "#include" ) )	// special include macro (not a key name)
 		{
 			s = ReadToken( buf, wasQuoted, wasConditional );
@@ -2402,15 +3461,21 @@ bool KeyValues::LoadFromBuffer( char const* resourceName, CUtlBuffer& buf, IBase
 
 		if( !pCurrentKey )
 		{
-			pCurrentKey = new KeyValues( s );
+			pCurrentKey = pArena ? pArena->AllocKey( s ) : new KeyValues( s );
 			Assert( pCurrentKey );
 
 			pCurrentKey->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // same format has parent use
 			pCurrentKey->UsesConditionals( m_bEvaluateConditionals != 0 );
+			pCurrentKey->UsesChildIndex( ( m_nFlags & KV_CHILD_INDEX_ENABLED ) != 0 );
 
 			if( pPreviousKey )
 			{
-				pPreviousKey->SetNextKey( pCurrentKey );
+				// the other keys are new, only this can be in an indexed child list
+				if( pPreviousKey == this )
+				{
+					InvalidateParentChildIndex();
+				}
+				pPreviousKey->m_pPeer = pCurrentKey;
 			}
 		}
 		else
@@ -2432,7 +3497,7 @@ bool KeyValues::LoadFromBuffer( char const* resourceName, CUtlBuffer& buf, IBase
 		if( s && *s == '{' && !wasQuoted )
 		{
 			// header is valid so load the file
-			pCurrentKey->RecursiveLoadFromBuffer( resourceName, buf );
+			pCurrentKey->RecursiveLoadFromBuffer( resourceName, buf, pArena );
 		}
 		else
 		{
@@ -2443,7 +3508,11 @@ bool KeyValues::LoadFromBuffer( char const* resourceName, CUtlBuffer& buf, IBase
 		{
 			if( pPreviousKey )
 			{
-				pPreviousKey->SetNextKey( NULL );
+				if( pPreviousKey == this )
+				{
+					InvalidateParentChildIndex();
+				}
+				pPreviousKey->m_pPeer = NULL;
 			}
 			pCurrentKey->Clear();
 		}
@@ -2514,10 +3583,135 @@ bool KeyValues::LoadFromBuffer( char const* resourceName, const char* pBuffer, I
 	return retVal;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Parses a copy of pBuffer in place. The keys and the copy share one
+//			allocation, string values point into the copy and are never
+//			allocated on their own, and deleteThis() on the returned root
+//			frees the lot. Files with #include or #base are loaded the
+//			regular way. Returns NULL if the buffer is NULL or the regular
+//			load fails; syntax errors are reported and the keys read up to
+//			them are kept, the same as LoadFromBuffer.
+//-----------------------------------------------------------------------------
+KeyValues* KeyValues::LoadFromBufferReadOnly( char const* resourceName, const char* pBuffer, IBaseFileSystem* pFileSystem, const char* pPathID )
+{
+	if( !pBuffer )
+	{
+		return NULL;
+	}
+
+	COM_TimestampedLog( "KeyValues::LoadFromBufferReadOnly(%s%s%s): Begin", pPathID ? pPathID : "", pPathID && resourceName ? "/" : "", resourceName ? resourceName : "" );
+
+	int nLen = Q_strlen( pBuffer );
+	bool bUnicode = nLen > 2 && ( uint8 )pBuffer[0] == 0xFF && ( uint8 )pBuffer[1] == 0xFE;
+
+	// Translate Unicode files into UTF-8 straight into the arena
+	int nBufferSize = bUnicode ? V_UnicodeToUTF8( ( wchar_t* )( pBuffer + 2 ), NULL, 0 ) : nLen;
+	CKeyValuesArena* pArena = CKeyValuesArena::Create( resourceName, nBufferSize );
+	if( bUnicode )
+	{
+		V_UnicodeToUTF8( ( wchar_t* )( pBuffer + 2 ), pArena->GetBuffer(), nBufferSize + 1 );
+		nBufferSize = Q_strlen( pArena->GetBuffer() );
+	}
+	else
+	{
+		Q_memcpy( pArena->GetBuffer(), pBuffer, nLen );
+	}
+
+	CUtlBuffer buf( pArena->GetBuffer(), nBufferSize, CUtlBuffer::READ_ONLY | CUtlBuffer::TEXT_BUFFER );
+
+	KeyValues* pRoot = pArena->GetRoot();
+	if( !pRoot->LoadFromBufferInternal( resourceName, buf, pFileSystem, pPathID, pArena ) )
+	{
+		pRoot->m_nFlags |= KV_ARENA_ROOT;
+		pRoot->deleteThis();
+
+		pRoot = new KeyValues( resourceName );
+		if( !pRoot->LoadFromBuffer( resourceName, pBuffer, pFileSystem, pPathID ) )
+		{
+			pRoot->deleteThis();
+			pRoot = NULL;
+		}
+	}
+	else
+	{
+		pRoot->m_nFlags |= KV_ARENA_ROOT;
+	}
+
+	COM_TimestampedLog( "KeyValues::LoadFromBufferReadOnly(%s%s%s): End", pPathID ? pPathID : "", pPathID && resourceName ? "/" : "", resourceName ? resourceName : "" );
+
+	return pRoot;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: LoadFromBufferReadOnly on a file, NULL if it can't be read or loaded
+//-----------------------------------------------------------------------------
+KeyValues* KeyValues::LoadFromFileReadOnly( IBaseFileSystem* filesystem, const char* resourceName, const char* pathID )
+{
+	Assert( filesystem );
+
+	FileHandle_t f = filesystem->Open( resourceName, "rb", pathID );
+	if( !f )
+	{
+		return NULL;
+	}
+
+	s_LastFileLoadingFrom = ( char* )resourceName;
+
+	// load file into a null-terminated buffer
+	int fileSize = filesystem->Size( f );
+	unsigned bufSize = ( ( IFileSystem* )filesystem )->GetOptimalReadSize( f, fileSize + 2 );
+
+	char* buffer = ( char* )( ( IFileSystem* )filesystem )->AllocOptimalReadBuffer( f, bufSize );
+	Assert( buffer );
+
+	bool bRetOK = ( ( ( IFileSystem* )filesystem )->ReadEx( buffer, bufSize, fileSize, f ) != 0 );
+
+	filesystem->Close( f );	// close file after reading
+
+	KeyValues* pRoot = NULL;
+	if( bRetOK )
+	{
+		buffer[fileSize] = 0; // null terminate file as EOF
+		buffer[fileSize + 1] = 0; // double NULL terminating in case this is a unicode file
+
+		// with a cache file, the values point into its mapping instead
+		if( CKeyValuesBinaryCache::IsEnabled() )
+		{
+			CKeyValuesArena* pArena = CKeyValuesArena::Create( resourceName, 0 );
+			pRoot = pArena->GetRoot();
+			pRoot->m_nFlags |= KV_ARENA_ROOT;
+
+			CKeyValuesBinaryCache cache( pRoot, resourceName, pathID, buffer, fileSize );
+			bool bCache = CKeyValuesBinaryCache::CanCache( pRoot, buffer, fileSize );
+			if( bCache && cache.Open( filesystem, pArena->GetMappedFile() ) )
+			{
+				CKeyValuesBinaryCache::Build( pRoot, pArena->GetMappedFile().Base(), pArena );
+			}
+			else
+			{
+				pRoot->deleteThis();
+				pRoot = LoadFromBufferReadOnly( resourceName, buffer, filesystem, pathID );
+				if( bCache && pRoot && ( pRoot->m_nFlags & KV_ARENA_ROOT ) )
+				{
+					cache.Write( filesystem, pRoot );
+				}
+			}
+		}
+		else
+		{
+			pRoot = LoadFromBufferReadOnly( resourceName, buffer, filesystem, pathID );
+		}
+	}
+
+	( ( IFileSystem* )filesystem )->FreeOptimalReadBuffer( buffer );
+
+	return pRoot;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose:
 //-----------------------------------------------------------------------------
-void KeyValues::RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& buf )
+void KeyValues::RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& buf, CKeyValuesArena* pArena )
 {
 	CKeyErrorContext errorReport( this );
 	bool wasQuoted;
@@ -2563,19 +3757,19 @@ void KeyValues::RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& b
 
 		// Always create the key; note that this could potentially
 		// cause some duplication, but that's what we want sometimes
-		KeyValues* dat = CreateKeyUsingKnownLastChild( name, pLastChild );
+		KeyValues* dat = CreateKeyUsingKnownLastChild( name, pLastChild, pArena );
 
 		errorKey.Reset( dat->GetNameSymbol() );
 
-		// get the value
-		const char* value = ReadToken( buf, wasQuoted, wasConditional );
+		// get the value, read only loads leave it where it is in the buffer
+		const char* value = pArena ? ReadTokenInPlace( buf, wasQuoted, wasConditional ) : ReadToken( buf, wasQuoted, wasConditional );
 
 		if( wasConditional && value )
 		{
 			bAccepted = !m_bEvaluateConditionals || EvaluateConditional( value );
 
 			// get the real value
-			value = ReadToken( buf, wasQuoted, wasConditional );
+			value = pArena ? ReadTokenInPlace( buf, wasQuoted, wasConditional ) : ReadToken( buf, wasQuoted, wasConditional );
 		}
 
 		if( !value )
@@ -2595,7 +3789,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& b
 			// this isn't a key, it's a section
 			errorKey.Reset( INVALID_KEY_SYMBOL );
 			// sub value list
-			dat->RecursiveLoadFromBuffer( resourceName, buf );
+			dat->RecursiveLoadFromBuffer( resourceName, buf, pArena );
 		}
 		else
 		{
@@ -2607,8 +3801,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& b
 
 			if( dat->m_sValue )
 			{
-				delete[] dat->m_sValue;
-				dat->m_sValue = NULL;
+				dat->FreeAllocatedValue();
 			}
 
 			int len = Q_strlen( value );
@@ -2671,7 +3864,12 @@ void KeyValues::RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& b
 				dat->m_iDataType = TYPE_STRING;
 			}
 
-			if( dat->m_iDataType == TYPE_STRING )
+			if( dat->m_iDataType == TYPE_STRING && pArena )
+			{
+				dat->m_sValue = pArena->AllocString( value, len );
+				dat->m_nFlags |= KV_VALUE_BORROWED;
+			}
+			else if( dat->m_iDataType == TYPE_STRING )
 			{
 				// copy in the string information
 				dat->m_sValue = new char[len + 1];
@@ -2700,6 +3898,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& b
 		else
 		{
 			//this->RemoveSubKey( dat );
+			InvalidateChildIndex();
 			if( pLastChild == NULL )
 			{
 				Assert( m_pSub == dat );
@@ -2711,7 +3910,11 @@ void KeyValues::RecursiveLoadFromBuffer( char const* resourceName, CUtlBuffer& b
 				pLastChild->m_pPeer = NULL;
 			}
 
-			dat->deleteThis();
+			// arena keys are freed with the arena
+			if( !pArena )
+			{
+				dat->deleteThis();
+			}
 			dat = NULL;
 		}
 	}
@@ -2823,8 +4026,10 @@ bool KeyValues::ReadAsBinary( CUtlBuffer& buffer, int nStackDepth )
 		return false;
 	}
 
+	char nArenaFlags = m_nFlags & ( KV_ARENA_KEY | KV_ARENA_ROOT );
 	RemoveEverything(); // remove current content
 	Init();	// reset
+	m_nFlags |= nArenaFlags;
 
 	if( nStackDepth > 100 )
 	{
@@ -0,0 +1,162 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Memory mapping of a whole file
+//
+//=============================================================================
+
+#include "tier1/mappedfile.h"
+
+#ifdef _WIN32
+	#include "winlite.h"
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+CMappedFile::CMappedFile()
+{
+	m_pBase = NULL;
+	m_nSize = 0;
+	m_bCopyOnWrite = false;
+#ifdef _WIN32
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMapping = NULL;
+#else
+	m_nFile = -1;
+#endif
+}
+
+CMappedFile::~CMappedFile()
+{
+	Close();
+}
+
+bool CMappedFile::Open( const char* pFilename, bool bCopyOnWrite )
+{
+	Close();
+
+#ifdef _WIN32
+	m_hFile = CreateFileA( pFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if( m_hFile == INVALID_HANDLE_VALUE )
+	{
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx( ( HANDLE )m_hFile, &size ) || size.QuadPart == 0 )
+	{
+		Close();
+		return false;
+	}
+
+	m_hMapping = CreateFileMappingA( ( HANDLE )m_hFile, NULL, bCopyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL );
+	if( !m_hMapping )
+	{
+		Close();
+		return false;
+	}
+
+	m_pBase = MapViewOfFile( ( HANDLE )m_hMapping, bCopyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0 );
+	if( !m_pBase )
+	{
+		Close();
+		return false;
+	}
+	m_nSize = size.QuadPart;
+#else
+	m_nFile = open( pFilename, O_RDONLY );
+	if( m_nFile < 0 )
+	{
+		return false;
+	}
+
+	struct stat st;
+	if( fstat( m_nFile, &st ) != 0 || st.st_size == 0 )
+	{
+		Close();
+		return false;
+	}
+
+	void* pBase = mmap( NULL, st.st_size, bCopyOnWrite ? ( PROT_READ | PROT_WRITE ) : PROT_READ, MAP_PRIVATE, m_nFile, 0 );
+	if( pBase == MAP_FAILED )
+	{
+		Close();
+		return false;
+	}
+	m_pBase = pBase;
+	m_nSize = st.st_size;
+#endif
+
+	m_bCopyOnWrite = bCopyOnWrite;
+	return true;
+}
+
+bool CMappedFile::IsSameFile( const char* pFilename ) const
+{
+	if( !m_pBase )
+	{
+		return false;
+	}
+
+#ifdef _WIN32
+	HANDLE hOther = CreateFileA( pFilename, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL );
+	if( hOther == INVALID_HANDLE_VALUE )
+	{
+		return false;
+	}
+
+	BY_HANDLE_FILE_INFORMATION mine, other;
+	bool bSame = GetFileInformationByHandle( ( HANDLE )m_hFile, &mine ) && GetFileInformationByHandle( hOther, &other ) &&
+				 mine.dwVolumeSerialNumber == other.dwVolumeSerialNumber &&
+				 mine.nFileIndexHigh == other.nFileIndexHigh && mine.nFileIndexLow == other.nFileIndexLow;
+	CloseHandle( hOther );
+	return bSame;
+#else
+	struct stat mine, other;
+	if( fstat( m_nFile, &mine ) != 0 || stat( pFilename, &other ) != 0 )
+	{
+		return false;
+	}
+	return mine.st_dev == other.st_dev && mine.st_ino == other.st_ino;
+#endif
+}
+
+void CMappedFile::Close()
+{
+#ifdef _WIN32
+	if( m_pBase )
+	{
+		UnmapViewOfFile( m_pBase );
+	}
+	if( m_hMapping )
+	{
+		CloseHandle( ( HANDLE )m_hMapping );
+	}
+	if( m_hFile != INVALID_HANDLE_VALUE )
+	{
+		CloseHandle( ( HANDLE )m_hFile );
+	}
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMapping = NULL;
+#else
+	if( m_pBase )
+	{
+		munmap( m_pBase, m_nSize );
+	}
+	if( m_nFile >= 0 )
+	{
+		close( m_nFile );
+	}
+	m_nFile = -1;
+#endif
+
+	m_pBase = NULL;
+	m_nSize = 0;
+	m_bCopyOnWrite = false;
+}
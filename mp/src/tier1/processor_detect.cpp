@@ -24,6 +24,10 @@ bool Check3DNowTechnology( void )
 {
 	return false;
 }
+bool CheckAVXTechnology( void )
+{
+	return false;
+}
 
 #elif defined( _WIN32 ) && !defined( _X360 )
 
@@ -287,6 +291,59 @@ bool Check3DNowTechnology( void )
 	return retval;
 }
 
+bool CheckAVXTechnology( void )
+{
+	int retval = true;
+	unsigned int RegECX = 0;
+	unsigned int RegXCR0 = 0;
+
+#ifdef CPUID
+	_asm pushad;
+#endif
+
+	__try
+	{
+		_asm
+		{
+			mov eax, 1				// set up CPUID to return processor version and features
+			CPUID					// code bytes = 0fh,  0a2h
+			mov RegECX, ecx			// AVX and OSXSAVE are returned in ecx
+		}
+	}
+	__except( EXCEPTION_EXECUTE_HANDLER )
+	{
+		retval = false;
+	}
+
+	if( retval )
+	{
+		// bit 27 is OSXSAVE, bit 28 is AVX
+		if( ( RegECX & 0x18000000 ) == 0x18000000 )
+		{
+			// the OS also has to be saving the ymm registers on a context switch
+			_asm
+			{
+				xor ecx, ecx
+				_emit 0x0f			// xgetbv
+				_emit 0x01
+				_emit 0xd0
+				mov RegXCR0, eax
+			}
+			retval = ( RegXCR0 & 6 ) == 6;
+		}
+		else
+		{
+			retval = false;
+		}
+	}
+
+#ifdef CPUID
+	_asm popad;
+#endif
+
+	return retval;
+}
+
 #pragma optimize( "", on )
 
 #endif // _WIN32
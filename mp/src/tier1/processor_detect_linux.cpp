@@ -9,6 +9,9 @@
 #define cpuid(in,a,b,c,d)												\
 	asm("pushl %%ebx\n\t" "cpuid\n\t" "movl %%ebx,%%esi\n\t" "pop %%ebx": "=a" (a), "=S" (b), "=c" (c), "=d" (d) : "a" (in));
 
+#define xgetbv(in,a,d)													\
+	asm(".byte 0x0f, 0x01, 0xd0": "=a" (a), "=d" (d) : "c" (in));
+
 bool CheckMMXTechnology( void )
 {
 	unsigned long eax, ebx, edx, unused;
@@ -45,3 +48,20 @@ bool Check3DNowTechnology( void )
 	}
 	return false;
 }
+
+bool CheckAVXTechnology( void )
+{
+	unsigned long eax, ebx, ecx, edx;
+	cpuid( 1, eax, ebx, ecx, edx );
+
+	// bit 27 is OSXSAVE, bit 28 is AVX
+	if( ( ecx & 0x18000000 ) != 0x18000000 )
+	{
+		return false;
+	}
+
+	// the OS also has to be saving the ymm registers on a context switch
+	unsigned long xcr0, unused;
+	xgetbv( 0, xcr0, unused );
+	return ( xcr0 & 6 ) == 6;
+}
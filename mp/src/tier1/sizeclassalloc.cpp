@@ -0,0 +1,339 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Thread-local, size-class pooled allocator, see sizeclassalloc.h
+//
+//===========================================================================//
+
+#include "tier1/sizeclassalloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include "tier0/dbg.h"
+#include "tier0/threadtools.h"
+
+// Should be last include
+#include "tier0/memdbgon.h"
+
+
+#define SIZECLASS_COUNT				16
+#define SIZECLASS_HEAP				-1
+
+// The depot carves blocks of one class out of chunks this big
+#define SIZECLASS_CHUNK_SIZE		( 64 * 1024 )
+
+// About this many bytes of every class stay on a thread before half go back to the depot
+#define SIZECLASS_THREAD_CACHE_SIZE	( 32 * 1024 )
+#define SIZECLASS_MIN_THREAD_BLOCKS	8
+
+static const int s_SizeClasses[SIZECLASS_COUNT] =
+{
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, SIZECLASS_MAX_SIZE
+};
+
+// In front of every block, keeps the payload 16 byte aligned
+struct SizeClassHeader_t
+{
+	union
+	{
+		SizeClassHeader_t*	m_pNext;	// only while the block is free
+		int64				m_nPad;
+	};
+	int		m_nClass;
+	int		m_nSize;					// requested size of heap blocks
+};
+
+struct SizeClassFreeList_t
+{
+	SizeClassHeader_t*	m_pHead;
+	int					m_nCount;
+};
+
+// Only written by the thread that owns the cache. They're 32 bits so GetStats can read
+// them while they change without tearing; it folds them into 64 bit totals as it goes.
+struct SizeClassThreadCounts_t
+{
+	volatile uint32	m_nAllocs;
+	volatile uint32	m_nFrees;
+	volatile uint32	m_nChunkAllocs;
+	volatile uint32	m_nLargeAllocs;
+};
+
+struct SizeClassThreadCache_t
+{
+	SizeClassFreeList_t		m_Free[SIZECLASS_COUNT];
+	SizeClassThreadCounts_t	m_Counts;
+	SizeClassThreadCounts_t	m_CountsSeen;	// m_Counts at the last GetStats
+	SizeClassAllocStats_t	m_Stats;		// only touched by GetStats, under s_DepotMutex
+	SizeClassThreadCache_t*	m_pNextCache;
+	bool					m_bInUse;
+};
+
+static CThreadFastMutex					s_DepotMutex;
+static SizeClassFreeList_t				s_Depot[SIZECLASS_COUNT];
+static SizeClassThreadCache_t*			s_pCaches = NULL;
+static SizeClassAllocStats_t			s_LastFrameTotals;
+static SizeClassAllocStats_t			s_FrameStats;
+static CTHREADLOCALPTR( SizeClassThreadCache_t ) s_pThreadCache;
+
+
+static inline int SizeClassForSize( size_t nSize )
+{
+	for( int i = 0; i < SIZECLASS_COUNT; i++ )
+	{
+		if( nSize <= ( size_t )s_SizeClasses[i] )
+		{
+			return i;
+		}
+	}
+	return SIZECLASS_HEAP;
+}
+
+static inline int BlockSize( int nClass )
+{
+	return sizeof( SizeClassHeader_t ) + s_SizeClasses[nClass];
+}
+
+static inline int ThreadCacheLimit( int nClass )
+{
+	return MAX( SIZECLASS_THREAD_CACHE_SIZE / BlockSize( nClass ), SIZECLASS_MIN_THREAD_BLOCKS );
+}
+
+// Moves up to nCount blocks from the head of one list to another
+static void MoveBlocks( SizeClassFreeList_t& from, SizeClassFreeList_t& to, int nCount )
+{
+	while( nCount-- > 0 && from.m_pHead )
+	{
+		SizeClassHeader_t* pHeader = from.m_pHead;
+		from.m_pHead = pHeader->m_pNext;
+		from.m_nCount--;
+
+		pHeader->m_pNext = to.m_pHead;
+		to.m_pHead = pHeader;
+		to.m_nCount++;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Finds the calling thread's cache, reusing one an exited thread released
+//-----------------------------------------------------------------------------
+static SizeClassThreadCache_t* GetThreadCache()
+{
+	SizeClassThreadCache_t* pCache = s_pThreadCache;
+	if( pCache )
+	{
+		return pCache;
+	}
+
+	AUTO_LOCK( s_DepotMutex );
+
+	for( pCache = s_pCaches; pCache; pCache = pCache->m_pNextCache )
+	{
+		if( !pCache->m_bInUse )
+		{
+			break;
+		}
+	}
+
+	if( !pCache )
+	{
+		pCache = ( SizeClassThreadCache_t* )malloc( sizeof( SizeClassThreadCache_t ) );
+		memset( pCache, 0, sizeof( SizeClassThreadCache_t ) );
+		pCache->m_pNextCache = s_pCaches;
+		s_pCaches = pCache;
+	}
+
+	pCache->m_bInUse = true;
+	s_pThreadCache = pCache;
+	return pCache;
+}
+
+
+//-----------------------------------------------------------------------------
+// Fills an empty thread list from the depot, which takes a new chunk from the
+// heap when it has nothing left either
+//-----------------------------------------------------------------------------
+static void RefillThreadCache( SizeClassThreadCache_t* pCache, int nClass )
+{
+	SizeClassFreeList_t& list = pCache->m_Free[nClass];
+	int nWanted = ThreadCacheLimit( nClass ) / 2;
+
+	AUTO_LOCK( s_DepotMutex );
+
+	if( !s_Depot[nClass].m_pHead )
+	{
+		int nBlockSize = BlockSize( nClass );
+		int nBlocks = SIZECLASS_CHUNK_SIZE / nBlockSize;
+		byte* pChunk = ( byte* )malloc( SIZECLASS_CHUNK_SIZE );
+		if( !pChunk )
+		{
+			Error( "CSizeClassAllocator: out of memory allocating a %d byte chunk\n", SIZECLASS_CHUNK_SIZE );
+			return;
+		}
+		pCache->m_Counts.m_nChunkAllocs++;
+
+		for( int i = nBlocks - 1; i >= 0; i-- )
+		{
+			SizeClassHeader_t* pHeader = ( SizeClassHeader_t* )( pChunk + i * nBlockSize );
+			pHeader->m_nClass = nClass;
+			pHeader->m_nSize = s_SizeClasses[nClass];
+			pHeader->m_pNext = s_Depot[nClass].m_pHead;
+			s_Depot[nClass].m_pHead = pHeader;
+			s_Depot[nClass].m_nCount++;
+		}
+	}
+
+	MoveBlocks( s_Depot[nClass], list, nWanted );
+}
+
+
+void* CSizeClassAllocator::Alloc( size_t nSize )
+{
+	SizeClassThreadCache_t* pCache = GetThreadCache();
+	pCache->m_Counts.m_nAllocs++;
+
+	int nClass = SizeClassForSize( nSize );
+	if( nClass == SIZECLASS_HEAP )
+	{
+		SizeClassHeader_t* pHeader = ( SizeClassHeader_t* )malloc( sizeof( SizeClassHeader_t ) + nSize );
+		if( !pHeader )
+		{
+			return NULL;
+		}
+		pCache->m_Counts.m_nLargeAllocs++;
+		pHeader->m_pNext = NULL;
+		pHeader->m_nClass = SIZECLASS_HEAP;
+		pHeader->m_nSize = ( int )nSize;
+		return pHeader + 1;
+	}
+
+	SizeClassFreeList_t& list = pCache->m_Free[nClass];
+	if( !list.m_pHead )
+	{
+		RefillThreadCache( pCache, nClass );
+		if( !list.m_pHead )
+		{
+			return NULL;
+		}
+	}
+
+	SizeClassHeader_t* pHeader = list.m_pHead;
+	list.m_pHead = pHeader->m_pNext;
+	list.m_nCount--;
+	pHeader->m_pNext = NULL;
+	return pHeader + 1;
+}
+
+
+//-----------------------------------------------------------------------------
+// Blocks go on the freeing thread's list, whichever thread allocated them
+//-----------------------------------------------------------------------------
+void CSizeClassAllocator::Free( void* pMem )
+{
+	if( !pMem )
+	{
+		return;
+	}
+
+	SizeClassThreadCache_t* pCache = GetThreadCache();
+	pCache->m_Counts.m_nFrees++;
+
+	SizeClassHeader_t* pHeader = ( SizeClassHeader_t* )pMem - 1;
+	int nClass = pHeader->m_nClass;
+	if( nClass == SIZECLASS_HEAP )
+	{
+		free( pHeader );
+		return;
+	}
+
+	Assert( nClass >= 0 && nClass < SIZECLASS_COUNT );
+	SizeClassFreeList_t& list = pCache->m_Free[nClass];
+	pHeader->m_pNext = list.m_pHead;
+	list.m_pHead = pHeader;
+	list.m_nCount++;
+
+	int nLimit = ThreadCacheLimit( nClass );
+	if( list.m_nCount > nLimit )
+	{
+		AUTO_LOCK( s_DepotMutex );
+		MoveBlocks( list, s_Depot[nClass], nLimit / 2 );
+	}
+}
+
+
+size_t CSizeClassAllocator::GetSize( void* pMem )
+{
+	if( !pMem )
+	{
+		return 0;
+	}
+
+	SizeClassHeader_t* pHeader = ( SizeClassHeader_t* )pMem - 1;
+	return pHeader->m_nSize;
+}
+
+
+void CSizeClassAllocator::ReleaseThreadCache()
+{
+	SizeClassThreadCache_t* pCache = s_pThreadCache;
+	if( !pCache )
+	{
+		return;
+	}
+
+	AUTO_LOCK( s_DepotMutex );
+	for( int i = 0; i < SIZECLASS_COUNT; i++ )
+	{
+		MoveBlocks( pCache->m_Free[i], s_Depot[i], pCache->m_Free[i].m_nCount );
+	}
+
+	// the stats stay with the cache so the totals don't go backwards
+	pCache->m_bInUse = false;
+	s_pThreadCache = NULL;
+}
+
+
+// Adds what a 32 bit count moved since it was last seen, wrapping included
+static inline void AddCountDelta( int64& nTotal, volatile uint32& nCount, volatile uint32& nSeen )
+{
+	uint32 nNow = nCount;
+	nTotal += ( uint32 )( nNow - nSeen );
+	nSeen = nNow;
+}
+
+void CSizeClassAllocator::GetStats( SizeClassAllocStats_t& stats )
+{
+	memset( &stats, 0, sizeof( stats ) );
+
+	AUTO_LOCK( s_DepotMutex );
+	for( SizeClassThreadCache_t* pCache = s_pCaches; pCache; pCache = pCache->m_pNextCache )
+	{
+		AddCountDelta( pCache->m_Stats.m_nAllocs, pCache->m_Counts.m_nAllocs, pCache->m_CountsSeen.m_nAllocs );
+		AddCountDelta( pCache->m_Stats.m_nFrees, pCache->m_Counts.m_nFrees, pCache->m_CountsSeen.m_nFrees );
+		AddCountDelta( pCache->m_Stats.m_nChunkAllocs, pCache->m_Counts.m_nChunkAllocs, pCache->m_CountsSeen.m_nChunkAllocs );
+		AddCountDelta( pCache->m_Stats.m_nLargeAllocs, pCache->m_Counts.m_nLargeAllocs, pCache->m_CountsSeen.m_nLargeAllocs );
+
+		stats.m_nAllocs += pCache->m_Stats.m_nAllocs;
+		stats.m_nFrees += pCache->m_Stats.m_nFrees;
+		stats.m_nChunkAllocs += pCache->m_Stats.m_nChunkAllocs;
+		stats.m_nLargeAllocs += pCache->m_Stats.m_nLargeAllocs;
+	}
+}
+
+
+void CSizeClassAllocator::EndFrame()
+{
+	SizeClassAllocStats_t totals;
+	GetStats( totals );
+
+	s_FrameStats.m_nAllocs = totals.m_nAllocs - s_LastFrameTotals.m_nAllocs;
+	s_FrameStats.m_nFrees = totals.m_nFrees - s_LastFrameTotals.m_nFrees;
+	s_FrameStats.m_nChunkAllocs = totals.m_nChunkAllocs - s_LastFrameTotals.m_nChunkAllocs;
+	s_FrameStats.m_nLargeAllocs = totals.m_nLargeAllocs - s_LastFrameTotals.m_nLargeAllocs;
+	s_LastFrameTotals = totals;
+}
+
+
+void CSizeClassAllocator::GetFrameStats( SizeClassAllocStats_t& stats )
+{
+	stats = s_FrameStats;
+}
@@ -14,6 +14,9 @@
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
+#define MIN_STRING_POOL_HASH_SLOTS	64
+#define STRING_POOL_HASH_SEED		0x5A17C0DE
+
 //-----------------------------------------------------------------------------
 // Purpose: Comparison function for string sorted associative data structures
 //-----------------------------------------------------------------------------
@@ -27,7 +30,7 @@ bool StrLess( const char* const& pszLeft, const char* const& pszRight )
 //-----------------------------------------------------------------------------
 
 CStringPool::CStringPool()
-	: m_Strings( 32, 256, StrLess )
+	: m_nCount( 0 )
 {
 }
 
@@ -44,42 +47,79 @@ CStringPool::~CStringPool()
 
 unsigned int CStringPool::Count() const
 {
-	return m_Strings.Count();
+	return m_nCount;
 }
 
 //-----------------------------------------------------------------------------
+// Purpose: Returns the slot holding pszValue, or the empty slot it would go in
 //-----------------------------------------------------------------------------
-const char* CStringPool::Find( const char* pszValue )
+int CStringPool::FindSlot( const char* pszValue, unsigned int nHash ) const
 {
-	unsigned short i = m_Strings.Find( pszValue );
-	if( m_Strings.IsValidIndex( i ) )
+	int nMask = m_Strings.Count() - 1;
+	for( int i = nHash & nMask; ; i = ( i + 1 ) & nMask )
 	{
-		return m_Strings[i];
+		const HashSlot_t& slot = m_Strings[i];
+		if( !slot.m_pString || ( slot.m_nHash == nHash && !Q_stricmp( slot.m_pString, pszValue ) ) )
+		{
+			return i;
+		}
 	}
-
-	return NULL;
 }
 
-const char* CStringPool::Allocate( const char* pszValue )
+void CStringPool::ResizeHash( int nSlots )
 {
-	char*	pszNew;
+	CUtlVector<HashSlot_t> oldSlots;
+	oldSlots.Swap( m_Strings );
+
+	m_Strings.SetCount( nSlots );
+	memset( m_Strings.Base(), 0, nSlots * sizeof( HashSlot_t ) );
 
-	unsigned short i 	= m_Strings.Find( pszValue );
-	bool		   bNew = ( i == m_Strings.InvalidIndex() );
+	int nMask = nSlots - 1;
+	for( int i = 0; i < oldSlots.Count(); i++ )
+	{
+		if( !oldSlots[i].m_pString )
+		{
+			continue;
+		}
+
+		int j = oldSlots[i].m_nHash & nMask;
+		while( m_Strings[j].m_pString )
+		{
+			j = ( j + 1 ) & nMask;
+		}
+		m_Strings[j] = oldSlots[i];
+	}
+}
 
-	if( !bNew )
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+const char* CStringPool::Find( const char* pszValue )
+{
+	if( !m_nCount )
 	{
-		return m_Strings[i];
+		return NULL;
 	}
 
-	pszNew = strdup( pszValue );
+	return m_Strings[FindSlot( pszValue, MurmurHash2LowerCase( pszValue, STRING_POOL_HASH_SEED ) )].m_pString;
+}
+
+const char* CStringPool::Allocate( const char* pszValue )
+{
+	if( ( m_nCount + 1 ) * 2 > m_Strings.Count() )
+	{
+		ResizeHash( max( m_Strings.Count() * 2, MIN_STRING_POOL_HASH_SLOTS ) );
+	}
 
-	if( bNew )
+	unsigned int nHash = MurmurHash2LowerCase( pszValue, STRING_POOL_HASH_SEED );
+	HashSlot_t& slot = m_Strings[FindSlot( pszValue, nHash )];
+	if( !slot.m_pString )
 	{
-		m_Strings.Insert( pszNew );
+		slot.m_pString = strdup( pszValue );
+		slot.m_nHash = nHash;
+		m_nCount++;
 	}
 
-	return pszNew;
+	return slot.m_pString;
 }
 
 //-----------------------------------------------------------------------------
@@ -87,13 +127,12 @@ const char* CStringPool::Allocate( const char* pszValue )
 
 void CStringPool::FreeAll()
 {
-	unsigned short i = m_Strings.FirstInorder();
-	while( i != m_Strings.InvalidIndex() )
+	for( int i = 0; i < m_Strings.Count(); i++ )
 	{
-		free( ( void* )m_Strings[i] );
-		i = m_Strings.NextInorder( i );
+		free( ( void* )m_Strings[i].m_pString );
 	}
-	m_Strings.RemoveAll();
+	m_Strings.Purge();
+	m_nCount = 0;
 }
 
 //-----------------------------------------------------------------------------
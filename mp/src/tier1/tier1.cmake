@@ -22,6 +22,7 @@ set(
 	"${TIER1_DIR}/KeyValues.cpp"
 	"${TIER1_DIR}/kvpacker.cpp"
 	"${TIER1_DIR}/lzmaDecoder.cpp"
+	"${TIER1_DIR}/mappedfile.cpp"
 	"$<$<NOT:${IS_SOURCESDK}>:${TIER1_DIR}/lzss.cpp>"
 	"${TIER1_DIR}/mempool.cpp"
 	"${TIER1_DIR}/memstack.cpp"
@@ -35,6 +36,7 @@ set(
 
 	"${TIER1_DIR}/rangecheckedvar.cpp"
 	"${TIER1_DIR}/reliabletimer.cpp"
+	"${TIER1_DIR}/sizeclassalloc.cpp"
 	"${TIER1_DIR}/stringpool.cpp"
 	"${TIER1_DIR}/strtools.cpp"
 	"${TIER1_DIR}/strtools_unicode.cpp"
@@ -91,12 +93,14 @@ set(
 	"${SRCDIR}/public/tier1/kvpacker.h"
 	"${SRCDIR}/public/tier1/lzmaDecoder.h"
 	"${SRCDIR}/public/tier1/lzss.h"
+	"${SRCDIR}/public/tier1/mappedfile.h"
 	"${SRCDIR}/public/tier1/mempool.h"
 	"${SRCDIR}/public/tier1/memstack.h"
 	"${SRCDIR}/public/tier1/netadr.h"
 	"${SRCDIR}/public/tier1/processor_detect.h"
 	"${SRCDIR}/public/tier1/rangecheckedvar.h"
 	"${SRCDIR}/public/tier1/refcount.h"
+	"${SRCDIR}/public/tier1/sizeclassalloc.h"
 	"${SRCDIR}/public/tier1/smartptr.h"
 	"${SRCDIR}/public/tier1/snappy.h"
 	"${SRCDIR}/public/tier1/snappy-sinksource.h"
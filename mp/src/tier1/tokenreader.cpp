@@ -12,6 +12,7 @@
 #include "tier0/platform.h"
 #include "tier1/strtools.h"
 #include "tier0/dbg.h"
+#include "tier1/utlbuffer.h"
 
 //-----------------------------------------------------------------------------
 // Purpose:
@@ -22,6 +23,9 @@ TokenReader::TokenReader( void )
 	m_nLine = 1;
 	m_nErrorCount = 0;
 	m_bStuffed = false;
+	m_pTokens = NULL;
+	m_nTokensSize = 0;
+	m_nTokenPos = 0;
 }
 
 
@@ -41,11 +45,93 @@ bool TokenReader::Open( const char* pszFilename )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Reads tokens recorded by Tokenize() instead of the file itself.
+// Input  : pszFilename - Name used in error messages.
+//			pTokens, nSize - The contents of the buffer Tokenize() filled in.
+// Output : Returns true on success, false on failure.
+//-----------------------------------------------------------------------------
+bool TokenReader::OpenTokens( const char* pszFilename, const void* pTokens, int nSize )
+{
+	Q_strncpy( m_szFilename, pszFilename, sizeof( m_szFilename ) );
+	m_nLine = 1;
+	m_nErrorCount = 0;
+	m_bStuffed = false;
+	m_pTokens = ( const unsigned char* )pTokens;
+	m_nTokensSize = nSize;
+	m_nTokenPos = 0;
+	return( pTokens != NULL );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Records every token in the file as its type, the line it ended on
+//			and its text. Stops after the first error, just like the readers.
+// Input  : pszFilename - File to tokenize.
+//			tokens - Receives the tokens.
+//			nStart, nEnd - Byte range to tokenize, nEnd -1 for the rest of the file.
+//				Only the range that reaches the end of the file records TOKENEOF.
+//			nStartLine - Line number at nStart.
+// Output : Returns false if the file couldn't be opened, or if a token ran
+//			past nEnd.
+//-----------------------------------------------------------------------------
+bool TokenReader::Tokenize( const char* pszFilename, CUtlBuffer& tokens, int nStart, int nEnd, int nStartLine )
+{
+	TokenReader reader;
+	if( !reader.Open( pszFilename ) )
+	{
+		return false;
+	}
+
+	reader.m_nLine = nStartLine;
+	if( nStart > 0 )
+	{
+		reader.seekg( nStart );
+	}
+
+	// Anything that's too long for this is too long for every reader
+	char szToken[8192];
+	trtoken_t eType;
+	bool bResult = true;
+	do
+	{
+		if( nEnd >= 0 )
+		{
+			int nPos = ( int )reader.tellg();
+			if( nPos >= nEnd )
+			{
+				bResult = ( nPos == nEnd );
+				break;
+			}
+		}
+
+		szToken[0] = '\0';
+		eType = reader.NextToken( szToken, sizeof( szToken ) );
+
+		tokens.PutInt( eType );
+		tokens.PutInt( reader.m_nLine );
+		tokens.PutString( szToken );
+	}
+	while( eType >= 0 );
+
+	reader.Close();
+	return bResult;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose:
 //-----------------------------------------------------------------------------
 void TokenReader::Close()
 {
+	if( m_pTokens )
+	{
+		m_pTokens = NULL;
+		m_nTokensSize = 0;
+		m_nTokenPos = 0;
+		return;
+	}
+
 	close();
 }
 
@@ -186,6 +272,47 @@ trtoken_t TokenReader::GetString( char* pszStore, int nSize )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns the next token Tokenize() recorded. Tokens that don't fit
+//			are handled the same way NextToken handles them in the file.
+// Input  : pszStore - Pointer to a string that will receive the token.
+// Output : Returns the type of token that was read, or TOKENEOF at the end.
+//-----------------------------------------------------------------------------
+trtoken_t TokenReader::NextRecordedToken( char* pszStore, int nSize )
+{
+	if( nSize <= 0 )
+	{
+		return TOKENERROR;
+	}
+
+	if( m_nTokenPos + 2 * ( int )sizeof( int ) >= m_nTokensSize )
+	{
+		*pszStore = '\0';
+		return TOKENEOF;
+	}
+
+	int nType, nLine;
+	memcpy( &nType, m_pTokens + m_nTokenPos, sizeof( int ) );
+	memcpy( &nLine, m_pTokens + m_nTokenPos + sizeof( int ), sizeof( int ) );
+	m_nTokenPos += 2 * sizeof( int );
+
+	const char* pszToken = ( const char* )m_pTokens + m_nTokenPos;
+	int nLen = Q_strlen( pszToken );
+	m_nTokenPos += nLen + 1;
+	m_nLine = nLine;
+
+	Q_strncpy( pszStore, pszToken, nSize );
+
+	trtoken_t eType = ( trtoken_t )nType;
+	if( eType == STRING && nLen >= nSize )
+	{
+		return TOKENSTRINGTOOLONG;
+	}
+
+	return eType;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Returns the next token, allocating enough memory to store the token
 //			plus a terminating NULL.
@@ -215,7 +342,7 @@ trtoken_t TokenReader::NextToken( char* pszStore, int nSize )
 {
 	char* pStart = pszStore;
 
-	if( !is_open() )
+	if( !m_pTokens && !is_open() )
 	{
 		return TOKENEOF;
 	}
@@ -230,6 +357,11 @@ trtoken_t TokenReader::NextToken( char* pszStore, int nSize )
 		return m_eStuffed;
 	}
 
+	if( m_pTokens )
+	{
+		return NextRecordedToken( pszStore, nSize );
+	}
+
 	SkipWhiteSpace();
 
 	if( eof() )
@@ -15,6 +15,7 @@
 #include "stringpool.h"
 #include "utlhashtable.h"
 #include "utlstring.h"
+#include "generichash.h"
 
 // Ensure that everybody has the right compiler version installed. The version
 // number can be obtained by looking at the compiler output when you type 'cl'
@@ -36,10 +37,11 @@
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
-#define INVALID_STRING_INDEX CStringPoolIndex( 0xFFFF, 0xFFFF )
-
 #define MIN_STRING_POOL_SIZE	2048
 
+#define MIN_SYMBOL_HASH_SLOTS	64
+#define SYMBOL_HASH_SEED		0x3F0A3E1B
+
 //-----------------------------------------------------------------------------
 // globals
 //-----------------------------------------------------------------------------
@@ -137,37 +139,70 @@ inline const char* CUtlSymbolTable::StringFromIndex( const CStringPoolIndex& ind
 }
 
 
-bool CUtlSymbolTable::CLess::operator()( const CStringPoolIndex& i1, const CStringPoolIndex& i2 ) const
+inline unsigned int CUtlSymbolTable::HashString( const char* pString ) const
 {
-	// Need to do pointer math because CUtlSymbolTable is used in CUtlVectors, and hence
-	// can be arbitrarily moved in memory on a realloc. Yes, this is portable. In reality,
-	// right now at least, because m_LessFunc is the first member of CUtlRBTree, and m_Lookup
-	// is the first member of CUtlSymbolTabke, this == pTable
-	CUtlSymbolTable* pTable = ( CUtlSymbolTable* )( ( byte* )this - offsetof( CUtlSymbolTable::CTree, m_LessFunc ) ) - offsetof( CUtlSymbolTable, m_Lookup );
-	const char* str1 = ( i1 == INVALID_STRING_INDEX ) ? pTable->m_pUserSearchString :
-					   pTable->StringFromIndex( i1 );
-	const char* str2 = ( i2 == INVALID_STRING_INDEX ) ? pTable->m_pUserSearchString :
-					   pTable->StringFromIndex( i2 );
-
-	if( !str1 && str2 )
-	{
-		return false;
-	}
-	if( !str2 && str1 )
+	if( m_bInsensitive )
 	{
-		return true;
+		return MurmurHash2LowerCase( pString, SYMBOL_HASH_SEED );
 	}
-	if( !str1 && !str2 )
+	return MurmurHash2( pString, V_strlen( pString ), SYMBOL_HASH_SEED );
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns the slot holding pString, or the empty slot it would go in
+//-----------------------------------------------------------------------------
+int CUtlSymbolTable::FindSlot( const char* pString, unsigned int nHash ) const
+{
+	int nMask = m_HashSlots.Count() - 1;
+	for( int i = nHash & nMask; ; i = ( i + 1 ) & nMask )
 	{
-		return false;
+		const HashSlot_t& slot = m_HashSlots[i];
+		if( slot.m_Id == UTL_INVAL_SYMBOL )
+		{
+			return i;
+		}
+
+		if( slot.m_nHash == nHash )
+		{
+			const char* pSlotString = StringFromIndex( m_Strings[slot.m_Id] );
+			if( m_bInsensitive ? !V_stricmp( pSlotString, pString ) : !V_strcmp( pSlotString, pString ) )
+			{
+				return i;
+			}
+		}
 	}
-	if( !pTable->m_bInsensitive )
+}
+
+
+void CUtlSymbolTable::ResizeHash( int nSlots )
+{
+	Assert( ( nSlots & ( nSlots - 1 ) ) == 0 && nSlots > m_Strings.Count() * 2 );
+
+	CUtlVector<HashSlot_t> oldSlots;
+	oldSlots.Swap( m_HashSlots );
+
+	m_HashSlots.SetCount( nSlots );
+	for( int i = 0; i < nSlots; i++ )
 	{
-		return V_strcmp( str1, str2 ) < 0;
+		m_HashSlots[i].m_Id = UTL_INVAL_SYMBOL;
 	}
-	else
+
+	// the hashes are kept, so no string is looked at again
+	int nMask = nSlots - 1;
+	for( int i = 0; i < oldSlots.Count(); i++ )
 	{
-		return V_stricmp( str1, str2 ) < 0;
+		if( oldSlots[i].m_Id == UTL_INVAL_SYMBOL )
+		{
+			continue;
+		}
+
+		int j = oldSlots[i].m_nHash & nMask;
+		while( m_HashSlots[j].m_Id != UTL_INVAL_SYMBOL )
+		{
+			j = ( j + 1 ) & nMask;
+		}
+		m_HashSlots[j] = oldSlots[i];
 	}
 }
 
@@ -176,7 +211,7 @@ bool CUtlSymbolTable::CLess::operator()( const CStringPoolIndex& i1, const CStri
 // constructor, destructor
 //-----------------------------------------------------------------------------
 CUtlSymbolTable::CUtlSymbolTable( int growSize, int initSize, bool caseInsensitive ) :
-	m_Lookup( growSize, initSize ), m_bInsensitive( caseInsensitive ), m_StringPools( 8 )
+	m_Strings( growSize, initSize ), m_bInsensitive( caseInsensitive ), m_StringPools( 8 )
 {
 }
 
@@ -189,23 +224,12 @@ CUtlSymbolTable::~CUtlSymbolTable()
 
 CUtlSymbol CUtlSymbolTable::Find( const char* pString ) const
 {
-	if( !pString )
+	if( !pString || !m_HashSlots.Count() )
 	{
 		return CUtlSymbol();
 	}
 
-	// Store a special context used to help with insertion
-	m_pUserSearchString = pString;
-
-	// Passing this special invalid symbol makes the comparison function
-	// use the string passed in the context
-	UtlSymId_t idx = m_Lookup.Find( INVALID_STRING_INDEX );
-
-#ifdef _DEBUG
-	m_pUserSearchString = NULL;
-#endif
-
-	return CUtlSymbol( idx );
+	return CUtlSymbol( m_HashSlots[FindSlot( pString, HashString( pString ) )].m_Id );
 }
 
 
@@ -236,11 +260,23 @@ CUtlSymbol CUtlSymbolTable::AddString( const char* pString )
 		return CUtlSymbol( UTL_INVAL_SYMBOL );
 	}
 
-	CUtlSymbol id = Find( pString );
+	if( ( m_Strings.Count() + 1 ) * 2 > m_HashSlots.Count() )
+	{
+		ResizeHash( max( m_HashSlots.Count() * 2, MIN_SYMBOL_HASH_SLOTS ) );
+	}
+
+	unsigned int nHash = HashString( pString );
+	int iSlot = FindSlot( pString, nHash );
+	if( m_HashSlots[iSlot].m_Id != UTL_INVAL_SYMBOL )
+	{
+		return CUtlSymbol( m_HashSlots[iSlot].m_Id );
+	}
 
-	if( id.IsValid() )
+	// the last id is UTL_INVAL_SYMBOL itself
+	if( m_Strings.Count() >= UTL_INVAL_SYMBOL )
 	{
-		return id;
+		Error( "CUtlSymbolTable: more than %d symbols\n", UTL_INVAL_SYMBOL );
+		return CUtlSymbol( UTL_INVAL_SYMBOL );
 	}
 
 	int len = V_strlen( pString ) + 1;
@@ -272,7 +308,9 @@ CUtlSymbol CUtlSymbolTable::AddString( const char* pString )
 	index.m_iPool = iPool;
 	index.m_iOffset = iStringOffset;
 
-	UtlSymId_t idx = m_Lookup.Insert( index );
+	UtlSymId_t idx = m_Strings.AddToTail( index );
+	m_HashSlots[iSlot].m_nHash = nHash;
+	m_HashSlots[iSlot].m_Id = idx;
 	return CUtlSymbol( idx );
 }
 
@@ -288,8 +326,8 @@ const char* CUtlSymbolTable::String( CUtlSymbol id ) const
 		return "";
 	}
 
-	Assert( m_Lookup.IsValidIndex( ( UtlSymId_t )id ) );
-	return StringFromIndex( m_Lookup[id] );
+	Assert( m_Strings.IsValidIndex( ( UtlSymId_t )id ) );
+	return StringFromIndex( m_Strings[id] );
 }
 
 
@@ -299,7 +337,8 @@ const char* CUtlSymbolTable::String( CUtlSymbol id ) const
 
 void CUtlSymbolTable::RemoveAll()
 {
-	m_Lookup.Purge();
+	m_Strings.Purge();
+	m_HashSlots.Purge();
 
 	for( int i = 0; i < m_StringPools.Count(); i++ )
 	{
@@ -28,6 +28,7 @@
 #include "vtf/vtf.h"
 #include "lzma/lzma.h"
 #include "tier1/lzmaDecoder.h"
+#include "tier1/mappedfile.h"
 
 //=============================================================================
 
@@ -711,8 +712,15 @@ struct Lump_t
 	void*	pLumps[HEADER_LUMPS];
 	int		size[HEADER_LUMPS];
 	bool	bLumpParsed[HEADER_LUMPS];
+	bool	bInMapping[HEADER_LUMPS];	// pLumps points into s_BSPMapping, don't free it
 } g_Lumps;
 
+// OpenBSPFile maps the file instead of reading all of it in, so only the lumps
+// that get copied out are ever paged in. The mapping is copy on write for the
+// code that patches the header in place. Lumps the tools don't know about stay
+// in the mapping until WriteBSPFile writes them back out.
+static CMappedFile s_BSPMapping;
+
 CGameLump	g_GameLumps;
 
 static IZip* s_pakFile = 0;
@@ -2021,7 +2029,17 @@ void Lumps_Parse( void )
 	{
 		if( !g_Lumps.bLumpParsed[i] && g_pBSPHeader->lumps[i].filelen )
 		{
-			g_Lumps.size[i] = CopyVariableLump<byte>( FIELD_CHARACTER, i, &g_Lumps.pLumps[i], -1 );
+			if( s_BSPMapping.IsOpen() )
+			{
+				g_Lumps.bLumpParsed[i] = true;
+				g_Lumps.bInMapping[i] = true;
+				g_Lumps.pLumps[i] = ( byte* )g_pBSPHeader + g_pBSPHeader->lumps[i].fileofs;
+				g_Lumps.size[i] = g_pBSPHeader->lumps[i].filelen;
+			}
+			else
+			{
+				g_Lumps.size[i] = CopyVariableLump<byte>( FIELD_CHARACTER, i, &g_Lumps.pLumps[i], -1 );
+			}
 			Msg( "Reading unknown lump #%d (%d bytes)\n", i, g_Lumps.size[i] );
 		}
 	}
@@ -2038,12 +2056,68 @@ void Lumps_Write( void )
 			Msg( "Writing unknown lump #%d (%d bytes)\n", i, g_Lumps.size[i] );
 			AddLump( i, ( byte* )g_Lumps.pLumps[i], g_Lumps.size[i] );
 		}
-		if( g_Lumps.pLumps[i] )
+		if( g_Lumps.pLumps[i] && !g_Lumps.bInMapping[i] )
 		{
 			free( g_Lumps.pLumps[i] );
-			g_Lumps.pLumps[i] = NULL;
 		}
+		g_Lumps.pLumps[i] = NULL;
+		g_Lumps.bInMapping[i] = false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Gives the lumps still in the mapping their own copy and unmaps the file
+//-----------------------------------------------------------------------------
+static void ReleaseBSPMapping( void )
+{
+	for( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		if( g_Lumps.bInMapping[i] )
+		{
+			void* pLump = malloc( g_Lumps.size[i] );
+			memcpy( pLump, g_Lumps.pLumps[i], g_Lumps.size[i] );
+			g_Lumps.pLumps[i] = pLump;
+			g_Lumps.bInMapping[i] = false;
+		}
+	}
+
+	if( g_pBSPHeader == s_BSPMapping.Base() )
+	{
+		g_pBSPHeader = NULL;
 	}
+	s_BSPMapping.Close();
+}
+
+//-----------------------------------------------------------------------------
+//	A mapped file can't be overwritten, so if pFilename is the mapped BSP
+//	anything still needed from it is read into memory first
+//-----------------------------------------------------------------------------
+static void UnmapBSPFileForWrite( const char* pFilename )
+{
+	if( !s_BSPMapping.IsSameFile( pFilename ) )
+	{
+		return;
+	}
+
+	if( g_pBSPHeader == s_BSPMapping.Base() )
+	{
+		void* pCopy = malloc( s_BSPMapping.Size() );
+		memcpy( pCopy, s_BSPMapping.Base(), s_BSPMapping.Size() );
+		g_pBSPHeader = ( dheader_t* )pCopy;
+	}
+	ReleaseBSPMapping();
+}
+
+static bool HasLumpsInMapping( void )
+{
+	for( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		if( g_Lumps.bInMapping[i] )
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
 int LoadLeafs( void )
@@ -2204,10 +2278,21 @@ void ValidateHeader( const char* filename, const dheader_t* pHeader )
 //-----------------------------------------------------------------------------
 void OpenBSPFile( const char* filename )
 {
+	// anything left from the last map has already been copied out by now
+	s_BSPMapping.Close();
 	Lumps_Init();
 
-	// load the file header
-	LoadFile( filename, ( void** )&g_pBSPHeader );
+	// load the file header. Byteswapped files are patched all over, so those
+	// are still read in.
+	if( !g_bSwapOnLoad && s_BSPMapping.Open( filename, true ) && s_BSPMapping.Size() >= ( int64 )sizeof( dheader_t ) )
+	{
+		g_pBSPHeader = ( dheader_t* )s_BSPMapping.WritableBase();
+	}
+	else
+	{
+		s_BSPMapping.Close();
+		LoadFile( filename, ( void** )&g_pBSPHeader );
+	}
 
 	if( g_bSwapOnLoad )
 	{
@@ -2225,7 +2310,14 @@ void OpenBSPFile( const char* filename )
 //-----------------------------------------------------------------------------
 void CloseBSPFile( void )
 {
-	free( g_pBSPHeader );
+	if( s_BSPMapping.IsOpen() )
+	{
+		ReleaseBSPMapping();
+	}
+	else
+	{
+		free( g_pBSPHeader );
+	}
 	g_pBSPHeader = NULL;
 }
 
@@ -2330,15 +2422,31 @@ void LoadBSPFile( const char* filename )
 	}
 	*/
 
-	// Load PAK file lump into appropriate data structure
+	// Load PAK file lump into appropriate data structure. The zip keeps its own
+	// copy, so it can read straight from the mapping.
 	byte* pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void** )&pakbuffer );
-	if( paksize > 0 )
+	int paksize;
+	if( s_BSPMapping.IsOpen() )
 	{
-		GetPakFile()->ActivateByteSwapping( IsX360() );
-		GetPakFile()->ParseFromBuffer( pakbuffer, paksize );
+		g_Lumps.bLumpParsed[LUMP_PAKFILE] = true;
+		paksize = g_pBSPHeader->lumps[LUMP_PAKFILE].filelen;
+		if( paksize > 0 )
+		{
+			GetPakFile()->ActivateByteSwapping( IsX360() );
+			GetPakFile()->ParseFromBuffer( ( byte* )g_pBSPHeader + g_pBSPHeader->lumps[LUMP_PAKFILE].fileofs, paksize );
+		}
 	}
 	else
+	{
+		paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void** )&pakbuffer );
+		if( paksize > 0 )
+		{
+			GetPakFile()->ActivateByteSwapping( IsX360() );
+			GetPakFile()->ParseFromBuffer( pakbuffer, paksize );
+		}
+	}
+
+	if( paksize <= 0 )
 	{
 		GetPakFile()->Reset();
 	}
@@ -2351,8 +2459,16 @@ void LoadBSPFile( const char* filename )
 	// parse any additional lumps
 	Lumps_Parse();
 
-	// everything has been copied out
-	CloseBSPFile();
+	// everything else has been copied out, the unknown lumps keep the
+	// mapping open until they're written
+	if( HasLumpsInMapping() )
+	{
+		g_pBSPHeader = NULL;
+	}
+	else
+	{
+		CloseBSPFile();
+	}
 
 	g_Swap.ActivateByteSwapping( false );
 }
@@ -2455,12 +2571,14 @@ void UnloadBSPFile()
 
 	for( int i = 0; i < HEADER_LUMPS; i++ )
 	{
-		if( g_Lumps.pLumps[i] )
+		if( g_Lumps.pLumps[i] && !g_Lumps.bInMapping[i] )
 		{
 			free( g_Lumps.pLumps[i] );
-			g_Lumps.pLumps[i] = NULL;
 		}
+		g_Lumps.pLumps[i] = NULL;
+		g_Lumps.bInMapping[i] = false;
 	}
+	s_BSPMapping.Close();
 
 	ReleasePakFileLumps();
 }
@@ -2670,6 +2788,7 @@ void WriteBSPFile( const char* filename, char* pUnused )
 	g_pBSPHeader->version = BSPVERSION;
 	g_pBSPHeader->mapRevision = g_MapRevision;
 
+	UnmapBSPFileForWrite( filename );
 	g_hBSPFile = SafeOpenWrite( filename );
 	WriteData( g_pBSPHeader );	// overwritten later
 
@@ -2770,6 +2889,9 @@ void WriteBSPFile( const char* filename, char* pUnused )
 	g_pFileSystem->Seek( g_hBSPFile, 0, FILESYSTEM_SEEK_HEAD );
 	WriteData( g_pBSPHeader );
 	g_pFileSystem->Close( g_hBSPFile );
+
+	// the unknown lumps were the last thing in the mapping
+	s_BSPMapping.Close();
 }
 
 // Generate the next clear lump filename for the bsp file
@@ -5224,6 +5346,7 @@ bool SetPakFileLump( const char* pBSPFilename, const char* pNewFilename, void* p
 	dheader_t oldHeader;
 	oldHeader = *g_pBSPHeader;
 
+	UnmapBSPFileForWrite( pNewFilename );
 	g_hBSPFile = SafeOpenWrite( pNewFilename );
 	if( !g_hBSPFile )
 	{
@@ -0,0 +1,914 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Socket based work distribution, see distribute.h.
+//
+//			Every message is a 4 byte size, a byte type and the payload. The
+//			size and the ints in the payloads are in network byte order, the
+//			arrays the tools Put() as they are. A worker thread connects, says
+//			hello with the phase it's in and gets one work unit at a time. The
+//			master never holds more than one unit per connection, so a lost
+//			connection only ever costs that unit. Workers send heartbeats while
+//			they work so long units don't look like hung workers.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifdef _WIN32
+	// winsock2.h has to come before anything that pulls in windows.h
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+#else
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <sys/select.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <arpa/inet.h>
+	#include <netdb.h>
+	#include <unistd.h>
+	#include <errno.h>
+#endif
+
+#include "cmdlib.h"
+#define NO_THREAD_NAMES
+#include "threads.h"
+#include "pacifier.h"
+#include "distribute.h"
+#include "tier0/threadtools.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/strtools.h"
+
+
+#ifdef _WIN32
+	typedef int socklen_t;
+	#define closesocket_portable	closesocket
+#else
+	typedef int SOCKET;
+	#define INVALID_SOCKET			-1
+	#define closesocket_portable	close
+#endif
+
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL	0
+#endif
+
+
+#define DIST_PROTOCOL_VERSION	2
+#define DIST_MAX_MESSAGE		( 1024 * 1024 * 1024 )
+#define DIST_RECONNECT_WAIT		1000		// ms between attempts to reach the master
+#define DIST_HEARTBEAT_MAX		30000		// ms between heartbeats, less with a short -disttimeout
+
+enum
+{
+	DIST_MSG_HELLO = 1,		// worker -> master: version, key, phase, work unit count
+	DIST_MSG_WORK,			// master -> worker: work unit to process
+	DIST_MSG_RESULT,		// worker -> master: work unit, results
+	DIST_MSG_WAIT,			// master -> worker: not at that phase yet or no room, reconnect later
+	DIST_MSG_DONE,			// master -> worker: the phase is finished, go on to the next one
+	DIST_MSG_REJECT,		// master -> worker: different map or options
+	DIST_MSG_HEARTBEAT		// worker -> master: still working on its unit
+};
+
+enum
+{
+	DIST_UNIT_QUEUED = 0,
+	DIST_UNIT_BUSY,
+	DIST_UNIT_DONE
+};
+
+struct distconnection_t
+{
+	SOCKET				m_Socket;
+	int					m_iWorker;
+	char				m_Name[64];
+	bool				m_bHello;
+	int					m_iWorkUnit;		// -1 when it has nothing to do
+	double				m_flLastHeard;
+	CUtlVector<byte>	m_Recv;				// partially received messages
+};
+
+struct distworker_t
+{
+	CThreadFastMutex	m_SendMutex;		// results and heartbeats are sent from different threads
+	SOCKET				m_Socket;			// INVALID_SOCKET unless it's working on a unit
+};
+
+bool g_bDistributed = false;
+bool g_bDistWorker = false;
+
+static int				s_iPort;
+static char				s_MasterHost[256];
+static float			s_flTimeout = 900.0f;		// seconds a worker can go without sending anything
+static CRC32_t			s_Key;
+static int				s_iPhase;					// phases run so far
+static SOCKET			s_ListenSocket = INVALID_SOCKET;
+static int				s_nWorkersSeen;
+
+// master side state of the current phase, s_QueueMutex protects everything but the connections
+static CThreadFastMutex					s_QueueMutex;
+static CUtlVector<int>					s_Queue;			// work units to hand out, next one at the tail
+static CUtlVector<byte>					s_UnitState;
+static int								s_nUnitsDone;
+static int								s_nUnitsRemote;
+static int								s_nUnits;
+static DistProcessFn					s_ProcessFn;
+static DistReceiveFn					s_ReceiveFn;
+static CUtlVector<distconnection_t*>	s_Connections;
+static CThreadManualEvent				s_QueueEvent;		// set when units are requeued or the phase is done
+static bool								s_bWarnedFull;
+
+// worker side
+static volatile int		s_nWorkerUnits;
+static distworker_t		s_Workers[MAX_TOOL_THREADS];
+static CThreadEvent		s_HeartbeatStop;
+
+
+static void Dist_Shutdown( void )
+{
+	if( s_ListenSocket != INVALID_SOCKET )
+	{
+		closesocket_portable( s_ListenSocket );
+		s_ListenSocket = INVALID_SOCKET;
+	}
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+
+bool Dist_HandleArg( int argc, char** argv, int& i )
+{
+	if( !Q_stricmp( argv[i], "-distmaster" ) )
+	{
+		if( ++i >= argc )
+		{
+			Error( "-distmaster needs a port\n" );
+		}
+		s_iPort = atoi( argv[i] );
+		g_bDistributed = true;
+		g_bDistWorker = false;
+		return true;
+	}
+
+	if( !Q_stricmp( argv[i], "-distworker" ) )
+	{
+		if( ++i >= argc || !strchr( argv[i], ':' ) )
+		{
+			Error( "-distworker needs the master's <host>:<port>\n" );
+		}
+		V_strncpy( s_MasterHost, argv[i], sizeof( s_MasterHost ) );
+		char* pPort = strrchr( s_MasterHost, ':' );
+		*pPort = 0;
+		s_iPort = atoi( pPort + 1 );
+		g_bDistributed = true;
+		g_bDistWorker = true;
+		return true;
+	}
+
+	if( !Q_stricmp( argv[i], "-disttimeout" ) )
+	{
+		if( ++i >= argc )
+		{
+			Error( "-disttimeout needs a number of seconds\n" );
+		}
+		s_flTimeout = atof( argv[i] );
+		return true;
+	}
+
+	return false;
+}
+
+
+void Dist_Init( void )
+{
+	CRC32_Init( &s_Key );
+
+	if( !g_bDistributed )
+	{
+		return;
+	}
+
+	if( s_iPort <= 0 || s_iPort > 65535 )
+	{
+		Error( "Invalid port %d for distributed compiling\n", s_iPort );
+	}
+
+#ifdef _WIN32
+	WSADATA wsaData;
+	if( WSAStartup( MAKEWORD( 2, 2 ), &wsaData ) != 0 )
+	{
+		Error( "WSAStartup failed\n" );
+	}
+#endif
+	CmdLib_AtCleanup( Dist_Shutdown );
+
+	if( g_bDistWorker )
+	{
+		Msg( "Working for %s:%d\n", s_MasterHost, s_iPort );
+		return;
+	}
+
+	s_ListenSocket = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+	if( s_ListenSocket == INVALID_SOCKET )
+	{
+		Error( "Can't create the socket for distributed compiling\n" );
+	}
+
+	int reuse = 1;
+	setsockopt( s_ListenSocket, SOL_SOCKET, SO_REUSEADDR, ( const char* )&reuse, sizeof( reuse ) );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_ANY );
+	addr.sin_port = htons( s_iPort );
+	if( bind( s_ListenSocket, ( sockaddr* )&addr, sizeof( addr ) ) != 0 || listen( s_ListenSocket, 64 ) != 0 )
+	{
+		Error( "Can't listen on port %d for workers\n", s_iPort );
+	}
+
+	Msg( "Listening for workers on port %d\n", s_iPort );
+}
+
+
+void Dist_HashFile( const char* pFilename )
+{
+	if( !g_bDistributed )
+	{
+		return;
+	}
+
+	FILE* fp = fopen( pFilename, "rb" );
+	if( !fp )
+	{
+		Error( "Can't open %s\n", pFilename );
+	}
+
+	byte buf[64 * 1024];
+	size_t nRead;
+	while( ( nRead = fread( buf, 1, sizeof( buf ), fp ) ) > 0 )
+	{
+		CRC32_ProcessBuffer( &s_Key, buf, nRead );
+	}
+	fclose( fp );
+}
+
+
+//-----------------------------------------------------------------------------
+// Message helpers
+//-----------------------------------------------------------------------------
+static bool SendAll( SOCKET s, const void* pData, int nSize )
+{
+	const char* p = ( const char* )pData;
+	while( nSize > 0 )
+	{
+		int nSent = send( s, p, nSize, MSG_NOSIGNAL );
+		if( nSent <= 0 )
+		{
+			return false;
+		}
+		p += nSent;
+		nSize -= nSent;
+	}
+	return true;
+}
+
+static bool RecvAll( SOCKET s, void* pData, int nSize )
+{
+	char* p = ( char* )pData;
+	while( nSize > 0 )
+	{
+		int nRecv = recv( s, p, nSize, 0 );
+		if( nRecv <= 0 )
+		{
+			return false;
+		}
+		p += nRecv;
+		nSize -= nRecv;
+	}
+	return true;
+}
+
+static bool SendDistMessage( SOCKET s, byte type, const void* pPayload, int nPayload )
+{
+	byte header[5];
+	uint32 nSize = htonl( nPayload + 1 );
+	memcpy( header, &nSize, sizeof( nSize ) );
+	header[4] = type;
+	return SendAll( s, header, sizeof( header ) ) && ( !nPayload || SendAll( s, pPayload, nPayload ) );
+}
+
+static bool SendInt( SOCKET s, byte type, int val )
+{
+	uint32 netVal = htonl( val );
+	return SendDistMessage( s, type, &netVal, sizeof( netVal ) );
+}
+
+// Every typed value in a payload is big endian, whichever machine wrote it
+static void SetNetworkOrder( CUtlBuffer& buf )
+{
+	buf.SetBigEndian( true );
+}
+
+
+//-----------------------------------------------------------------------------
+// Master
+//-----------------------------------------------------------------------------
+static void CloseConnection( distconnection_t* pConn, bool bRequeue )
+{
+	if( pConn->m_iWorkUnit != -1 && bRequeue )
+	{
+		s_QueueMutex.Lock();
+		s_UnitState[pConn->m_iWorkUnit] = DIST_UNIT_QUEUED;
+		s_Queue.AddToTail( pConn->m_iWorkUnit );
+		s_QueueEvent.Set();
+		s_QueueMutex.Unlock();
+	}
+
+	closesocket_portable( pConn->m_Socket );
+	s_Connections.FindAndRemove( pConn );
+	delete pConn;
+}
+
+static void DropConnection( distconnection_t* pConn, const char* pReason )
+{
+	if( pConn->m_bHello )
+	{
+		if( pConn->m_iWorkUnit != -1 )
+		{
+			Warning( "\nWorker %d (%s) %s, handing work unit %d to someone else\n", pConn->m_iWorker, pConn->m_Name, pReason, pConn->m_iWorkUnit );
+		}
+		else
+		{
+			Warning( "\nWorker %d (%s) %s\n", pConn->m_iWorker, pConn->m_Name, pReason );
+		}
+	}
+	CloseConnection( pConn, true );
+}
+
+// Gives an idle connection the next queued work unit, if there is one
+static bool AssignWork( distconnection_t* pConn )
+{
+	s_QueueMutex.Lock();
+	int iWorkUnit = -1;
+	if( s_Queue.Count() )
+	{
+		iWorkUnit = s_Queue.Tail();
+		s_Queue.RemoveMultipleFromTail( 1 );
+		s_UnitState[iWorkUnit] = DIST_UNIT_BUSY;
+	}
+	s_QueueMutex.Unlock();
+
+	if( iWorkUnit == -1 )
+	{
+		return true;
+	}
+
+	pConn->m_iWorkUnit = iWorkUnit;
+	pConn->m_flLastHeard = Plat_FloatTime();
+	return SendInt( pConn->m_Socket, DIST_MSG_WORK, iWorkUnit );
+}
+
+static bool HandleHello( distconnection_t* pConn, CUtlBuffer& buf )
+{
+	int version = buf.GetInt();
+	CRC32_t key = buf.GetUnsignedInt();
+	int phase = buf.GetInt();
+	int nUnits = buf.GetInt();
+	if( !buf.IsValid() || version != DIST_PROTOCOL_VERSION )
+	{
+		Warning( "\nIgnoring %s, it doesn't speak our protocol\n", pConn->m_Name );
+		CloseConnection( pConn, false );
+		return false;
+	}
+
+	if( phase < s_iPhase )
+	{
+		// came in late, it'll skip ahead
+		SendDistMessage( pConn->m_Socket, DIST_MSG_DONE, NULL, 0 );
+		CloseConnection( pConn, false );
+		return false;
+	}
+
+	if( phase > s_iPhase )
+	{
+		SendDistMessage( pConn->m_Socket, DIST_MSG_WAIT, NULL, 0 );
+		CloseConnection( pConn, false );
+		return false;
+	}
+
+	if( key != s_Key || nUnits != s_nUnits )
+	{
+		Warning( "\nRejecting %s, it's working on a different map or with different options\n", pConn->m_Name );
+		SendDistMessage( pConn->m_Socket, DIST_MSG_REJECT, NULL, 0 );
+		CloseConnection( pConn, false );
+		return false;
+	}
+
+	pConn->m_bHello = true;
+	pConn->m_iWorker = s_nWorkersSeen++;
+	return true;
+}
+
+static bool HandleResult( distconnection_t* pConn, CUtlBuffer& buf )
+{
+	int iWorkUnit = buf.GetInt();
+	if( !buf.IsValid() || iWorkUnit != pConn->m_iWorkUnit )
+	{
+		DropConnection( pConn, "sent results for a work unit it wasn't given" );
+		return false;
+	}
+
+	s_ReceiveFn( iWorkUnit, buf, pConn->m_iWorker );
+	if( !buf.IsValid() )
+	{
+		Error( "Bad results for work unit %d from worker %d (%s)\n", iWorkUnit, pConn->m_iWorker, pConn->m_Name );
+	}
+
+	s_QueueMutex.Lock();
+	s_UnitState[iWorkUnit] = DIST_UNIT_DONE;
+	s_nUnitsDone++;
+	s_nUnitsRemote++;
+	if( s_nUnitsDone == s_nUnits )
+	{
+		s_QueueEvent.Set();
+	}
+	s_QueueMutex.Unlock();
+
+	pConn->m_iWorkUnit = -1;
+	return true;
+}
+
+// Reads what's waiting on the socket and handles every complete message.
+// Returns false if the connection was closed.
+static bool ReadConnection( distconnection_t* pConn )
+{
+	char data[64 * 1024];
+	int nRecv = recv( pConn->m_Socket, data, sizeof( data ), 0 );
+	if( nRecv <= 0 )
+	{
+		DropConnection( pConn, "disconnected" );
+		return false;
+	}
+
+	pConn->m_flLastHeard = Plat_FloatTime();
+	pConn->m_Recv.AddMultipleToTail( nRecv, ( byte* )data );
+
+	while( pConn->m_Recv.Count() >= ( int )sizeof( int ) )
+	{
+		uint32 netSize;
+		memcpy( &netSize, pConn->m_Recv.Base(), sizeof( netSize ) );
+		int nSize = ( int )ntohl( netSize );
+		if( nSize < 1 || nSize > DIST_MAX_MESSAGE )
+		{
+			DropConnection( pConn, "sent garbage" );
+			return false;
+		}
+		if( pConn->m_Recv.Count() < ( int )sizeof( int ) + nSize )
+		{
+			break;
+		}
+
+		byte type = pConn->m_Recv[sizeof( int )];
+		CUtlBuffer buf( pConn->m_Recv.Base() + sizeof( int ) + 1, nSize - 1, CUtlBuffer::READ_ONLY );
+		SetNetworkOrder( buf );
+
+		bool bOk;
+		if( type == DIST_MSG_HELLO && !pConn->m_bHello )
+		{
+			bOk = HandleHello( pConn, buf );
+		}
+		else if( type == DIST_MSG_RESULT && pConn->m_bHello )
+		{
+			bOk = HandleResult( pConn, buf );
+		}
+		else if( type == DIST_MSG_HEARTBEAT && pConn->m_bHello )
+		{
+			// m_flLastHeard is already up to date
+			bOk = true;
+		}
+		else
+		{
+			DropConnection( pConn, "sent an unexpected message" );
+			bOk = false;
+		}
+
+		if( !bOk )
+		{
+			return false;
+		}
+
+		pConn->m_Recv.RemoveMultipleFromHead( sizeof( int ) + nSize );
+	}
+
+	return true;
+}
+
+static void AcceptConnection( void )
+{
+	sockaddr_in addr;
+	socklen_t addrlen = sizeof( addr );
+	SOCKET s = accept( s_ListenSocket, ( sockaddr* )&addr, &addrlen );
+	if( s == INVALID_SOCKET )
+	{
+		return;
+	}
+
+	// select() can't watch more sockets than fit in an fd_set. On Windows that's
+	// FD_SETSIZE sockets including the listen socket, elsewhere descriptors below
+	// FD_SETSIZE. Anyone past that is told to wait and tries again when a slot frees up.
+#ifdef _WIN32
+	bool bFull = s_Connections.Count() + 1 >= FD_SETSIZE;
+#else
+	bool bFull = s >= FD_SETSIZE;
+#endif
+	if( bFull )
+	{
+		if( !s_bWarnedFull )
+		{
+			Warning( "\nToo many workers for select(), the ones past %d wait for a free slot\n", s_Connections.Count() );
+			s_bWarnedFull = true;
+		}
+		SendDistMessage( s, DIST_MSG_WAIT, NULL, 0 );
+		closesocket_portable( s );
+		return;
+	}
+
+	int nodelay = 1;
+	setsockopt( s, IPPROTO_TCP, TCP_NODELAY, ( const char* )&nodelay, sizeof( nodelay ) );
+	int keepalive = 1;
+	setsockopt( s, SOL_SOCKET, SO_KEEPALIVE, ( const char* )&keepalive, sizeof( keepalive ) );
+
+	distconnection_t* pConn = new distconnection_t;
+	pConn->m_Socket = s;
+	pConn->m_iWorker = -1;
+	V_snprintf( pConn->m_Name, sizeof( pConn->m_Name ), "%s:%d", inet_ntoa( addr.sin_addr ), ntohs( addr.sin_port ) );
+	pConn->m_bHello = false;
+	pConn->m_iWorkUnit = -1;
+	pConn->m_flLastHeard = Plat_FloatTime();
+	s_Connections.AddToTail( pConn );
+}
+
+// The master's own threads take work units from the same queue as the workers
+static void LocalWorkerThread( int iThread, void* pUserData )
+{
+	while( 1 )
+	{
+		s_QueueMutex.Lock();
+		if( s_nUnitsDone == s_nUnits )
+		{
+			s_QueueMutex.Unlock();
+			break;
+		}
+
+		int iWorkUnit = -1;
+		if( s_Queue.Count() )
+		{
+			iWorkUnit = s_Queue.Tail();
+			s_Queue.RemoveMultipleFromTail( 1 );
+			s_UnitState[iWorkUnit] = DIST_UNIT_BUSY;
+		}
+		else
+		{
+			// everything left is out with the workers, sleep until one of them
+			// drops its unit or the last result comes in
+			s_QueueEvent.Reset();
+		}
+		s_QueueMutex.Unlock();
+
+		if( iWorkUnit == -1 )
+		{
+			s_QueueEvent.Wait();
+			continue;
+		}
+
+		s_ProcessFn( iThread, iWorkUnit, NULL );
+
+		s_QueueMutex.Lock();
+		s_UnitState[iWorkUnit] = DIST_UNIT_DONE;
+		s_nUnitsDone++;
+		if( s_nUnitsDone == s_nUnits )
+		{
+			s_QueueEvent.Set();
+		}
+		s_QueueMutex.Unlock();
+	}
+}
+
+static void RunMaster( void )
+{
+	RunThreads_Start( LocalWorkerThread, NULL );
+
+	while( 1 )
+	{
+		s_QueueMutex.Lock();
+		int nDone = s_nUnitsDone;
+		s_QueueMutex.Unlock();
+
+		UpdatePacifier( ( float )nDone / s_nUnits );
+		if( nDone == s_nUnits )
+		{
+			break;
+		}
+
+		fd_set readSet;
+		FD_ZERO( &readSet );
+		FD_SET( s_ListenSocket, &readSet );
+		SOCKET maxSocket = s_ListenSocket;
+		for( int i = 0; i < s_Connections.Count(); i++ )
+		{
+			FD_SET( s_Connections[i]->m_Socket, &readSet );
+			maxSocket = max( maxSocket, s_Connections[i]->m_Socket );
+		}
+
+		timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 100 * 1000;
+		if( select( ( int )maxSocket + 1, &readSet, NULL, NULL, &tv ) < 0 )
+		{
+			continue;
+		}
+
+		// iterate over a copy, connections remove themselves when they close
+		CUtlVector<distconnection_t*> connections;
+		connections.CopyArray( s_Connections.Base(), s_Connections.Count() );
+		for( int i = 0; i < connections.Count(); i++ )
+		{
+			if( FD_ISSET( connections[i]->m_Socket, &readSet ) )
+			{
+				ReadConnection( connections[i] );
+			}
+		}
+
+		if( FD_ISSET( s_ListenSocket, &readSet ) )
+		{
+			AcceptConnection();
+		}
+
+		double flNow = Plat_FloatTime();
+		connections.CopyArray( s_Connections.Base(), s_Connections.Count() );
+		for( int i = 0; i < connections.Count(); i++ )
+		{
+			distconnection_t* pConn = connections[i];
+			if( !pConn->m_bHello )
+			{
+				continue;
+			}
+
+			if( pConn->m_iWorkUnit == -1 )
+			{
+				if( !AssignWork( pConn ) )
+				{
+					DropConnection( pConn, "disconnected" );
+				}
+			}
+			else if( s_flTimeout > 0 && flNow - pConn->m_flLastHeard > s_flTimeout )
+			{
+				DropConnection( pConn, "stopped responding" );
+			}
+		}
+	}
+
+	RunThreads_End();
+
+	// let everyone still connected move on to the next phase
+	while( s_Connections.Count() )
+	{
+		distconnection_t* pConn = s_Connections.Tail();
+		SendDistMessage( pConn->m_Socket, DIST_MSG_DONE, NULL, 0 );
+		CloseConnection( pConn, false );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Worker
+//-----------------------------------------------------------------------------
+static SOCKET ConnectToMaster( void )
+{
+	char port[16];
+	V_snprintf( port, sizeof( port ), "%d", s_iPort );
+
+	addrinfo hints;
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	double flGiveUp = Plat_FloatTime() + max( s_flTimeout, 60.0f );
+	while( Plat_FloatTime() < flGiveUp )
+	{
+		addrinfo* pResult = NULL;
+		if( getaddrinfo( s_MasterHost, port, &hints, &pResult ) == 0 )
+		{
+			for( addrinfo* p = pResult; p; p = p->ai_next )
+			{
+				SOCKET s = socket( p->ai_family, p->ai_socktype, p->ai_protocol );
+				if( s == INVALID_SOCKET )
+				{
+					continue;
+				}
+				if( connect( s, p->ai_addr, ( int )p->ai_addrlen ) == 0 )
+				{
+					freeaddrinfo( pResult );
+
+					int nodelay = 1;
+					setsockopt( s, IPPROTO_TCP, TCP_NODELAY, ( const char* )&nodelay, sizeof( nodelay ) );
+					int keepalive = 1;
+					setsockopt( s, SOL_SOCKET, SO_KEEPALIVE, ( const char* )&keepalive, sizeof( keepalive ) );
+					return s;
+				}
+				closesocket_portable( s );
+			}
+			freeaddrinfo( pResult );
+		}
+
+		ThreadSleep( DIST_RECONNECT_WAIT );
+	}
+
+	Error( "Lost the master at %s:%d\n", s_MasterHost, s_iPort );
+	return INVALID_SOCKET;
+}
+
+// Tells the master every worker thread that's busy with a unit is still alive
+static unsigned HeartbeatThread( void* pParam )
+{
+	unsigned nInterval = clamp( ( int )( s_flTimeout * 1000.0f / 4 ), 1000, DIST_HEARTBEAT_MAX );
+	if( s_flTimeout <= 0 )
+	{
+		nInterval = DIST_HEARTBEAT_MAX;
+	}
+
+	while( !s_HeartbeatStop.Wait( nInterval ) )
+	{
+		for( int i = 0; i < numthreads; i++ )
+		{
+			distworker_t* pWorker = &s_Workers[i];
+			pWorker->m_SendMutex.Lock();
+			if( pWorker->m_Socket != INVALID_SOCKET )
+			{
+				// a failed send shows up when the results go out
+				SendDistMessage( pWorker->m_Socket, DIST_MSG_HEARTBEAT, NULL, 0 );
+			}
+			pWorker->m_SendMutex.Unlock();
+		}
+	}
+	return 0;
+}
+
+static void RemoteWorkerThread( int iThread, void* pUserData )
+{
+	distworker_t* pWorker = &s_Workers[iThread];
+	CUtlBuffer results;
+	SetNetworkOrder( results );
+
+	while( 1 )
+	{
+		SOCKET s = ConnectToMaster();
+
+		CUtlBuffer hello;
+		SetNetworkOrder( hello );
+		hello.PutInt( DIST_PROTOCOL_VERSION );
+		hello.PutUnsignedInt( s_Key );
+		hello.PutInt( s_iPhase );
+		hello.PutInt( s_nUnits );
+		bool bOk = SendDistMessage( s, DIST_MSG_HELLO, hello.Base(), hello.TellPut() );
+
+		while( bOk )
+		{
+			uint32 netSize;
+			byte type;
+			if( !RecvAll( s, &netSize, sizeof( netSize ) ) || ntohl( netSize ) < 1 || !RecvAll( s, &type, 1 ) )
+			{
+				break;
+			}
+			int nSize = ( int )ntohl( netSize );
+
+			if( type == DIST_MSG_DONE )
+			{
+				closesocket_portable( s );
+				return;
+			}
+
+			if( type == DIST_MSG_REJECT )
+			{
+				Error( "The master rejected us, check that it has the same map and options\n" );
+			}
+
+			if( type != DIST_MSG_WORK || nSize != 1 + sizeof( int ) )
+			{
+				// WAIT, or something we don't understand
+				break;
+			}
+
+			uint32 netWorkUnit;
+			if( !RecvAll( s, &netWorkUnit, sizeof( netWorkUnit ) ) )
+			{
+				break;
+			}
+			int iWorkUnit = ( int )ntohl( netWorkUnit );
+
+			pWorker->m_SendMutex.Lock();
+			pWorker->m_Socket = s;
+			pWorker->m_SendMutex.Unlock();
+
+			results.Purge();
+			results.PutInt( iWorkUnit );
+			s_ProcessFn( iThread, iWorkUnit, &results );
+
+			pWorker->m_SendMutex.Lock();
+			bOk = SendDistMessage( s, DIST_MSG_RESULT, results.Base(), results.TellPut() );
+			pWorker->m_Socket = INVALID_SOCKET;
+			pWorker->m_SendMutex.Unlock();
+
+			ThreadInterlockedIncrement( &s_nWorkerUnits );
+		}
+
+		// the master isn't at our phase yet or the connection broke, any work unit
+		// we had is handed out again
+		closesocket_portable( s );
+		ThreadSleep( DIST_RECONNECT_WAIT );
+	}
+}
+
+
+double RunDistributedWork( int nWorkUnits, DistProcessFn processFn, DistReceiveFn receiveFn, DistSkipFn skipFn )
+{
+	double flStart = Plat_FloatTime();
+
+	if( numthreads == -1 )
+	{
+		ThreadSetDefault();
+	}
+
+	s_nUnits = nWorkUnits;
+	s_ProcessFn = processFn;
+	s_ReceiveFn = receiveFn;
+
+	if( g_bDistWorker )
+	{
+		s_nWorkerUnits = 0;
+		for( int i = 0; i < MAX_TOOL_THREADS; i++ )
+		{
+			s_Workers[i].m_Socket = INVALID_SOCKET;
+		}
+		s_HeartbeatStop.Reset();
+		ThreadHandle_t hHeartbeat = CreateSimpleThread( HeartbeatThread, NULL );
+
+		RunThreads_Start( RemoteWorkerThread, NULL );
+		RunThreads_End();
+
+		s_HeartbeatStop.Set();
+		ThreadJoin( hHeartbeat );
+		ReleaseThreadHandle( hHeartbeat );
+		Msg( "(%d work units)", s_nWorkerUnits );
+	}
+	else
+	{
+		// the tail is handed out first, so queue the units in reverse to keep their order
+		s_UnitState.SetCount( nWorkUnits );
+		s_Queue.RemoveAll();
+		s_Queue.EnsureCapacity( nWorkUnits );
+		s_nUnitsDone = 0;
+		s_nUnitsRemote = 0;
+		s_QueueEvent.Reset();
+		for( int i = nWorkUnits - 1; i >= 0; i-- )
+		{
+			if( skipFn && skipFn( i ) )
+			{
+				s_UnitState[i] = DIST_UNIT_DONE;
+				s_nUnitsDone++;
+			}
+			else
+			{
+				s_UnitState[i] = DIST_UNIT_QUEUED;
+				s_Queue.AddToTail( i );
+			}
+		}
+
+		StartPacifier( "" );
+		if( nWorkUnits )
+		{
+			RunMaster();
+		}
+		EndPacifier( false );
+		Msg( " (%d of %d by workers)", s_nUnitsRemote, nWorkUnits );
+
+		s_Queue.Purge();
+		s_UnitState.Purge();
+	}
+
+	s_iPhase++;
+
+	double flElapsed = Plat_FloatTime() - flStart;
+	Msg( " (%d)\n", ( int )flElapsed );
+	return flElapsed;
+}
+
+
+void Dist_WorkerDone( void )
+{
+	Msg( "Worker finished, the master does the rest.\n" );
+	CmdLib_Exit( 0 );
+}
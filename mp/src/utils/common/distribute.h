@@ -0,0 +1,63 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Spreads the work units of a compile phase over worker processes
+//			on this or other machines with plain TCP sockets.
+//
+//			The master is started with -distmaster <port> and processes work
+//			units with its own threads while it hands the rest out. Workers
+//			are the same tool with the same options and map, started with
+//			-distworker <host>:<port>. They run the compile up to each
+//			distributed phase, work on the units the master gives them and
+//			quit after the last one. A worker that disconnects or stops
+//			answering has its unit handed to someone else, and workers can
+//			join or leave at any time.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef DISTRIBUTE_H
+#define DISTRIBUTE_H
+#ifdef _WIN32
+	#pragma once
+#endif
+
+
+class CUtlBuffer;
+
+
+extern bool g_bDistributed;		// -distmaster or -distworker was given
+extern bool g_bDistWorker;		// we're a worker, the master owns the results
+
+
+// Workers process a work unit and append its results to pBuf. pBuf is NULL
+// when the master runs the work unit itself.
+typedef void ( *DistProcessFn )( int iThread, int iWorkUnit, CUtlBuffer* pBuf );
+
+// The master reads the results a worker wrote in DistProcessFn. It's called on the
+// main thread while the local threads keep processing other work units.
+typedef void ( *DistReceiveFn )( int iWorkUnit, CUtlBuffer& buf, int iWorker );
+
+// Optional, lets the master skip work units that are already done (cached results).
+typedef bool ( *DistSkipFn )( int iWorkUnit );
+
+
+// Handles -distmaster, -distworker and -disttimeout. Returns true if argv[i] was one of
+// them, with i moved to its last argument.
+bool Dist_HandleArg( int argc, char** argv, int& i );
+
+// Call once the command line is parsed. The master starts listening here.
+void Dist_Init( void );
+
+// The master only hands out work to workers that hashed the same files.
+void Dist_HashFile( const char* pFilename );
+
+// Runs a phase. The master and the workers have to run the same phases in the same
+// order. On the master this returns once every work unit has been received, on a
+// worker once the master is done with the phase. Returns the elapsed time.
+double RunDistributedWork( int nWorkUnits, DistProcessFn processFn, DistReceiveFn receiveFn, DistSkipFn skipFn = NULL );
+
+// Workers call this after their last phase. Doesn't return.
+void Dist_WorkerDone( void );
+
+
+#endif // DISTRIBUTE_H
@@ -0,0 +1,274 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Hierarchical phase timing for the compile tools, see phaseprofile.h
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cmdlib.h"
+#include "threads.h"
+#include "phaseprofile.h"
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "utlbuffer.h"
+#include "utlvector.h"
+
+
+#define MAX_PHASE_NAME			64
+
+// Rays are counted in one slot per tool thread so tracing doesn't fight over a cache line.
+#define MAX_PHASE_RAY_SLOTS		( MAX_TOOL_THREADS + 1 )
+
+struct phasethreadtime_t
+{
+	double	m_flBusyTime;
+	double	m_flIdleTime;
+	int		m_nItems;
+};
+
+struct phasenode_t
+{
+	char	m_szName[MAX_PHASE_NAME];
+	int		m_iParent;
+	int		m_nCalls;
+	double	m_flStartTime;
+	double	m_flTotalTime;
+	int64	m_nRays;
+	int64	m_nRaysAtStart;
+
+	// Summed over the RunThreadsOn calls made directly in this phase
+	int		m_nThreadRuns;
+	int		m_nWorkers;
+	phasethreadtime_t	m_Threads[MAX_TOOL_THREADS + 1];
+};
+
+struct phaseraycount_t
+{
+	int64	m_nRays;
+	byte	m_Pad[56];
+};
+
+static bool							s_bPhaseProfile = false;
+static char							s_szPhaseToolName[MAX_PHASE_NAME];
+static char							s_szPhaseFileName[MAX_PATH];
+static CUtlVector<phasenode_t>		s_PhaseNodes;		// 0 is the whole run
+static int							s_iCurrentPhase = -1;
+
+static phaseraycount_t				s_PhaseRays[MAX_PHASE_RAY_SLOTS];	// indexed by tool thread
+
+
+static int64 PhaseProfile_TotalRays()
+{
+	int64 nRays = 0;
+	for( int i = 0; i < MAX_PHASE_RAY_SLOTS; i++ )
+	{
+		nRays += s_PhaseRays[i].m_nRays;
+	}
+	return nRays;
+}
+
+static int PhaseProfile_AddNode( const char* pName, int iParent )
+{
+	int i = s_PhaseNodes.AddToTail();
+	phasenode_t& node = s_PhaseNodes[i];
+	memset( &node, 0, sizeof( node ) );
+	V_strncpy( node.m_szName, pName, sizeof( node.m_szName ) );
+	node.m_iParent = iParent;
+	return i;
+}
+
+static void PhaseProfile_StartNode( int iNode )
+{
+	phasenode_t& node = s_PhaseNodes[iNode];
+	node.m_nCalls++;
+	node.m_flStartTime = Plat_FloatTime();
+	node.m_nRaysAtStart = PhaseProfile_TotalRays();
+	s_iCurrentPhase = iNode;
+}
+
+static void PhaseProfile_StopNode( int iNode )
+{
+	phasenode_t& node = s_PhaseNodes[iNode];
+	node.m_flTotalTime += Plat_FloatTime() - node.m_flStartTime;
+	node.m_nRays += PhaseProfile_TotalRays() - node.m_nRaysAtStart;
+	s_iCurrentPhase = node.m_iParent;
+}
+
+static void PhaseProfile_Cleanup()
+{
+	PhaseProfile_Write();
+}
+
+void PhaseProfile_Init( const char* pToolName, const char* pFileName )
+{
+	if( s_bPhaseProfile )
+	{
+		return;
+	}
+
+	s_bPhaseProfile = true;
+	V_strncpy( s_szPhaseToolName, pToolName, sizeof( s_szPhaseToolName ) );
+	V_strncpy( s_szPhaseFileName, pFileName, sizeof( s_szPhaseFileName ) );
+
+	PhaseProfile_StartNode( PhaseProfile_AddNode( pToolName, -1 ) );
+
+	CmdLib_AtCleanup( PhaseProfile_Cleanup );
+}
+
+bool PhaseProfile_IsEnabled()
+{
+	return s_bPhaseProfile;
+}
+
+void PhaseProfile_Begin( const char* pName )
+{
+	if( !s_bPhaseProfile )
+	{
+		return;
+	}
+	Assert( !threaded );
+
+	// Is this phase already under the current one?
+	int iNode = -1;
+	for( int i = s_iCurrentPhase + 1; i < s_PhaseNodes.Count(); i++ )
+	{
+		if( s_PhaseNodes[i].m_iParent == s_iCurrentPhase && !Q_stricmp( s_PhaseNodes[i].m_szName, pName ) )
+		{
+			iNode = i;
+			break;
+		}
+	}
+
+	if( iNode == -1 )
+	{
+		iNode = PhaseProfile_AddNode( pName, s_iCurrentPhase );
+	}
+	PhaseProfile_StartNode( iNode );
+}
+
+void PhaseProfile_End()
+{
+	if( !s_bPhaseProfile )
+	{
+		return;
+	}
+
+	// never close the whole run here
+	if( s_iCurrentPhase <= 0 )
+	{
+		Warning( "PhaseProfile_End without PhaseProfile_Begin\n" );
+		return;
+	}
+	PhaseProfile_StopNode( s_iCurrentPhase );
+}
+
+void PhaseProfile_AddThreadStats( const ThreadWorkStats_t* pStats, int nWorkers )
+{
+	if( !s_bPhaseProfile || s_iCurrentPhase < 0 )
+	{
+		return;
+	}
+
+	phasenode_t& node = s_PhaseNodes[s_iCurrentPhase];
+	node.m_nThreadRuns++;
+	node.m_nWorkers = max( node.m_nWorkers, min( nWorkers, MAX_TOOL_THREADS + 1 ) );
+	for( int t = 0; t < nWorkers && t < MAX_TOOL_THREADS + 1; t++ )
+	{
+		node.m_Threads[t].m_flBusyTime += pStats[t].m_flBusyTime;
+		node.m_Threads[t].m_flIdleTime += pStats[t].m_flIdleTime;
+		node.m_Threads[t].m_nItems += pStats[t].m_nItems;
+	}
+}
+
+void PhaseProfile_AddRays( int nRays )
+{
+	if( !s_bPhaseProfile )
+	{
+		return;
+	}
+
+	s_PhaseRays[GetToolThreadIndex()].m_nRays += nRays;
+}
+
+static void PhaseProfile_WriteNode( CUtlBuffer& buf, int iNode, int nIndent )
+{
+	const phasenode_t& node = s_PhaseNodes[iNode];
+
+	buf.Printf( "%*s{\n", nIndent, "" );
+	buf.Printf( "%*s\"name\": \"%s\",\n", nIndent + 2, "", node.m_szName );
+	buf.Printf( "%*s\"calls\": %d,\n", nIndent + 2, "", node.m_nCalls );
+	buf.Printf( "%*s\"seconds\": %.4f,\n", nIndent + 2, "", node.m_flTotalTime );
+	buf.Printf( "%*s\"rays\": %lld,\n", nIndent + 2, "", ( long long )node.m_nRays );
+
+	double flBusy = 0.0, flIdle = 0.0;
+	for( int t = 0; t < node.m_nWorkers; t++ )
+	{
+		flBusy += node.m_Threads[t].m_flBusyTime;
+		flIdle += node.m_Threads[t].m_flIdleTime;
+	}
+	buf.Printf( "%*s\"thread_runs\": %d,\n", nIndent + 2, "", node.m_nThreadRuns );
+	buf.Printf( "%*s\"busy_seconds\": %.4f,\n", nIndent + 2, "", flBusy );
+	buf.Printf( "%*s\"idle_seconds\": %.4f,\n", nIndent + 2, "", flIdle );
+
+	buf.Printf( "%*s\"threads\": [", nIndent + 2, "" );
+	for( int t = 0; t < node.m_nWorkers; t++ )
+	{
+		buf.Printf( "%s\n%*s{ \"busy\": %.4f, \"idle\": %.4f, \"items\": %d }", t ? "," : "", nIndent + 4, "",
+					node.m_Threads[t].m_flBusyTime, node.m_Threads[t].m_flIdleTime, node.m_Threads[t].m_nItems );
+	}
+	buf.Printf( node.m_nWorkers ? "\n%*s],\n" : "%*s],\n", node.m_nWorkers ? nIndent + 2 : 0, "" );
+
+	buf.Printf( "%*s\"children\": [", nIndent + 2, "" );
+	bool bFirst = true;
+	for( int i = iNode + 1; i < s_PhaseNodes.Count(); i++ )
+	{
+		if( s_PhaseNodes[i].m_iParent != iNode )
+		{
+			continue;
+		}
+		buf.Printf( bFirst ? "\n" : ",\n" );
+		PhaseProfile_WriteNode( buf, i, nIndent + 4 );
+		bFirst = false;
+	}
+	buf.Printf( bFirst ? "%*s]\n" : "\n%*s]\n", bFirst ? 0 : nIndent + 2, "" );
+
+	buf.Printf( "%*s}", nIndent, "" );
+}
+
+void PhaseProfile_Write()
+{
+	if( !s_bPhaseProfile )
+	{
+		return;
+	}
+
+	// close whatever is still running, an Error() can leave phases open
+	while( s_iCurrentPhase >= 0 )
+	{
+		PhaseProfile_StopNode( s_iCurrentPhase );
+	}
+
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	buf.Printf( "{\n" );
+	buf.Printf( "  \"tool\": \"%s\",\n", s_szPhaseToolName );
+	buf.Printf( "  \"threads\": %d,\n", numthreads );
+	buf.Printf( "  \"phases\":\n" );
+	PhaseProfile_WriteNode( buf, 0, 2 );
+	buf.Printf( "\n}\n" );
+
+	// CmdLib_Cleanup has already shut down the file system when this runs
+	FILE* fp = fopen( s_szPhaseFileName, "wb" );
+	if( fp )
+	{
+		fwrite( buf.Base(), 1, buf.TellPut(), fp );
+		fclose( fp );
+		Msg( "Wrote phase profile to %s\n", s_szPhaseFileName );
+	}
+	else
+	{
+		Warning( "Couldn't write phase profile %s\n", s_szPhaseFileName );
+	}
+
+	// only once
+	s_bPhaseProfile = false;
+}
@@ -0,0 +1,55 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Hierarchical timing of the compile tool phases. With -phaseprofile
+//			<file> the tools write the wall time, rays traced and per thread
+//			busy/idle time of every phase to <file> as JSON when they exit.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef PHASEPROFILE_H
+#define PHASEPROFILE_H
+#ifdef _WIN32
+	#pragma once
+#endif
+
+
+struct ThreadWorkStats_t;
+
+
+// Turns profiling on, the file is written from CmdLib_Cleanup. Until this is called
+// everything else here does nothing.
+void PhaseProfile_Init( const char* pToolName, const char* pFileName );
+bool PhaseProfile_IsEnabled();
+
+// Phases nest, and phases with the same name under the same parent are added together.
+// Only call these from the main thread, outside of RunThreadsOn.
+void PhaseProfile_Begin( const char* pName );
+void PhaseProfile_End();
+
+// Called by the thread scheduler at the end of each RunThreadsOn.
+void PhaseProfile_AddThreadStats( const ThreadWorkStats_t* pStats, int nWorkers );
+
+// Safe to call from the main thread and the RunThreadsOn/RunThreads_Start workers.
+void PhaseProfile_AddRays( int nRays );
+
+// Writes the file now, instead of at cleanup.
+void PhaseProfile_Write();
+
+
+// Times a phase for the rest of the scope
+class CPhaseProfileScope
+{
+public:
+	CPhaseProfileScope( const char* pName )
+	{
+		PhaseProfile_Begin( pName );
+	}
+	~CPhaseProfileScope()
+	{
+		PhaseProfile_End();
+	}
+};
+
+
+#endif // PHASEPROFILE_H
@@ -13,12 +13,12 @@
 #include "worldsize.h"
 #include "threads.h"
 #include "tier0/dbg.h"
+#include "tier1/sizeclassalloc.h"
 
 // doesn't seem to need to be here? -- in threads.h
 //extern int numthreads;
 
-// counters are only bumped when running single threaded,
-// because they are an awefull coherence problem
+// counters are bumped with interlocked ops, the tools split windings on every thread
 int	c_active_windings;
 int	c_peak_windings;
 int	c_winding_allocs;
@@ -33,39 +33,24 @@ void pw( winding_t* w )
 	}
 }
 
-winding_t* winding_pool[MAX_POINTS_ON_WINDING + 4];
-
 /*
 =============
 AllocWinding
+
+The points follow the winding in the same block. Blocks come from the
+calling thread's size-class pool, so worker threads don't serialize on
+ThreadLock for every split.
 =============
 */
 winding_t* AllocWinding( int points )
 {
 	winding_t*	w;
 
-	if( numthreads == 1 )
-	{
-		c_winding_allocs++;
-		c_winding_points += points;
-		c_active_windings++;
-		if( c_active_windings > c_peak_windings )
-		{
-			c_peak_windings = c_active_windings;
-		}
-	}
-	ThreadLock();
-	if( winding_pool[points] )
-	{
-		w = winding_pool[points];
-		winding_pool[points] = w->next;
-	}
-	else
-	{
-		w = ( winding_t* )malloc( sizeof( *w ) );
-		w->p = ( Vector* )calloc( points, sizeof( Vector ) );
-	}
-	ThreadUnlock();
+	ThreadInterlockedIncrement( &c_winding_allocs );
+	ThreadInterlockedExchangeAdd( &c_winding_points, points );
+	ThreadUpdatePeak( &c_peak_windings, ThreadInterlockedIncrement( &c_active_windings ) );
+	w = ( winding_t* )CSizeClassAllocator::Alloc( sizeof( winding_t ) + points * sizeof( Vector ) );
+	w->p = ( Vector* )( w + 1 );
 	w->numpoints = 0; // None are occupied yet even though allocated.
 	w->maxpoints = points;
 	w->next = NULL;
@@ -79,11 +64,8 @@ void FreeWinding( winding_t* w )
 		Error( "FreeWinding: freed a freed winding" );
 	}
 
-	ThreadLock();
 	w->numpoints = 0xdeaddead; // flag as freed
-	w->next = winding_pool[w->maxpoints];
-	winding_pool[w->maxpoints] = w;
-	ThreadUnlock();
+	CSizeClassAllocator::Free( w );
 }
 
 /*
@@ -121,10 +103,7 @@ void RemoveColinearPoints( winding_t* w )
 		return;
 	}
 
-	if( numthreads == 1 )
-	{
-		c_removed += w->numpoints - nump;
-	}
+	ThreadInterlockedExchangeAdd( &c_removed, w->numpoints - nump );
 	w->numpoints = nump;
 	memcpy( w->p, p, nump * sizeof( p[0] ) );
 }
@@ -17,20 +17,17 @@
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "phaseprofile.h"
+#include "tier1/sizeclassalloc.h"
 
 #ifdef _WIN32
 	#include <windows.h>
 #else
 	#include <pthread.h>
+	#include <unistd.h>
 #endif
 
-#ifdef MAPBASE
-	// This was suggested in that Source 2013 pull request that fixed Vrad.
-	// I trust their judgement on this.
-	#define	MAX_THREADS	32
-#else
-	#define	MAX_THREADS	16
-#endif
+#define	MAX_THREADS	MAX_TOOL_THREADS
 
 
 class CRunThreadsData
@@ -44,7 +41,6 @@ public:
 CRunThreadsData g_RunThreadsData[MAX_THREADS];
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
@@ -54,6 +50,235 @@ bool g_bLowPriorityThreads = false;
 HANDLE g_ThreadHandles[MAX_THREADS];
 
 
+/*
+===================================================================
+
+WORK-STEALING SCHEDULER
+
+Every worker owns a contiguous range [head, tail) of g_WorkOrder. Items are
+dealt to the workers up front so each range carries about the same total cost,
+and the original item order is kept within a range so callers that sort their
+work (vvis sorts portals by mightsee) still progress from cheap to expensive.
+
+A worker claims cost-weighted chunks from the front of its own range. Once its
+range is empty it steals the back half of the range with the most cost left.
+No work is ever added after the start, so a worker that finds every range empty
+is done.
+
+===================================================================
+*/
+
+// How many chunks each worker's share is split into. Higher values balance better
+// at the end of a run but take the queue lock more often.
+#define WORK_CHUNKS_PER_THREAD	32
+
+struct CThreadWorkQueue
+{
+	CThreadFastMutex	m_Mutex;
+	volatile int		m_iHead;
+	volatile int		m_iTail;
+
+	// Chunk being worked on, only touched by the owning thread.
+	int		m_iChunkCur;
+	int		m_iChunkEnd;
+
+	double	m_flLastClaimTime;
+	double	m_flFinishTime;
+	ThreadWorkStats_t	m_Stats;
+
+	byte	m_Pad[64];	// keep queues on separate cache lines
+};
+
+static CThreadWorkQueue		g_WorkQueues[MAX_TOOL_THREADS + 1];
+static ThreadWorkStats_t	g_WorkStats[MAX_TOOL_THREADS + 1];
+static int					g_nWorkStatsWorkers;
+
+static CUtlVector<int>		g_WorkOrder;		// work item indices, grouped by initial owner
+static CUtlVector<double>	g_WorkCostSum;		// prefix sums of item costs over g_WorkOrder
+static double				g_flWorkChunkCost;
+static volatile int			g_nWorkClaimed;
+static CThreadFastMutex		g_PacifierMutex;
+
+// 1-based index of the worker running on this thread, 0 for the main thread.
+static CTHREADLOCALINT		g_iThreadWorker;
+
+static inline double WorkRangeCost( int iStart, int iEnd )
+{
+	return g_WorkCostSum[iEnd] - g_WorkCostSum[iStart];
+}
+
+static void WorkQueue_Init( int workcnt, int nWorkers, ThreadWorkCostFn costFn )
+{
+	CUtlVector<float> costs;
+	costs.SetCount( workcnt );
+	for( int i = 0; i < workcnt; i++ )
+	{
+		costs[i] = costFn ? max( costFn( i ), 1.0f ) : 1.0f;
+	}
+
+	// Deal the items to whichever worker has the least cost so far. Items stay
+	// in their original relative order inside each worker's range.
+	CUtlVector<int> owner;
+	owner.SetCount( workcnt );
+	int counts[MAX_TOOL_THREADS + 1];
+	double load[MAX_TOOL_THREADS + 1];
+	for( int t = 0; t < nWorkers; t++ )
+	{
+		counts[t] = 0;
+		load[t] = 0.0;
+	}
+
+	for( int i = 0; i < workcnt; i++ )
+	{
+		int iBest = 0;
+		for( int t = 1; t < nWorkers; t++ )
+		{
+			if( load[t] < load[iBest] )
+			{
+				iBest = t;
+			}
+		}
+		owner[i] = iBest;
+		load[iBest] += costs[i];
+		counts[iBest]++;
+	}
+
+	g_WorkOrder.SetCount( workcnt );
+	g_WorkCostSum.SetCount( workcnt + 1 );
+
+	int iStart = 0;
+	for( int t = 0; t <= MAX_TOOL_THREADS; t++ )
+	{
+		CThreadWorkQueue& queue = g_WorkQueues[t];
+		int nCount = ( t < nWorkers ) ? counts[t] : 0;
+		queue.m_iHead = queue.m_iTail = iStart;
+		queue.m_iChunkCur = queue.m_iChunkEnd = 0;
+		queue.m_flLastClaimTime = queue.m_flFinishTime = 0.0;
+		memset( &queue.m_Stats, 0, sizeof( queue.m_Stats ) );
+		iStart += nCount;
+	}
+
+	for( int i = 0; i < workcnt; i++ )
+	{
+		CThreadWorkQueue& queue = g_WorkQueues[owner[i]];
+		g_WorkOrder[queue.m_iTail++] = i;
+	}
+
+	double flTotal = 0.0;
+	g_WorkCostSum[0] = 0.0;
+	for( int i = 0; i < workcnt; i++ )
+	{
+		flTotal += costs[g_WorkOrder[i]];
+		g_WorkCostSum[i + 1] = flTotal;
+	}
+
+	g_flWorkChunkCost = flTotal / ( nWorkers * WORK_CHUNKS_PER_THREAD );
+	g_nWorkClaimed = 0;
+}
+
+// Returns the first index in [iStart, iEnd] whose prefix cost reaches flCost.
+static int WorkRangeFind( int iStart, int iEnd, double flCost )
+{
+	while( iStart < iEnd )
+	{
+		int iMid = ( iStart + iEnd ) / 2;
+		if( g_WorkCostSum[iMid] >= flCost )
+		{
+			iEnd = iMid;
+		}
+		else
+		{
+			iStart = iMid + 1;
+		}
+	}
+	return iStart;
+}
+
+// Takes a cost-weighted chunk off the front of the queue. Assumes the queue is locked.
+static bool WorkQueue_ClaimChunk( CThreadWorkQueue& queue, int& iChunkStart, int& iChunkEnd )
+{
+	int iHead = queue.m_iHead;
+	int iTail = queue.m_iTail;
+	if( iHead >= iTail )
+	{
+		return false;
+	}
+
+	// Shortest run from the head that covers the chunk cost, at least one item.
+	iChunkStart = iHead;
+	iChunkEnd = WorkRangeFind( iHead + 1, iTail, g_WorkCostSum[iHead] + g_flWorkChunkCost );
+	queue.m_iHead = iChunkEnd;
+	return true;
+}
+
+// Moves the back half of the fullest other queue into the (empty) queue of iWorker.
+static bool WorkQueue_Steal( int iWorker )
+{
+	while( 1 )
+	{
+		int iVictim = -1;
+		double flBestCost = 0.0;
+		for( int t = 0; t <= MAX_TOOL_THREADS; t++ )
+		{
+			if( t == iWorker )
+			{
+				continue;
+			}
+
+			// Unlocked peek, only used to pick a victim.
+			int iHead = g_WorkQueues[t].m_iHead;
+			int iTail = g_WorkQueues[t].m_iTail;
+			if( iTail > iHead )
+			{
+				double flCost = WorkRangeCost( iHead, iTail );
+				if( flCost > flBestCost )
+				{
+					flBestCost = flCost;
+					iVictim = t;
+				}
+			}
+		}
+
+		if( iVictim == -1 )
+		{
+			return false;
+		}
+
+		CThreadWorkQueue& victim = g_WorkQueues[iVictim];
+		victim.m_Mutex.Lock();
+		int iHead = victim.m_iHead;
+		int iTail = victim.m_iTail;
+		if( iHead >= iTail )
+		{
+			// Drained while we were looking; pick again.
+			victim.m_Mutex.Unlock();
+			continue;
+		}
+
+		// Split by cost so the thief doesn't walk off with all the expensive items.
+		// A lone item that the owner hasn't claimed yet is taken whole.
+		int iSplit = iHead;
+		if( iTail - iHead > 1 )
+		{
+			iSplit = WorkRangeFind( iHead + 1, iTail - 1, ( g_WorkCostSum[iHead] + g_WorkCostSum[iTail] ) * 0.5 );
+		}
+		victim.m_iTail = iSplit;
+		victim.m_Mutex.Unlock();
+
+		CThreadWorkQueue& queue = g_WorkQueues[iWorker];
+		queue.m_Mutex.Lock();
+		queue.m_iHead = iSplit;
+		queue.m_iTail = iTail;
+		queue.m_Mutex.Unlock();
+		return true;
+	}
+}
+
+int	GetToolThreadIndex( void )
+{
+	int iWorker = g_iThreadWorker - 1;
+	return iWorker < 0 ? THREADINDEX_MAIN : iWorker;
+}
 
 /*
 =============
@@ -63,23 +288,108 @@ GetThreadWork
 */
 int	GetThreadWork( void )
 {
-	int	r;
+	int iWorker = GetToolThreadIndex();
+	CThreadWorkQueue& queue = g_WorkQueues[iWorker];
+	if( queue.m_iChunkCur < queue.m_iChunkEnd )
+	{
+		queue.m_Stats.m_nItems++;
+		return g_WorkOrder[queue.m_iChunkCur++];
+	}
+
+	double flStart = Plat_FloatTime();
+	if( queue.m_flLastClaimTime != 0.0 )
+	{
+		queue.m_Stats.m_flBusyTime += flStart - queue.m_flLastClaimTime;
+	}
+
+	int iChunkStart = 0, iChunkEnd = 0;
+	bool bClaimed = false;
+	while( !bClaimed )
+	{
+		queue.m_Mutex.Lock();
+		bClaimed = WorkQueue_ClaimChunk( queue, iChunkStart, iChunkEnd );
+		queue.m_Mutex.Unlock();
 
-	ThreadLock();
+		if( bClaimed )
+		{
+			queue.m_Stats.m_nChunks++;
+		}
+		else if( WorkQueue_Steal( iWorker ) )
+		{
+			queue.m_Stats.m_nSteals++;
+		}
+		else
+		{
+			break;
+		}
+	}
 
-	if( dispatch == workcount )
+	double flEnd = Plat_FloatTime();
+	queue.m_Stats.m_flIdleTime += flEnd - flStart;
+	queue.m_flLastClaimTime = flEnd;
+
+	if( !bClaimed )
 	{
-		ThreadUnlock();
+		queue.m_flFinishTime = flEnd;
 		return -1;
 	}
 
-	UpdatePacifier( ( float )dispatch / workcount );
+	int nClaimed = ThreadInterlockedExchangeAdd( &g_nWorkClaimed, iChunkEnd - iChunkStart ) + ( iChunkEnd - iChunkStart );
+	if( g_PacifierMutex.TryLock() )
+	{
+		UpdatePacifier( ( float )nClaimed / workcount );
+		g_PacifierMutex.Unlock();
+	}
+
+	queue.m_iChunkCur = iChunkStart + 1;
+	queue.m_iChunkEnd = iChunkEnd;
+	queue.m_Stats.m_nItems++;
+	return g_WorkOrder[iChunkStart];
+}
+
+static void WorkQueue_Finish( int nWorkers, double flStartTime, double flEndTime )
+{
+	g_nWorkStatsWorkers = nWorkers;
+	for( int t = 0; t < nWorkers; t++ )
+	{
+		CThreadWorkQueue& queue = g_WorkQueues[t];
+		g_WorkStats[t] = queue.m_Stats;
+
+		// Time between this worker running dry and the last worker finishing is idle too.
+		double flFinish = queue.m_flFinishTime != 0.0 ? queue.m_flFinishTime : flEndTime;
+		g_WorkStats[t].m_flIdleTime += flEndTime - flFinish;
+
+		// Workers that drive their own loop through RunThreadsOn may never ask for work.
+		if( queue.m_flLastClaimTime == 0.0 )
+		{
+			g_WorkStats[t].m_flBusyTime = flEndTime - flStartTime;
+		}
+	}
+
+	double flBusy = 0.0, flIdle = 0.0;
+	int nSteals = 0;
+	for( int t = 0; t < nWorkers; t++ )
+	{
+		const ThreadWorkStats_t& stats = g_WorkStats[t];
+		qprintf( "  thread %2d: %6d items %4d chunks %4d steals  busy %7.2fs  idle %7.2fs\n",
+				 t, stats.m_nItems, stats.m_nChunks, stats.m_nSteals, stats.m_flBusyTime, stats.m_flIdleTime );
+		flBusy += stats.m_flBusyTime;
+		flIdle += stats.m_flIdleTime;
+		nSteals += stats.m_nSteals;
+	}
+
+	if( flBusy + flIdle > 0.0 )
+	{
+		qprintf( "  %.1f%% busy, %d steals\n", flBusy * 100.0 / ( flBusy + flIdle ), nSteals );
+	}
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock();
+	PhaseProfile_AddThreadStats( g_WorkStats, nWorkers );
+}
 
-	return r;
+const ThreadWorkStats_t* GetThreadWorkStats( int& nWorkers )
+{
+	nWorkers = g_nWorkStatsWorkers;
+	return g_WorkStats;
 }
 
 
@@ -101,7 +411,7 @@ void ThreadWorkerFunction( int iThread, void* pUserData )
 	}
 }
 
-void RunThreadsOnIndividual( int workcnt, qboolean showpacifier, ThreadWorkerFn func )
+void RunThreadsOnIndividual( int workcnt, qboolean showpacifier, ThreadWorkerFn func, ThreadWorkCostFn costFn )
 {
 	if( numthreads == -1 )
 	{
@@ -109,7 +419,7 @@ void RunThreadsOnIndividual( int workcnt, qboolean showpacifier, ThreadWorkerFn
 	}
 
 	workfunction = func;
-	RunThreadsOn( workcnt, showpacifier, ThreadWorkerFunction );
+	RunThreadsOn( workcnt, showpacifier, ThreadWorkerFunction, NULL, costFn );
 }
 
 
@@ -156,15 +466,32 @@ void ThreadSetDefault( void )
 	{
 		GetSystemInfo( &info );
 		numthreads = info.dwNumberOfProcessors;
-		if( numthreads < 1 || numthreads > 32 )
+		if( numthreads < 1 )
 		{
 			numthreads = 1;
 		}
+		else if( numthreads > MAX_TOOL_THREADS )
+		{
+			numthreads = MAX_TOOL_THREADS;
+		}
 	}
 
 	Msg( "%i threads\n", numthreads );
 #else
-	numthreads = 8; /* Not porting the above shit yet, sorry */
+	if( numthreads == -1 )	// not set manually
+	{
+		numthreads = sysconf( _SC_NPROCESSORS_ONLN );
+		if( numthreads < 1 )
+		{
+			numthreads = 1;
+		}
+		else if( numthreads > MAX_TOOL_THREADS )
+		{
+			numthreads = MAX_TOOL_THREADS;
+		}
+	}
+
+	Msg( "%i threads\n", numthreads );
 #endif
 }
 
@@ -198,6 +525,21 @@ void ThreadUnlock( void )
 }
 
 
+void ThreadUpdatePeak( int volatile* pPeak, int nValue )
+{
+	int nPeak = *pPeak;
+	while( nValue > nPeak )
+	{
+		int nPrev = ThreadInterlockedCompareExchange( pPeak, nValue, nPeak );
+		if( nPrev == nPeak )
+		{
+			break;
+		}
+		nPeak = nPrev;
+	}
+}
+
+
 // This runs in the thread and dispatches a RunThreadsFn call.
 #ifdef _WIN32
 	DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
@@ -206,7 +548,12 @@ void ThreadUnlock( void )
 #endif
 {
 	CRunThreadsData* pData = ( CRunThreadsData* )pParameter;
+	g_iThreadWorker = pData->m_iThread + 1;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	g_iThreadWorker = 0;
+
+	// the thread is about to exit, let the next worker have its pooled blocks
+	CSizeClassAllocator::ReleaseThreadCache();
 	return 0;
 }
 
@@ -281,12 +628,11 @@ void RunThreads_End()
 RunThreadsOn
 =============
 */
-void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void* pUserData )
+void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void* pUserData, ThreadWorkCostFn costFn )
 {
 	int		start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
 	StartPacifier( "" );
 	pacifier = showpacifier;
@@ -298,8 +644,17 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void* pU
 #endif
 
 
+	if( numthreads > MAX_TOOL_THREADS )
+	{
+		numthreads = MAX_TOOL_THREADS;
+	}
+
+	WorkQueue_Init( workcnt, numthreads, costFn );
+
+	double flStart = Plat_FloatTime();
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
+	WorkQueue_Finish( numthreads, flStart, Plat_FloatTime() );
 
 
 	end = Plat_FloatTime();
@@ -15,26 +15,31 @@
 #define THREADS_H
 #pragma once
 
-#ifdef MAPBASE
-	// This was suggested in that Source 2013 pull request that fixed Vrad.
-	// I trust their judgement on this.
-	#define MAX_TOOL_THREADS	32
-#else
-	// Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
-	// large so THREADINDEX_MAIN can be used from the main thread.
-	#define MAX_TOOL_THREADS	16
-#endif
+// Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
+// large so THREADINDEX_MAIN can be used from the main thread.
+// 64 is as many handles as WaitForMultipleObjects waits on, and as many
+// processors as Windows reports in one processor group.
+#define MAX_TOOL_THREADS	64
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
 extern	int		numthreads;
 
+// True while RunThreadsOn's workers are running. The pool can't be entered again
+// from a worker, so code that can run either way uses this to stay serial.
+extern	qboolean	threaded;
+
 // If set to true, then all the threads that are created are low priority.
 extern bool	g_bLowPriorityThreads;
 
 typedef void ( *ThreadWorkerFn )( int iThread, int iWorkItem );
 typedef void ( *RunThreadsFn )( int iThread, void* pUserData );
 
+// Optional estimate of how expensive a work item is (in arbitrary units, clamped to >= 1).
+// The scheduler uses it to balance the initial split between workers and to size chunk
+// claims, so cheap items are handed out in bulk and expensive ones one at a time.
+typedef float ( *ThreadWorkCostFn )( int iWorkItem );
+
 
 enum ERunThreadsPriority
 {
@@ -47,12 +52,30 @@ enum ERunThreadsPriority
 // Put the process into an idle priority class so it doesn't hog the UI.
 void SetLowPriority();
 
+// Per-worker statistics gathered by the scheduler for the last RunThreadsOn call.
+struct ThreadWorkStats_t
+{
+	double	m_flBusyTime;		// seconds spent running work items
+	double	m_flIdleTime;		// seconds spent looking for work or waiting for the other workers
+	int		m_nItems;			// work items processed
+	int		m_nChunks;			// chunks claimed from the worker's own queue
+	int		m_nSteals;			// successful steals from other workers' queues
+};
+
 void ThreadSetDefault( void );
 int	GetThreadWork( void );
 
-void RunThreadsOnIndividual( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
+// The iThread that RunThreadsOn/RunThreads_Start passed to the worker running this code,
+// or THREADINDEX_MAIN on the main thread. Threads started some other way get
+// THREADINDEX_MAIN too, so they must not use it to index per thread data.
+int	GetToolThreadIndex( void );
+
+void RunThreadsOnIndividual( int workcnt, qboolean showpacifier, ThreadWorkerFn fn, ThreadWorkCostFn costFn = NULL );
 
-void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void* pUserData = NULL );
+void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void* pUserData = NULL, ThreadWorkCostFn costFn = NULL );
+
+// Returns the stats of the last scheduled run (indexed by thread) and the number of workers.
+const ThreadWorkStats_t* GetThreadWorkStats( int& nWorkers );
 
 // This version doesn't track work items - it just runs your function and waits for it to finish.
 void RunThreads_Start( RunThreadsFn fn, void* pUserData, ERunThreadsPriority ePriority = k_eRunThreadsPriority_UseGlobalState );
@@ -61,10 +84,13 @@ void RunThreads_End();
 void ThreadLock( void );
 void ThreadUnlock( void );
 
+// Raises *pPeak to nValue if it's lower. For the peak counters that any thread can bump.
+void ThreadUpdatePeak( int volatile* pPeak, int nValue );
+
 
 #ifndef NO_THREAD_NAMES
-	#define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
-	#define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
+	#define RunThreadsOn(n,p,f,...) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f,##__VA_ARGS__); }
+	#define RunThreadsOnIndividual(n,p,f,...) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f,##__VA_ARGS__); }
 #endif
 
 #endif // THREADS_H
@@ -7,6 +7,8 @@
 //=============================================================================//
 
 #include "vbsp.h"
+#include "tier1/utlvector.h"
+#include "phaseprofile.h"
 
 
 int		c_nodes;
@@ -348,11 +350,9 @@ node_t* AllocNode( void )
 
 	node = ( node_t* )malloc( sizeof( *node ) );
 	memset( node, 0, sizeof( *node ) );
-	node->id = s_NodeCount;
+	node->id = ThreadInterlockedIncrement( &s_NodeCount ) - 1;
 	node->diskId = -1;
 
-	s_NodeCount++;
-
 	return node;
 }
 
@@ -372,11 +372,8 @@ bspbrush_t* AllocBrush( int numsides )
 	c = ( int ) & ( ( ( bspbrush_t* )0 )->sides[numsides] );
 	bb = ( bspbrush_t* )malloc( c );
 	memset( bb, 0, c );
-	bb->id = s_BrushId++;
-	if( numthreads == 1 )
-	{
-		c_active_brushes++;
-	}
+	bb->id = ThreadInterlockedIncrement( &s_BrushId ) - 1;
+	ThreadInterlockedIncrement( &c_active_brushes );
 	return bb;
 }
 
@@ -395,10 +392,7 @@ void FreeBrush( bspbrush_t* brushes )
 			FreeWinding( brushes->sides[i].winding );
 		}
 	free( brushes );
-	if( numthreads == 1 )
-	{
-		c_active_brushes--;
-	}
+	ThreadInterlockedDecrement( &c_active_brushes );
 }
 
 
@@ -944,6 +938,147 @@ qboolean CheckPlaneAgainstVolume( int pnum, node_t* node )
 	return good;
 }
 
+/*
+================
+EvaluateSplitPlane
+
+Gives a value estimate for splitting the brushes with pnum, which came
+from side. When bMarkSides is set, the side test is saved in each brush's
+testside and sides that lie on the plane are flagged as tested so they
+aren't tried again. Parallel scoring leaves the brushes alone.
+================
+*/
+static int EvaluateSplitPlane( bspbrush_t* brushes, side_t* side, int pnum, bool bMarkSides )
+{
+	bspbrush_t*	test;
+	int			j, s;
+	int			value;
+	int			front, back, both, facing, splits;
+	int			bsplits;
+	int			epsilonbrush;
+	qboolean	hintsplit = false;
+
+	front = 0;
+	back = 0;
+	both = 0;
+	facing = 0;
+	splits = 0;
+	epsilonbrush = 0;
+
+	for( test = brushes ; test ; test = test->next )
+	{
+		s = TestBrushToPlanenum( test, pnum, &bsplits, &hintsplit, &epsilonbrush );
+
+		splits += bsplits;
+		if( bsplits && ( s & PSIDE_FACING ) )
+		{
+			Error( "PSIDE_FACING with splits" );
+		}
+
+		if( bMarkSides )
+		{
+			test->testside = s;
+		}
+		// if the brush shares this face, don't bother
+		// testing that facenum as a splitter again
+		if( s & PSIDE_FACING )
+		{
+			facing++;
+			if( bMarkSides )
+			{
+				for( j = 0 ; j < test->numsides ; j++ )
+				{
+					if( ( test->sides[j].planenum & ~1 ) == pnum )
+					{
+						test->sides[j].tested = true;
+					}
+				}
+			}
+		}
+		if( s & PSIDE_FRONT )
+		{
+			front++;
+		}
+		if( s & PSIDE_BACK )
+		{
+			back++;
+		}
+		if( s == PSIDE_BOTH )
+		{
+			both++;
+		}
+	}
+
+	// give a value estimate for using this plane
+	value =  5 * facing - 5 * splits - abs( front - back );
+//	value =  -5*splits;
+//	value =  5*facing - 5*splits;
+	if( g_MainMap->mapplanes[pnum].type < 3 )
+	{
+		value += 5;    // axial is better
+	}
+	value -= epsilonbrush * 1000;	// avoid!
+
+	// trans should split last
+	if( side->surf & SURF_TRANS )
+	{
+		value -= 500;
+	}
+
+	// never split a hint side except with another hint
+	if( hintsplit && !( side->surf & SURF_HINT ) )
+	{
+		value = -9999999;
+	}
+
+	// water should split first
+	if( side->contents & ( CONTENTS_WATER | CONTENTS_SLIME ) )
+	{
+		value = 9999999;
+	}
+
+	return value;
+}
+
+
+//-----------------------------------------------------------------------------
+// Runs fn on every work item with the tool threads. RunThreadsOn would restart
+// the pacifier of the phase we're called from, so this hands out the items
+// itself, in order.
+//-----------------------------------------------------------------------------
+struct brushbspwork_t
+{
+	ThreadWorkerFn	m_Fn;
+	int				m_nItems;
+	int volatile	m_iNextItem;
+};
+
+static void BrushBSPWork_Thread( int iThread, void* pUserData )
+{
+	brushbspwork_t* pWork = ( brushbspwork_t* )pUserData;
+	while( 1 )
+	{
+		int iItem = ThreadInterlockedIncrement( &pWork->m_iNextItem ) - 1;
+		if( iItem >= pWork->m_nItems )
+		{
+			break;
+		}
+		pWork->m_Fn( iThread, iItem );
+	}
+}
+
+static void RunBrushBSPWork( int nItems, ThreadWorkerFn fn )
+{
+	brushbspwork_t work;
+	work.m_Fn = fn;
+	work.m_nItems = nItems;
+	work.m_iNextItem = 0;
+
+	RunThreads_Start( BrushBSPWork_Thread, &work );
+	RunThreads_End();
+}
+
+
 /*
 ================
 SelectSplitSide
@@ -959,18 +1094,11 @@ side_t* SelectSplitSide( bspbrush_t* brushes, node_t* node )
 	int			value, bestvalue;
 	bspbrush_t*	brush, *test;
 	side_t*		side, *bestside;
-	int			i, j, pass, numpasses;
+	int			i, pass, numpasses;
 	int			pnum;
-	int			s;
-	int			front, back, both, facing, splits;
-	int			bsplits;
-	int			bestsplits;
-	int			epsilonbrush;
-	qboolean	hintsplit = false;
 
 	bestside = NULL;
 	bestvalue = -99999;
-	bestsplits = 0;
 
 	// the search order goes: visible-structural, nonvisible-structural
 	// If any valid plane is available in a pass, no further
@@ -1019,78 +1147,7 @@ side_t* SelectSplitSide( bspbrush_t* brushes, node_t* node )
 					continue;    // would produce a tiny volume
 				}
 
-				front = 0;
-				back = 0;
-				both = 0;
-				facing = 0;
-				splits = 0;
-				epsilonbrush = 0;
-
-				for( test = brushes ; test ; test = test->next )
-				{
-					s = TestBrushToPlanenum( test, pnum, &bsplits, &hintsplit, &epsilonbrush );
-
-					splits += bsplits;
-					if( bsplits && ( s & PSIDE_FACING ) )
-					{
-						Error( "PSIDE_FACING with splits" );
-					}
-
-					test->testside = s;
-					// if the brush shares this face, don't bother
-					// testing that facenum as a splitter again
-					if( s & PSIDE_FACING )
-					{
-						facing++;
-						for( j = 0 ; j < test->numsides ; j++ )
-						{
-							if( ( test->sides[j].planenum & ~1 ) == pnum )
-							{
-								test->sides[j].tested = true;
-							}
-						}
-					}
-					if( s & PSIDE_FRONT )
-					{
-						front++;
-					}
-					if( s & PSIDE_BACK )
-					{
-						back++;
-					}
-					if( s == PSIDE_BOTH )
-					{
-						both++;
-					}
-				}
-
-				// give a value estimate for using this plane
-				value =  5 * facing - 5 * splits - abs( front - back );
-//					value =  -5*splits;
-//					value =  5*facing - 5*splits;
-				if( g_MainMap->mapplanes[pnum].type < 3 )
-				{
-					value += 5;    // axial is better
-				}
-				value -= epsilonbrush * 1000;	// avoid!
-
-				// trans should split last
-				if( side->surf & SURF_TRANS )
-				{
-					value -= 500;
-				}
-
-				// never split a hint side except with another hint
-				if( hintsplit && !( side->surf & SURF_HINT ) )
-				{
-					value = -9999999;
-				}
-
-				// water should split first
-				if( side->contents & ( CONTENTS_WATER | CONTENTS_SLIME ) )
-				{
-					value = 9999999;
-				}
+				value = EvaluateSplitPlane( brushes, side, pnum, true );
 
 				// save off the side test so we don't need
 				// to recalculate it when we actually seperate
@@ -1099,7 +1156,6 @@ side_t* SelectSplitSide( bspbrush_t* brushes, node_t* node )
 				{
 					bestvalue = value;
 					bestside = side;
-					bestsplits = splits;
 					for( test = brushes ; test ; test = test->next )
 					{
 						test->side = test->testside;
@@ -1114,10 +1170,7 @@ side_t* SelectSplitSide( bspbrush_t* brushes, node_t* node )
 		{
 			if( pass > 0 )
 			{
-				if( numthreads == 1 )
-				{
-					c_nonvis++;
-				}
+				ThreadInterlockedIncrement( &c_nonvis );
 			}
 			break;
 		}
@@ -1496,25 +1549,20 @@ void SplitBrushList( bspbrush_t* brushes,
 
 /*
 ================
-BuildTree_r
+SplitTreeNode
+
+Picks the split plane for node and divides its brushes between two new
+children. Returns false and makes node a leaf if nothing can split it.
+SplitTreeNodeOnSide does the same with a side that was already picked,
+which has left the side test of the plane in each brush.
 ================
 */
-
-
-node_t* BuildTree_r( node_t* node, bspbrush_t* brushes )
+static bool SplitTreeNodeOnSide( node_t* node, bspbrush_t* brushes, side_t* bestside, bspbrush_t** children )
 {
 	node_t*		newnode;
-	side_t*		bestside;
 	int			i;
-	bspbrush_t*	children[2];
-
-	if( numthreads == 1 )
-	{
-		c_nodes++;
-	}
 
-	// find the best plane to use as a splitter
-	bestside = SelectSplitSide( brushes, node );
+	ThreadInterlockedIncrement( &c_nodes );
 
 	if( !bestside )
 	{
@@ -1522,7 +1570,7 @@ node_t* BuildTree_r( node_t* node, bspbrush_t* brushes )
 		node->side = NULL;
 		node->planenum = -1;
 		LeafNode( node, brushes );
-		return node;
+		return false;
 	}
 
 	// this is a splitplane node
@@ -1543,6 +1591,32 @@ node_t* BuildTree_r( node_t* node, bspbrush_t* brushes )
 	SplitBrush( node->volume, node->planenum, &node->children[0]->volume,
 				&node->children[1]->volume );
 
+	return true;
+}
+
+static bool SplitTreeNode( node_t* node, bspbrush_t* brushes, bspbrush_t** children )
+{
+	// find the best plane to use as a splitter
+	side_t* bestside = SelectSplitSide( brushes, node );
+	return SplitTreeNodeOnSide( node, brushes, bestside, children );
+}
+
+
+/*
+================
+BuildTree_r
+================
+*/
+node_t* BuildTree_r( node_t* node, bspbrush_t* brushes )
+{
+	int			i;
+	bspbrush_t*	children[2];
+
+	if( !SplitTreeNode( node, brushes, children ) )
+	{
+		return node;
+	}
+
 	// recursively process children
 	for( i = 0 ; i < 2 ; i++ )
 	{
@@ -1553,6 +1627,287 @@ node_t* BuildTree_r( node_t* node, bspbrush_t* brushes )
 }
 
 
+//-----------------------------------------------------------------------------
+// The two sides of a split never touch each other's brushes or nodes, so once
+// the top of the tree is split there are independent subtrees to build on
+// every thread. The tree comes out the same as from BuildTree_r.
+//
+// The top is split a round at a time: every subtree with at least half the
+// brushes of the largest one is split in the round, and the candidate planes
+// of all of them are scored by the threads in one run per pass.
+//-----------------------------------------------------------------------------
+#define SUBTREES_PER_THREAD		8
+#define SUBTREE_MIN_BRUSHES		32
+
+struct subtree_t
+{
+	node_t*		m_pNode;
+	bspbrush_t*	m_pBrushes;
+	int			m_nBrushes;
+
+	// the split picked for this round
+	bool		m_bSplitting;
+	side_t*		m_pBestSide;
+	int			m_nBestValue;
+	int			m_nBestPlane;
+
+	// where this subtree's candidates are in s_SplitCandidates
+	int			m_iFirstCandidate;
+	int			m_nCandidates;
+};
+
+struct splitcandidate_t
+{
+	int		m_iSubtree;
+	side_t*	m_pSide;
+	int		m_nPlane;
+	int		m_nValue;
+	bool	m_bValid;		// false if the plane would produce a tiny volume
+};
+
+static CUtlVector<subtree_t>			s_Subtrees;
+static CUtlVector<splitcandidate_t>		s_SplitCandidates;
+
+static void AddSubtree( CUtlVector<subtree_t>& subtrees, node_t* node, bspbrush_t* brushes )
+{
+	subtree_t& subtree = subtrees[subtrees.AddToTail()];
+	memset( &subtree, 0, sizeof( subtree ) );
+	subtree.m_pNode = node;
+	subtree.m_pBrushes = brushes;
+	subtree.m_nBrushes = CountBrushList( brushes );
+}
+
+static int SubtreeSortFn( const subtree_t* pLeft, const subtree_t* pRight )
+{
+	return pRight->m_nBrushes - pLeft->m_nBrushes;
+}
+
+static void BuildSubtree_Thread( int iThread, int iSubtree )
+{
+	BuildTree_r( s_Subtrees[iSubtree].m_pNode, s_Subtrees[iSubtree].m_pBrushes );
+}
+
+static void EvaluateSplitCandidate_Thread( int iThread, int iCandidate )
+{
+	splitcandidate_t& c = s_SplitCandidates[iCandidate];
+	const subtree_t& subtree = s_Subtrees[c.m_iSubtree];
+
+	CheckPlaneAgainstParents( c.m_nPlane, subtree.m_pNode );
+
+	c.m_bValid = CheckPlaneAgainstVolume( c.m_nPlane, subtree.m_pNode ) != 0;
+	if( c.m_bValid )
+	{
+		c.m_nValue = EvaluateSplitPlane( subtree.m_pBrushes, c.m_pSide, c.m_nPlane, false );
+	}
+}
+
+// Adds the planes of one subtree for this pass, in the order the serial search
+// in SelectSplitSide tries them. A plane is only scored for the first side
+// that proposes it. Scoring a plane flags every side on it as tested in the
+// serial search, so planes that got a score in the first pass (prevPass) are
+// left out of the second.
+static void AddSplitCandidates( int iSubtree, int pass, const CUtlVector<splitcandidate_t>& prevPass, CUtlVector<bool>& planeSeen )
+{
+	subtree_t&	subtree = s_Subtrees[iSubtree];
+	bspbrush_t*	brush;
+	side_t*		side;
+	int			i, pnum;
+
+	memset( planeSeen.Base(), 0, planeSeen.Count() * sizeof( bool ) );
+	if( pass > 0 )
+	{
+		for( i = 0 ; i < subtree.m_nCandidates ; i++ )
+		{
+			const splitcandidate_t& c = prevPass[subtree.m_iFirstCandidate + i];
+			if( c.m_bValid )
+			{
+				planeSeen[c.m_nPlane >> 1] = true;
+			}
+		}
+	}
+
+	subtree.m_iFirstCandidate = s_SplitCandidates.Count();
+	for( brush = s_Subtrees[iSubtree].m_pBrushes ; brush ; brush = brush->next )
+	{
+		for( i = 0 ; i < brush->numsides ; i++ )
+		{
+			side = brush->sides + i;
+			if( side->bevel || !side->winding || side->texinfo == TEXINFO_NODE ||
+					( side->surf & SURF_SKIP ) || ( side->visible ^ ( pass < 1 ) ) )
+			{
+				continue;
+			}
+
+			pnum = side->planenum & ~1;
+			if( planeSeen[pnum >> 1] )
+			{
+				continue;
+			}
+			planeSeen[pnum >> 1] = true;
+
+			splitcandidate_t& c = s_SplitCandidates[s_SplitCandidates.AddToTail()];
+			c.m_iSubtree = iSubtree;
+			c.m_pSide = side;
+			c.m_nPlane = pnum;
+			c.m_nValue = 0;
+			c.m_bValid = false;
+		}
+	}
+	subtree.m_nCandidates = s_SplitCandidates.Count() - subtree.m_iFirstCandidate;
+}
+
+// Picks the split side of every subtree marked m_bSplitting. Makes the same choice
+// as SelectSplitSide would for each of them: ties go to the earlier candidate.
+static void SelectSplitSides()
+{
+	bspbrush_t*	test;
+	int			i, pass;
+	int			bsplits, epsilonbrush;
+	qboolean	hintsplit;
+
+	CUtlVector<bool> planeSeen;
+	planeSeen.SetCount( g_MainMap->nummapplanes / 2 + 1 );
+	CUtlVector<splitcandidate_t> prevPass;
+
+	for( i = 0 ; i < s_Subtrees.Count() ; i++ )
+	{
+		s_Subtrees[i].m_pBestSide = NULL;
+		s_Subtrees[i].m_nBestValue = -99999;
+		s_Subtrees[i].m_nBestPlane = 0;
+	}
+
+	for( pass = 0 ; pass < 2 ; pass++ )
+	{
+		// a subtree that found a plane doesn't try any other passes
+		prevPass.Swap( s_SplitCandidates );
+		s_SplitCandidates.RemoveAll();
+		for( i = 0 ; i < s_Subtrees.Count() ; i++ )
+		{
+			if( s_Subtrees[i].m_bSplitting && !s_Subtrees[i].m_pBestSide )
+			{
+				AddSplitCandidates( i, pass, prevPass, planeSeen );
+			}
+		}
+		if( !s_SplitCandidates.Count() )
+		{
+			continue;
+		}
+
+		RunBrushBSPWork( s_SplitCandidates.Count(), EvaluateSplitCandidate_Thread );
+
+		for( i = 0 ; i < s_SplitCandidates.Count() ; i++ )
+		{
+			const splitcandidate_t& c = s_SplitCandidates[i];
+			subtree_t& subtree = s_Subtrees[c.m_iSubtree];
+			if( c.m_bValid && c.m_nValue > subtree.m_nBestValue )
+			{
+				subtree.m_nBestValue = c.m_nValue;
+				subtree.m_pBestSide = c.m_pSide;
+				subtree.m_nBestPlane = c.m_nPlane;
+			}
+		}
+
+		if( pass > 0 )
+		{
+			for( i = 0 ; i < s_Subtrees.Count() ; i++ )
+			{
+				if( s_Subtrees[i].m_bSplitting && s_Subtrees[i].m_pBestSide )
+				{
+					c_nonvis++;
+				}
+			}
+		}
+	}
+	s_SplitCandidates.Purge();
+
+	// -checksplits: run the serial search too and stop if the picks differ. It
+	// leaves the side test of its pick in the brushes, like the loop below.
+	if( g_bCheckSplits )
+	{
+		int nNonVis = c_nonvis;
+		for( i = 0 ; i < s_Subtrees.Count() ; i++ )
+		{
+			if( s_Subtrees[i].m_bSplitting &&
+					SelectSplitSide( s_Subtrees[i].m_pBrushes, s_Subtrees[i].m_pNode ) != s_Subtrees[i].m_pBestSide )
+			{
+				Error( "Parallel split search disagrees with the serial search on a node of %d brushes\n", s_Subtrees[i].m_nBrushes );
+			}
+		}
+		c_nonvis = nNonVis;
+	}
+
+	// SplitBrushList wants the side test for the plane we went with
+	for( i = 0 ; i < s_Subtrees.Count() ; i++ )
+	{
+		if( !s_Subtrees[i].m_pBestSide )
+		{
+			continue;
+		}
+		for( test = s_Subtrees[i].m_pBrushes ; test ; test = test->next )
+		{
+			test->side = TestBrushToPlanenum( test, s_Subtrees[i].m_nBestPlane, &bsplits, &hintsplit, &epsilonbrush );
+		}
+	}
+}
+
+static void BuildTree( node_t* headnode, bspbrush_t* brushes )
+{
+	int			i, nLargest, nSplitMin;
+	bspbrush_t*	children[2];
+
+	if( numthreads == 1 || threaded )
+	{
+		BuildTree_r( headnode, brushes );
+		return;
+	}
+
+	// keep splitting the largest subtrees until there's enough to go around
+	s_Subtrees.RemoveAll();
+	AddSubtree( s_Subtrees, headnode, brushes );
+	while( s_Subtrees.Count() && s_Subtrees.Count() < numthreads * SUBTREES_PER_THREAD )
+	{
+		nLargest = 0;
+		for( i = 0 ; i < s_Subtrees.Count() ; i++ )
+		{
+			nLargest = MAX( nLargest, s_Subtrees[i].m_nBrushes );
+		}
+		if( nLargest < SUBTREE_MIN_BRUSHES )
+		{
+			break;
+		}
+
+		nSplitMin = MAX( nLargest / 2, SUBTREE_MIN_BRUSHES );
+		for( i = 0 ; i < s_Subtrees.Count() ; i++ )
+		{
+			s_Subtrees[i].m_bSplitting = s_Subtrees[i].m_nBrushes >= nSplitMin;
+		}
+
+		SelectSplitSides();
+
+		CUtlVector<subtree_t> next;
+		for( i = 0 ; i < s_Subtrees.Count() ; i++ )
+		{
+			const subtree_t& subtree = s_Subtrees[i];
+			if( !subtree.m_bSplitting )
+			{
+				next.AddToTail( subtree );
+			}
+			else if( SplitTreeNodeOnSide( subtree.m_pNode, subtree.m_pBrushes, subtree.m_pBestSide, children ) )
+			{
+				AddSubtree( next, subtree.m_pNode->children[0], children[0] );
+				AddSubtree( next, subtree.m_pNode->children[1], children[1] );
+			}
+		}
+		s_Subtrees.Swap( next );
+	}
+
+	// biggest first, so a big one doesn't start last
+	s_Subtrees.Sort( SubtreeSortFn );
+	RunBrushBSPWork( s_Subtrees.Count(), BuildSubtree_Thread );
+	s_Subtrees.Purge();
+}
+
+
 //===========================================================
 
 /*
@@ -1573,6 +1928,7 @@ tree_t* BrushBSP( bspbrush_t* brushlist, Vector& mins, Vector& maxs )
 	vec_t		volume;
 
 	qprintf( "--- BrushBSP ---\n" );
+	CPhaseProfileScope phase( "BrushBSP" );
 
 	tree = AllocTree();
 
@@ -1629,7 +1985,7 @@ tree_t* BrushBSP( bspbrush_t* brushlist, Vector& mins, Vector& maxs )
 
 	tree->headnode = node;
 
-	node = BuildTree_r( node, brushlist );
+	BuildTree( node, brushlist );
 	qprintf( "%5i visible nodes\n", c_nodes / 2 - c_nonvis );
 	qprintf( "%5i nonvis nodes\n", c_nonvis );
 	qprintf( "%5i leafs\n", ( c_nodes + 1 ) / 2 );
@@ -14,6 +14,7 @@
 #include "mstristrip.h"
 #include "tier1/strtools.h"
 #include "materialpatch.h"
+#include "phaseprofile.h"
 /*
 
   some faces will be removed before saving, but still form nodes:
@@ -83,6 +84,17 @@ typedef struct hashvert_s
 int	vertexchain[MAX_MAP_VERTS];		// the next vertex in a hash chain
 int	hashverts[HASH_SIZE * HASH_SIZE];	// a vertex number, or 0 for no verts
 
+// The columns above are what FindEdgeVerts needs, but they get long on tall maps.
+// GetVertexnum looks for its match in small quantized 3D cells instead.
+#define WELD_CELL_BITS	3
+#define WELD_HASHES		65536
+
+int	weldchain[MAX_MAP_VERTS];		// the next vertex in a weld cell chain
+int	weldhash[WELD_HASHES];			// a vertex number, or 0 for no verts
+
+// New verts are added under the lock, lookups don't take it
+static CThreadFastMutex s_VertexMutex;
+
 //face_t		*edgefaces[MAX_MAP_EDGES][2];
 
 //============================================================================
@@ -104,11 +116,78 @@ unsigned HashVec( Vector& vec )
 }
 
 #ifdef USE_HASHING
+static inline int WeldCell( vec_t v )
+{
+	return ( int )floor( v ) >> WELD_CELL_BITS;
+}
+
+static inline unsigned WeldHash( int x, int y, int z )
+{
+	return ( ( unsigned )x * 73856093 ^ ( unsigned )y * 19349663 ^ ( unsigned )z * 83492791 ) & ( WELD_HASHES - 1 );
+}
+
+/*
+=============
+FindWeldVertex
+
+Returns the vertex within POINT_EPSILON of vert, or 0. Only verts in
+the same hashverts column count and the newest one wins, which is the
+one the column search used to find.
+=============
+*/
+static int FindWeldVertex( const Vector& vert, unsigned h )
+{
+	int			cells[3][2], numcells[3];
+	int			i, x, y, z;
+	int			vnum, best;
+
+	// a match can be in the next cell over if vert is close to the edge
+	for( i = 0 ; i < 3 ; i++ )
+	{
+		cells[i][0] = WeldCell( vert[i] );
+		numcells[i] = 1;
+		if( WeldCell( vert[i] - 2 * POINT_EPSILON ) != cells[i][0] )
+		{
+			cells[i][numcells[i]++] = cells[i][0] - 1;
+		}
+		else if( WeldCell( vert[i] + 2 * POINT_EPSILON ) != cells[i][0] )
+		{
+			cells[i][numcells[i]++] = cells[i][0] + 1;
+		}
+	}
+
+	best = 0;
+	for( x = 0 ; x < numcells[0] ; x++ )
+	{
+		for( y = 0 ; y < numcells[1] ; y++ )
+		{
+			for( z = 0 ; z < numcells[2] ; z++ )
+			{
+				unsigned cell = WeldHash( cells[0][x], cells[1][y], cells[2][z] );
+				for( vnum = *( volatile int* )&weldhash[cell] ; vnum ; vnum = weldchain[vnum] )
+				{
+					Vector& p = dvertexes[vnum].point;
+					if( vnum > best
+							&& fabs( p[0] - vert[0] ) < POINT_EPSILON
+							&& fabs( p[1] - vert[1] ) < POINT_EPSILON
+							&& fabs( p[2] - vert[2] ) < POINT_EPSILON
+							&& HashVec( p ) == h )
+					{
+						best = vnum;
+					}
+				}
+			}
+		}
+	}
+
+	return best;
+}
+
 /*
 =============
 GetVertex
 
-Uses hashing
+Uses hashing. Safe to call from several threads.
 =============
 */
 int	GetVertexnum( Vector& in )
@@ -118,7 +197,7 @@ int	GetVertexnum( Vector& in )
 	Vector		vert;
 	int			vnum;
 
-	c_totalverts++;
+	ThreadInterlockedIncrement( &c_totalverts );
 
 	for( i = 0 ; i < 3 ; i++ )
 	{
@@ -134,15 +213,19 @@ int	GetVertexnum( Vector& in )
 
 	h = HashVec( vert );
 
-	for( vnum = hashverts[h] ; vnum ; vnum = vertexchain[vnum] )
+	vnum = FindWeldVertex( vert, h );
+	if( vnum )
 	{
-		Vector& p = dvertexes[vnum].point;
-		if( fabs( p[0] - vert[0] ) < POINT_EPSILON
-				&& fabs( p[1] - vert[1] ) < POINT_EPSILON
-				&& fabs( p[2] - vert[2] ) < POINT_EPSILON )
-		{
-			return vnum;
-		}
+		return vnum;
+	}
+
+	AUTO_LOCK_FM( s_VertexMutex );
+
+	// someone else may have added it since we looked
+	vnum = FindWeldVertex( vert, h );
+	if( vnum )
+	{
+		return vnum;
 	}
 
 // emit a vertex
@@ -151,18 +234,25 @@ int	GetVertexnum( Vector& in )
 		Error( "Too many unique verts, max = %d (map has too much brush geometry)\n", MAX_MAP_VERTS );
 	}
 
-	dvertexes[numvertexes].point[0] = vert[0];
-	dvertexes[numvertexes].point[1] = vert[1];
-	dvertexes[numvertexes].point[2] = vert[2];
+	vnum = numvertexes;
+	dvertexes[vnum].point[0] = vert[0];
+	dvertexes[vnum].point[1] = vert[1];
+	dvertexes[vnum].point[2] = vert[2];
+
+	unsigned cell = WeldHash( WeldCell( vert[0] ), WeldCell( vert[1] ), WeldCell( vert[2] ) );
+	vertexchain[vnum] = hashverts[h];
+	weldchain[vnum] = weldhash[cell];
 
-	vertexchain[numvertexes] = hashverts[h];
-	hashverts[h] = numvertexes;
+	// the vertex has to be complete before the lookups can see it
+	ThreadMemoryBarrier();
+	hashverts[h] = vnum;
+	weldhash[cell] = vnum;
 
 	c_uniqueverts++;
 
 	numvertexes++;
 
-	return numvertexes - 1;
+	return vnum;
 }
 #else
 /*
@@ -807,10 +897,14 @@ FixTjuncs
 
 face_t* FixTjuncs( node_t* headnode, face_t* pLeafFaceList )
 {
+	CPhaseProfileScope phase( "FixTjuncs" );
+
 	// snap and merge all vertexes
 	qprintf( "---- snap verts ----\n" );
 	memset( hashverts, 0, sizeof( hashverts ) );
 	memset( vertexchain, 0, sizeof( vertexchain ) );
+	memset( weldhash, 0, sizeof( weldhash ) );
+	memset( weldchain, 0, sizeof( weldchain ) );
 	c_totalverts = 0;
 	c_uniqueverts = 0;
 	c_faceoverflows = 0;
@@ -1946,6 +2040,7 @@ MakeFaces
 void MakeFaces( node_t* node )
 {
 	qprintf( "--- MakeFaces ---\n" );
+	CPhaseProfileScope phase( "MakeFaces" );
 	c_merge = 0;
 	c_subdivide = 0;
 	c_nodefaces = 0;
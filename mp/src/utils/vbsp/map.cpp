@@ -15,6 +15,8 @@
 #include "materialsub.h"
 #include "fgdlib/fgdlib.h"
 #include "manifest.h"
+#include "utlbuffer.h"
+#include "utldict.h"
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -217,6 +219,125 @@ qboolean	PlaneEqual( plane_t* p, Vector& normal, vec_t dist, float normalEpsilon
 	return false;
 }
 
+//-----------------------------------------------------------------------------
+// Planes are hashed on their quantized normal and dist. The cells are centered
+// on the axial normals and the cell edges are kept off the integer and half
+// integer dists most planes have, so a lookup almost always has one cell to look
+// in. The other cell is only needed within an epsilon of an edge.
+//-----------------------------------------------------------------------------
+#define PLANE_NORMAL_CELLS	16			// cells per unit of normal component
+#define PLANE_DIST_CELL		8.0f		// units of dist per cell
+#define PLANE_DIST_OFFSET	0.45f		// moves the dist cell edges to 8k - 3.6
+
+// New planes are added under the lock, lookups don't take it
+static CThreadFastMutex s_PlaneMutex;
+
+static inline int PlaneNormalCell( vec_t v )
+{
+	return ( int )floor( v * PLANE_NORMAL_CELLS + 0.5f );
+}
+
+static inline int PlaneDistCell( vec_t dist )
+{
+	return ( int )floor( dist * ( 1.0f / PLANE_DIST_CELL ) + PLANE_DIST_OFFSET );
+}
+
+static inline int PlaneCellHash( int x, int y, int z, int d )
+{
+	unsigned h = ( unsigned )x * 73856093 ^ ( unsigned )y * 19349663 ^ ( unsigned )z * 83492791 ^ ( unsigned )d * 2654435761u;
+	return h & ( PLANE_HASHES - 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the hash bucket for a plane. If pNeighborCells is given, it
+//			gets the cells of normal[0..2] and dist in [i][0], and the neighbor
+//			cell a plane within epsilon could be in, or the same cell again, in
+//			[i][1].
+//-----------------------------------------------------------------------------
+int CMapFile::PlaneHash( const Vector& normal, vec_t dist, int* pNeighborCells )
+{
+	int cells[4];
+	for( int i = 0; i < 3; i++ )
+	{
+		cells[i] = PlaneNormalCell( normal[i] );
+	}
+	cells[3] = PlaneDistCell( dist );
+
+	if( pNeighborCells )
+	{
+		for( int i = 0; i < 4; i++ )
+		{
+			int* pCell = &pNeighborCells[i * 2];
+			pCell[0] = pCell[1] = cells[i];
+
+			vec_t v = ( i < 3 ) ? normal[i] : dist;
+			vec_t epsilon = 2 * ( ( i < 3 ) ? RENDER_NORMAL_EPSILON : RENDER_DIST_EPSILON );
+			int lo = ( i < 3 ) ? PlaneNormalCell( v - epsilon ) : PlaneDistCell( v - epsilon );
+			int hi = ( i < 3 ) ? PlaneNormalCell( v + epsilon ) : PlaneDistCell( v + epsilon );
+			if( lo != cells[i] )
+			{
+				pCell[1] = lo;
+			}
+			else if( hi != cells[i] )
+			{
+				pCell[1] = hi;
+			}
+		}
+	}
+
+	return PlaneCellHash( cells[0], cells[1], cells[2], cells[3] );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Looks through every cell an equal plane could be in. Doesn't lock.
+//-----------------------------------------------------------------------------
+plane_t* CMapFile::FindPlaneInHash( const Vector& normal, vec_t dist )
+{
+	int cells[4][2];
+	PlaneHash( normal, dist, &cells[0][0] );
+
+	// each cell is tried once, the second one only if it's a different cell
+	for( int x = 0; x < 2; x++ )
+	{
+		if( x && cells[0][1] == cells[0][0] )
+		{
+			break;
+		}
+		for( int y = 0; y < 2; y++ )
+		{
+			if( y && cells[1][1] == cells[1][0] )
+			{
+				break;
+			}
+			for( int z = 0; z < 2; z++ )
+			{
+				if( z && cells[2][1] == cells[2][0] )
+				{
+					break;
+				}
+				for( int d = 0; d < 2; d++ )
+				{
+					if( d && cells[3][1] == cells[3][0] )
+					{
+						break;
+					}
+
+					int h = PlaneCellHash( cells[0][x], cells[1][y], cells[2][z], cells[3][d] );
+					for( plane_t* p = *( plane_t * volatile* )&planehash[h]; p; p = p->hash_chain )
+					{
+						if( PlaneEqual( p, ( Vector& )normal, dist, RENDER_NORMAL_EPSILON, RENDER_DIST_EPSILON ) )
+						{
+							return p;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
 /*
 ================
 AddPlaneToHash
@@ -226,10 +347,12 @@ void CMapFile::AddPlaneToHash( plane_t* p )
 {
 	int		hash;
 
-	hash = ( int )fabs( p->dist ) / 8;
-	hash &= ( PLANE_HASHES - 1 );
+	hash = PlaneHash( p->normal, p->dist, NULL );
 
 	p->hash_chain = planehash[hash];
+
+	// the plane has to be complete before the lookups can see it
+	ThreadMemoryBarrier();
 	planehash[hash] = p;
 }
 
@@ -389,25 +512,23 @@ int CMapFile::FindFloatPlane( Vector& normal, vec_t dist )
 #else
 int	CMapFile::FindFloatPlane( Vector& normal, vec_t dist )
 {
-	int		i;
 	plane_t*	p;
-	int		hash, h;
 
 	SnapPlane( normal, dist );
-	hash = ( int )fabs( dist ) / 8;
-	hash &= ( PLANE_HASHES - 1 );
 
-	// search the border bins as well
-	for( i = -1 ; i <= 1 ; i++ )
+	p = FindPlaneInHash( normal, dist );
+	if( p )
 	{
-		h = ( hash + i ) & ( PLANE_HASHES - 1 );
-		for( p = planehash[h] ; p ; p = p->hash_chain )
-		{
-			if( PlaneEqual( p, normal, dist, RENDER_NORMAL_EPSILON, RENDER_DIST_EPSILON ) )
-			{
-				return p - mapplanes;
-			}
-		}
+		return p - mapplanes;
+	}
+
+	AUTO_LOCK_FM( s_PlaneMutex );
+
+	// someone else may have added it since we looked
+	p = FindPlaneInHash( normal, dist );
+	if( p )
+	{
+		return p - mapplanes;
 	}
 
 	return CreateNewFloatPlane( normal, dist );
@@ -2054,6 +2175,34 @@ void CMapFile::ForceFuncAreaPortalWindowContents()
 
 static GameData	GD;
 
+// Instance VMFs are run through the tokenizer on all threads before they're loaded, and
+// LoadMapFile reads the tokens back from memory. This is a cache of tokens, not of loaded
+// maps: loading a map changes global state (texinfo, cubemaps, overlays, displacements)
+// in file order, so the chunk handlers stay on the main thread and run again for every
+// func_instance. The tokens are kept until the main map is done, so an instance used by
+// many func_instances is only read from disk and tokenized once.
+struct instancetokens_t
+{
+	char		m_szPath[ MAX_PATH ];
+	CUtlBuffer	m_Tokens;
+	bool		m_bValid;
+};
+
+static CUtlDict< instancetokens_t*, int >	s_InstanceTokens;
+static CUtlVector< instancetokens_t* >		s_PendingInstanceTokens;
+
+static void TokenizeInstanceFile( int iThread, int iInstance )
+{
+	instancetokens_t* pInstance = s_PendingInstanceTokens[ iInstance ];
+	pInstance->m_bValid = TokenReader::Tokenize( pInstance->m_szPath, pInstance->m_Tokens );
+}
+
+static void PurgeInstanceTokens( void )
+{
+	s_InstanceTokens.PurgeAndDeleteElements();
+	s_PendingInstanceTokens.Purge();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: this function will read in a standard key / value file
 // Input  : pFilename - the absolute name of the file to read
@@ -2167,6 +2316,23 @@ bool CMapFile::DeterminePath( const char* pszBaseFileName, const char* pszInstan
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: finds the file of a func_instance the same way for the prefetch and the load.
+// Input  : pszFileName - the file that referenced the instance
+//			pszInstanceFile - the file key of the func_instance
+// Output : Returns true if it was able to locate the file
+//			pszOutFileName - the full path to the file name if located
+//-----------------------------------------------------------------------------
+static bool FindInstanceFile( const char* pszFileName, const char* pszInstanceFile, char* pszOutFileName )
+{
+#ifdef MAPBASE
+	return CMapFile::DeterminePath( pszFileName, pszInstanceFile, pszOutFileName ) || CMapFile::DeterminePath( g_MainMapPath, pszInstanceFile, pszOutFileName );
+#else
+	return CMapFile::DeterminePath( pszFileName, pszInstanceFile, pszOutFileName );
+#endif
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: this function will check the main map for any func_instances.  It will
 //			also attempt to load in the gamedata file for instancing remapping help.
@@ -2223,8 +2389,16 @@ void CMapFile::CheckForInstances( const char* pszFileName )
 
 	// this list will grow as instances are merged onto it.  sub-instances are merged and
 	// automatically done in this processing.
+	int nPrefetched = 0;
 	for( int i = 0; i < num_entities; i++ )
 	{
+		// the instances merged since the last batch brought their own func_instances
+		if( i >= nPrefetched )
+		{
+			PrefetchInstances( pszFileName, i );
+			nPrefetched = num_entities;
+		}
+
 		char* pEntity = ValueForKey( &entities[ i ], "classname" );
 		if( !strcmp( pEntity, "func_instance" ) )
 		{
@@ -2234,11 +2408,7 @@ void CMapFile::CheckForInstances( const char* pszFileName )
 				char	InstancePath[ MAX_PATH ];
 				bool	bLoaded = false;
 
-#ifdef MAPBASE
-				if( DeterminePath( pszFileName, pInstanceFile, InstancePath ) || DeterminePath( g_MainMapPath, pInstanceFile, InstancePath ) )
-#else
-				if( DeterminePath( pszFileName, pInstanceFile, InstancePath ) )
-#endif
+				if( FindInstanceFile( pszFileName, pInstanceFile, InstancePath ) )
 				{
 					if( LoadMapFile( InstancePath ) )
 					{
@@ -2261,10 +2431,57 @@ void CMapFile::CheckForInstances( const char* pszFileName )
 		}
 	}
 
+	PurgeInstanceTokens();
+
 	g_LoadingMap = this;
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: tokenizes the instance files referenced by the func_instances from
+//			nFirstEntity on with all threads, so LoadMapFile can read them from memory.
+// Input  : pszFileName - the file the instances are relative to
+//			nFirstEntity - the first entity that hasn't been looked at
+// Output : none
+//-----------------------------------------------------------------------------
+void CMapFile::PrefetchInstances( const char* pszFileName, int nFirstEntity )
+{
+	s_PendingInstanceTokens.RemoveAll();
+
+	for( int i = nFirstEntity; i < num_entities; i++ )
+	{
+		if( strcmp( ValueForKey( &entities[ i ], "classname" ), "func_instance" ) )
+		{
+			continue;
+		}
+
+		char* pInstanceFile = ValueForKey( &entities[ i ], "file" );
+		char	InstancePath[ MAX_PATH ];
+		if( !pInstanceFile[ 0 ] || !FindInstanceFile( pszFileName, pInstanceFile, InstancePath ) )
+		{
+			continue;
+		}
+
+		if( s_InstanceTokens.Find( InstancePath ) != s_InstanceTokens.InvalidIndex() )
+		{
+			continue;
+		}
+
+		instancetokens_t* pInstance = new instancetokens_t;
+		V_strncpy( pInstance->m_szPath, InstancePath, sizeof( pInstance->m_szPath ) );
+		pInstance->m_bValid = false;
+		s_InstanceTokens.Insert( InstancePath, pInstance );
+		s_PendingInstanceTokens.AddToTail( pInstance );
+	}
+
+	if( s_PendingInstanceTokens.Count() )
+	{
+		RunThreadsOnIndividual( s_PendingInstanceTokens.Count(), true, TokenizeInstanceFile );
+		s_PendingInstanceTokens.RemoveAll();
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: this function will do all of the necessary work to merge the instance
 //			into the main map.
@@ -2844,6 +3061,157 @@ void CMapFile::MergeOverlays( entity_t* pInstanceEntity, CMapFile* Instance, Vec
 }
 
 
+// The main VMF is cut between its top-level chunks (world, entities, cameras, ...) into
+// a few ranges per thread. The ranges are tokenized on all threads and their tokens are
+// appended in file order, so LoadMapFile reads the same tokens it would from the file.
+// Like the instances, only the tokenizing is threaded: the chunk handlers still run on
+// the main thread in file order.
+#define MAP_TOKENIZE_MIN_BYTES			( 256 * 1024 )	// smaller files aren't worth splitting
+#define MAP_TOKENIZE_RANGES_PER_THREAD	4
+
+struct maptokenrange_t
+{
+	int			m_nStart;
+	int			m_nEnd;			// -1 for the last range
+	int			m_nStartLine;
+	CUtlBuffer	m_Tokens;
+	bool		m_bValid;
+};
+
+static const char*						s_pszTokenizeMapFile;
+static CUtlVector< maptokenrange_t* >	s_MapTokenRanges;
+
+static void TokenizeMapFileRange( int iThread, int iRange )
+{
+	maptokenrange_t* pRange = s_MapTokenRanges[ iRange ];
+	pRange->m_bValid = TokenReader::Tokenize( s_pszTokenizeMapFile, pRange->m_Tokens,
+						pRange->m_nStart, pRange->m_nEnd, pRange->m_nStartLine );
+}
+
+static void AddMapTokenRange( int nStart, int nEnd, int nStartLine )
+{
+	maptokenrange_t* pRange = new maptokenrange_t;
+	pRange->m_nStart = nStart;
+	pRange->m_nEnd = nEnd;
+	pRange->m_nStartLine = nStartLine;
+	pRange->m_bValid = false;
+	s_MapTokenRanges.AddToTail( pRange );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: finds the ends of the top-level chunks the same way the tokenizer sees
+//			them: braces don't count in quoted strings or // comments.
+// Input  : pBuf, nSize - the contents of the file
+// Output : Returns false if the braces don't balance, the tokenizer gets to report that.
+//-----------------------------------------------------------------------------
+static bool SplitMapFileRanges( const char* pBuf, int nSize )
+{
+	int nRangeSize = nSize / ( numthreads * MAP_TOKENIZE_RANGES_PER_THREAD );
+	int nRangeStart = 0;
+	int nRangeLine = 1;
+	int nDepth = 0;
+	int nLine = 1;
+
+	for( int i = 0; i < nSize; i++ )
+	{
+		char ch = pBuf[ i ];
+		if( ch == '\"' )
+		{
+			const char* pClose = ( const char* )memchr( pBuf + i + 1, '\"', nSize - i - 1 );
+			if( !pClose )
+			{
+				return false;
+			}
+			i = pClose - pBuf;
+		}
+		else if( ch == '/' && i + 1 < nSize && pBuf[ i + 1 ] == '/' )
+		{
+			// stop on the newline so it's counted
+			while( i + 1 < nSize && pBuf[ i + 1 ] != '\n' )
+			{
+				i++;
+			}
+		}
+		else if( ch == '\n' )
+		{
+			nLine++;
+		}
+		else if( ch == '{' )
+		{
+			nDepth++;
+		}
+		else if( ch == '}' )
+		{
+			if( --nDepth < 0 )
+			{
+				return false;
+			}
+			if( nDepth == 0 && i + 1 - nRangeStart >= nRangeSize )
+			{
+				AddMapTokenRange( nRangeStart, i + 1, nRangeLine );
+				nRangeStart = i + 1;
+				nRangeLine = nLine;
+			}
+		}
+	}
+
+	if( nDepth != 0 )
+	{
+		return false;
+	}
+
+	AddMapTokenRange( nRangeStart, -1, nRangeLine );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: tokenizes a map file with all threads.
+// Input  : pszFileName - the map file
+//			tokens - receives the tokens, for CChunkFile::OpenTokens
+// Output : Returns false if the file should just be read from disk instead.
+//-----------------------------------------------------------------------------
+static bool TokenizeMapFile( const char* pszFileName, CUtlBuffer& tokens )
+{
+	if( numthreads == 1 || threaded )
+	{
+		return false;
+	}
+
+	FILE* fp = fopen( pszFileName, "rb" );
+	if( !fp )
+	{
+		return false;
+	}
+	CUtlVector<char> buf;
+	fseek( fp, 0, SEEK_END );
+	buf.SetSize( ftell( fp ) );
+	fseek( fp, 0, SEEK_SET );
+	int nRead = fread( buf.Base(), 1, buf.Count(), fp );
+	fclose( fp );
+	if( nRead != buf.Count() || nRead < MAP_TOKENIZE_MIN_BYTES )
+	{
+		return false;
+	}
+
+	bool bResult = SplitMapFileRanges( buf.Base(), buf.Count() ) && s_MapTokenRanges.Count() > 1;
+	if( bResult )
+	{
+		s_pszTokenizeMapFile = pszFileName;
+		RunThreadsOnIndividual( s_MapTokenRanges.Count(), false, TokenizeMapFileRange );
+
+		for( int i = 0; i < s_MapTokenRanges.Count() && bResult; i++ )
+		{
+			CUtlBuffer& rangeTokens = s_MapTokenRanges[ i ]->m_Tokens;
+			bResult = s_MapTokenRanges[ i ]->m_bValid;
+			tokens.Put( rangeTokens.Base(), rangeTokens.TellMaxPut() );
+		}
+	}
+
+	s_MapTokenRanges.PurgeAndDeleteElements();
+	return bResult;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Loads a VMF or MAP file. If the file has a .MAP extension, the MAP
 //			loader is used, otherwise the file is assumed to be in VMF format.
@@ -2881,8 +3249,22 @@ bool LoadMapFile( const char* pszFileName )
 		//
 		// Open the file.
 		//
+		CUtlBuffer mapTokens;
 		CChunkFile File;
-		eResult = File.Open( pszFileName, ChunkFile_Read );
+		int iTokens = s_InstanceTokens.Find( pszFileName );
+		if( iTokens != s_InstanceTokens.InvalidIndex() && s_InstanceTokens[ iTokens ]->m_bValid )
+		{
+			CUtlBuffer& tokens = s_InstanceTokens[ iTokens ]->m_Tokens;
+			eResult = File.OpenTokens( pszFileName, tokens.Base(), tokens.TellMaxPut() );
+		}
+		else if( TokenizeMapFile( pszFileName, mapTokens ) )
+		{
+			eResult = File.OpenTokens( pszFileName, mapTokens.Base(), mapTokens.TellMaxPut() );
+		}
+		else
+		{
+			eResult = File.Open( pszFileName, ChunkFile_Read );
+		}
 
 		//
 		// Read the file.
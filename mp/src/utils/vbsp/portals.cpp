@@ -29,14 +29,7 @@ portal_t* AllocPortal( void )
 
 	portal_t*	p;
 
-	if( numthreads == 1 )
-	{
-		c_active_portals++;
-	}
-	if( c_active_portals > c_peak_portals )
-	{
-		c_peak_portals = c_active_portals;
-	}
+	ThreadUpdatePeak( &c_peak_portals, ThreadInterlockedIncrement( &c_active_portals ) );
 
 	p = ( portal_t* )malloc( sizeof( portal_t ) );
 	memset( p, 0, sizeof( portal_t ) );
@@ -52,10 +45,7 @@ void FreePortal( portal_t* p )
 	{
 		FreeWinding( p->winding );
 	}
-	if( numthreads == 1 )
-	{
-		c_active_portals--;
-	}
+	ThreadInterlockedDecrement( &c_active_portals );
 	free( p );
 }
 
@@ -96,10 +96,7 @@ void FreeTree_r( node_t* node )
 		FreeBrush( node->volume );
 	}
 
-	if( numthreads == 1 )
-	{
-		c_nodes--;
-	}
+	ThreadInterlockedDecrement( &c_nodes );
 	free( node );
 }
 
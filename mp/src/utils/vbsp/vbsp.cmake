@@ -53,6 +53,7 @@ set(
 	"${SRCDIR}/utils/common/filesystem_tools.cpp"
 	"${SRCDIR}/utils/common/map_shared.cpp"
 	"${SRCDIR}/utils/common/pacifier.cpp"
+	"${SRCDIR}/utils/common/phaseprofile.cpp"
 	"${SRCDIR}/utils/common/polylib.cpp"
 	"${SRCDIR}/utils/common/scriplib.cpp"
 	"${SRCDIR}/utils/common/threads.cpp"
@@ -90,6 +91,7 @@ set(
 	"${VBSP_DIR}/ivp.h"
 	"${SRCDIR}/utils/common/map_shared.h"
 	"${SRCDIR}/utils/common/pacifier.h"
+	"${SRCDIR}/utils/common/phaseprofile.h"
 	"${SRCDIR}/utils/common/polylib.h"
 	"${SRCDIR}/public/tier1/tokenreader.h"
 	"${SRCDIR}/utils/common/utilmatlib.h"
@@ -19,6 +19,8 @@
 #include "loadcmdline.h"
 #include "byteswap.h"
 #include "worldvertextransitionfixup.h"
+#include "pacifier.h"
+#include "phaseprofile.h"
 
 #ifdef MAPBASE_VSCRIPT
 	#include "vscript/ivscript.h"
@@ -65,6 +67,7 @@ bool		g_NodrawTriggers = false;
 bool		g_DisableWaterLighting = false;
 bool		g_bAllowDetailCracks = false;
 bool		g_bNoVirtualMesh = false;
+bool		g_bCheckSplits = false;
 #ifdef MAPBASE
 	bool		g_bNoHiddenManifestMaps = false;
 	bool		g_bNoDefaultCubemaps = true;
@@ -281,8 +284,30 @@ void ProcessWorldModel( void )
 	{
 		qprintf( "--------------------------------------------\n" );
 
-		RunThreadsOnIndividual( ( block_xh - block_xl + 1 ) * ( block_yh - block_yl + 1 ),
-								!verbose, ProcessBlock_Thread );
+		// The blocks share the clip planes in csg.cpp and the areaportal fixups write
+		// to the map brushes, so they go one at a time and BrushBSP threads each tree.
+		int nBlocks = ( block_xh - block_xl + 1 ) * ( block_yh - block_yl + 1 );
+		double flStart = Plat_FloatTime();
+		PhaseProfile_Begin( "ProcessBlocks" );
+		if( !verbose )
+		{
+			Msg( "%-20s ", "ProcessBlock_Thread:" );
+			StartPacifier( "" );
+		}
+		for( int iBlock = 0; iBlock < nBlocks; iBlock++ )
+		{
+			ProcessBlock_Thread( 0, iBlock );
+			if( !verbose )
+			{
+				UpdatePacifier( ( float )( iBlock + 1 ) / nBlocks );
+			}
+		}
+		if( !verbose )
+		{
+			EndPacifier( false );
+			Msg( " (%d)\n", ( int )( Plat_FloatTime() - flStart ) );
+		}
+		PhaseProfile_End();
 
 		//
 		// build the division tree
@@ -308,7 +333,9 @@ void ProcessWorldModel( void )
 		//
 
 		// make the portals/faces by traversing down to each empty leaf
+		PhaseProfile_Begin( "MakeTreePortals" );
 		MakeTreePortals( tree );
+		PhaseProfile_End();
 
 		if( FloodEntities( tree ) )
 		{
@@ -382,7 +409,9 @@ void ProcessWorldModel( void )
 	if( !noprune )
 	{
 		Msg( "PruneNodes...\n" );
+		PhaseProfile_Begin( "PruneNodes" );
 		PruneNodes( tree->headnode );
+		PhaseProfile_End();
 	}
 
 //	Msg( "SplitSubdividedFaces...\n" );
@@ -913,12 +942,15 @@ void ProcessModels( void )
 
 		if( entity_num == 0 )
 		{
+			PhaseProfile_Begin( "ProcessWorldModel" );
 			ProcessWorldModel();
 		}
 		else
 		{
+			PhaseProfile_Begin( "ProcessSubModel" );
 			ProcessSubModel( );
 		}
+		PhaseProfile_End();
 
 		EndModel();
 
@@ -937,7 +969,9 @@ void ProcessModels( void )
 #else
 	Cubemap_CreateDefaultCubemaps();
 #endif
+	PhaseProfile_Begin( "EndBSPFile" );
 	EndBSPFile();
+	PhaseProfile_End();
 }
 
 
@@ -963,6 +997,7 @@ int RunVBSP( int argc, char** argv )
 	int		i;
 	double		start, end;
 	char		path[1024];
+	char		szPhaseProfile[MAX_PATH] = "";
 
 	CommandLine()->CreateCmdLine( argc, argv );
 	MathLib_Init( 2.2f, 2.2f, 0.0f, OVERBRIGHT, false, true, true, false );
@@ -997,6 +1032,24 @@ int RunVBSP( int argc, char** argv )
 		{
 			glview = true;
 		}
+		else if( !Q_stricmp( argv[i], "-phaseprofile" ) )
+		{
+			if( ++i < argc )
+			{
+				V_strncpy( szPhaseProfile, argv[i], sizeof( szPhaseProfile ) );
+			}
+			else
+			{
+				Warning( "Error: expected a filename after '-phaseprofile'\n" );
+				DeleteCmdLine( argc, argv );
+				CmdLib_Exit( 1 );
+			}
+		}
+		else if( !Q_stricmp( argv[i], "-checksplits" ) )
+		{
+			Msg( "checksplits = true\n" );
+			g_bCheckSplits = true;
+		}
 		else if( !Q_stricmp( argv[i], "-v" ) || !Q_stricmp( argv[i], "-verbose" ) )
 		{
 			Msg( "verbose = true\n" );
@@ -1432,6 +1485,9 @@ int RunVBSP( int argc, char** argv )
 				"  -nox360		   : Disable generation Xbox360 version of vsp (default)\n"
 				"  -replacematerials : Substitute materials according to materialsub.txt in content\\maps\n"
 				"  -FullMinidumps  : Write large minidumps on crash.\n"
+				"  -phaseprofile <file> : Write the time spent in each phase to <file> as JSON.\n"
+				"  -checksplits    : Check the threaded BSP split search against the serial one\n"
+				"                    and stop if they pick different splits.\n"
 #ifdef MAPBASE
 				"  -insert_search_path <directory> : Includes an extra base directory for mounting additional content.\n"
 				"  -nohiddenmaps   : Exclude manifest maps if they are currently hidden.\n"
@@ -1455,6 +1511,11 @@ int RunVBSP( int argc, char** argv )
 		CmdLib_Exit( 1 );
 	}
 
+	if( szPhaseProfile[0] )
+	{
+		PhaseProfile_Init( "vbsp", szPhaseProfile );
+	}
+
 	start = Plat_FloatTime();
 
 	// Run in the background?
@@ -1477,7 +1538,6 @@ int RunVBSP( int argc, char** argv )
 	}
 
 	ThreadSetDefault();
-	numthreads = 1;		// multiple threads aren't helping...
 
 	// Setup the logfile.
 	char logFile[512];
@@ -1601,7 +1661,9 @@ int RunVBSP( int argc, char** argv )
 			AddBufferToPak( GetPakFile(), "stale.txt", "stale", strlen( "stale" ) + 1, false );
 		}
 
+		PhaseProfile_Begin( "LoadMapFile" );
 		LoadMapFile( name );
+		PhaseProfile_End();
 		WorldVertexTransitionFixup();
 		if( ( g_nDXLevel == 0 ) || ( g_nDXLevel >= 70 ) )
 		{
@@ -1612,7 +1674,9 @@ int RunVBSP( int argc, char** argv )
 		SetModelNumbers();
 		SetLightStyles();
 		LoadEmitDetailObjectDictionary( gamedir );
+		PhaseProfile_Begin( "ProcessModels" );
 		ProcessModels();
+		PhaseProfile_End();
 
 		// Add embed dir if provided
 		if( *g_szEmbedDir )
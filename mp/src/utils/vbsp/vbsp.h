@@ -300,6 +300,7 @@ public:
 	static bool			DeterminePath( const char* pszBaseFileName, const char* pszInstanceFileName, char* pszOutFileName );
 
 	void				CheckForInstances( const char* pszFileName );
+	void				PrefetchInstances( const char* pszFileName, int nFirstEntity );
 	void				MergeInstance( entity_t* pInstanceEntity, CMapFile* Instance );
 	void				MergePlanes( entity_t* pInstanceEntity, CMapFile* Instance, Vector& InstanceOrigin, QAngle& InstanceAngle, matrix3x4_t& InstanceMatrix );
 	void				MergeBrushes( entity_t* pInstanceEntity, CMapFile* Instance, Vector& InstanceOrigin, QAngle& InstanceAngle, matrix3x4_t& InstanceMatrix );
@@ -314,8 +315,10 @@ public:
 	plane_t		mapplanes[MAX_MAP_PLANES];
 	int			nummapplanes;
 
-#define	PLANE_HASHES	1024
-	plane_t*		planehash[PLANE_HASHES];
+#define	PLANE_HASHES	65536
+	plane_t*		planehash[PLANE_HASHES];	// quantized ( normal, dist ) cells, see PlaneHash
+	int					PlaneHash( const Vector& normal, vec_t dist, int* pNeighborCells );
+	plane_t*			FindPlaneInHash( const Vector& normal, vec_t dist );
 
 	int			nummapbrushes;
 	mapbrush_t	mapbrushes[MAX_MAP_BRUSHES];
@@ -432,6 +435,7 @@ extern	bool		g_NodrawTriggers;
 extern	bool		g_DisableWaterLighting;
 extern	bool		g_bAllowDetailCracks;
 extern	bool		g_bNoVirtualMesh;
+extern	bool		g_bCheckSplits;
 #ifdef MAPBASE
 	extern	bool		g_bNoHiddenManifestMaps;
 	extern bool			g_bPropperInsertAllAsStatic;
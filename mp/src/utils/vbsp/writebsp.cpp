@@ -15,6 +15,7 @@
 #include "utilmatlib.h"
 #include "utldict.h"
 #include "map.h"
+#include "phaseprofile.h"
 
 int		c_nofaces;
 int		c_facenodes;
@@ -962,6 +963,8 @@ void WriteBSP( node_t* headnode, face_t* pLeafFaceList )
 	int		oldfaces;
 	int     oldorigfaces;
 
+	CPhaseProfileScope phase( "WriteBSP" );
+
 	c_nofaces = 0;
 	c_facenodes = 0;
 
@@ -1343,17 +1346,23 @@ void EndBSPFile( void )
 	OverlayTransition_EmitOverlayFaces();
 
 	// phys collision needs dispinfo to operate (needs to generate phys collision for displacement surfs)
+	PhaseProfile_Begin( "EmitPhysCollision" );
 	EmitPhysCollision();
+	PhaseProfile_End();
 
 	// We can't calculate this properly until vvis (since we need vis to do this), so we set
 	// to zero everywhere by default.
 	ClearDistToClosestWater();
 
 	// Emit static props found in the .vmf file
+	PhaseProfile_Begin( "EmitStaticProps" );
 	EmitStaticProps();
+	PhaseProfile_End();
 
 	// Place detail props found in .vmf and based on material properties
+	PhaseProfile_Begin( "EmitDetailObjects" );
 	EmitDetailObjects();
+	PhaseProfile_End();
 
 	// Compute bounds after creating disp info because we need to reference it
 	ComputeBoundsNoSkybox();
@@ -1374,7 +1383,9 @@ void EndBSPFile( void )
 	V_strncpy( fileName, g_source, sizeof( fileName ) );
 	V_DefaultExtension( fileName, ".bsp", sizeof( fileName ) );
 	Msg( "Writing %s\n", fileName );
+	PhaseProfile_Begin( "WriteBSPFile" );
 	WriteBSPFile( fileName );
+	PhaseProfile_End();
 }
 
 
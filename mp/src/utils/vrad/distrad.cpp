@@ -0,0 +1,270 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: BuildFacelights and BuildVisLeafs on top of the socket work
+//			distribution in utils/common/distribute.cpp. Same results as
+//			the VMPI versions in mpivrad.cpp, but workers only need a copy
+//			of the map and a connection to the master.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "vismat.h"
+#include "distribute.h"
+#include "transferfile.h"
+#include "tier1/utlbuffer.h"
+
+
+extern int total_transfer;
+extern int max_transfer;
+extern void BuildPatchLights( int facenum );
+
+
+template<class T> static void PutValues( CUtlBuffer& buf, T const* pSrc, int nNumValues )
+{
+	buf.Put( pSrc, sizeof( pSrc[0] ) * nNumValues );
+}
+
+template<class T> static T* GetValues( CUtlBuffer& buf, int nNumValues )
+{
+	T* pDest = ( T* )calloc( nNumValues, sizeof( T ) );
+	buf.Get( pDest, sizeof( T ) * nNumValues );
+	return pDest;
+}
+
+
+//-----------------------------------------------------------------------------
+// BuildFacelights
+//-----------------------------------------------------------------------------
+static void SerializeFace( CUtlBuffer& buf, int facenum )
+{
+	dface_t*      f  = &g_pFaces[facenum];
+	facelight_t* fl = &facelight[facenum];
+
+	buf.Put( f, sizeof( dface_t ) );
+	buf.Put( fl, sizeof( facelight_t ) );
+	PutValues( buf, fl->sample, fl->numsamples );
+
+	// the pointers in facelight_t only tell the master which of these follow
+	for( int i = 0; i < MAXLIGHTMAPS; ++i )
+	{
+		for( int n = 0; n < NUM_BUMP_VECTS + 1; ++n )
+		{
+			if( fl->light[i][n] )
+			{
+				PutValues( buf, fl->light[i][n], fl->numsamples );
+			}
+		}
+	}
+
+	if( fl->luxel )
+	{
+		PutValues( buf, fl->luxel, fl->numluxels );
+	}
+
+	if( fl->luxelNormals )
+	{
+		PutValues( buf, fl->luxelNormals, fl->numluxels );
+	}
+}
+
+// The worker never looks at a face again once the master has it
+static void FreeFacelight( int facenum )
+{
+	facelight_t* fl = &facelight[facenum];
+
+	free( fl->sample );
+	for( int i = 0; i < MAXLIGHTMAPS; ++i )
+	{
+		for( int n = 0; n < NUM_BUMP_VECTS + 1; ++n )
+		{
+			free( fl->light[i][n] );
+		}
+	}
+	free( fl->luxel );
+	free( fl->luxelNormals );
+	memset( fl, 0, sizeof( facelight_t ) );
+}
+
+static void UnSerializeFace( CUtlBuffer& buf, int facenum )
+{
+	dface_t*      f  = &g_pFaces[facenum];
+	facelight_t* fl = &facelight[facenum];
+
+	buf.Get( f, sizeof( dface_t ) );
+	buf.Get( fl, sizeof( facelight_t ) );
+	if( !buf.IsValid() || fl->numsamples < 0 || fl->numluxels < 0 ||
+			fl->numsamples > buf.TellMaxPut() || fl->numluxels > buf.TellMaxPut() )
+	{
+		Error( "Bad facelight data for face %d\n", facenum );
+	}
+
+	fl->sample = GetValues<sample_t>( buf, fl->numsamples );
+	for( int i = 0; i < fl->numsamples; ++i )
+	{
+		// windings stay on the worker
+		fl->sample[i].w = NULL;
+	}
+
+	for( int i = 0; i < MAXLIGHTMAPS; ++i )
+	{
+		for( int n = 0; n < NUM_BUMP_VECTS + 1; ++n )
+		{
+			if( fl->light[i][n] )
+			{
+				fl->light[i][n] = GetValues<LightingValue_t>( buf, fl->numsamples );
+			}
+		}
+	}
+
+	if( fl->luxel )
+	{
+		fl->luxel = GetValues<Vector>( buf, fl->numluxels );
+	}
+
+	if( fl->luxelNormals )
+	{
+		fl->luxelNormals = GetValues<Vector>( buf, fl->numluxels );
+	}
+}
+
+static void DistProcessFaces( int iThread, int iWorkUnit, CUtlBuffer* pBuf )
+{
+	BuildFacelights( iThread, iWorkUnit );
+
+	if( pBuf )
+	{
+		SerializeFace( *pBuf, iWorkUnit );
+		FreeFacelight( iWorkUnit );
+	}
+}
+
+static void DistReceiveFaceResults( int iWorkUnit, CUtlBuffer& buf, int iWorker )
+{
+	UnSerializeFace( buf, iWorkUnit );
+
+	// BuildFacelights does this for the faces the master lights itself
+	BuildPatchLights( iWorkUnit );
+}
+
+void RunDistributedBuildFacelights( void )
+{
+	Msg( "%-20s ", "BuildFacelights:" );
+	RunDistributedWork( numfaces, DistProcessFaces, DistReceiveFaceResults );
+}
+
+
+//-----------------------------------------------------------------------------
+// BuildVisLeafs
+//-----------------------------------------------------------------------------
+struct distvisleafs_t
+{
+	transfer_t*		m_pTransfers;		// scratch row for BuildVisLeafs_Cluster
+	CUtlBuffer*		m_pBuf;				// where the finished rows go, NULL on the master
+	int				m_nPatches;
+};
+
+static distvisleafs_t s_VisLeafsData[MAX_TOOL_THREADS + 1];
+static CUtlVector<transfer_t> s_ReceivedTransfers;
+
+// Called by BuildVisLeafs_Cluster every time it finishes a patch
+static void DistAddPatchData( int iThread, int patchnum, CPatch* patch )
+{
+	distvisleafs_t* pData = &s_VisLeafsData[iThread];
+	if( !pData->m_pBuf )
+	{
+		return;
+	}
+
+	pData->m_nPatches++;
+	pData->m_pBuf->PutInt( patchnum );
+	pData->m_pBuf->PutInt( patch->numtransfers );
+	PutValues( *pData->m_pBuf, patch->transfers, patch->numtransfers );
+
+	// only the master bounces light
+	free( patch->transfers );
+	patch->transfers = NULL;
+}
+
+static void DistProcessVisLeafs( int iThread, int iWorkUnit, CUtlBuffer* pBuf )
+{
+	distvisleafs_t* pData = &s_VisLeafsData[iThread];
+	pData->m_pBuf = pBuf;
+	pData->m_nPatches = 0;
+
+	// patch count goes in front, it's filled in once the cluster is done
+	int iCountPos = 0;
+	if( pBuf )
+	{
+		iCountPos = pBuf->TellPut();
+		pBuf->PutInt( 0 );
+	}
+
+	BuildVisLeafs_Cluster( iThread, pData->m_pTransfers, iWorkUnit, DistAddPatchData );
+
+	if( pBuf )
+	{
+		int iEnd = pBuf->TellPut();
+		pBuf->SeekPut( CUtlBuffer::SEEK_HEAD, iCountPos );
+		pBuf->PutInt( pData->m_nPatches );
+		pBuf->SeekPut( CUtlBuffer::SEEK_HEAD, iEnd );
+		pData->m_pBuf = NULL;
+	}
+}
+
+static void DistReceiveVisLeafsResults( int iWorkUnit, CUtlBuffer& buf, int iWorker )
+{
+	int nPatches = buf.GetInt();
+	for( int k = 0; k < nPatches && buf.IsValid(); ++k )
+	{
+		int patchnum = buf.GetInt();
+		int numtransfers = buf.GetInt();
+		if( !buf.IsValid() || patchnum < 0 || patchnum >= g_Patches.Count() || numtransfers < 0 || numtransfers > MAX_PATCHES )
+		{
+			Error( "Bad transfers for cluster %d\n", iWorkUnit );
+		}
+
+		CPatch* patch = &g_Patches[patchnum];
+		patch->numtransfers = numtransfers;
+
+		if( g_bTransferFiles )
+		{
+			// the rows are already scaled, they just have to go out to disk
+			s_ReceivedTransfers.SetCount( numtransfers );
+			buf.Get( s_ReceivedTransfers.Base(), numtransfers * sizeof( transfer_t ) );
+			WriteTransferRow( THREADINDEX_MAIN, patchnum, s_ReceivedTransfers.Base(), numtransfers );
+		}
+		else if( numtransfers )
+		{
+			patch->transfers = GetValues<transfer_t>( buf, numtransfers );
+		}
+
+		ThreadLock();
+		total_transfer += numtransfers;
+		if( max_transfer < numtransfers )
+		{
+			max_transfer = numtransfers;
+		}
+		ThreadUnlock();
+	}
+}
+
+void RunDistributedBuildVisLeafs( void )
+{
+	memset( s_VisLeafsData, 0, sizeof( s_VisLeafsData ) );
+	for( int i = 0; i < numthreads; i++ )
+	{
+		s_VisLeafsData[i].m_pTransfers = BuildVisLeafs_Start();
+	}
+
+	Msg( "%-20s ", "BuildVisLeafs:" );
+	RunDistributedWork( dvis->numclusters, DistProcessVisLeafs, DistReceiveVisLeafsResults );
+
+	for( int i = 0; i < numthreads; i++ )
+	{
+		BuildVisLeafs_End( s_VisLeafsData[i].m_pTransfers );
+		s_VisLeafsData[i].m_pTransfers = NULL;
+	}
+	s_ReceivedTransfers.Purge();
+}
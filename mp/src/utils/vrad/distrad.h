@@ -0,0 +1,19 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: The vrad phases that can be spread over -distworker processes.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef DISTRAD_H
+#define DISTRAD_H
+#ifdef _WIN32
+	#pragma once
+#endif
+
+
+void		RunDistributedBuildFacelights( void );
+void		RunDistributedBuildVisLeafs( void );
+
+
+#endif // DISTRAD_H
@@ -14,10 +14,15 @@
 
 #include "mathlib/vector.h"
 #include "utlvector.h"
+#include "checksum_crc.h"
 
 
 typedef unsigned short IncrementalLightID;
 
+// Every supersampled sample gathers light at this many groups of 4 points: the
+// rows of the direct light and then one group for the sky ambient.
+#define INCREMENTAL_SUPERSAMPLE_GROUPS	5
+
 
 // Incremental lighting manager.
 class IIncremental
@@ -31,28 +36,113 @@ public:
 	// already so it can detect if the incremental file is up to date.
 	virtual bool		Init( char const* pBSPFilename, char const* pIncrementalFilename ) = 0;
 
+	// Sets up for vrad -incremental. Every face is lit as usual, but lights that
+	// match one in the incremental file have their direct light read back from it
+	// instead of being traced. The file is only used if it was written for the
+	// same key (a CRC of the geometry and the lighting options).
+	virtual bool		InitRelight( char const* pBSPFilename, char const* pIncrementalFilename, CRC32_t key ) = 0;
+
 	// Prepare to light. You must call Init once, but then you can
 	// do as many Prepare/AddLight/Finalize phases as you want.
 	virtual bool		PrepareForLighting() = 0;
 
-	// Called every time light is added to a face.
-	// NOTE: This is the ONLY threadsafe function in IIncremental.
+	// Called every time light is added to a face. pDots has the falloff * dot for
+	// each of the nNormals lightmap pages.
+	// NOTE: This, FinishFace, GetLightFromFile and the supersample and static prop
+	// functions below are the only threadsafe functions in IIncremental.
 	virtual void		AddLightToFace(
 		IncrementalLightID lightID,
 		int iFace,
 		int iSample,
 		int lmSize,
-		float dot,
+		int nNormals,
+		float const* pDots,
+		float flSunAmount,
+		int iThread ) = 0;
+
+	// Returns true if this light's direct light comes out of the incremental file.
+	virtual bool		IsLightFromFile( IncrementalLightID lightID ) = 0;
+
+	// Fills in what AddLightToFace got for nSamples samples starting at iSample.
+	// pDots is nNormals rows of nSamples values. Returns false if the light
+	// doesn't reach the face at all.
+	virtual bool		GetLightFromFile(
+		IncrementalLightID lightID,
+		int iFace,
+		int iSample,
+		int nSamples,
+		int lmSize,
+		int nNormals,
+		float* pDots,
+		float* pSunAmount,
+		int iThread ) = 0;
+
+	// Called with what a light added to group iGroup of the supersamples of
+	// sample iSample. pDots is nNormals rows of 4 values.
+	virtual void		AddSupersampleLight(
+		IncrementalLightID lightID,
+		int iFace,
+		int iSample,
+		int iGroup,
+		int lmSize,
+		int nNormals,
+		float const* pDots,
+		float const* pSunAmount,
+		int iThread ) = 0;
+
+	// Fills in what AddSupersampleLight got when the file was saved. Returns false
+	// if the light wasn't gathered at these supersamples then, it has to be traced.
+	virtual bool		GetSupersampleLightFromFile(
+		IncrementalLightID lightID,
+		int iFace,
+		int iSample,
+		int iGroup,
+		int lmSize,
+		int nNormals,
+		float* pDots,
+		float* pSunAmount,
 		int iThread ) = 0;
 
 	// Called when it's done applying light from the specified light to the specified face.
+	// With InitRelight this comes after the face's supersampling.
 	virtual void		FinishFace(
 		IncrementalLightID lightID,
 		int iFace,
 		int iThread ) = 0;
 
+	// Call before the static props are lit, with the number of props.
+	virtual void		PrepareForStaticPropLighting( int nProps ) = 0;
+
+	// Called with the falloff * dot a light has at nPoints points of a static prop,
+	// starting at iPoint. The points of a prop are numbered in the order they're lit.
+	virtual void		AddLightToStaticProp(
+		IncrementalLightID lightID,
+		int iProp,
+		int iPoint,
+		int nPoints,
+		float const* pDots,
+		int iThread ) = 0;
+
+	// Fills in what AddLightToStaticProp got when the file was saved. Returns false
+	// if the light wasn't traced at these points then, it has to be traced.
+	virtual bool		GetStaticPropLightFromFile(
+		IncrementalLightID lightID,
+		int iProp,
+		int iPoint,
+		int nPoints,
+		float* pDots,
+		int iThread ) = 0;
+
+	// Called when a light is done with a static prop.
+	virtual void		FinishStaticProp(
+		IncrementalLightID lightID,
+		int iProp,
+		int iThread ) = 0;
+
 	// For each face that was changed during the lighting process, save out
-	// new data for it in the incremental file.
+	// new data for it in the incremental file. With InitRelight, this only saves
+	// the incremental file and leaves the lightmaps alone, call it once the static
+	// props are lit.
 	// Returns false if the incremental lighting isn't active.
 	virtual bool		Finalize() = 0;
 
@@ -37,6 +37,18 @@ static bool CompareLights( dworldlight_t* a, dworldlight_t* b )
 }
 
 
+// -incremental also has to catch changes to the hard falloff and the light's cap distance.
+static bool CompareLights( directlight_t* dl, CIncLight* pLight )
+{
+	static float flEpsilon = 1e-7;
+
+	return CompareLights( &dl->light, &pLight->m_Light ) &&
+		   fabs( dl->m_flStartFadeDistance - pLight->m_flStartFadeDistance ) < flEpsilon &&
+		   fabs( dl->m_flEndFadeDistance - pLight->m_flEndFadeDistance ) < flEpsilon &&
+		   dl->m_flCapDist == pLight->m_flCapDist;
+}
+
+
 long FileOpen( char const* pFilename, bool bRead )
 {
 	g_bFileError = false;
@@ -109,6 +121,8 @@ CIncremental::CIncremental()
 	m_pIncrementalFilename = NULL;
 	m_pBSPFilename = NULL;
 	m_bSuccessfulRun = false;
+	m_bRelight = false;
+	m_Key = 0;
 }
 
 
@@ -125,6 +139,14 @@ bool CIncremental::Init( char const* pBSPFilename, char const* pIncrementalFilen
 }
 
 
+bool CIncremental::InitRelight( char const* pBSPFilename, char const* pIncrementalFilename, CRC32_t key )
+{
+	m_bRelight = true;
+	m_Key = key;
+	return Init( pBSPFilename, pIncrementalFilename );
+}
+
+
 bool CIncremental::PrepareForLighting()
 {
 	if( !m_pBSPFilename )
@@ -144,6 +166,12 @@ bool CIncremental::PrepareForLighting()
 		LoadIncrementalFile();
 	}
 
+	if( m_bRelight )
+	{
+		MatchLightsForRelight();
+		return true;
+	}
+
 	// unmatched = a list of the lights we have
 	CUtlLinkedList<int, int> unmatched;
 	for( int i = m_Lights.Head(); i != m_Lights.InvalidIndex(); i = m_Lights.Next( i ) )
@@ -230,6 +258,13 @@ bool CIncremental::ReadIncrementalHeader( long fp, CIncrementalHeader* pHeader )
 		return false;
 	}
 
+	CRC32_t key;
+	FileRead( fp, key );
+	if( key != m_Key )
+	{
+		return false;
+	}
+
 	int nFaces;
 	FileRead( fp, nFaces );
 
@@ -244,6 +279,7 @@ bool CIncremental::WriteIncrementalHeader( long fp )
 {
 	int version = INCREMENTALFILE_VERSION;
 	FileWrite( fp, version );
+	FileWrite( fp, m_Key );
 
 	int nFaces = numfaces;
 	FileWrite( fp, nFaces );
@@ -307,7 +343,9 @@ void CIncremental::AddLightToFace(
 	int iFace,
 	int iSample,
 	int lmSize,
-	float dot,
+	int nNormals,
+	float const* pDots,
+	float flSunAmount,
 	int iThread )
 {
 	// If we're not being used, don't do anything.
@@ -316,33 +354,40 @@ void CIncremental::AddLightToFace(
 		return;
 	}
 
-	CIncLight* pLight = m_Lights[lightID];
+	CLightFace* pFace = GetTracedFace( m_Lights[lightID], iFace, lmSize, nNormals, iThread );
 
-	// Check for the 99.99% case in which the face already exists.
-	CLightFace* pFace;
-	if( pLight->m_pCachedFaces[iThread] &&
-			pLight->m_pCachedFaces[iThread]->m_FaceIndex == iFace )
+	// Add this into the light's data.
+	CLightValue& value = pFace->m_LightValues[iSample];
+	for( int n = 0; n < nNormals; n++ )
 	{
-		pFace = pLight->m_pCachedFaces[iThread];
+		value.m_Dot[n] = pDots[n];
 	}
-	else
+	value.m_SunAmount = flSunAmount;
+}
+
+
+CLightFace* CIncremental::GetTracedFace( CIncLight* pLight, int iFace, int lmSize, int nNormals, int iThread )
+{
+	// Check for the 99.99% case in which the face already exists.
+	CLightFace* pFace = pLight->m_pCachedFaces[iThread];
+	if( pFace && pFace->m_FaceIndex == iFace )
 	{
-		bool bNew;
+		return pFace;
+	}
 
-		pLight->m_Mutex.Lock();
-		pFace = pLight->FindOrCreateLightFace( iFace, lmSize, &bNew );
-		pLight->m_Mutex.Unlock();
+	bool bNew;
 
-		pLight->m_pCachedFaces[iThread] = pFace;
+	pLight->m_Mutex.Lock();
+	pFace = pLight->FindOrCreateLightFace( iFace, lmSize, nNormals, &bNew );
+	pLight->m_Mutex.Unlock();
 
-		if( bNew )
-		{
-			m_TotalMemory += pFace->m_LightValues.Count() * sizeof( pFace->m_LightValues[0] );
-		}
-	}
+	pLight->m_pCachedFaces[iThread] = pFace;
 
-	// Add this into the light's data.
-	pFace->m_LightValues[iSample].m_Dot = dot;
+	if( bNew )
+	{
+		m_TotalMemory += pFace->m_LightValues.Count() * sizeof( pFace->m_LightValues[0] );
+	}
+	return pFace;
 }
 
 
@@ -377,39 +422,95 @@ void EncodeCharOrShort( CUtlBuffer* pBuf, unsigned short val )
 }
 
 
-void DecompressLightData( CUtlBuffer* pIn, CUtlVector<CLightValue>* pOut )
+// A page is one value out of each CLightValue: the dot for each normal and then
+// the sun amount.
+static inline float& PageValue( CLightValue& value, int iPage, int nNormals )
+{
+	return ( iPage < nNormals ) ? value.m_Dot[iPage] : value.m_SunAmount;
+}
+
+
+void CPageReader::Init( CUtlBuffer* pIn )
+{
+	m_pIn = pIn;
+	m_flScale = pIn->GetFloat() * ( 1.0f / 32767.0f );
+	m_flValue = 0.0f;
+	m_nRunLeft = 0;
+}
+
+
+float CPageReader::Next()
+{
+	if( !m_nRunLeft && m_pIn->IsValid() )
+	{
+		m_nRunLeft = m_pIn->GetUnsignedChar();
+		m_flValue = DecodeCharOrShort( m_pIn ) * m_flScale;
+	}
+
+	if( m_nRunLeft )
+	{
+		--m_nRunLeft;
+	}
+	return m_flValue;
+}
+
+
+// Returns the number of normals the light was saved with. Values past the
+// end of pOut are dropped.
+int DecompressLightData( CUtlBuffer* pIn, CUtlVector<CLightValue>* pOut )
 {
-	int iOut = 0;
-	while( pIn->TellGet() < pIn->TellPut() )
+	int nNormals = pIn->GetUnsignedChar();
+	int nValues = pIn->GetInt();
+	if( nNormals > NUM_BUMP_VECTS + 1 )
 	{
-		unsigned char runLength = pIn->GetUnsignedChar();
-		unsigned short usVal = DecodeCharOrShort( pIn );
+		return 0;
+	}
 
-		while( runLength > 0 )
-		{
-			--runLength;
+	for( int iPage = 0; iPage <= nNormals; iPage++ )
+	{
+		CPageReader reader;
+		reader.Init( pIn );
 
-			pOut->Element( iOut ).m_Dot = usVal;
-			++iOut;
+		for( int iOut = 0; iOut < nValues && pIn->IsValid(); iOut++ )
+		{
+			float flVal = reader.Next();
+			if( iOut < pOut->Count() )
+			{
+				PageValue( pOut->Element( iOut ), iPage, nNormals ) = flVal;
+			}
 		}
 	}
+
+	return nNormals;
 }
 
 #ifdef _WIN32
 	#pragma warning (disable:4701)
 #endif
 
-void CompressLightData(
-	CLightValue const* pValues,
-	int nValues,
-	CUtlBuffer* pBuf )
+// A page is stored as its largest value followed by runs of 15 bit fractions
+// of it. Returns false if every value is 0.
+static bool CompressPage( float const* pValues, int nValues, CUtlBuffer* pBuf )
 {
+	float flMax = 0.0f;
+	for( int i = 0; i < nValues; i++ )
+	{
+		flMax = max( flMax, pValues[i] );
+	}
+	pBuf->PutFloat( flMax );
+
+	float flQuantize = 0.0f;
+	if( flMax > 0.0f )
+	{
+		flQuantize = 32767.0f / flMax;
+	}
+
 	unsigned char runLength = 0;
 	unsigned short flLastValue;
 
 	for( int i = 0; i < nValues; i++ )
 	{
-		unsigned short flCurValue = ( unsigned short )pValues[i].m_Dot;
+		unsigned short flCurValue = ( unsigned short )( pValues[i] * flQuantize + 0.5f );
 
 		if( i == 0 )
 		{
@@ -436,18 +537,247 @@ void CompressLightData(
 		pBuf->PutUnsignedChar( runLength );
 		EncodeCharOrShort( pBuf, flLastValue );
 	}
+
+	return flMax > 0.0f;
 }
 
 #ifdef _WIN32
 	#pragma warning (default:4701)
 #endif
 
-void MultiplyValues( CUtlVector<CLightValue>& values, float scale )
+// Each page goes through CompressPage. Returns false if the light didn't add anything.
+bool CompressLightData(
+	CLightValue* pValues,
+	int nValues,
+	int nNormals,
+	CUtlBuffer* pBuf )
 {
-	for( int i = 0; i < values.Count(); i++ )
+	bool bAnyLight = false;
+
+	pBuf->PutUnsignedChar( nNormals );
+	pBuf->PutInt( nValues );
+
+	CUtlVector<float> page;
+	page.SetCount( nValues );
+	for( int iPage = 0; iPage <= nNormals; iPage++ )
 	{
-		values[i].m_Dot *= scale;
+		for( int i = 0; i < nValues; i++ )
+		{
+			page[i] = PageValue( pValues[i], iPage, nNormals );
+		}
+
+		if( CompressPage( page.Base(), nValues, pBuf ) )
+		{
+			bAnyLight = true;
+		}
 	}
+
+	return bAnyLight;
+}
+
+
+bool CIncremental::IsLightFromFile( IncrementalLightID lightID )
+{
+	return m_Lights[lightID]->m_bFromFile;
+}
+
+
+CLightFace* CIncremental::GetFileFace( CIncLight* pLight, int iFace, int lmSize, int iThread )
+{
+	// Faces belong to one thread while they're lit, so the samples can be
+	// decompressed into the CLightFace until FinishFace.
+	CLightFace* pFace = pLight->m_pCachedFaces[iThread];
+	if( pFace && pFace->m_FaceIndex == iFace )
+	{
+		return pFace;
+	}
+
+	pFace = NULL;
+
+	CFaceLightList& faceLights = m_FileFaceLights[iFace];
+	for( int i = 0; i < faceLights.Count(); i++ )
+	{
+		if( faceLights[i]->m_pLight == pLight )
+		{
+			pFace = faceLights[i];
+			break;
+		}
+	}
+
+	pLight->m_pCachedFaces[iThread] = pFace;
+	if( pFace )
+	{
+		pFace->m_LightValues.SetSize( lmSize );
+		memset( pFace->m_LightValues.Base(), 0, sizeof( CLightValue ) * lmSize );
+		pFace->m_CompressedData.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+		DecompressLightData( &pFace->m_CompressedData, &pFace->m_LightValues );
+	}
+	return pFace;
+}
+
+
+bool CIncremental::GetLightFromFile(
+	IncrementalLightID lightID,
+	int iFace,
+	int iSample,
+	int nSamples,
+	int lmSize,
+	int nNormals,
+	float* pDots,
+	float* pSunAmount,
+	int iThread )
+{
+	CLightFace* pFace = GetFileFace( m_Lights[lightID], iFace, lmSize, iThread );
+	if( !pFace )
+	{
+		return false;
+	}
+
+	// Bumped faces only store the pages they had when the light was saved.
+	for( int i = 0; i < nSamples; i++ )
+	{
+		CLightValue const& value = pFace->m_LightValues[iSample + i];
+		for( int n = 0; n < nNormals; n++ )
+		{
+			pDots[n * nSamples + i] = ( n < pFace->m_nNormals ) ? value.m_Dot[n] : 0.0f;
+		}
+		pSunAmount[i] = value.m_SunAmount;
+	}
+
+	return true;
+}
+
+
+// The supersamples are stored as a bit per sample and then the values, like the samples.
+void CIncremental::LoadSupersamples( CLightFace* pFace, int lmSize )
+{
+	if( pFace->m_SupersampleValues.Count() )
+	{
+		return;
+	}
+
+	pFace->m_SupersampleValues.SetSize( lmSize * INCREMENTAL_SUPERSAMPLE_GROUPS * 4 );
+	memset( pFace->m_SupersampleValues.Base(), 0, pFace->m_SupersampleValues.Count() * sizeof( CLightValue ) );
+	pFace->m_Supersampled.SetSize( ( lmSize + 7 ) >> 3 );
+	memset( pFace->m_Supersampled.Base(), 0, pFace->m_Supersampled.Count() );
+
+	CUtlBuffer& buf = pFace->m_CompressedSupersamples;
+	if( !buf.TellPut() )
+	{
+		return;
+	}
+
+	buf.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+	if( buf.GetInt() != pFace->m_Supersampled.Count() )
+	{
+		// saved for a different lightmap size, it all gets traced again
+		pFace->m_bSupersamplesChanged = true;
+		return;
+	}
+	buf.Get( pFace->m_Supersampled.Base(), pFace->m_Supersampled.Count() );
+	DecompressLightData( &buf, &pFace->m_SupersampleValues );
+}
+
+
+void CIncremental::AddSupersampleLight(
+	IncrementalLightID lightID,
+	int iFace,
+	int iSample,
+	int iGroup,
+	int lmSize,
+	int nNormals,
+	float const* pDots,
+	float const* pSunAmount,
+	int iThread )
+{
+	CIncLight* pLight = m_Lights[lightID];
+
+	CLightFace* pFace;
+	if( pLight->m_bFromFile )
+	{
+		// a light from the file gets traced at supersamples that weren't supersampled before
+		pFace = GetFileFace( pLight, iFace, lmSize, iThread );
+		if( !pFace )
+		{
+			// it only reaches the supersamples
+			pFace = GetTracedFace( pLight, iFace, lmSize, nNormals, iThread );
+			m_FileFaceLights[iFace].AddToTail( pFace );
+		}
+	}
+	else
+	{
+		pFace = GetTracedFace( pLight, iFace, lmSize, nNormals, iThread );
+	}
+
+	LoadSupersamples( pFace, lmSize );
+	pFace->m_Supersampled[iSample >> 3] |= 1 << ( iSample & 7 );
+	pFace->m_bSupersamplesChanged = true;
+
+	CLightValue* pValues = &pFace->m_SupersampleValues[( iSample * INCREMENTAL_SUPERSAMPLE_GROUPS + iGroup ) * 4];
+	for( int i = 0; i < 4; i++ )
+	{
+		for( int n = 0; n < nNormals; n++ )
+		{
+			pValues[i].m_Dot[n] = pDots[n * 4 + i];
+		}
+		pValues[i].m_SunAmount = pSunAmount[i];
+	}
+}
+
+
+bool CIncremental::GetSupersampleLightFromFile(
+	IncrementalLightID lightID,
+	int iFace,
+	int iSample,
+	int iGroup,
+	int lmSize,
+	int nNormals,
+	float* pDots,
+	float* pSunAmount,
+	int iThread )
+{
+	CLightFace* pFace = GetFileFace( m_Lights[lightID], iFace, lmSize, iThread );
+	if( !pFace || ( !pFace->m_SupersampleValues.Count() && !pFace->m_CompressedSupersamples.TellPut() ) )
+	{
+		return false;
+	}
+
+	LoadSupersamples( pFace, lmSize );
+	if( !( pFace->m_Supersampled[iSample >> 3] & ( 1 << ( iSample & 7 ) ) ) )
+	{
+		return false;
+	}
+
+	CLightValue const* pValues = &pFace->m_SupersampleValues[( iSample * INCREMENTAL_SUPERSAMPLE_GROUPS + iGroup ) * 4];
+	for( int i = 0; i < 4; i++ )
+	{
+		for( int n = 0; n < nNormals; n++ )
+		{
+			pDots[n * 4 + i] = ( n < pFace->m_nNormals ) ? pValues[i].m_Dot[n] : 0.0f;
+		}
+		pSunAmount[i] = pValues[i].m_SunAmount;
+	}
+
+	return true;
+}
+
+
+// Returns true if the face has supersamples
+static bool CompressSupersamples( CLightFace* pFace )
+{
+	if( pFace->m_bSupersamplesChanged )
+	{
+		CUtlBuffer& buf = pFace->m_CompressedSupersamples;
+		buf.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
+		buf.PutInt( pFace->m_Supersampled.Count() );
+		buf.Put( pFace->m_Supersampled.Base(), pFace->m_Supersampled.Count() );
+		CompressLightData( pFace->m_SupersampleValues.Base(), pFace->m_SupersampleValues.Count(), pFace->m_nNormals, &buf );
+		pFace->m_bSupersamplesChanged = false;
+	}
+
+	pFace->m_SupersampleValues.Purge();
+	pFace->m_Supersampled.Purge();
+	return pFace->m_CompressedSupersamples.TellPut() != 0;
 }
 
 
@@ -459,46 +789,178 @@ void CIncremental::FinishFace(
 	CIncLight* pLight = m_Lights[lightID];
 
 	// Check for the 99.99% case in which the face already exists.
-	CLightFace* pFace;
-	if( pLight->m_pCachedFaces[iThread] && pLight->m_pCachedFaces[iThread]->m_FaceIndex == iFace )
+	CLightFace* pFace = pLight->m_pCachedFaces[iThread];
+	if( !pFace || pFace->m_FaceIndex != iFace )
+	{
+		return;
+	}
+
+	bool bSupersampled = CompressSupersamples( pFace );
+
+	// Lights from the file only had their samples decompressed for GetLightFromFile,
+	// unless the face is new because the light only reaches its supersamples.
+	if( pLight->m_bFromFile )
 	{
-		pFace = pLight->m_pCachedFaces[iThread];
+		if( !pFace->m_CompressedData.TellPut() )
+		{
+			CompressLightData( pFace->m_LightValues.Base(), pFace->m_LightValues.Count(), pFace->m_nNormals, &pFace->m_CompressedData );
+		}
+		pFace->m_LightValues.Purge();
+		pLight->m_pCachedFaces[iThread] = NULL;
+		return;
+	}
 
-		// Compress the data.
-		MultiplyValues( pFace->m_LightValues, pLight->m_flMaxIntensity );
+	// Compress the data.
+	pFace->m_CompressedData.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
+	bool bAnyLight = CompressLightData(
+						 pFace->m_LightValues.Base(),
+						 pFace->m_LightValues.Count(),
+						 pFace->m_nNormals,
+						 &pFace->m_CompressedData );
 
-		pFace->m_CompressedData.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
-		CompressLightData(
-			pFace->m_LightValues.Base(),
-			pFace->m_LightValues.Count(),
-			&pFace->m_CompressedData );
+	// Supersamples stay even if they're dark, so they aren't traced again next time.
+	if( !bAnyLight && !bSupersampled )
+	{
+		// No contribution.. delete this face from the light.
+		pLight->m_Mutex.Lock();
+		pLight->m_LightFaces.Remove( pFace->m_LightFacesIndex );
+		delete pFace;
+		pLight->m_Mutex.Unlock();
+
+		pLight->m_pCachedFaces[iThread] = NULL;
+	}
+	else
+	{
+		// Discard the uncompressed data.
+		pFace->m_LightValues.Purge();
+		m_FacesTouched[ pFace->m_FaceIndex ] = 1;
+	}
+}
 
-#if 0
-		// test decompression
-		CUtlVector<CLightValue> test;
-		test.SetSize( 2048 );
-		pFace->m_CompressedData.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
-		DecompressLightData( &pFace->m_CompressedData, &test );
-#endif
 
-		if( pFace->m_CompressedData.TellPut() == 0 )
+void CIncremental::PrepareForStaticPropLighting( int nProps )
+{
+	for( int iLight = m_Lights.Head(); iLight != m_Lights.InvalidIndex(); iLight = m_Lights.Next( iLight ) )
+	{
+		CUtlVector<CLightProp*>& props = m_Lights[iLight]->m_LightProps;
+		for( int i = nProps; i < props.Count(); i++ )
 		{
-			// No contribution.. delete this face from the light.
-			pLight->m_Mutex.Lock();
-			pLight->m_LightFaces.Remove( pFace->m_LightFacesIndex );
-			delete pFace;
-			pLight->m_Mutex.Unlock();
+			delete props[i];
 		}
-		else
+
+		int nOld = props.Count();
+		props.SetCountNonDestructively( nProps );
+		for( int i = nOld; i < nProps; i++ )
 		{
-			// Discard the uncompressed data.
-			pFace->m_LightValues.Purge();
-			m_FacesTouched[ pFace->m_FaceIndex ] = 1;
+			props[i] = NULL;
 		}
 	}
 }
 
 
+void CIncremental::AddLightToStaticProp(
+	IncrementalLightID lightID,
+	int iProp,
+	int iPoint,
+	int nPoints,
+	float const* pDots,
+	int iThread )
+{
+	CLightProp*& pProp = m_Lights[lightID]->m_LightProps[iProp];
+	if( !pProp )
+	{
+		pProp = new CLightProp;
+	}
+
+	if( !pProp->m_Dots.Count() && pProp->m_nPoints )
+	{
+		// a light from the file is missing these points, it keeps what it had
+		pProp->m_Dots.SetCount( pProp->m_nPoints );
+		pProp->m_CompressedData.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+		pProp->m_Reader.Init( &pProp->m_CompressedData );
+		for( int i = 0; i < pProp->m_nPoints; i++ )
+		{
+			pProp->m_Dots[i] = pProp->m_Reader.Next();
+		}
+	}
+
+	int nOld = pProp->m_Dots.Count();
+	if( nOld < iPoint + nPoints )
+	{
+		pProp->m_Dots.SetCountNonDestructively( iPoint + nPoints );
+		for( int i = nOld; i < iPoint; i++ )
+		{
+			pProp->m_Dots[i] = 0.0f;
+		}
+	}
+	memcpy( &pProp->m_Dots[iPoint], pDots, nPoints * sizeof( float ) );
+}
+
+
+bool CIncremental::GetStaticPropLightFromFile(
+	IncrementalLightID lightID,
+	int iProp,
+	int iPoint,
+	int nPoints,
+	float* pDots,
+	int iThread )
+{
+	CLightProp* pProp = m_Lights[lightID]->m_LightProps[iProp];
+	if( !pProp || iPoint + nPoints > pProp->m_nPoints )
+	{
+		return false;
+	}
+
+	if( pProp->m_Dots.Count() )
+	{
+		memcpy( pDots, &pProp->m_Dots[iPoint], nPoints * sizeof( float ) );
+		return true;
+	}
+
+	// The points are asked for in order, so they're decompressed as they go.
+	if( pProp->m_iReadPoint < 0 || pProp->m_iReadPoint > iPoint )
+	{
+		pProp->m_CompressedData.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+		pProp->m_Reader.Init( &pProp->m_CompressedData );
+		pProp->m_iReadPoint = 0;
+	}
+
+	for( ; pProp->m_iReadPoint < iPoint; pProp->m_iReadPoint++ )
+	{
+		pProp->m_Reader.Next();
+	}
+
+	for( int i = 0; i < nPoints; i++ )
+	{
+		pDots[i] = pProp->m_Reader.Next();
+	}
+	pProp->m_iReadPoint += nPoints;
+	return true;
+}
+
+
+void CIncremental::FinishStaticProp(
+	IncrementalLightID lightID,
+	int iProp,
+	int iThread )
+{
+	CLightProp* pProp = m_Lights[lightID]->m_LightProps[iProp];
+	if( !pProp )
+	{
+		return;
+	}
+
+	if( pProp->m_Dots.Count() )
+	{
+		pProp->m_nPoints = pProp->m_Dots.Count();
+		pProp->m_CompressedData.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
+		CompressPage( pProp->m_Dots.Base(), pProp->m_nPoints, &pProp->m_CompressedData );
+		pProp->m_Dots.Purge();
+	}
+	pProp->m_iReadPoint = -1;
+}
+
+
 bool CIncremental::Finalize()
 {
 	// If we're not being used, don't do anything.
@@ -507,6 +969,18 @@ bool CIncremental::Finalize()
 		return false;
 	}
 
+	// vrad -incremental goes on to bounce and finish the lightmaps like any other compile.
+	if( m_bRelight )
+	{
+		m_bSuccessfulRun = true;
+		m_FileFaceLights.Purge();
+		if( !SaveIncrementalFile() )
+		{
+			Warning( "Unable to write incremental lighting file %s.\n", m_pIncrementalFilename );
+		}
+		return true;
+	}
+
 	CUtlVector<CFaceLightList> faceLights;
 	LinkLightsToFaces( faceLights );
 
@@ -535,17 +1009,18 @@ bool CIncremental::Finalize()
 		{
 			CLightFace* pFace = faceLights[facenum][iFace];
 
+			memset( faceLightValues.Base(), 0, nLuxels * sizeof( CLightValue ) );
 			pFace->m_CompressedData.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
 			DecompressLightData( &pFace->m_CompressedData, &faceLightValues );
 
 			for( int iSample = 0; iSample < nLuxels; iSample++ )
 			{
-				float flDot = faceLightValues[iSample].m_Dot;
+				float flDot = faceLightValues[iSample].m_Dot[0];
 				if( flDot )
 				{
 					VectorMA(
 						faceLight[iSample],
-						flDot / pFace->m_pLight->m_flMaxIntensity,
+						flDot,
 						pFace->m_pLight->m_Light.intensity,
 						faceLight[iSample] );
 				}
@@ -604,11 +1079,86 @@ void CIncremental::AddLightsForActiveLights()
 
 		// Copy the light information.
 		pLight->m_Light = dl->light;
-		pLight->m_flMaxIntensity = max( dl->light.intensity[0], max( dl->light.intensity[1], dl->light.intensity[2] ) );
+		pLight->m_flStartFadeDistance = dl->m_flStartFadeDistance;
+		pLight->m_flEndFadeDistance = dl->m_flEndFadeDistance;
+		pLight->m_flCapDist = dl->m_flCapDist;
+		pLight->m_bFromFile = false;
 	}
 }
 
 
+void CIncremental::MatchLightsForRelight()
+{
+	// Hand each light in 'activelights' the data of a matching light from the file.
+	CUtlVector<CIncLight*> fileLights;
+	for( int i = m_Lights.Head(); i != m_Lights.InvalidIndex(); i = m_Lights.Next( i ) )
+	{
+		fileLights.AddToTail( m_Lights[i] );
+	}
+	m_Lights.RemoveAll();
+
+	int nLights = 0, nFromFile = 0;
+	for( directlight_t* dl = activelights; dl != NULL; dl = dl->next )
+	{
+		++nLights;
+
+		CIncLight* pLight = NULL;
+		for( int i = 0; i < fileLights.Count(); i++ )
+		{
+			if( CompareLights( dl, fileLights[i] ) )
+			{
+				pLight = fileLights[i];
+				fileLights.FastRemove( i );
+				break;
+			}
+		}
+
+		if( pLight )
+		{
+			pLight->m_bFromFile = true;
+			++nFromFile;
+		}
+		else
+		{
+			pLight = new CIncLight;
+			pLight->m_Light = dl->light;
+			pLight->m_flStartFadeDistance = dl->m_flStartFadeDistance;
+			pLight->m_flEndFadeDistance = dl->m_flEndFadeDistance;
+			pLight->m_flCapDist = dl->m_flCapDist;
+			pLight->m_bFromFile = false;
+		}
+
+		memset( pLight->m_pCachedFaces, 0, sizeof( pLight->m_pCachedFaces ) );
+		dl->m_IncrementalID = m_Lights.AddToTail( pLight );
+	}
+
+	// Whatever is left was removed or changed in the map.
+	fileLights.PurgeAndDeleteElements();
+
+	m_FileFaceLights.Purge();
+	m_FileFaceLights.SetSize( numfaces );
+	for( int iLight = m_Lights.Head(); iLight != m_Lights.InvalidIndex(); iLight = m_Lights.Next( iLight ) )
+	{
+		CIncLight* pLight = m_Lights[iLight];
+		if( !pLight->m_bFromFile )
+		{
+			continue;
+		}
+
+		for( int iFace = pLight->m_LightFaces.Head(); iFace != pLight->m_LightFaces.InvalidIndex(); iFace = pLight->m_LightFaces.Next( iFace ) )
+		{
+			CLightFace* pFace = pLight->m_LightFaces[iFace];
+			if( pFace->m_FaceIndex < numfaces )
+			{
+				m_FileFaceLights[pFace->m_FaceIndex].AddToTail( pFace );
+			}
+		}
+	}
+
+	Msg( "Incremental lighting: %d of %d lights read from %s\n", nFromFile, nLights, m_pIncrementalFilename );
+}
+
+
 bool CIncremental::LoadIncrementalFile()
 {
 	Term();
@@ -634,6 +1184,7 @@ bool CIncremental::LoadIncrementalFile()
 
 
 	// Read the lights.
+	CUtlVector<unsigned char> data;
 	int nLights;
 	FileRead( fp, nLights );
 	for( int iLight = 0; iLight < nLights; iLight++ )
@@ -642,41 +1193,94 @@ bool CIncremental::LoadIncrementalFile()
 		m_Lights.AddToTail( pLight );
 
 		FileRead( fp, pLight->m_Light );
-		pLight->m_flMaxIntensity =
-			max( pLight->m_Light.intensity.x,
-				 max( pLight->m_Light.intensity.y, pLight->m_Light.intensity.z ) );
+		FileRead( fp, pLight->m_flStartFadeDistance );
+		FileRead( fp, pLight->m_flEndFadeDistance );
+		FileRead( fp, pLight->m_flCapDist );
+		pLight->m_bFromFile = false;
 
 		int nFaces;
 		FileRead( fp, nFaces );
 		assert( nFaces < 70000 );
 
-		for( int iFace = 0; iFace < nFaces; iFace++ )
+		for( int iFace = 0; iFace < nFaces && !FileError(); iFace++ )
 		{
 			CLightFace* pFace = new CLightFace;
-			pLight->m_LightFaces.AddToTail( pFace );
+			pFace->m_LightFacesIndex = pLight->m_LightFaces.AddToTail( pFace );
 
 			pFace->m_pLight = pLight;
 			FileRead( fp, pFace->m_FaceIndex );
+			FileRead( fp, pFace->m_nNormals );
 
 			int dataSize;
 			FileRead( fp, dataSize );
+			if( dataSize < 0 || dataSize > MAX_MAP_LIGHTING )
+			{
+				FileClose( fp );
+				Term();
+				return false;
+			}
+
+			data.SetCount( dataSize );
+			FileRead( fp, data.Base(), dataSize );
 
 			pFace->m_CompressedData.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
-			while( dataSize )
+			pFace->m_CompressedData.Put( data.Base(), dataSize );
+
+			FileRead( fp, dataSize );
+			if( dataSize < 0 || dataSize > MAX_MAP_LIGHTING * INCREMENTAL_SUPERSAMPLE_GROUPS * 4 )
 			{
-				--dataSize;
+				FileClose( fp );
+				Term();
+				return false;
+			}
 
-				unsigned char ucData;
-				FileRead( fp, ucData );
+			data.SetCount( dataSize );
+			FileRead( fp, data.Base(), dataSize );
+			pFace->m_CompressedSupersamples.Put( data.Base(), dataSize );
+		}
 
-				pFace->m_CompressedData.PutUnsignedChar( ucData );
+		int nProps;
+		FileRead( fp, nProps );
+		for( int i = 0; i < nProps && !FileError(); i++ )
+		{
+			int iProp, nPoints, dataSize;
+			FileRead( fp, iProp );
+			FileRead( fp, nPoints );
+			FileRead( fp, dataSize );
+			// a point takes at most a run length and a 2 byte value
+			if( iProp < pLight->m_LightProps.Count() || iProp > 0xFFFF || nPoints < 0 || nPoints > ( 1 << 24 ) ||
+					dataSize < 0 || dataSize > nPoints * 3 + ( int )sizeof( float ) )
+			{
+				FileClose( fp );
+				Term();
+				return false;
 			}
+
+			// props are written in order, the ones in between weren't reached
+			while( pLight->m_LightProps.Count() < iProp )
+			{
+				pLight->m_LightProps.AddToTail( NULL );
+			}
+
+			CLightProp* pProp = new CLightProp;
+			pLight->m_LightProps.AddToTail( pProp );
+			pProp->m_nPoints = nPoints;
+
+			data.SetCount( dataSize );
+			FileRead( fp, data.Base(), dataSize );
+			pProp->m_CompressedData.Put( data.Base(), dataSize );
 		}
 	}
 
 
 	FileClose( fp );
-	return !FileError();
+	if( FileError() )
+	{
+		// Don't trust half a file.
+		Term();
+		return false;
+	}
+	return true;
 }
 
 
@@ -702,6 +1306,9 @@ bool CIncremental::SaveIncrementalFile()
 		CIncLight* pLight = m_Lights[iLight];
 
 		FileWrite( fp, pLight->m_Light );
+		FileWrite( fp, pLight->m_flStartFadeDistance );
+		FileWrite( fp, pLight->m_flEndFadeDistance );
+		FileWrite( fp, pLight->m_flCapDist );
 
 		int nFaces = pLight->m_LightFaces.Count();
 		FileWrite( fp, nFaces );
@@ -710,16 +1317,38 @@ bool CIncremental::SaveIncrementalFile()
 			CLightFace* pFace = pLight->m_LightFaces[iFace];
 
 			FileWrite( fp, pFace->m_FaceIndex );
+			FileWrite( fp, pFace->m_nNormals );
 
 			int dataSize = pFace->m_CompressedData.TellPut();
 			FileWrite( fp, dataSize );
+			FileWrite( fp, pFace->m_CompressedData.Base(), dataSize );
 
-			pFace->m_CompressedData.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
-			while( dataSize )
+			dataSize = pFace->m_CompressedSupersamples.TellPut();
+			FileWrite( fp, dataSize );
+			FileWrite( fp, pFace->m_CompressedSupersamples.Base(), dataSize );
+		}
+
+		int nProps = 0;
+		for( int iProp = 0; iProp < pLight->m_LightProps.Count(); iProp++ )
+		{
+			nProps += ( pLight->m_LightProps[iProp] != NULL );
+		}
+
+		FileWrite( fp, nProps );
+		for( int iProp = 0; iProp < pLight->m_LightProps.Count(); iProp++ )
+		{
+			CLightProp* pProp = pLight->m_LightProps[iProp];
+			if( !pProp )
 			{
-				--dataSize;
-				FileWrite( fp, pFace->m_CompressedData.GetUnsignedChar() );
+				continue;
 			}
+
+			FileWrite( fp, iProp );
+			FileWrite( fp, pProp->m_nPoints );
+
+			int dataSize = pProp->m_CompressedData.TellPut();
+			FileWrite( fp, dataSize );
+			FileWrite( fp, pProp->m_CompressedData.Base(), dataSize );
 		}
 	}
 
@@ -757,16 +1386,21 @@ void CIncremental::LinkLightsToFaces( CUtlVector<CFaceLightList>& faceLights )
 CIncLight::CIncLight()
 {
 	memset( m_pCachedFaces, 0, sizeof( m_pCachedFaces ) );
+	m_flStartFadeDistance = 0.0f;
+	m_flEndFadeDistance = -1.0f;
+	m_flCapDist = 1.0e22;
+	m_bFromFile = false;
 }
 
 
 CIncLight::~CIncLight()
 {
 	m_LightFaces.PurgeAndDeleteElements();
+	m_LightProps.PurgeAndDeleteElements();
 }
 
 
-CLightFace* CIncLight::FindOrCreateLightFace( int iFace, int lmSize, bool* bNew )
+CLightFace* CIncLight::FindOrCreateLightFace( int iFace, int lmSize, int nNormals, bool* bNew )
 {
 	if( bNew )
 	{
@@ -792,6 +1426,7 @@ CLightFace* CIncLight::FindOrCreateLightFace( int iFace, int lmSize, bool* bNew
 	pFace->m_pLight = this;
 
 	pFace->m_FaceIndex = iFace;
+	pFace->m_nNormals = nNormals;
 	pFace->m_LightValues.SetSize( lmSize );
 	memset( pFace->m_LightValues.Base(), 0, sizeof( CLightValue ) * lmSize );
 
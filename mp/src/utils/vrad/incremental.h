@@ -20,7 +20,7 @@
 #include "vrad.h"
 
 
-#define INCREMENTALFILE_VERSION	31241
+#define INCREMENTALFILE_VERSION	31243
 
 
 class CIncLight;
@@ -29,22 +29,70 @@ class CIncLight;
 class CLightValue
 {
 public:
-	float m_Dot;
+	float m_Dot[NUM_BUMP_VECTS + 1];
+	float m_SunAmount;
 };
 
 
 class CLightFace
 {
 public:
+	CLightFace() : m_bSupersamplesChanged( false ) {}
+
 	unsigned short				m_FaceIndex;		// global face index
 	unsigned short				m_LightFacesIndex;	// index into CIncLight::m_LightFaces.
+	unsigned char				m_nNormals;			// 1, or NUM_BUMP_VECTS + 1 for bumped faces
 
-	// The lightmap grid for this face. Only used while building lighting data for a face.
+	// The lightmap grid for this face. Only used while building lighting data for a face
+	// (or reading it back with GetLightFromFile).
 	// Compressed into m_CompressedData immediately afterwards.
 	CUtlVector<CLightValue>		m_LightValues;
 
 	CUtlBuffer					m_CompressedData;
 	CIncLight*					m_pLight;
+
+	// INCREMENTAL_SUPERSAMPLE_GROUPS * 4 values per sample, for the samples with
+	// their bit set in m_Supersampled. Like m_LightValues, these are only around
+	// while the face is lit.
+	CUtlVector<CLightValue>		m_SupersampleValues;
+	CUtlVector<unsigned char>	m_Supersampled;
+	CUtlBuffer					m_CompressedSupersamples;
+	bool						m_bSupersamplesChanged;
+};
+
+
+// Reads back a page written by CompressPage one value at a time.
+class CPageReader
+{
+public:
+	void			Init( CUtlBuffer* pIn );
+	float			Next();
+
+private:
+	CUtlBuffer*		m_pIn;
+	float			m_flScale;
+	float			m_flValue;
+	int				m_nRunLeft;
+};
+
+
+// What a light adds to the points of a static prop.
+class CLightProp
+{
+public:
+	CLightProp() : m_nPoints( 0 ), m_iReadPoint( -1 ) {}
+
+	// The points the light was traced at when the file was saved, one page of values.
+	int							m_nPoints;
+	CUtlBuffer					m_CompressedData;
+
+	// Set while the prop is lit if the light had to be traced.
+	CUtlVector<float>			m_Dots;
+
+	// GetStaticPropLightFromFile reads the points in order, m_iReadPoint is the
+	// point m_Reader returns next.
+	CPageReader					m_Reader;
+	int							m_iReadPoint;
 };
 
 
@@ -54,7 +102,7 @@ public:
 	CIncLight();
 	~CIncLight();
 
-	CLightFace*		FindOrCreateLightFace( int iFace, int lmSize, bool* bNew = NULL );
+	CLightFace*		FindOrCreateLightFace( int iFace, int lmSize, int nNormals, bool* bNew = NULL );
 
 
 public:
@@ -65,14 +113,22 @@ public:
 	// This is the light for which m_LightFaces was built.
 	dworldlight_t	m_Light;
 
+	// The parts of directlight_t that aren't in dworldlight_t.
+	float			m_flStartFadeDistance;
+	float			m_flEndFadeDistance;
+	float			m_flCapDist;
+
+	// Set by InitRelight for lights that didn't change since the incremental file was saved.
+	bool			m_bFromFile;
+
 	CLightFace*		m_pCachedFaces[MAX_TOOL_THREADS + 1];
 
 	// The list of faces that this light contributes to.
 	CUtlLinkedList<CLightFace*, unsigned short>	m_LightFaces;
 
-	// Largest value in intensity of light. Used to scale dot products up into a
-	// range where their values make sense.
-	float			m_flMaxIntensity;
+	// The static props it was traced at, by prop index. Props belong to one thread
+	// while they're lit, so these don't need the mutex.
+	CUtlVector<CLightProp*>	m_LightProps;
 };
 
 
@@ -104,6 +160,8 @@ public:
 
 	virtual bool		Init( char const* pBSPFilename, char const* pIncrementalFilename );
 
+	virtual bool		InitRelight( char const* pBSPFilename, char const* pIncrementalFilename, CRC32_t key );
+
 	// Load the light definitions out of the incremental file.
 	// Figure out which lights have changed.
 	// Change 'activelights' to only consist of new or changed lights.
@@ -114,7 +172,44 @@ public:
 		int iFace,
 		int iSample,
 		int lmSize,
-		float dot,
+		int nNormals,
+		float const* pDots,
+		float flSunAmount,
+		int iThread );
+
+	virtual bool		IsLightFromFile( IncrementalLightID lightID );
+
+	virtual bool		GetLightFromFile(
+		IncrementalLightID lightID,
+		int iFace,
+		int iSample,
+		int nSamples,
+		int lmSize,
+		int nNormals,
+		float* pDots,
+		float* pSunAmount,
+		int iThread );
+
+	virtual void		AddSupersampleLight(
+		IncrementalLightID lightID,
+		int iFace,
+		int iSample,
+		int iGroup,
+		int lmSize,
+		int nNormals,
+		float const* pDots,
+		float const* pSunAmount,
+		int iThread );
+
+	virtual bool		GetSupersampleLightFromFile(
+		IncrementalLightID lightID,
+		int iFace,
+		int iSample,
+		int iGroup,
+		int lmSize,
+		int nNormals,
+		float* pDots,
+		float* pSunAmount,
 		int iThread );
 
 	virtual void		FinishFace(
@@ -122,6 +217,29 @@ public:
 		int iFace,
 		int iThread );
 
+	virtual void		PrepareForStaticPropLighting( int nProps );
+
+	virtual void		AddLightToStaticProp(
+		IncrementalLightID lightID,
+		int iProp,
+		int iPoint,
+		int nPoints,
+		float const* pDots,
+		int iThread );
+
+	virtual bool		GetStaticPropLightFromFile(
+		IncrementalLightID lightID,
+		int iProp,
+		int iPoint,
+		int nPoints,
+		float* pDots,
+		int iThread );
+
+	virtual void		FinishStaticProp(
+		IncrementalLightID lightID,
+		int iProp,
+		int iThread );
+
 	// For each face that was changed during the lighting process, save out
 	// new data for it in the incremental file.
 	virtual bool		Finalize();
@@ -145,6 +263,9 @@ private:
 	// For each light in 'activelights', add a light to m_Lights and link them together.
 	void				AddLightsForActiveLights();
 
+	// InitRelight's PrepareForLighting. Keeps every light in 'activelights'.
+	void				MatchLightsForRelight();
+
 	// Load and save the state.
 	bool				LoadIncrementalFile();
 	bool				SaveIncrementalFile();
@@ -152,12 +273,30 @@ private:
 	typedef CUtlVector<CLightFace*> CFaceLightList;
 	void				LinkLightsToFaces( CUtlVector<CFaceLightList>& faceLights );
 
+	// The face a traced light adds its samples to.
+	CLightFace*			GetTracedFace( CIncLight* pLight, int iFace, int lmSize, int nNormals, int iThread );
+
+	// The face of a light from the file with its samples decompressed, NULL if the
+	// light didn't reach the face.
+	CLightFace*			GetFileFace( CIncLight* pLight, int iFace, int lmSize, int iThread );
+
+	// Decompresses the supersamples of a face if they aren't already.
+	void				LoadSupersamples( CLightFace* pFace, int lmSize );
+
 
 private:
 
 	char const*		m_pIncrementalFilename;
 	char const*		m_pBSPFilename;
 
+	// Set by InitRelight. Files saved with a different key are ignored.
+	bool			m_bRelight;
+	CRC32_t			m_Key;
+
+	// The faces of the lights from the file, so GetLightFromFile doesn't have
+	// to walk the whole m_LightFaces list of a light.
+	CUtlVector<CFaceLightList>	m_FileFaceLights;
+
 	CUtlLinkedList<CIncLight*, IncrementalLightID>
 	m_Lights;
 
@@ -16,6 +16,7 @@
 #include "messbuf.h"
 #include "vmpi.h"
 #include "vmpi_distribute_work.h"
+#include "utlmap.h"
 
 static TableVector g_BoxDirections[6] =
 {
@@ -97,53 +98,269 @@ float Engine_WorldLightDistanceFalloff( const dworldlight_t* wl, const Vector& d
 }
 
 
-void AddEmitSurfaceLights( const Vector& vStart, Vector lightBoxColor[6] )
+//-----------------------------------------------------------------------------
+// Visibility of the emit_surface lights, shared between nearby samples
+//
+// A sample that can see the center of its LEAF_AMBIENT_VIS_CELL sized cell uses
+// the light visibility from that center, so every sample in the cell (and the
+// same cluster) shares one set of rays, no matter which leaf it's in. The
+// center traces every light that could reach any point in the cell. The
+// results only depend on the cell, so it doesn't matter which thread gets
+// there first.
+//-----------------------------------------------------------------------------
+
+#define LEAF_AMBIENT_VIS_CELL	16.0f
+
+struct lightvis_t
+{
+	int		m_nLight;			// dworldlights index
+	float	m_flVisible;
+};
+
+static CUtlVector<int>									s_AmbientCubeLights;	// the dworldlights in the ambient cubes
+static CUtlMap<uint64, CUtlVector<lightvis_t>*>		s_LightVisCells( DefLessFunc( uint64 ) );
+static CThreadFastMutex									s_LightVisCellsMutex;
+
+// How much of the light the point gets, before visibility. flSlack relaxes the tests
+// so they pass for any point within flSlack of pos.
+static float EmitSurfaceLightScale( dworldlight_t* wl, const Vector& pos, float flSlack )
 {
-	fltx4 fractionVisible;
+	Vector vDelta = wl->origin - pos;
+	if( flSlack > 0 )
+	{
+		if( wl->radius != 0 && vDelta.Length() > wl->radius + flSlack )
+		{
+			return 0.0f;
+		}
+		return ( DotProduct( vDelta, wl->normal ) < flSlack ) ? 1.0f : 0.0f;
+	}
+
+	float flDistanceScale = Engine_WorldLightDistanceFalloff( wl, vDelta );
 
-	FourVectors vStart4, wlOrigin4;
-	vStart4.DuplicateVector( vStart );
+	Vector vDeltaNorm = vDelta;
+	VectorNormalize( vDeltaNorm );
+	float flAngleScale = Engine_WorldLightAngle( wl, wl->normal, vDeltaNorm, vDeltaNorm );
 
-	for( int iLight = 0; iLight < *pNumworldlights; iLight++ )
+	return flDistanceScale * flAngleScale;
+}
+
+// Traces all the rays at once, 4 at a time. pVisible gets the visible fraction of each.
+static void TraceAmbientRays( const Vector* pStarts, const Vector* pEnds, int nRays, float* pVisible )
+{
+	for( int i = 0; i < nRays; i += 4 )
 	{
-		dworldlight_t* wl = &dworldlights[iLight];
+		int nPacket = min( 4, nRays - i );
 
-		// Should this light even go in the ambient cubes?
-		if( !( wl->flags & DWL_FLAGS_INAMBIENTCUBE ) )
+		Vector starts[4], ends[4];
+		for( int k = 0; k < 4; k++ )
 		{
-			continue;
+			starts[k] = pStarts[i + min( k, nPacket - 1 )];
+			ends[k] = pEnds[i + min( k, nPacket - 1 )];
 		}
 
-		Assert( wl->type == emit_surface );
+		FourVectors start4, end4;
+		start4.LoadAndSwizzle( starts[0], starts[1], starts[2], starts[3] );
+		end4.LoadAndSwizzle( ends[0], ends[1], ends[2], ends[3] );
 
-		// Can this light see the point?
-		wlOrigin4.DuplicateVector( wl->origin );
-		TestLine( vStart4, wlOrigin4, &fractionVisible );
-		if( !TestSignSIMD( CmpGtSIMD( fractionVisible, Four_Zeros ) ) )
+		fltx4 fractionVisible;
+		TestLine( start4, end4, &fractionVisible );
+		for( int k = 0; k < nPacket; k++ )
+		{
+			pVisible[i + k] = SubFloat( fractionVisible, k );
+		}
+	}
+}
+
+static uint64 LightVisCellKey( int cluster, int x, int y, int z )
+{
+	return ( ( uint64 )( cluster + 1 ) << 48 ) | ( ( uint64 )( x & 0xffff ) << 32 ) | ( ( uint64 )( y & 0xffff ) << 16 ) | ( uint64 )( z & 0xffff );
+}
+
+// Returns the visible lights from a cell center, tracing them the first time
+static const CUtlVector<lightvis_t>* GetLightVisCell( uint64 key, const Vector& vCenter )
+{
+	{
+		AUTO_LOCK_FM( s_LightVisCellsMutex );
+		unsigned short i = s_LightVisCells.Find( key );
+		if( i != s_LightVisCells.InvalidIndex() )
+		{
+			return s_LightVisCells[i];
+		}
+	}
+
+	float flSlack = LEAF_AMBIENT_VIS_CELL * 0.5f * 1.7321f;
+
+	CUtlVector<Vector> starts, ends;
+	CUtlVector<int> lights;
+	for( int i = 0; i < s_AmbientCubeLights.Count(); i++ )
+	{
+		dworldlight_t* wl = &dworldlights[s_AmbientCubeLights[i]];
+		if( EmitSurfaceLightScale( wl, vCenter, flSlack ) == 0.0f )
 		{
 			continue;
 		}
+		starts.AddToTail( vCenter );
+		ends.AddToTail( wl->origin );
+		lights.AddToTail( s_AmbientCubeLights[i] );
+	}
 
-		// Add this light's contribution.
-		Vector vDelta = wl->origin - vStart;
-		float flDistanceScale = Engine_WorldLightDistanceFalloff( wl, vDelta );
+	CUtlVector<float> visible;
+	visible.SetCount( lights.Count() );
+	TraceAmbientRays( starts.Base(), ends.Base(), lights.Count(), visible.Base() );
 
-		Vector vDeltaNorm = vDelta;
-		VectorNormalize( vDeltaNorm );
-		float flAngleScale = Engine_WorldLightAngle( wl, wl->normal, vDeltaNorm, vDeltaNorm );
+	// sorted by light, since s_AmbientCubeLights is
+	CUtlVector<lightvis_t>* pCell = new CUtlVector<lightvis_t>;
+	for( int i = 0; i < lights.Count(); i++ )
+	{
+		if( visible[i] > 0.0f )
+		{
+			lightvis_t& vis = pCell->Element( pCell->AddToTail() );
+			vis.m_nLight = lights[i];
+			vis.m_flVisible = visible[i];
+		}
+	}
 
-		float ratio = flDistanceScale * flAngleScale * SubFloat( fractionVisible, 0 );
-		if( ratio == 0 )
+	// another thread may have done the same cell meanwhile, its results are the same
+	AUTO_LOCK_FM( s_LightVisCellsMutex );
+	unsigned short i = s_LightVisCells.Find( key );
+	if( i != s_LightVisCells.InvalidIndex() )
+	{
+		delete pCell;
+		return s_LightVisCells[i];
+	}
+	s_LightVisCells.Insert( key, pCell );
+	return pCell;
+}
+
+static float FindLightVis( const CUtlVector<lightvis_t>& cell, int nLight )
+{
+	int lo = 0, hi = cell.Count() - 1;
+	while( lo <= hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		if( cell[mid].m_nLight == nLight )
 		{
+			return cell[mid].m_flVisible;
+		}
+		if( cell[mid].m_nLight < nLight )
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	return 0.0f;
+}
+
+// Adds the emit_surface lights to the cubes of all of a leaf's samples. The rays of the
+// samples that can't use their cell go out together in one batch.
+// pCubes holds 6 colors per sample
+static void AddEmitSurfaceLights( int leafID, const Vector* pPositions, Vector* pCubes, int nSamples )
+{
+	if( !s_AmbientCubeLights.Count() || !nSamples )
+	{
+		return;
+	}
+
+	int cluster = dleafs[leafID].cluster;
+
+	// find the cells and see if the samples can use them
+	CUtlVector<uint64> keys;
+	CUtlVector<Vector> centers;
+	CUtlVector<float> centerVisible;
+	keys.SetCount( nSamples );
+	centers.SetCount( nSamples );
+	centerVisible.SetCount( nSamples );
+	for( int i = 0; i < nSamples; i++ )
+	{
+		int x = ( int )floor( pPositions[i].x / LEAF_AMBIENT_VIS_CELL );
+		int y = ( int )floor( pPositions[i].y / LEAF_AMBIENT_VIS_CELL );
+		int z = ( int )floor( pPositions[i].z / LEAF_AMBIENT_VIS_CELL );
+		keys[i] = LightVisCellKey( cluster, x, y, z );
+		centers[i].Init( ( x + 0.5f ) * LEAF_AMBIENT_VIS_CELL, ( y + 0.5f ) * LEAF_AMBIENT_VIS_CELL, ( z + 0.5f ) * LEAF_AMBIENT_VIS_CELL );
+
+		// the center has to be out in the open, in the same part of the map
+		int centerLeaf = PointLeafnum( centers[i] );
+		if( cluster < 0 || dleafs[centerLeaf].cluster != cluster || ( dleafs[centerLeaf].contents & CONTENTS_SOLID ) )
+		{
+			centers[i] = pPositions[i];
+		}
+	}
+	TraceAmbientRays( pPositions, centers.Base(), nSamples, centerVisible.Base() );
+
+	CUtlVector<const CUtlVector<lightvis_t>*> cells;
+	cells.SetCount( nSamples );
+	CUtlVector<Vector> starts, ends;
+	CUtlVector<int> rays;		// sample * lights + light, for the samples that trace their own
+	for( int i = 0; i < nSamples; i++ )
+	{
+		cells[i] = NULL;
+		if( centers[i] != pPositions[i] && centerVisible[i] >= 1.0f )
+		{
+			cells[i] = GetLightVisCell( keys[i], centers[i] );
 			continue;
 		}
 
-		for( int i = 0; i < 6; i++ )
+		for( int j = 0; j < s_AmbientCubeLights.Count(); j++ )
 		{
-			float t = DotProduct( g_BoxDirections[i], vDeltaNorm );
-			if( t > 0 )
+			dworldlight_t* wl = &dworldlights[s_AmbientCubeLights[j]];
+			if( EmitSurfaceLightScale( wl, pPositions[i], 0.0f ) == 0.0f )
 			{
-				lightBoxColor[i] += wl->intensity * ( t * ratio );
+				continue;
+			}
+			starts.AddToTail( pPositions[i] );
+			ends.AddToTail( wl->origin );
+			rays.AddToTail( i * s_AmbientCubeLights.Count() + j );
+		}
+	}
+
+	CUtlVector<float> visible;
+	visible.SetCount( rays.Count() );
+	TraceAmbientRays( starts.Base(), ends.Base(), rays.Count(), visible.Base() );
+
+	int iRay = 0;
+	for( int i = 0; i < nSamples; i++ )
+	{
+		for( int j = 0; j < s_AmbientCubeLights.Count(); j++ )
+		{
+			float flVisible;
+			if( cells[i] )
+			{
+				flVisible = FindLightVis( *cells[i], s_AmbientCubeLights[j] );
+			}
+			else if( iRay < rays.Count() && rays[iRay] == i * s_AmbientCubeLights.Count() + j )
+			{
+				flVisible = visible[iRay++];
+			}
+			else
+			{
+				continue;
+			}
+
+			if( flVisible <= 0.0f )
+			{
+				continue;
+			}
+
+			// Add this light's contribution.
+			dworldlight_t* wl = &dworldlights[s_AmbientCubeLights[j]];
+			float ratio = EmitSurfaceLightScale( wl, pPositions[i], 0.0f ) * flVisible;
+			if( ratio == 0 )
+			{
+				continue;
+			}
+
+			Vector vDeltaNorm = wl->origin - pPositions[i];
+			VectorNormalize( vDeltaNorm );
+			for( int k = 0; k < 6; k++ )
+			{
+				float t = DotProduct( g_BoxDirections[k], vDeltaNorm );
+				if( t > 0 )
+				{
+					pCubes[i * 6 + k] += wl->intensity * ( t * ratio );
+				}
 			}
 		}
 	}
@@ -156,16 +373,33 @@ void ComputeAmbientFromSphericalSamples( int iThread, const Vector& vStart, Vect
 	Vector radcolor[NUMVERTEXNORMALS];
 	float tanTheta = tan( VERTEXNORMAL_CONE_INNER_ANGLE );
 
-	for( int i = 0; i < NUMVERTEXNORMALS; i++ )
+	FourVectors start4;
+	start4.DuplicateVector( vStart );
+
+	for( int i = 0; i < NUMVERTEXNORMALS; i += 4 )
 	{
-		Vector vEnd = vStart + g_anorms[i] * ( COORD_EXTENT * 1.74 );
+		int nRays = min( 4, NUMVERTEXNORMALS - i );
+
+		Vector ends[4];
+		for( int k = 0; k < 4; k++ )
+		{
+			ends[k] = vStart + g_anorms[i + min( k, nRays - 1 )] * ( COORD_EXTENT * 1.74 );
+		}
+		FourVectors end4;
+		end4.LoadAndSwizzle( ends[0], ends[1], ends[2], ends[3] );
 
-		// Now that we've got a ray, see what surface we've hit
-		Vector lightStyleColors[MAX_LIGHTSTYLES];
-		lightStyleColors[0].Init();	// We only care about light style 0 here.
-		CalcRayAmbientLighting( iThread, vStart, vEnd, tanTheta, lightStyleColors );
+		// Now that we've got the rays, see what surfaces they hit
+		Vector lightStyleColors[4][MAX_LIGHTSTYLES];
+		for( int k = 0; k < nRays; k++ )
+		{
+			lightStyleColors[k][0].Init();	// We only care about light style 0 here.
+		}
+		CalcRayAmbientLighting4Separate( start4, end4, nRays, tanTheta, lightStyleColors );
 
-		radcolor[i] = lightStyleColors[0];
+		for( int k = 0; k < nRays; k++ )
+		{
+			radcolor[i + k] = lightStyleColors[k][0];
+		}
 	}
 
 	// accumulate samples into radiant box
@@ -188,9 +422,7 @@ void ComputeAmbientFromSphericalSamples( int iThread, const Vector& vStart, Vect
 		lightBoxColor[j] *= 1 / t;
 	}
 
-	// Now add direct light from the emit_surface lights. These go in the ambient cube because
-	// there are a ton of them and they are often so dim that they get filtered out by r_worldlightmin.
-	AddEmitSurfaceLights( vStart, lightBoxColor );
+	// NOTE: ComputeAmbientForLeaf adds the emit_surface lights once it has all of the leaf's samples
 }
 
 
@@ -487,54 +719,165 @@ float AABBDistance( const Vector& mins0, const Vector& maxs0, const Vector& mins
 	return delta.Length();
 }
 
-// build a list of leaves from a query
-class CLeafList : public ISpatialLeafEnumerator
+// conver short[3] to vector
+static void LeafBounds( int leafIndex, Vector& mins, Vector& maxs )
 {
-public:
-	virtual bool EnumerateLeaf( int leaf, int context )
+	for( int i = 0; i < 3; i++ )
 	{
-		m_list.AddToTail( leaf );
-		return true;
+		mins[i] = dleafs[leafIndex].mins[i];
+		maxs[i] = dleafs[leafIndex].maxs[i];
 	}
+}
+
+//-----------------------------------------------------------------------------
+// A kd tree over the bounds of the leaves that got ambient samples, so each
+// leaf without any can find its nearest lit neighbor without walking the bsp
+//-----------------------------------------------------------------------------
 
-	CUtlVector<int> m_list;
+#define LIT_LEAF_TREE_LEAF_SIZE	8
+
+struct litleafnode_t
+{
+	Vector	m_Mins;
+	Vector	m_Maxs;
+	int		m_nChildren[2];		// -1 for a leaf node
+	int		m_nFirstLeaf;		// into s_LitLeaves
+	int		m_nLeafCount;
 };
 
-// conver short[3] to vector
-static void LeafBounds( int leafIndex, Vector& mins, Vector& maxs )
+static CUtlVector<int>				s_LitLeaves;
+static CUtlVector<litleafnode_t>	s_LitLeafNodes;
+static int							s_nLitLeafSortAxis;
+
+static int LitLeafCompare( const void* p0, const void* p1 )
 {
-	for( int i = 0; i < 3; i++ )
+	int leaf0 = *( const int* )p0;
+	int leaf1 = *( const int* )p1;
+	int center0 = dleafs[leaf0].mins[s_nLitLeafSortAxis] + dleafs[leaf0].maxs[s_nLitLeafSortAxis];
+	int center1 = dleafs[leaf1].mins[s_nLitLeafSortAxis] + dleafs[leaf1].maxs[s_nLitLeafSortAxis];
+	if( center0 != center1 )
 	{
-		mins[i] = dleafs[leafIndex].mins[i];
-		maxs[i] = dleafs[leafIndex].maxs[i];
+		return center0 < center1 ? -1 : 1;
+	}
+	return leaf0 - leaf1;
+}
+
+static int BuildLitLeafNode( int nFirstLeaf, int nLeafCount )
+{
+	int nodeIndex = s_LitLeafNodes.AddToTail();
+	litleafnode_t node;
+	node.m_nChildren[0] = node.m_nChildren[1] = -1;
+	node.m_nFirstLeaf = nFirstLeaf;
+	node.m_nLeafCount = nLeafCount;
+
+	LeafBounds( s_LitLeaves[nFirstLeaf], node.m_Mins, node.m_Maxs );
+	for( int i = 1; i < nLeafCount; i++ )
+	{
+		Vector mins, maxs;
+		LeafBounds( s_LitLeaves[nFirstLeaf + i], mins, maxs );
+		VectorMin( node.m_Mins, mins, node.m_Mins );
+		VectorMax( node.m_Maxs, maxs, node.m_Maxs );
+	}
+
+	if( nLeafCount > LIT_LEAF_TREE_LEAF_SIZE )
+	{
+		Vector size = node.m_Maxs - node.m_Mins;
+		s_nLitLeafSortAxis = ( size.x > size.y ) ? ( ( size.x > size.z ) ? 0 : 2 ) : ( ( size.y > size.z ) ? 1 : 2 );
+		qsort( &s_LitLeaves[nFirstLeaf], nLeafCount, sizeof( int ), LitLeafCompare );
+
+		int nHalf = nLeafCount / 2;
+		node.m_nChildren[0] = BuildLitLeafNode( nFirstLeaf, nHalf );
+		node.m_nChildren[1] = BuildLitLeafNode( nFirstLeaf + nHalf, nLeafCount - nHalf );
+	}
+
+	// the recursion may have moved the nodes
+	s_LitLeafNodes[nodeIndex] = node;
+	return nodeIndex;
+}
+
+static void BuildLitLeafTree()
+{
+	s_LitLeaves.RemoveAll();
+	s_LitLeafNodes.RemoveAll();
+	for( int i = 0; i < numleafs; i++ )
+	{
+		if( g_pLeafAmbientIndex->Element( i ).ambientSampleCount )
+		{
+			s_LitLeaves.AddToTail( i );
+		}
+	}
+
+	if( s_LitLeaves.Count() )
+	{
+		BuildLitLeafNode( 0, s_LitLeaves.Count() );
 	}
 }
 
+static bool BoxesOverlap( const Vector& mins0, const Vector& maxs0, const Vector& mins1, const Vector& maxs1 )
+{
+	return mins0.x <= maxs1.x && mins1.x <= maxs0.x &&
+		   mins0.y <= maxs1.y && mins1.y <= maxs0.y &&
+		   mins0.z <= maxs1.z && mins1.z <= maxs0.z;
+}
+
 // returns the index of the nearest leaf with ambient samples
 int NearestNeighborWithLight( int leafID )
 {
 	Vector mins, maxs;
 	LeafBounds( leafID, mins, maxs );
+
+	// only look at the leaves touching a box around this one, twice its size
 	Vector size = maxs - mins;
-	CLeafList leafList;
-	ToolBSPTree()->EnumerateLeavesInBox( mins - size, maxs + size, &leafList, 0 );
+	Vector windowMins = mins - size;
+	Vector windowMaxs = maxs + size;
+
 	float bestDist = FLT_MAX;
 	int bestIndex = leafID;
-	for( int i = 0; i < leafList.m_list.Count(); i++ )
+	if( !s_LitLeafNodes.Count() )
 	{
-		int testIndex = leafList.m_list[i];
-		if( !g_pLeafAmbientIndex->Element( testIndex ).ambientSampleCount )
+		return bestIndex;
+	}
+
+	int stack[64];
+	int nStack = 0;
+	stack[nStack++] = 0;
+	while( nStack )
+	{
+		const litleafnode_t& node = s_LitLeafNodes[stack[--nStack]];
+		if( !BoxesOverlap( node.m_Mins, node.m_Maxs, windowMins, windowMaxs ) )
+		{
+			continue;
+		}
+		if( AABBDistance( mins, maxs, node.m_Mins, node.m_Maxs ) > bestDist )
 		{
 			continue;
 		}
 
-		Vector testMins, testMaxs;
-		LeafBounds( testIndex, testMins, testMaxs );
-		float dist = AABBDistance( mins, maxs, testMins, testMaxs );
-		if( dist < bestDist )
+		if( node.m_nChildren[0] != -1 && nStack + 2 <= ARRAYSIZE( stack ) )
 		{
-			bestDist = dist;
-			bestIndex = testIndex;
+			stack[nStack++] = node.m_nChildren[0];
+			stack[nStack++] = node.m_nChildren[1];
+			continue;
+		}
+
+		// also covers the (impossible) case of a tree deeper than the stack
+		for( int i = 0; i < node.m_nLeafCount; i++ )
+		{
+			int testIndex = s_LitLeaves[node.m_nFirstLeaf + i];
+
+			Vector testMins, testMaxs;
+			LeafBounds( testIndex, testMins, testMaxs );
+			if( !BoxesOverlap( testMins, testMaxs, windowMins, windowMaxs ) )
+			{
+				continue;
+			}
+
+			float dist = AABBDistance( mins, maxs, testMins, testMaxs );
+			if( dist < bestDist || ( dist == bestDist && testIndex < bestIndex ) )
+			{
+				bestDist = dist;
+				bestIndex = testIndex;
+			}
 		}
 	}
 	return bestIndex;
@@ -582,15 +925,25 @@ void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t>
 		// NOTE: We copy the nearest non-solid leaf sample pointers into this leaf at the end
 		return;
 	}
-	Vector cube[6];
+	// place all the samples first so the rays to the emit_surface lights can go out together
+	CUtlVector<Vector> positions;
+	CUtlVector<Vector> cubes;
+	positions.SetCount( sampleCount );
+	cubes.SetCount( sampleCount * 6 );
+	for( int i = 0; i < sampleCount; i++ )
+	{
+		sampler.GenerateLeafSamplePosition( leafID, leafPlanes, positions[i] );
+		ComputeAmbientFromSphericalSamples( iThread, positions[i], &cubes[i * 6] );
+	}
+
+	// Now add direct light from the emit_surface lights. These go in the ambient cube because
+	// there are a ton of them and they are often so dim that they get filtered out by r_worldlightmin.
+	AddEmitSurfaceLights( leafID, positions.Base(), cubes.Base(), sampleCount );
+
 	for( int i = 0; i < sampleCount; i++ )
 	{
-		// compute each candidate sample and add to the list
-		Vector samplePosition;
-		sampler.GenerateLeafSamplePosition( leafID, leafPlanes, samplePosition );
-		ComputeAmbientFromSphericalSamples( iThread, samplePosition, cube );
 		// note this will remove the least valuable sample once the limit is reached
-		AddSampleToList( list, samplePosition, cube );
+		AddSampleToList( list, positions[i], &cubes[i * 6] );
 	}
 
 	// remove any samples that can be reconstructed with the remaining data
@@ -683,10 +1036,30 @@ void ComputePerLeafAmbientLighting()
 
 	Msg( "%d of %d (%d%% of) surface lights went in leaf ambient cubes.\n", nInAmbientCube, nSurfaceLights, nSurfaceLights ? ( ( nInAmbientCube * 100 ) / nSurfaceLights ) : 0 );
 
+	// the lights the samples have to test, in order
+	s_AmbientCubeLights.RemoveAll();
+	for( int i = 0; i < *pNumworldlights; i++ )
+	{
+		if( dworldlights[i].flags & DWL_FLAGS_INAMBIENTCUBE )
+		{
+			s_AmbientCubeLights.AddToTail( i );
+		}
+	}
+
+	// the sphere rays are traced against the world triangles
+	SetupLightSurfaceTrace();
+
 	g_LeafAmbientSamples.SetCount( numleafs );
 
 	RunThreadsOn( numleafs, true, ThreadComputeLeafAmbient );
 
+	for( unsigned short i = s_LightVisCells.FirstInorder(); i != s_LightVisCells.InvalidIndex(); i = s_LightVisCells.NextInorder( i ) )
+	{
+		delete s_LightVisCells[i];
+	}
+	s_LightVisCells.RemoveAll();
+	s_AmbientCubeLights.Purge();
+
 	// now write out the data
 	Msg( "Writing leaf ambient..." );
 	g_pLeafAmbientIndex->RemoveAll();
@@ -721,6 +1094,7 @@ void ComputePerLeafAmbientLighting()
 			}
 		}
 	}
+	BuildLitLeafTree();
 	for( int i = 0; i < numleafs; i++ )
 	{
 		// UNDONE: Do this dynamically in the engine instead.  This will allow us to sample across leaf
@@ -737,6 +1111,8 @@ void ComputePerLeafAmbientLighting()
 			g_pLeafAmbientIndex->Element( i ).firstAmbientSample = refLeaf;
 		}
 	}
+	s_LitLeaves.Purge();
+	s_LitLeafNodes.Purge();
 	Msg( "done\n" );
 }
 
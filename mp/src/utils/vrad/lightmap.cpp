@@ -1776,30 +1776,46 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t& out, directlight_t* dl, i
 	}
 
 	fltx4 totalFractionVisible = Four_Zeros;
-	fltx4 fractionVisible = Four_Zeros;
+	fltx4 fractionVisible[2];
 
 	DirectionalSampler_t sampler;
 
-	for( int d = 0; d < nsamples; d++ )
+	// samples are traced in pairs so the sun's area light fills 8 wide ray packets
+	FourVectors start4[2] = { pos, pos };
+	FourVectors delta4[2];
+	for( int d = 0; d < nsamples; d += 2 )
 	{
-		// determine visibility of skylight
-		// serach back to see if we can hit a sky brush
-		Vector delta;
-		VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
-		if( d )
+		int nbatch = min( 2, nsamples - d );
+		for( int k = 0; k < nbatch; k++ )
 		{
-			// jitter light source location
-			Vector ofs = sampler.NextValue();
-			ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
-			delta += ofs;
+			// determine visibility of skylight
+			// serach back to see if we can hit a sky brush
+			Vector delta;
+			VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
+			if( d + k )
+			{
+				// jitter light source location
+				Vector ofs = sampler.NextValue();
+				ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
+				delta += ofs;
+			}
+			delta4[k].DuplicateVector( delta );
+			delta4[k] += pos;
 		}
-		FourVectors delta4;
-		delta4.DuplicateVector( delta );
-		delta4 += pos;
 
-		TestLine_DoesHitSky( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
+		if( nbatch == 2 )
+		{
+			TestLine_DoesHitSky8( start4, delta4, fractionVisible, true, static_prop_index_to_ignore );
+		}
+		else
+		{
+			TestLine_DoesHitSky( pos, delta4[0], &fractionVisible[0], true, static_prop_index_to_ignore );
+		}
 
-		totalFractionVisible = AddSIMD( totalFractionVisible, fractionVisible );
+		for( int k = 0; k < nbatch; k++ )
+		{
+			totalFractionVisible = AddSIMD( totalFractionVisible, fractionVisible[k] );
+		}
 	}
 
 	fltx4 seeAmount = MulSIMD( totalFractionVisible, ReplicateX4( 1.0f / nsamples ) );
@@ -1820,6 +1836,32 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t& out, directlight_t* dl, i
 	}
 }
 
+// Traces 1 or 2 sets of sky directions for GatherSampleAmbientSkySSE and adds in the light that
+// gets through, weighted by each direction's dot products
+static void AddAmbientSkySamples( int nSamples, FourVectors const* start, FourVectors const* stop,
+								  fltx4 dots[][NUM_BUMP_VECTS + 1], int normalCount, fltx4* ambient_intensity,
+								  int static_prop_index_to_ignore )
+{
+	fltx4 fractionVisible[2];
+	if( nSamples == 2 )
+	{
+		TestLine_DoesHitSky8( start, stop, fractionVisible, true, static_prop_index_to_ignore );
+	}
+	else
+	{
+		TestLine_DoesHitSky( start[0], stop[0], &fractionVisible[0], true, static_prop_index_to_ignore );
+	}
+
+	for( int k = 0; k < nSamples; k++ )
+	{
+		for( int i = 0; i < normalCount; i++ )
+		{
+			fltx4 addedAmount = MulSIMD( fractionVisible[k], dots[k][i] );
+			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+		}
+	}
+}
+
 // Helper function - gathers light from ambient sky light
 void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t& out, directlight_t* dl, int facenum,
 								FourVectors const& pos, FourVectors* pNormals, int normalCount, int iThread,
@@ -1833,7 +1875,11 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t& out, directlight_t* dl,
 	fltx4 sumdot = Four_Zeros;
 	fltx4 ambient_intensity[NUM_BUMP_VECTS + 1];
 	fltx4 possibleHitCount[NUM_BUMP_VECTS + 1];
-	fltx4 dots[NUM_BUMP_VECTS + 1];
+
+	// directions are traced in pairs so they fill 8 wide ray packets
+	fltx4 pendingDots[2][NUM_BUMP_VECTS + 1];
+	FourVectors pendingStart[2], pendingStop[2];
+	int nPending = 0;
 
 	for( int i = 0; i < normalCount; i++ )
 	{
@@ -1857,6 +1903,8 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t& out, directlight_t* dl,
 		FourVectors anorm;
 		anorm.DuplicateVector( sampler.NextValue() );
 
+		fltx4* dots = pendingDots[nPending];
+
 		if( bIgnoreNormals )
 		{
 			dots[0] = ReplicateX4( CONSTANT_DOT );
@@ -1894,22 +1942,26 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t& out, directlight_t* dl,
 		}
 
 		// search back to see if we can hit a sky brush
-		FourVectors delta = anorm;
+		FourVectors& delta = pendingStop[nPending];
+		delta = anorm;
 		delta *= -MAX_TRACE_LENGTH;
 		delta += pos;
-		FourVectors surfacePos = pos;
+		FourVectors& surfacePos = pendingStart[nPending];
+		surfacePos = pos;
 		FourVectors offset = anorm;
 		offset *= -flEpsilon;
 		surfacePos -= offset;
 
-		fltx4 fractionVisible = Four_Ones;
-		TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
-		for( int i = 0; i < normalCount; i++ )
+		if( ++nPending == 2 )
 		{
-			fltx4 addedAmount = MulSIMD( fractionVisible, dots[i] );
-			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+			AddAmbientSkySamples( nPending, pendingStart, pendingStop, pendingDots, normalCount, ambient_intensity, static_prop_index_to_ignore );
+			nPending = 0;
 		}
+	}
 
+	if( nPending )
+	{
+		AddAmbientSkySamples( nPending, pendingStart, pendingStop, pendingDots, normalCount, ambient_intensity, static_prop_index_to_ignore );
 	}
 
 	out.m_flFalloff = Four_Ones;
@@ -1925,14 +1977,22 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t& out, directlight_t* dl,
 
 }
 
-// Helper function - gathers light from area lights, spot lights, and point lights
-void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t& out, directlight_t* dl, int facenum,
-								   FourVectors const& pos, FourVectors* pNormals, int normalCount, int iThread,
-								   int nLFlags, int static_prop_index_to_ignore,
-								   float flEpsilon )
+// What a point, spot or surface light needs besides its shadow ray
+struct SSE_StandardLightTrace_t
 {
-	bool bIgnoreNormals = ( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) != 0;
+	FourVectors	m_Start;
+	FourVectors	m_Stop;
+	FourVectors	m_Delta;	// normalized, towards the light
+	fltx4		m_flDot;	// before visibility
+};
 
+//-----------------------------------------------------------------------------
+// Falloff and dot of a point, spot or surface light, and where its shadow ray
+// goes. Returns false if none of the samples can be lit, out stays zero then.
+//-----------------------------------------------------------------------------
+static bool SetupStandardLightSSE( SSE_sampleLightOutput_t& out, SSE_StandardLightTrace_t& trace, directlight_t* dl,
+								   FourVectors const& pos, FourVectors* pNormals, int nLFlags )
+{
 	FourVectors src;
 	src.DuplicateVector( vec3_origin );
 
@@ -1952,7 +2012,7 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t& out, directlight_t*
 
 	// Compute dot
 	fltx4 dot = ReplicateX4( ( float ) CONSTANT_DOT );
-	if( !bIgnoreNormals )
+	if( !( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) )
 	{
 		dot = delta * pNormals[0];
 	}
@@ -1966,7 +2026,7 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t& out, directlight_t*
 		dot = AndSIMD( dot, notPastFadeDist );  // dot = 0 if past fade distance
 		if( !TestSignSIMD( notPastFadeDist ) )
 		{
-			return;
+			return false;
 		}
 	}
 
@@ -1999,7 +2059,7 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t& out, directlight_t*
 			dot2 = MaxSIMD( Four_Zeros, dot2 );
 			if( TestSignSIMD( CmpEqSIMD( Four_Zeros, dot ) ) == 0xF )
 			{
-				return;
+				return false;
 			}
 
 			out.m_flFalloff = ReciprocalSIMD( dist2 );
@@ -2019,7 +2079,7 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t& out, directlight_t*
 			inCone = CmpGtSIMD( dot2, ReplicateX4( dl->light.stopdot2 ) );
 			if( !TestSignSIMD( inCone ) )
 			{
-				return;
+				return false;
 			}
 			dot = AndSIMD( inCone, dot );
 
@@ -2079,11 +2139,19 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t& out, directlight_t*
 		out.m_flFalloff = MulSIMD( mult, out.m_flFalloff );
 	}
 
-	// Raytrace for visibility function
-	fltx4 fractionVisible = Four_Ones;
-	TestLine( pos, src, &fractionVisible, static_prop_index_to_ignore );
-	dot = MulSIMD( fractionVisible, dot );
-	out.m_flDot[0] = dot;
+	trace.m_Start = pos;
+	trace.m_Stop = src;
+	trace.m_Delta = delta;
+	trace.m_flDot = dot;
+	return true;
+}
+
+static void FinishStandardLightSSE( SSE_sampleLightOutput_t& out, SSE_StandardLightTrace_t& trace, fltx4 fractionVisible,
+									FourVectors* pNormals, int normalCount, int nLFlags )
+{
+	bool bIgnoreNormals = ( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) != 0;
+
+	out.m_flDot[0] = MulSIMD( fractionVisible, trace.m_flDot );
 
 	for( int i = 1; i < normalCount; i++ )
 	{
@@ -2093,23 +2161,37 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t& out, directlight_t*
 		}
 		else
 		{
-			out.m_flDot[i] = pNormals[i] * delta;
+			out.m_flDot[i] = pNormals[i] * trace.m_Delta;
 			out.m_flDot[i] = MaxSIMD( Four_Zeros, out.m_flDot[i] );
 		}
 	}
 }
 
+// Helper function - gathers light from area lights, spot lights, and point lights
+void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t& out, directlight_t* dl, int facenum,
+								   FourVectors const& pos, FourVectors* pNormals, int normalCount, int iThread,
+								   int nLFlags, int static_prop_index_to_ignore,
+								   float flEpsilon )
+{
+	SSE_StandardLightTrace_t trace;
+	if( !SetupStandardLightSSE( out, trace, dl, pos, pNormals, nLFlags ) )
+	{
+		return;
+	}
+
+	// Raytrace for visibility function
+	fltx4 fractionVisible = Four_Ones;
+	TestLine( trace.m_Start, trace.m_Stop, &fractionVisible, static_prop_index_to_ignore );
+	FinishStandardLightSSE( out, trace, fractionVisible, pNormals, normalCount, nLFlags );
+}
+
 // returns dot product with normal and delta
 // dl - light
 // pos - position of sample
 // normal - surface normal of sample
 // out.m_flDot[] - returned dot products with light vector and each normal
 // out.m_flFalloff - amount of light falloff
-void GatherSampleLightSSE( SSE_sampleLightOutput_t& out, directlight_t* dl, int facenum,
-						   FourVectors const& pos, FourVectors* pNormals, int normalCount, int iThread,
-						   int nLFlags,
-						   int static_prop_index_to_ignore,
-						   float flEpsilon )
+static void ClearSampleLightOutput( SSE_sampleLightOutput_t& out, int normalCount )
 {
 	for( int b = 0; b < normalCount; b++ )
 	{
@@ -2118,6 +2200,30 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t& out, directlight_t* dl, int
 	out.m_flFalloff = Four_Zeros;
 	out.m_flSunAmount = Four_Zeros;
 	Assert( normalCount <= ( NUM_BUMP_VECTS + 1 ) );
+}
+
+static void ClampSampleLightDots( SSE_sampleLightOutput_t& out, int normalCount )
+{
+	// NOTE: Notice here that if the light is on the back side of the face
+	// (tested by checking the dot product of the face normal and the light position)
+	// we don't want it to contribute to *any* of the bumped lightmaps. It glows
+	// in disturbing ways if we don't do this.
+	out.m_flDot[0] = MaxSIMD( out.m_flDot[0], Four_Zeros );
+	fltx4 notZero = CmpGtSIMD( out.m_flDot[0], Four_Zeros );
+	for( int n = 1; n < normalCount; n++ )
+	{
+		out.m_flDot[n] = MaxSIMD( out.m_flDot[n], Four_Zeros );
+		out.m_flDot[n] = AndSIMD( out.m_flDot[n], notZero );
+	}
+}
+
+void GatherSampleLightSSE( SSE_sampleLightOutput_t& out, directlight_t* dl, int facenum,
+						   FourVectors const& pos, FourVectors* pNormals, int normalCount, int iThread,
+						   int nLFlags,
+						   int static_prop_index_to_ignore,
+						   float flEpsilon )
+{
+	ClearSampleLightOutput( out, normalCount );
 
 	// skylights work fundamentally differently than normal lights
 	switch( dl->light.type )
@@ -2141,18 +2247,53 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t& out, directlight_t* dl, int
 			return;
 	}
 
-	// NOTE: Notice here that if the light is on the back side of the face
-	// (tested by checking the dot product of the face normal and the light position)
-	// we don't want it to contribute to *any* of the bumped lightmaps. It glows
-	// in disturbing ways if we don't do this.
-	out.m_flDot[0] = MaxSIMD( out.m_flDot[0], Four_Zeros );
-	fltx4 notZero = CmpGtSIMD( out.m_flDot[0], Four_Zeros );
-	for( int n = 1; n < normalCount; n++ )
+	ClampSampleLightDots( out, normalCount );
+}
+
+bool IsStandardLight( directlight_t* dl )
+{
+	return dl->light.type == emit_point || dl->light.type == emit_surface || dl->light.type == emit_spotlight;
+}
+
+//-----------------------------------------------------------------------------
+// GatherSampleLightSSE for two point, spot or surface lights at the same
+// points. When both need a shadow ray they are traced as one 8 wide packet.
+//-----------------------------------------------------------------------------
+void GatherSampleLightPairSSE( SSE_sampleLightOutput_t* pOut, directlight_t** ppLights, int facenum,
+							   FourVectors const& pos, FourVectors* pNormals, int normalCount, int iThread,
+							   int nLFlags, int static_prop_index_to_ignore )
+{
+	Assert( IsStandardLight( ppLights[0] ) && IsStandardLight( ppLights[1] ) );
+
+	SSE_StandardLightTrace_t trace[2];
+	bool bTrace[2];
+	for( int i = 0; i < 2; i++ )
 	{
-		out.m_flDot[n] = MaxSIMD( out.m_flDot[n], Four_Zeros );
-		out.m_flDot[n] = AndSIMD( out.m_flDot[n], notZero );
+		ClearSampleLightOutput( pOut[i], normalCount );
+		bTrace[i] = SetupStandardLightSSE( pOut[i], trace[i], ppLights[i], pos, pNormals, nLFlags );
+	}
+
+	fltx4 fractionVisible[2] = { Four_Ones, Four_Ones };
+	if( bTrace[0] && bTrace[1] )
+	{
+		FourVectors start[2] = { trace[0].m_Start, trace[1].m_Start };
+		FourVectors stop[2] = { trace[0].m_Stop, trace[1].m_Stop };
+		TestLine8( start, stop, fractionVisible, static_prop_index_to_ignore );
 	}
 
+	for( int i = 0; i < 2; i++ )
+	{
+		if( !bTrace[i] )
+		{
+			continue;
+		}
+		if( !bTrace[1 - i] )
+		{
+			TestLine( trace[i].m_Start, trace[i].m_Stop, &fractionVisible[i], static_prop_index_to_ignore );
+		}
+		FinishStandardLightSSE( pOut[i], trace[i], fractionVisible[i], pNormals, normalCount, nLFlags );
+		ClampSampleLightDots( pOut[i], normalCount );
+	}
 }
 
 /*
@@ -2617,12 +2758,98 @@ static void ComputeIlluminationPointAndNormalsSSE( lightinfo_t const& l, FourVec
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Applies the PVS check filter and computes falloff x dot. Returns false if
+// the light adds nothing to any of the samples.
+//-----------------------------------------------------------------------------
+static bool ComputeLightFxDot( SSE_sampleLightOutput_t const& out, fltx4 dotMask, int normalCount, fltx4* fxdot )
+{
+	bool bAnyLight = false;
+	for( int b = 0; b < normalCount; b++ )
+	{
+		fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
+		fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
+		if( !IsAllZeros( fxdot[b] ) )
+		{
+			bAnyLight = true;
+		}
+	}
+	return bAnyLight;
+}
+
+//-----------------------------------------------------------------------------
+// Adds what a light gathered at up to 4 sample points to the face
+//-----------------------------------------------------------------------------
+static void AddLightAt4Points( SSE_SampleInfo_t& info, directlight_t* dl, fltx4 const* fxdot, fltx4 sunAmount, int sampleIdx, int numSamples )
+{
+	// Figure out the lightstyle for this particular sample
+	int lightStyleIndex = FindOrAllocateLightstyleSamples( info.m_pFace, info.m_pFaceLight,
+						  dl->light.style, info.m_NormalCount );
+	if( lightStyleIndex < 0 )
+	{
+		if( info.m_WarnFace != info.m_FaceNum )
+		{
+			//Warning ("\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
+			//         info.m_Points.x.m128_f32[0], info.m_Points.y.m128_f32[0], info.m_Points.z.m128_f32[0] );
+			Warning( "\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
+					 FLTX4_ELEMENT( info.m_Points.x, 0 ), FLTX4_ELEMENT( info.m_Points.y, 0 ), FLTX4_ELEMENT( info.m_Points.z, 0 ) );
+
+			info.m_WarnFace = info.m_FaceNum;
+		}
+		return;
+	}
+
+	// pLightmaps is an array of the lightmaps for each normal direction,
+	// here's where the result of the sample gathering goes
+	LightingValue_t** pLightmaps = info.m_pFaceLight->light[lightStyleIndex];
+
+	// Incremental lighting only cares about lightstyle zero, -incremental keeps them all
+	if( g_pIncremental && ( dl->light.style == 0 || g_bIncrementalRelight ) &&
+			!( g_bIncrementalRelight && g_pIncremental->IsLightFromFile( dl->m_IncrementalID ) ) )
+	{
+		for( int i = 0; i < numSamples; i++ )
+		{
+			float flDots[NUM_BUMP_VECTS + 1];
+			for( int n = 0; n < info.m_NormalCount; ++n )
+			{
+				flDots[n] = SubFloat( fxdot[n], i );
+			}
+			g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, sampleIdx + i,
+											max( info.m_LightmapSize, info.m_NumSamples ), info.m_NormalCount,
+											flDots, SubFloat( sunAmount, i ), info.m_iThread );
+		}
+	}
+
+	for( int n = 0; n < info.m_NormalCount; ++n )
+	{
+		for( int i = 0; i < numSamples; i++ )
+		{
+			pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( sunAmount, i ) );
+		}
+	}
+}
+
+static void GatherOneLightAt4Points( SSE_SampleInfo_t& info, directlight_t* dl, fltx4 dotMask, int sampleIdx, int numSamples )
+{
+	SSE_sampleLightOutput_t out;
+	fltx4 fxdot[NUM_BUMP_VECTS + 1];
+	GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+	if( ComputeLightFxDot( out, dotMask, info.m_NormalCount, fxdot ) )
+	{
+		AddLightAt4Points( info, dl, fxdot, out.m_flSunAmount, sampleIdx, numSamples );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Iterates over all lights and computes lighting at up to 4 sample points
 //-----------------------------------------------------------------------------
 static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples )
 {
-	SSE_sampleLightOutput_t out;
+	// Point, spot and surface lights are gathered two at a time so their shadow
+	// rays go out as one 8 wide packet. A light waiting for its partner is added
+	// before any later light, so the lights are still added in list order.
+	directlight_t* pPending = NULL;
+	fltx4 pendingMask = Four_Zeros;
 
 	// Iterate over all direct lights and add them to the particular sample
 	for( directlight_t* dl = activelights; dl != NULL; dl = dl->next )
@@ -2643,74 +2870,159 @@ static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, i
 			continue;
 		}
 
-		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+		bool bFromFile = g_bIncrementalRelight && g_pIncremental->IsLightFromFile( dl->m_IncrementalID );
+		if( !bFromFile && IsStandardLight( dl ) )
+		{
+			if( !pPending )
+			{
+				pPending = dl;
+				pendingMask = dotMask;
+				continue;
+			}
+
+			SSE_sampleLightOutput_t out[2];
+			directlight_t* pLights[2] = { pPending, dl };
+			fltx4 masks[2] = { pendingMask, dotMask };
+			GatherSampleLightPairSSE( out, pLights, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+			for( int i = 0; i < 2; i++ )
+			{
+				fltx4 fxdot[NUM_BUMP_VECTS + 1];
+				if( ComputeLightFxDot( out[i], masks[i], info.m_NormalCount, fxdot ) )
+				{
+					AddLightAt4Points( info, pLights[i], fxdot, out[i].m_flSunAmount, sampleIdx, numSamples );
+				}
+			}
+			pPending = NULL;
+			continue;
+		}
+
+		if( pPending )
+		{
+			GatherOneLightAt4Points( info, pPending, pendingMask, sampleIdx, numSamples );
+			pPending = NULL;
+		}
+
+		if( !bFromFile )
+		{
+			GatherOneLightAt4Points( info, dl, dotMask, sampleIdx, numSamples );
+			continue;
+		}
+
+		// -incremental already has what this light added last time
+		float flDots[( NUM_BUMP_VECTS + 1 ) * 4];
+		float flSunAmount[4];
+		if( !g_pIncremental->GetLightFromFile( dl->m_IncrementalID, info.m_FaceNum, sampleIdx, numSamples,
+											   max( info.m_LightmapSize, info.m_NumSamples ), info.m_NormalCount,
+											   flDots, flSunAmount, info.m_iThread ) )
+		{
+			continue;
+		}
 
-		// Apply the PVS check filter and compute falloff x dot
 		fltx4 fxdot[NUM_BUMP_VECTS + 1];
+		fltx4 sunAmount = Four_Zeros;
 		skipLight = true;
 		for( int b = 0; b < info.m_NormalCount; b++ )
 		{
-			fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
-			fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
+			fxdot[b] = Four_Zeros;
+			for( int i = 0; i < numSamples; i++ )
+			{
+				fxdot[b] = SetComponentSIMD( fxdot[b], i, flDots[b * numSamples + i] );
+			}
 			if( !IsAllZeros( fxdot[b] ) )
 			{
 				skipLight = false;
 			}
 		}
-		if( skipLight )
+		for( int i = 0; i < numSamples; i++ )
 		{
-			continue;
+			sunAmount = SetComponentSIMD( sunAmount, i, flSunAmount[i] );
 		}
 
-		// Figure out the lightstyle for this particular sample
-		int lightStyleIndex = FindOrAllocateLightstyleSamples( info.m_pFace, info.m_pFaceLight,
-							  dl->light.style, info.m_NormalCount );
-		if( lightStyleIndex < 0 )
+		if( !skipLight )
 		{
-			if( info.m_WarnFace != info.m_FaceNum )
-			{
-				//Warning ("\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
-				//         info.m_Points.x.m128_f32[0], info.m_Points.y.m128_f32[0], info.m_Points.z.m128_f32[0] );
-				Warning( "\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
-						 FLTX4_ELEMENT( info.m_Points.x, 0 ), FLTX4_ELEMENT( info.m_Points.y, 0 ), FLTX4_ELEMENT( info.m_Points.z, 0 ) );
-
-				info.m_WarnFace = info.m_FaceNum;
-			}
-			continue;
+			AddLightAt4Points( info, dl, fxdot, sunAmount, sampleIdx, numSamples );
 		}
+	}
+
+	if( pPending )
+	{
+		GatherOneLightAt4Points( info, pPending, pendingMask, sampleIdx, numSamples );
+	}
+}
 
-		// pLightmaps is an array of the lightmaps for each normal direction,
-		// here's where the result of the sample gathering goes
-		LightingValue_t** pLightmaps = info.m_pFaceLight->light[lightStyleIndex];
 
-		// Incremental lighting only cares about lightstyle zero
-		if( g_pIncremental && ( dl->light.style == 0 ) )
+
+static void AddResampledLight( SSE_SampleInfo_t& info, directlight_t* dl, SSE_sampleLightOutput_t const& out, fltx4 dotMask,
+							   int sampleIdx, int iGroup, LightingValue_t pLightmap[4][NUM_BUMP_VECTS + 1] )
+{
+	// Apply the PVS check filter and compute falloff x dot
+	fltx4 fxdot[NUM_BUMP_VECTS + 1];
+	ComputeLightFxDot( out, dotMask, info.m_NormalCount, fxdot );
+
+	// -incremental keeps the supersamples of every light, dark ones too, so they
+	// don't have to be traced again
+	if( g_bIncrementalRelight )
+	{
+		float flDots[( NUM_BUMP_VECTS + 1 ) * 4];
+		float flSunAmount[4];
+		for( int i = 0; i < 4; ++i )
 		{
-			for( int i = 0; i < numSamples; i++ )
+			for( int n = 0; n < info.m_NormalCount; ++n )
 			{
-				g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, sampleIdx + i,
-												info.m_LightmapSize, SubFloat( fxdot[0], i ), info.m_iThread );
+				flDots[n * 4 + i] = SubFloat( fxdot[n], i );
 			}
+			flSunAmount[i] = SubFloat( out.m_flSunAmount, i );
 		}
+		g_pIncremental->AddSupersampleLight( dl->m_IncrementalID, info.m_FaceNum, sampleIdx, iGroup,
+											 max( info.m_LightmapSize, info.m_NumSamples ), info.m_NormalCount,
+											 flDots, flSunAmount, info.m_iThread );
+	}
 
+	// Compute the contributions to each of the bumped lightmaps
+	// The first sample is for non-bumped lighting.
+	// The other sample are for bumpmapping.
+	for( int i = 0; i < 4; ++i )
+	{
 		for( int n = 0; n < info.m_NormalCount; ++n )
 		{
-			for( int i = 0; i < numSamples; i++ )
-			{
-				pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
-			}
+			pLightmap[i][n].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
 		}
 	}
 }
 
+// -incremental: adds what a light from the file added to these supersamples last time.
+// Returns false if they weren't supersampled then.
+static bool AddResampledLightFromFile( SSE_SampleInfo_t& info, directlight_t* dl, int sampleIdx, int iGroup,
+									   LightingValue_t pLightmap[4][NUM_BUMP_VECTS + 1] )
+{
+	float flDots[( NUM_BUMP_VECTS + 1 ) * 4];
+	float flSunAmount[4];
+	if( !g_pIncremental->GetSupersampleLightFromFile( dl->m_IncrementalID, info.m_FaceNum, sampleIdx, iGroup,
+			max( info.m_LightmapSize, info.m_NumSamples ), info.m_NormalCount,
+			flDots, flSunAmount, info.m_iThread ) )
+	{
+		return false;
+	}
 
+	for( int i = 0; i < 4; ++i )
+	{
+		for( int n = 0; n < info.m_NormalCount; ++n )
+		{
+			pLightmap[i][n].AddLight( flDots[n * 4 + i], dl->light.intensity, flSunAmount[i] );
+		}
+	}
+	return true;
+}
 
 //-----------------------------------------------------------------------------
-// Iterates over all lights and computes lighting at a sample point
+// Iterates over all lights and computes lighting at a sample point. iGroup is
+// which of the INCREMENTAL_SUPERSAMPLE_GROUPS groups of supersamples of sample
+// sampleIdx these are.
 //-----------------------------------------------------------------------------
-static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int lightStyleIndex, int flags, LightingValue_t pLightmap[4][NUM_BUMP_VECTS + 1] )
+static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int iGroup, int lightStyleIndex, int flags,
+									LightingValue_t pLightmap[4][NUM_BUMP_VECTS + 1] )
 {
-	SSE_sampleLightOutput_t out;
+	SSE_sampleLightOutput_t out[2];
 
 	// Clear result
 	for( int i = 0; i < 4; ++i )
@@ -2721,6 +3033,10 @@ static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int lightStyleIndex,
 		}
 	}
 
+	// Point, spot and surface lights go in pairs, as in GatherSampleLightAt4Points
+	directlight_t* pLights[2] = { NULL, NULL };
+	fltx4 masks[2];
+
 	// Iterate over all direct lights and add them to the particular sample
 	for( directlight_t* dl = activelights; dl != NULL; dl = dl->next )
 	{
@@ -2758,30 +3074,45 @@ static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int lightStyleIndex,
 			continue;
 		}
 
-		// NOTE: Notice here that if the light is on the back side of the face
-		// (tested by checking the dot product of the face normal and the light position)
-		// we don't want it to contribute to *any* of the bumped lightmaps. It glows
-		// in disturbing ways if we don't do this.
-		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+		bool bFromFile = g_bIncrementalRelight && g_pIncremental->IsLightFromFile( dl->m_IncrementalID );
+		if( !bFromFile && IsStandardLight( dl ) )
+		{
+			if( !pLights[0] )
+			{
+				pLights[0] = dl;
+				masks[0] = dotMask;
+				continue;
+			}
 
-		// Apply the PVS check filter and compute falloff x dot
-		fltx4 fxdot[NUM_BUMP_VECTS + 1];
-		for( int b = 0; b < info.m_NormalCount; b++ )
+			pLights[1] = dl;
+			masks[1] = dotMask;
+			GatherSampleLightPairSSE( out, pLights, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+			AddResampledLight( info, pLights[0], out[0], masks[0], sampleIdx, iGroup, pLightmap );
+			AddResampledLight( info, pLights[1], out[1], masks[1], sampleIdx, iGroup, pLightmap );
+			pLights[0] = NULL;
+			continue;
+		}
+
+		if( pLights[0] )
 		{
-			fxdot[b] = MulSIMD( out.m_flFalloff, out.m_flDot[b] );
-			fxdot[b] = MulSIMD( fxdot[b], dotMask );
+			GatherSampleLightSSE( out[0], pLights[0], info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+			AddResampledLight( info, pLights[0], out[0], masks[0], sampleIdx, iGroup, pLightmap );
+			pLights[0] = NULL;
 		}
 
-		// Compute the contributions to each of the bumped lightmaps
-		// The first sample is for non-bumped lighting.
-		// The other sample are for bumpmapping.
-		for( int i = 0; i < 4; ++i )
+		if( bFromFile && AddResampledLightFromFile( info, dl, sampleIdx, iGroup, pLightmap ) )
 		{
-			for( int n = 0; n < info.m_NormalCount; ++n )
-			{
-				pLightmap[i][n].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
-			}
+			continue;
 		}
+
+		GatherSampleLightSSE( out[0], dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+		AddResampledLight( info, dl, out[0], dotMask, sampleIdx, iGroup, pLightmap );
+	}
+
+	if( pLights[0] )
+	{
+		GatherSampleLightSSE( out[0], pLights[0], info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+		AddResampledLight( info, pLights[0], out[0], masks[0], sampleIdx, iGroup, pLightmap );
 	}
 }
 
@@ -2893,7 +3224,7 @@ static int SupersampleLightAtPoint( lightinfo_t& l, SSE_SampleInfo_t& info,
 
 			// Resample the non-ambient light at this point...
 			LightingValue_t result[4][NUM_BUMP_VECTS + 1];
-			ResampleLightAt4Points( info, lightStyleIndex, NON_AMBIENT_ONLY, result );
+			ResampleLightAt4Points( info, sampleIndex, s, lightStyleIndex, NON_AMBIENT_ONLY, result );
 
 			// Got more subsamples
 			for( int i = 0; i < 4; i++ )
@@ -2928,7 +3259,7 @@ static int SupersampleLightAtPoint( lightinfo_t& l, SSE_SampleInfo_t& info,
 		ComputeIlluminationPointAndNormalsSSE( l, superSamplePosition, superSampleNormal, &info, 4 );
 
 		LightingValue_t result[4][NUM_BUMP_VECTS + 1];
-		ResampleLightAt4Points( info, lightStyleIndex, AMBIENT_ONLY, result );
+		ResampleLightAt4Points( info, sampleIndex, INCREMENTAL_SUPERSAMPLE_GROUPS - 1, lightStyleIndex, AMBIENT_ONLY, result );
 
 		// Got more subsamples
 		for( int i = 0; i < 4; i++ )
@@ -3096,7 +3427,7 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 			}
 
 			// Don't supersample if the lighting is pretty uniform near the sample
-			if( pGradient[i] < 0.0625 )
+			if( pGradient[i] < g_flExtraThreshold )
 			{
 				continue;
 			}
@@ -3337,7 +3668,7 @@ void BuildFacelights( int iThread, int facenum )
 	}
 
 	// Tell the incremental light manager that we're done with this face.
-	if( g_pIncremental )
+	if( g_pIncremental && !g_bIncrementalRelight )
 	{
 		for( dl = activelights; dl != NULL; dl = dl->next )
 		{
@@ -3349,7 +3680,7 @@ void BuildFacelights( int iThread, int facenum )
 		}
 
 		// Don't have to deal with patch lights (only direct lighting is used)
-		// or supersampling
+		// or supersampling.
 		return;
 	}
 
@@ -3369,6 +3700,21 @@ void BuildFacelights( int iThread, int facenum )
 		}
 	}
 
+	// -incremental goes on like a normal compile once it has the supersamples too
+	if( g_pIncremental )
+	{
+		for( dl = activelights; dl != NULL; dl = dl->next )
+		{
+			g_pIncremental->FinishFace( dl->m_IncrementalID, facenum, iThread );
+		}
+	}
+
+	// smooth out what's left of the sampling noise, the patches pick up the result
+	if( g_nDenoisePasses > 0 && !debug_extra )
+	{
+		DenoiseFaceLight( facenum, sampleInfo.m_NormalCount );
+	}
+
 #if defined ( MPI ) && defined ( _WIN32 )
 	//
 	// This is done on the master node when MPI is used
@@ -3626,7 +3972,7 @@ void PrecompLightmapOffsets()
 
 	// The incremental lighting code needs us to preserve the contents of dlightdata
 	// since it only recomposites lighting for faces that have lights that touch them.
-	if( g_pIncremental && pdlightdata->Count() )
+	if( g_pIncremental && !g_bIncrementalRelight && pdlightdata->Count() )
 	{
 		return;
 	}
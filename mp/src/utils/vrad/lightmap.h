@@ -137,5 +137,8 @@ void FreeDLights();
 
 void ExportDirectLightsToWorldLights();
 
+// Edge-aware smoothing of a face's sample light, see lightmapdenoise.cpp
+void DenoiseFaceLight( int facenum, int nNormalCount );
+
 
 #endif // LIGHTMAP_H
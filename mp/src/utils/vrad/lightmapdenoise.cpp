@@ -0,0 +1,169 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Edge-aware smoothing of the per sample light in facelight_t, so
+//			-extrasky can trade rays for a cleaner result at lower counts.
+//
+//			Each pass is one level of an a-trous wavelet filter: a 5x5 B3
+//			spline kernel whose taps are spread 2^pass luxels apart. The taps
+//			are weighted down by how much the normals differ, how far the tap
+//			is off the sample's plane and how different the lighting is, so
+//			shadow edges, creases and smoothing group seams stay sharp. A face
+//			is only ever filtered with itself, and every bump basis vector of a
+//			sample uses the same weights.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+
+
+// normal weight is dot^DENOISE_NORMAL_POWER
+#define DENOISE_NORMAL_POWER	32.0f
+
+// lighting differences are compared in the same perceptual space as the -extra gradients
+#define DENOISE_INTENSITY_SIGMA	0.0625f
+
+
+static const float s_DenoiseKernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+
+static inline float PerceptualIntensity( LightingValue_t const& light )
+{
+	return pow( max( light.Intensity(), 0.0f ) / 256.0f, 1.0f / 2.2f );
+}
+
+//-----------------------------------------------------------------------------
+// Runs g_nDenoisePasses filter passes over every lightstyle of a face
+//-----------------------------------------------------------------------------
+void DenoiseFaceLight( int facenum, int nNormalCount )
+{
+	dface_t* f = &g_pFaces[facenum];
+	facelight_t* fl = &facelight[facenum];
+	if( fl->numsamples < 2 || g_nDenoisePasses <= 0 )
+	{
+		return;
+	}
+
+	int w = f->m_LightmapTextureSizeInLuxels[0] + 1;
+	int h = f->m_LightmapTextureSizeInLuxels[1] + 1;
+
+	// which sample sits on each luxel
+	CUtlVector<int> grid;
+	grid.SetCount( w * h );
+	for( int i = 0; i < grid.Count(); i++ )
+	{
+		grid[i] = -1;
+	}
+	for( int i = 0; i < fl->numsamples; i++ )
+	{
+		sample_t& sample = fl->sample[i];
+		if( sample.s >= 0 && sample.s < w && sample.t >= 0 && sample.t < h && grid[sample.s + sample.t * w] == -1 )
+		{
+			grid[sample.s + sample.t * w] = i;
+		}
+	}
+
+	float flLuxelSize = max( sqrt( fl->worldAreaPerLuxel ), 1e-3f );
+	float flIntensitySigma = DENOISE_INTENSITY_SIGMA * max( g_flDenoiseStrength, 1e-3f );
+
+	CUtlVector<LightingValue_t> src;
+	src.SetCount( fl->numsamples * nNormalCount );
+	CUtlVector<float> intensity;
+	intensity.SetCount( fl->numsamples );
+
+	for( int style = 0; style < MAXLIGHTMAPS; style++ )
+	{
+		if( f->styles[style] == 255 )
+		{
+			break;
+		}
+
+		LightingValue_t** ppLight = fl->light[style];
+
+		for( int pass = 0; pass < g_nDenoisePasses; pass++ )
+		{
+			int step = 1 << pass;
+
+			// read from a copy, the results go straight back into the facelight
+			for( int i = 0; i < fl->numsamples; i++ )
+			{
+				for( int n = 0; n < nNormalCount; n++ )
+				{
+					src[i * nNormalCount + n] = ppLight[n][i];
+				}
+				intensity[i] = PerceptualIntensity( ppLight[0][i] );
+			}
+
+			for( int i = 0; i < fl->numsamples; i++ )
+			{
+				sample_t& sample = fl->sample[i];
+
+				LightingValue_t sum[NUM_BUMP_VECTS + 1];
+				for( int n = 0; n < nNormalCount; n++ )
+				{
+					sum[n].Zero();
+				}
+				float flTotalWeight = 0.0f;
+
+				for( int dt = -2; dt <= 2; dt++ )
+				{
+					int t = sample.t + dt * step;
+					if( t < 0 || t >= h )
+					{
+						continue;
+					}
+
+					for( int ds = -2; ds <= 2; ds++ )
+					{
+						int s = sample.s + ds * step;
+						if( s < 0 || s >= w )
+						{
+							continue;
+						}
+
+						int q = ( ds == 0 && dt == 0 ) ? i : grid[s + t * w];
+						if( q == -1 )
+						{
+							continue;
+						}
+
+						float flWeight = s_DenoiseKernel[ds + 2] * s_DenoiseKernel[dt + 2];
+						if( q != i )
+						{
+							sample_t& other = fl->sample[q];
+
+							float flDot = DotProduct( sample.normal, other.normal );
+							if( flDot <= 0.0f )
+							{
+								continue;
+							}
+							flWeight *= pow( flDot, DENOISE_NORMAL_POWER );
+
+							Vector delta = other.pos - sample.pos;
+							flWeight *= exp( -fabs( DotProduct( delta, sample.normal ) ) / ( flLuxelSize * step ) );
+							flWeight *= exp( -fabs( intensity[q] - intensity[i] ) / flIntensitySigma );
+						}
+
+						for( int n = 0; n < nNormalCount; n++ )
+						{
+							sum[n].AddWeighted( src[q * nNormalCount + n], flWeight );
+						}
+						flTotalWeight += flWeight;
+					}
+				}
+
+				if( flTotalWeight <= 0.0f )
+				{
+					continue;
+				}
+
+				for( int n = 0; n < nNormalCount; n++ )
+				{
+					sum[n].Scale( 1.0f / flTotalWeight );
+					ppLight[n][i] = sum[n];
+				}
+			}
+		}
+	}
+}
@@ -13,6 +13,7 @@
 #include "trace.h"
 #include "cmodel.h"
 #include "mathlib/vmatrix.h"
+#include "phaseprofile.h"
 
 
 //=============================================================================
@@ -153,6 +154,27 @@ public:
 	}
 };
 
+static void VisibilityFromTrace( RayTracingResult& rt_result, fltx4 len, CCoverageCountTexture& coverageCallback, fltx4* pFractionVisible )
+{
+	// Assume we can see the targets unless we get hits
+	float visibility[4];
+	for( int i = 0; i < 4; i++ )
+	{
+		visibility[i] = 1.0f;
+		if( ( rt_result.HitIds[i] != -1 ) &&
+				//( rt_result.HitDistance.m128_f32[i] < len.m128_f32[i] ) )
+				( FLTX4_ELEMENT( rt_result.HitDistance, i ) < FLTX4_ELEMENT( len, i ) ) )
+		{
+			visibility[i] = 0.0f;
+		}
+	}
+	*pFractionVisible = LoadUnalignedSIMD( visibility );
+	if( g_bTextureShadows )
+	{
+		*pFractionVisible = MinSIMD( *pFractionVisible, coverageCallback.GetFractionVisible() );
+	}
+}
+
 void TestLine( const FourVectors& start, const FourVectors& stop,
 			   fltx4* pFractionVisible, int static_prop_index_to_ignore )
 {
@@ -167,23 +189,35 @@ void TestLine( const FourVectors& start, const FourVectors& stop,
 	CCoverageCountTexture coverageCallback;
 
 	g_RtEnv.Trace4Rays( myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore, g_bTextureShadows ? &coverageCallback : 0 );
+	PhaseProfile_AddRays( 4 );
 
-	// Assume we can see the targets unless we get hits
-	float visibility[4];
-	for( int i = 0; i < 4; i++ )
+	VisibilityFromTrace( rt_result, len, coverageCallback, pFractionVisible );
+}
+
+void TestLine8( FourVectors const* start, FourVectors const* stop,
+				fltx4* pFractionVisible, int static_prop_index_to_ignore )
+{
+	EightRays myrays;
+	fltx4 tmin[2], len[2];
+	for( int h = 0; h < 2; h++ )
 	{
-		visibility[i] = 1.0f;
-		if( ( rt_result.HitIds[i] != -1 ) &&
-				//( rt_result.HitDistance.m128_f32[i] < len.m128_f32[i] ) )
-				( FLTX4_ELEMENT( rt_result.HitDistance, i ) < FLTX4_ELEMENT( len, i ) ) )
-		{
-			visibility[i] = 0.0f;
-		}
+		myrays.half[h].origin = start[h];
+		myrays.half[h].direction = stop[h];
+		myrays.half[h].direction -= myrays.half[h].origin;
+		len[h] = myrays.half[h].direction.length();
+		myrays.half[h].direction *= ReciprocalSIMD( len[h] );
+		tmin[h] = Four_Zeros;
 	}
-	*pFractionVisible = LoadUnalignedSIMD( visibility );
-	if( g_bTextureShadows )
+	RayTracingResult rt_result[2];
+	CCoverageCountTexture coverageCallback[2];
+	ITransparentTriangleCallback* pCallbacks[2] = { &coverageCallback[0], &coverageCallback[1] };
+
+	g_RtEnv.Trace8Rays( myrays, tmin, len, rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore, g_bTextureShadows ? pCallbacks : NULL );
+	PhaseProfile_AddRays( 8 );
+
+	for( int h = 0; h < 2; h++ )
 	{
-		*pFractionVisible = MinSIMD( *pFractionVisible, coverageCallback.GetFractionVisible() );
+		VisibilityFromTrace( rt_result[h], len[h], coverageCallback[h], &pFractionVisible[h] );
 	}
 }
 
@@ -394,25 +428,12 @@ void DM_ClipBoxToBrush( CToolTrace* trace, const Vector& mins, const Vector& max
 	}
 }
 
-void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
-						  fltx4* pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+// Turns the result of tracing 4 lines towards the sky into their visibility, recursing into the
+// 3D skybox for the rays that made it out
+static void SkyVisibilityFromTrace( FourVectors const& start, FourVectors const& stop,
+									RayTracingResult& rt_result, fltx4 len, CCoverageCount& coverageCallback,
+									fltx4* pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
 {
-	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
-	RayTracingResult rt_result;
-	CCoverageCountTexture coverageCallback;
-
-	g_RtEnv.Trace4Rays( myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows ? &coverageCallback : 0 );
-
-	if( bDoDebug )
-	{
-		WriteTrace( "trace.txt", myrays, rt_result );
-	}
-
 	float aOcclusion[4];
 	for( int i = 0; i < 4; i++ )
 	{
@@ -478,6 +499,56 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 	*pFractionVisible = SubSIMD( Four_Ones, occlusion );
 }
 
+void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+						  fltx4* pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+{
+	FourRays myrays;
+	myrays.origin = start;
+	myrays.direction = stop;
+	myrays.direction -= myrays.origin;
+	fltx4 len = myrays.direction.length();
+	myrays.direction *= ReciprocalSIMD( len );
+	RayTracingResult rt_result;
+	CCoverageCountTexture coverageCallback;
+
+	g_RtEnv.Trace4Rays( myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows ? &coverageCallback : 0 );
+	PhaseProfile_AddRays( 4 );
+
+	if( bDoDebug )
+	{
+		WriteTrace( "trace.txt", myrays, rt_result );
+	}
+
+	SkyVisibilityFromTrace( start, stop, rt_result, len, coverageCallback, pFractionVisible, canRecurse, static_prop_to_skip, bDoDebug );
+}
+
+void TestLine_DoesHitSky8( FourVectors const* start, FourVectors const* stop,
+						   fltx4* pFractionVisible, bool canRecurse, int static_prop_to_skip )
+{
+	EightRays myrays;
+	fltx4 tmin[2], len[2];
+	for( int h = 0; h < 2; h++ )
+	{
+		myrays.half[h].origin = start[h];
+		myrays.half[h].direction = stop[h];
+		myrays.half[h].direction -= myrays.half[h].origin;
+		len[h] = myrays.half[h].direction.length();
+		myrays.half[h].direction *= ReciprocalSIMD( len[h] );
+		tmin[h] = Four_Zeros;
+	}
+	RayTracingResult rt_result[2];
+	CCoverageCountTexture coverageCallback[2];
+	ITransparentTriangleCallback* pCallbacks[2] = { &coverageCallback[0], &coverageCallback[1] };
+
+	g_RtEnv.Trace8Rays( myrays, tmin, len, rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows ? pCallbacks : NULL );
+	PhaseProfile_AddRays( 8 );
+
+	for( int h = 0; h < 2; h++ )
+	{
+		SkyVisibilityFromTrace( start[h], stop[h], rt_result[h], len[h], coverageCallback[h], &pFractionVisible[h], canRecurse, static_prop_to_skip, false );
+	}
+}
+
 
 
 //-----------------------------------------------------------------------------
@@ -0,0 +1,429 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Out-of-core storage for the patch transfer lists.
+//
+//			A row is the patch number, the transfer count and the largest
+//			transfer, followed by each transfer as the varint delta of its
+//			patch number from the previous one and a 16 bit fraction of the
+//			largest transfer. Rows never span chunks.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "transferfile.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlbuffer.h"
+
+
+#define TRANSFER_CHUNK_SIZE		( 256 * 1024 )			// a chunk is flushed once it gets this big
+#define TRANSFER_FILE_SIZE		( 1024 * 1024 * 1024 )	// keeps offsets well inside 31 bits
+#define TRANSFER_INDEX_VERSION	1
+
+struct transferfile_t
+{
+	char				m_Name[MAX_PATH];
+	FILE*				m_fp;
+	CThreadFastMutex	m_Lock;			// seek + read have to happen together
+};
+
+struct transferchunk_t
+{
+	int		m_iFile;
+	int		m_nOffset;
+	int		m_nSize;
+	int		m_nTransfers;
+};
+
+struct transferwriter_t
+{
+	int			m_iFile;			// -1 until the first chunk is flushed
+	transferfile_t*	m_pFile;		// s_Files may grow under other threads, so keep our own pointer
+	int			m_nFileSize;
+	int			m_nTransfers;		// in the chunk being built
+	CUtlBuffer	m_Chunk;
+};
+
+bool g_bTransferFiles = false;
+
+static char							s_BaseName[MAX_PATH];
+static CUtlVector<transferfile_t*>	s_Files;
+static CUtlVector<transferchunk_t>	s_Chunks;
+static transferwriter_t				s_Writers[MAX_TOOL_THREADS + 1];
+static CUtlVector<byte>				s_ReadBuffer[MAX_TOOL_THREADS + 1];
+static CUtlVector<transfer_t>		s_RowBuffer[MAX_TOOL_THREADS + 1];
+
+
+static void PutVarInt( CUtlBuffer& buf, unsigned int val )
+{
+	while( val >= 0x80 )
+	{
+		buf.PutUnsignedChar( ( val & 0x7F ) | 0x80 );
+		val >>= 7;
+	}
+	buf.PutUnsignedChar( val );
+}
+
+static inline unsigned int GetVarInt( const byte*& p )
+{
+	unsigned int val = 0;
+	for( int shift = 0; ; shift += 7 )
+	{
+		byte b = *p++;
+		val |= ( b & 0x7F ) << shift;
+		if( !( b & 0x80 ) )
+		{
+			return val;
+		}
+	}
+}
+
+static int TransferPatchCompare( const void* a, const void* b )
+{
+	return ( ( const transfer_t* )a )->patch - ( ( const transfer_t* )b )->patch;
+}
+
+
+static void GetTransferIndexName( char* pName, int nMaxLen )
+{
+	V_snprintf( pName, nMaxLen, "%s.transfers", s_BaseName );
+}
+
+
+void BeginTransferFiles( const char* pBaseName )
+{
+	V_strncpy( s_BaseName, pBaseName, sizeof( s_BaseName ) );
+
+	// an index left by -incremental no longer matches the files once we start writing
+	char szIndex[MAX_PATH];
+	GetTransferIndexName( szIndex, sizeof( szIndex ) );
+	remove( szIndex );
+	for( int i = 0; i < ARRAYSIZE( s_Writers ); i++ )
+	{
+		s_Writers[i].m_iFile = -1;
+		s_Writers[i].m_pFile = NULL;
+		s_Writers[i].m_nFileSize = 0;
+		s_Writers[i].m_nTransfers = 0;
+		s_Writers[i].m_Chunk.Purge();
+	}
+}
+
+
+static void FlushTransferChunk( transferwriter_t& writer )
+{
+	int nSize = writer.m_Chunk.TellPut();
+	if( !nSize )
+	{
+		return;
+	}
+
+	// start a new file on the first flush and whenever this one fills up
+	if( writer.m_iFile == -1 || writer.m_nFileSize + nSize > TRANSFER_FILE_SIZE )
+	{
+		if( writer.m_pFile )
+		{
+			fclose( writer.m_pFile->m_fp );
+			writer.m_pFile->m_fp = NULL;
+		}
+
+		transferfile_t* pFile = new transferfile_t;
+		ThreadLock();
+		writer.m_iFile = s_Files.AddToTail( pFile );
+		ThreadUnlock();
+		writer.m_pFile = pFile;
+
+		V_snprintf( pFile->m_Name, sizeof( pFile->m_Name ), "%s.transfers%d", s_BaseName, writer.m_iFile );
+		pFile->m_fp = fopen( pFile->m_Name, "wb" );
+		if( !pFile->m_fp )
+		{
+			Error( "Can't create transfer file %s\n", pFile->m_Name );
+		}
+		writer.m_nFileSize = 0;
+	}
+
+	transferfile_t* pFile = writer.m_pFile;
+	if( fwrite( writer.m_Chunk.Base(), nSize, 1, pFile->m_fp ) != 1 )
+	{
+		Error( "Error writing transfer file %s, out of disk space?\n", pFile->m_Name );
+	}
+
+	transferchunk_t chunk;
+	chunk.m_iFile = writer.m_iFile;
+	chunk.m_nOffset = writer.m_nFileSize;
+	chunk.m_nSize = nSize;
+	chunk.m_nTransfers = writer.m_nTransfers;
+	ThreadLock();
+	s_Chunks.AddToTail( chunk );
+	ThreadUnlock();
+
+	writer.m_nFileSize += nSize;
+	writer.m_nTransfers = 0;
+	writer.m_Chunk.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
+}
+
+
+void WriteTransferRow( int iThread, int patchnum, transfer_t* pTransfers, int numTransfers )
+{
+	transferwriter_t& writer = s_Writers[iThread];
+
+	qsort( pTransfers, numTransfers, sizeof( transfer_t ), TransferPatchCompare );
+
+	float flMax = 0.0f;
+	for( int i = 0; i < numTransfers; i++ )
+	{
+		flMax = max( flMax, pTransfers[i].transfer );
+	}
+
+	CUtlBuffer& buf = writer.m_Chunk;
+	PutVarInt( buf, patchnum );
+	PutVarInt( buf, numTransfers );
+	buf.PutFloat( flMax );
+
+	float flQuantize = flMax > 0.0f ? 65535.0f / flMax : 0.0f;
+	int prev = 0;
+	for( int i = 0; i < numTransfers; i++ )
+	{
+		PutVarInt( buf, pTransfers[i].patch - prev );
+		prev = pTransfers[i].patch;
+		buf.PutUnsignedShort( ( unsigned short )( pTransfers[i].transfer * flQuantize + 0.5f ) );
+	}
+
+	writer.m_nTransfers += numTransfers;
+	if( buf.TellPut() >= TRANSFER_CHUNK_SIZE )
+	{
+		FlushTransferChunk( writer );
+	}
+}
+
+
+void FinishTransferFiles( void )
+{
+	for( int i = 0; i < ARRAYSIZE( s_Writers ); i++ )
+	{
+		FlushTransferChunk( s_Writers[i] );
+		s_Writers[i].m_Chunk.Purge();
+	}
+
+	int64 nTotalSize = 0;
+	for( int i = 0; i < s_Files.Count(); i++ )
+	{
+		transferfile_t* pFile = s_Files[i];
+		if( pFile->m_fp )
+		{
+			fclose( pFile->m_fp );
+		}
+		pFile->m_fp = fopen( pFile->m_Name, "rb" );
+		if( !pFile->m_fp )
+		{
+			Error( "Can't open transfer file %s\n", pFile->m_Name );
+		}
+	}
+	for( int i = 0; i < s_Chunks.Count(); i++ )
+	{
+		nTotalSize += s_Chunks[i].m_nSize;
+	}
+
+	qprintf( "transfer files: %5.1f megs in %d chunks\n", ( float )nTotalSize / ( 1024 * 1024 ), s_Chunks.Count() );
+}
+
+
+int NumTransferChunks( void )
+{
+	return s_Chunks.Count();
+}
+
+
+// Gathering is linear in the number of transfers
+float TransferChunkCost( int iChunk )
+{
+	return s_Chunks[iChunk].m_nTransfers;
+}
+
+
+void ForEachTransferRow( int iThread, int iChunk, TransferRowFn fn )
+{
+	const transferchunk_t& chunk = s_Chunks[iChunk];
+	transferfile_t* pFile = s_Files[chunk.m_iFile];
+
+	CUtlVector<byte>& data = s_ReadBuffer[iThread];
+	data.SetCount( chunk.m_nSize );
+
+	pFile->m_Lock.Lock();
+	bool bOk = fseek( pFile->m_fp, chunk.m_nOffset, SEEK_SET ) == 0 &&
+			   fread( data.Base(), chunk.m_nSize, 1, pFile->m_fp ) == 1;
+	pFile->m_Lock.Unlock();
+	if( !bOk )
+	{
+		Error( "Error reading transfer file %s\n", pFile->m_Name );
+	}
+
+	CUtlVector<transfer_t>& row = s_RowBuffer[iThread];
+	const byte* p = data.Base();
+	const byte* pEnd = p + chunk.m_nSize;
+	while( p < pEnd )
+	{
+		int patchnum = GetVarInt( p );
+		int numTransfers = GetVarInt( p );
+		float flMax;
+		memcpy( &flMax, p, sizeof( flMax ) );
+		p += sizeof( flMax );
+
+		float flScale = flMax / 65535.0f;
+		row.SetCount( numTransfers );
+		int patch = 0;
+		for( int i = 0; i < numTransfers; i++ )
+		{
+			patch += GetVarInt( p );
+			unsigned short q;
+			memcpy( &q, p, sizeof( q ) );
+			p += sizeof( q );
+
+			row[i].patch = patch;
+			row[i].transfer = q * flScale;
+		}
+
+		fn( patchnum, row.Base(), numTransfers );
+	}
+}
+
+
+static int GetTransferFileSize( FILE* fp )
+{
+	fseek( fp, 0, SEEK_END );
+	return ftell( fp );
+}
+
+
+bool SaveTransferIndex( CRC32_t key )
+{
+	CUtlBuffer buf;
+	buf.PutInt( TRANSFER_INDEX_VERSION );
+	buf.PutUnsignedInt( key );
+
+	// the file sizes catch files that were changed or cut short since
+	buf.PutInt( s_Files.Count() );
+	for( int i = 0; i < s_Files.Count(); i++ )
+	{
+		buf.PutInt( GetTransferFileSize( s_Files[i]->m_fp ) );
+	}
+
+	buf.PutInt( s_Chunks.Count() );
+	buf.Put( s_Chunks.Base(), s_Chunks.Count() * sizeof( transferchunk_t ) );
+
+	char szIndex[MAX_PATH];
+	GetTransferIndexName( szIndex, sizeof( szIndex ) );
+
+	FILE* fp = fopen( szIndex, "wb" );
+	bool bOk = fp && fwrite( buf.Base(), buf.TellPut(), 1, fp ) == 1;
+	if( fp )
+	{
+		fclose( fp );
+	}
+	if( !bOk )
+	{
+		Warning( "Unable to write transfer index %s\n", szIndex );
+		remove( szIndex );
+	}
+	return bOk;
+}
+
+
+bool LoadTransferIndex( const char* pBaseName, CRC32_t key )
+{
+	V_strncpy( s_BaseName, pBaseName, sizeof( s_BaseName ) );
+
+	char szIndex[MAX_PATH];
+	GetTransferIndexName( szIndex, sizeof( szIndex ) );
+
+	CUtlBuffer buf;
+	FILE* fp = fopen( szIndex, "rb" );
+	if( !fp )
+	{
+		return false;
+	}
+	int nSize = GetTransferFileSize( fp );
+	fseek( fp, 0, SEEK_SET );
+	buf.EnsureCapacity( nSize );
+	bool bOk = nSize > 0 && fread( buf.Base(), nSize, 1, fp ) == 1;
+	fclose( fp );
+	if( !bOk )
+	{
+		return false;
+	}
+	buf.SeekPut( CUtlBuffer::SEEK_HEAD, nSize );
+
+	if( buf.GetInt() != TRANSFER_INDEX_VERSION || buf.GetUnsignedInt() != key )
+	{
+		return false;
+	}
+
+	int nFiles = buf.GetInt();
+	for( int i = 0; i < nFiles && buf.IsValid(); i++ )
+	{
+		int nFileSize = buf.GetInt();
+
+		transferfile_t* pFile = new transferfile_t;
+		s_Files.AddToTail( pFile );
+		V_snprintf( pFile->m_Name, sizeof( pFile->m_Name ), "%s.transfers%d", s_BaseName, i );
+		pFile->m_fp = fopen( pFile->m_Name, "rb" );
+		if( !pFile->m_fp || GetTransferFileSize( pFile->m_fp ) != nFileSize )
+		{
+			bOk = false;
+			break;
+		}
+	}
+
+	int nChunks = buf.GetInt();
+	if( bOk && buf.IsValid() && nChunks >= 0 && nChunks * ( int )sizeof( transferchunk_t ) <= buf.GetBytesRemaining() )
+	{
+		s_Chunks.SetCount( nChunks );
+		buf.Get( s_Chunks.Base(), nChunks * sizeof( transferchunk_t ) );
+		for( int i = 0; i < nChunks; i++ )
+		{
+			if( s_Chunks[i].m_iFile < 0 || s_Chunks[i].m_iFile >= s_Files.Count() )
+			{
+				bOk = false;
+			}
+		}
+	}
+	else
+	{
+		bOk = false;
+	}
+
+	if( !bOk || !buf.IsValid() )
+	{
+		// start over, BeginTransferFiles writes new files
+		FreeTransferFiles( true );
+		return false;
+	}
+
+	qprintf( "transfer files: reusing %d chunks from %s\n", s_Chunks.Count(), szIndex );
+	return true;
+}
+
+
+void FreeTransferFiles( bool bKeepFiles )
+{
+	for( int i = 0; i < s_Files.Count(); i++ )
+	{
+		transferfile_t* pFile = s_Files[i];
+		if( pFile->m_fp )
+		{
+			fclose( pFile->m_fp );
+		}
+		if( !bKeepFiles )
+		{
+			remove( pFile->m_Name );
+		}
+		delete pFile;
+	}
+	s_Files.Purge();
+	s_Chunks.Purge();
+
+	for( int i = 0; i < ARRAYSIZE( s_ReadBuffer ); i++ )
+	{
+		s_ReadBuffer[i].Purge();
+		s_RowBuffer[i].Purge();
+	}
+}
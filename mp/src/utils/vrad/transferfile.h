@@ -0,0 +1,55 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Out-of-core storage for the patch transfer lists. With
+//			-transferfiles each thread writes the rows MakeScales produces to
+//			its own temp files, quantized and delta coded, in fixed size
+//			chunks. The bounce passes then stream the chunks back in, so the
+//			transfers never have to fit in memory all at once.
+//
+//			-incremental keeps the files and an index next to the map so the
+//			next compile of the same geometry can skip BuildVisMatrix.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef TRANSFERFILE_H
+#define TRANSFERFILE_H
+#ifdef _WIN32
+	#pragma once
+#endif
+
+#include "checksum_crc.h"
+
+struct transfer_t;
+
+typedef void ( *TransferRowFn )( int patchnum, const transfer_t* pTransfers, int numTransfers );
+
+extern bool g_bTransferFiles;
+
+// Call before BuildVisMatrix. Files are named after pBaseName.
+void BeginTransferFiles( const char* pBaseName );
+
+// Stores the (already scaled) transfers of one patch. The list gets reordered.
+void WriteTransferRow( int iThread, int patchnum, transfer_t* pTransfers, int numTransfers );
+
+// Call once all rows are written, after this the chunks can be read.
+void FinishTransferFiles( void );
+
+int NumTransferChunks( void );
+float TransferChunkCost( int iChunk );
+
+// Reads and decodes chunk iChunk, calling fn for every row in it
+void ForEachTransferRow( int iThread, int iChunk, TransferRowFn fn );
+
+// Writes <pBaseName>.transfers, the index of the finished files. key has to
+// change whenever the transfers would.
+bool SaveTransferIndex( CRC32_t key );
+
+// Reopens the files of an index saved with the same key, instead of
+// BeginTransferFiles ... FinishTransferFiles.
+bool LoadTransferIndex( const char* pBaseName, CRC32_t key );
+
+// Closes and deletes the files, unless they're kept for LoadTransferIndex
+void FreeTransferFiles( bool bKeepFiles = false );
+
+#endif // TRANSFERFILE_H
@@ -8,6 +8,7 @@
 
 #include "vrad.h"
 #include "vmpi.h"
+#include "distribute.h"
 #ifdef MPI
 	#include "messbuf.h"
 	static MessageBuffer mb;
@@ -440,7 +441,7 @@ void BuildVisLeafs_Cluster(
 			transferMaker.Finish();
 
 			// do the transfers
-			MakeScales( patchnum, transfers );
+			MakeScales( patchnum, transfers, threadnum );
 
 			// Let MPI aggregate the data if it's being used.
 			if( PatchCB )
@@ -482,6 +483,18 @@ void BuildVisLeafs( int threadnum, void* pUserData )
 }
 
 
+// Each patch in the cluster builds its own vis row
+static float BuildVisLeafsCost( int iCluster )
+{
+	int nPatches = 0;
+	for( int i = clusterChildren.Element( iCluster ); i != g_Patches.InvalidIndex(); i = g_Patches[i].ndxNextClusterChild )
+	{
+		nPatches++;
+	}
+	return nPatches;
+}
+
+
 /*
 ==============
 BuildVisMatrix
@@ -496,8 +509,13 @@ void BuildVisMatrix( void )
 	}
 	else
 #endif // MPI && _WIN32
+	if( g_bDistributed )
+	{
+		RunDistributedBuildVisLeafs();
+	}
+	else
 	{
-		RunThreadsOn( dvis->numclusters, true, BuildVisLeafs );
+		RunThreadsOn( dvis->numclusters, true, BuildVisLeafs, NULL, BuildVisLeafsCost );
 	}
 }
 
@@ -19,6 +19,10 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "gamebspfile.h"
+#include "transferfile.h"
+#include "distribute.h"
+#include "phaseprofile.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -57,6 +61,8 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bUseTreeCache = true;
+bool		g_bUseAVX = true;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -82,11 +88,17 @@ char		vismatfile[_MAX_PATH] = "";
 char		incrementfile[_MAX_PATH] = "";
 
 IIncremental* g_pIncremental = 0;
+bool		g_bIncrementalRelight = false;	// -incremental
+static CRC32_t s_IncrementalOptionsCRC = 0;
+static CRC32_t s_IncrementalKey = 0;
 bool		g_bInterrupt = false;	// Wsed with background lighting in WC. Tells VRAD
 // to stop lighting.
 float g_SunAngularExtent = 0.0;
 
 float g_flSkySampleScale = 1.0;
+float g_flExtraThreshold = 0.0625;
+int g_nDenoisePasses = 0;
+float g_flDenoiseStrength = 1.0;
 
 bool g_bLargeDispSampleRadius = false;
 
@@ -115,6 +127,7 @@ qboolean	g_bLowPriority = false;
 qboolean	g_bLogHashData = false;
 bool		g_bNoDetailLighting = false;
 double		g_flStartTime;
+char		g_szPhaseProfile[MAX_PATH] = "";
 bool		g_bStaticPropLighting = false;
 bool        g_bStaticPropPolys = false;
 bool        g_bTextureShadows = false;
@@ -1249,7 +1262,7 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t* all_transfers )
 }
 
 
-void MakeScales( int ndxPatch, transfer_t* all_transfers )
+void MakeScales( int ndxPatch, transfer_t* all_transfers, int iThread )
 {
 	int		j;
 	float	total;
@@ -1270,13 +1283,6 @@ void MakeScales( int ndxPatch, transfer_t* all_transfers )
 			max_transfer = patch->numtransfers;
 		}
 
-
-		patch->transfers = ( transfer_t* )calloc( 1, patch->numtransfers * sizeof( transfer_t ) );
-		if( !patch->transfers )
-		{
-			Error( "Memory allocation failure" );
-		}
-
 		// get total transfer energy
 		t2 = all_transfers;
 
@@ -1296,12 +1302,31 @@ void MakeScales( int ndxPatch, transfer_t* all_transfers )
 			total = 1.0f / M_PI;
 		}
 
-		t = patch->transfers;
-		t2 = all_transfers;
-		for( j = 0 ; j < patch->numtransfers ; j++, t++, t2++ )
+		if( g_bTransferFiles )
+		{
+			// scale in place and let the row go out to disk
+			t2 = all_transfers;
+			for( j = 0 ; j < patch->numtransfers ; j++, t2++ )
+			{
+				t2->transfer *= total;
+			}
+			WriteTransferRow( iThread, ndxPatch, all_transfers, patch->numtransfers );
+		}
+		else
 		{
-			t->transfer = t2->transfer * total;
-			t->patch = t2->patch;
+			patch->transfers = ( transfer_t* )calloc( 1, patch->numtransfers * sizeof( transfer_t ) );
+			if( !patch->transfers )
+			{
+				Error( "Memory allocation failure" );
+			}
+
+			t = patch->transfers;
+			t2 = all_transfers;
+			for( j = 0 ; j < patch->numtransfers ; j++, t++, t2++ )
+			{
+				t->transfer = t2->transfer * total;
+				t->patch = t2->patch;
+			}
 		}
 		if( patch->numtransfers > max_transfer )
 		{
@@ -1609,113 +1634,130 @@ void PreGetBumpNormalsForDisp( texinfo_t* pTexinfo, Vector& vecU, Vector& vecV,
 	vecV = vecTexV;
 }
 
-void GatherLight( int threadnum, void* pUserData )
+// Gathers the light patch j receives through its transfers into addlight[j]
+static void GatherLightForPatch( int j, const transfer_t* trans, int num )
 {
-	int			i, j, k;
-	transfer_t*	trans;
-	int			num;
+	int			i, k;
 	CPatch*		patch;
 	Vector		sum, v;
 
-	while( 1 )
+	patch = &g_Patches[j];
+
+	if( patch->needsBumpmap )
 	{
-		j = GetThreadWork();
-		if( j == -1 )
-		{
-			break;
-		}
+		Vector delta;
+		Vector bumpSum[NUM_BUMP_VECTS + 1];
+		Vector normals[NUM_BUMP_VECTS + 1];
 
-		patch = &g_Patches[j];
+		// Disps
+		bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 );
+		if( bDisp )
+		{
+			normals[0] = patch->normal;
+			texinfo_t* pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+			Vector vecTexU, vecTexV;
+			PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
 
-		trans = patch->transfers;
-		num = patch->numtransfers;
-		if( patch->needsBumpmap )
+			// use facenormal along with the smooth normal to build the three bump map vectors
+			GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] );
+		}
+		else
 		{
-			Vector delta;
-			Vector bumpSum[NUM_BUMP_VECTS + 1];
-			Vector normals[NUM_BUMP_VECTS + 1];
+			GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
 
-			// Disps
-			bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 );
-			if( bDisp )
-			{
-				normals[0] = patch->normal;
-				texinfo_t* pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				Vector vecTexU, vecTexV;
-				PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
+			texinfo_t* pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+			// use facenormal along with the smooth normal to build the three bump map vectors
+			GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0],
+							pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal,
+							normals[0], &normals[1] );
+		}
 
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] );
-			}
-			else
-			{
-				GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
+		// force the base lightmap to use the flat normal instead of the phong normal
+		// FIXME: why does the patch not use the phong normal?
+		normals[0] = patch->normal;
 
-				texinfo_t* pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0],
-								pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal,
-								normals[0], &normals[1] );
-			}
+		for( i = 0; i < NUM_BUMP_VECTS + 1; i++ )
+		{
+			VectorFill( bumpSum[i], 0 );
+		}
 
-			// force the base lightmap to use the flat normal instead of the phong normal
-			// FIXME: why does the patch not use the phong normal?
-			normals[0] = patch->normal;
+		float dot;
+		for( k = 0 ; k < num ; k++, trans++ )
+		{
+			CPatch* patch2 = &g_Patches[trans->patch];
 
-			for( i = 0; i < NUM_BUMP_VECTS + 1; i++ )
+			// get vector to other patch
+			VectorSubtract( patch2->origin, patch->origin, delta );
+			VectorNormalize( delta );
+			// find light emitted from other patch
+			for( i = 0; i < 3; i++ )
 			{
-				VectorFill( bumpSum[i], 0 );
+				v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
 			}
+			// remove normal already factored into transfer steradian
+			float scale = 1.0f / DotProduct( delta, patch->normal );
+			VectorScale( v, trans->transfer * scale, v );
 
-			float dot;
-			for( k = 0 ; k < num ; k++, trans++ )
+			Vector bumpTransfer;
+			for( i = 0; i < NUM_BUMP_VECTS + 1; i++ )
 			{
-				CPatch* patch2 = &g_Patches[trans->patch];
-
-				// get vector to other patch
-				VectorSubtract( patch2->origin, patch->origin, delta );
-				VectorNormalize( delta );
-				// find light emitted from other patch
-				for( i = 0; i < 3; i++ )
-				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
-				}
-				// remove normal already factored into transfer steradian
-				float scale = 1.0f / DotProduct( delta, patch->normal );
-				VectorScale( v, trans->transfer * scale, v );
-
-				Vector bumpTransfer;
-				for( i = 0; i < NUM_BUMP_VECTS + 1; i++ )
+				dot = DotProduct( delta, normals[i] );
+				if( dot <= 0 )
 				{
-					dot = DotProduct( delta, normals[i] );
-					if( dot <= 0 )
-					{
 //						Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
-						continue;
-					}
-					bumpTransfer = v * dot;
-					VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
+					continue;
 				}
-			}
-			for( i = 0; i < NUM_BUMP_VECTS + 1; i++ )
-			{
-				VectorCopy( bumpSum[i], addlight[j].light[i] );
+				bumpTransfer = v * dot;
+				VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
 			}
 		}
-		else
+		for( i = 0; i < NUM_BUMP_VECTS + 1; i++ )
+		{
+			VectorCopy( bumpSum[i], addlight[j].light[i] );
+		}
+	}
+	else
+	{
+		VectorFill( sum, 0 );
+		for( k = 0 ; k < num ; k++, trans++ )
 		{
-			VectorFill( sum, 0 );
-			for( k = 0 ; k < num ; k++, trans++ )
+			for( i = 0; i < 3; i++ )
 			{
-				for( i = 0; i < 3; i++ )
-				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
-				}
-				VectorScale( v, trans->transfer, v );
-				VectorAdd( sum, v, sum );
+				v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
 			}
-			VectorCopy( sum, addlight[j].light[0] );
+			VectorScale( v, trans->transfer, v );
+			VectorAdd( sum, v, sum );
 		}
+		VectorCopy( sum, addlight[j].light[0] );
+	}
+}
+
+void GatherLight( int threadnum, void* pUserData )
+{
+	while( 1 )
+	{
+		int j = GetThreadWork();
+		if( j == -1 )
+		{
+			break;
+		}
+
+		GatherLightForPatch( j, g_Patches[j].transfers, g_Patches[j].numtransfers );
+	}
+}
+
+// Same as GatherLight, but with the transfers streamed in from the transfer files a chunk at a time
+void GatherLightFromTransferFiles( int threadnum, void* pUserData )
+{
+	while( 1 )
+	{
+		int iChunk = GetThreadWork();
+		if( iChunk == -1 )
+		{
+			break;
+		}
+
+		ForEachTransferRow( threadnum, iChunk, GatherLightForPatch );
 	}
 }
 
@@ -1724,6 +1766,13 @@ void GatherLight( int threadnum, void* pUserData )
 #endif
 
 
+// Gathering is linear in the number of transfers
+static float GatherLightCost( int patchnum )
+{
+	return g_Patches[patchnum].numtransfers;
+}
+
+
 /*
 =============
 BounceLight
@@ -1782,8 +1831,17 @@ void BounceLight( void )
 	{
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
-		uiPatchCount = g_Patches.Size();
-		RunThreadsOn( uiPatchCount, true, GatherLight );
+		if( g_bTransferFiles )
+		{
+			// only patches with a row in the files get written to
+			memset( addlight.Base(), 0, addlight.Count() * sizeof( bumplights_t ) );
+			RunThreadsOn( NumTransferChunks(), true, GatherLightFromTransferFiles, NULL, TransferChunkCost );
+		}
+		else
+		{
+			uiPatchCount = g_Patches.Size();
+			RunThreadsOn( uiPatchCount, true, GatherLight, NULL, GatherLightCost );
+		}
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
@@ -1889,8 +1947,10 @@ void RadWorld_Start()
 	BuildClusterTable();
 
 	// turn each face into a single patch
+	PhaseProfile_Begin( "MakePatches" );
 	MakePatches();
 	PairEdges();
+	PhaseProfile_End();
 
 	// store the vertex normals calculated in PairEdges
 	// so that the can be written to the bsp file for
@@ -1898,13 +1958,17 @@ void RadWorld_Start()
 	SaveVertexNormals();
 
 	// subdivide patches to a maximum dimension
+	PhaseProfile_Begin( "SubdividePatches" );
 	SubdividePatches();
+	PhaseProfile_End();
 
 	// add displacement faces to cluster table
 	AddDispsToClusterTable();
 
 	// create directlights out of patches and lights
+	PhaseProfile_Begin( "CreateDirectLights" );
 	CreateDirectLights();
+	PhaseProfile_End();
 
 	// set up sky cameras
 	ProcessSkyCameras();
@@ -2007,16 +2071,49 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 void MakeAllScales( void )
 {
+#if defined ( MPI ) && defined ( _WIN32 )
+	if( g_bTransferFiles && g_bUseMPI )
+	{
+		Warning( "-transferfiles doesn't work with MPI, keeping the transfers in memory.\n" );
+		g_bTransferFiles = false;
+	}
+#endif // MPI && _WIN32
+
+	if( g_bTransferFiles )
+	{
+		// -incremental reuses the transfers of the last compile of the same geometry
+		if( g_bIncrementalRelight && LoadTransferIndex( source, s_IncrementalKey ) )
+		{
+			return;
+		}
+
+		BeginTransferFiles( source );
+	}
+
 	// determine visibility between patches
+	PhaseProfile_Begin( "BuildVisMatrix" );
 	BuildVisMatrix();
+	PhaseProfile_End();
 
 	// release visibility matrix
 	FreeVisMatrix();
 
 	Msg( "transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf( "transfer lists: %5.1f megs\n"
-			 , ( float )total_transfer * sizeof( transfer_t ) / ( 1024 * 1024 ) );
+	if( g_bTransferFiles )
+	{
+		FinishTransferFiles();
+
+		if( g_bIncrementalRelight )
+		{
+			SaveTransferIndex( s_IncrementalKey );
+		}
+	}
+	else
+	{
+		qprintf( "transfer lists: %5.1f megs\n"
+				 , ( float )total_transfer * sizeof( transfer_t ) / ( 1024 * 1024 ) );
+	}
 }
 
 
@@ -2085,13 +2182,36 @@ void ScratchPad_DrawWorld()
 #endif
 
 
+// Direct lighting cost scales with the number of luxels (and bump pages) on the face
+static float BuildFacelightsCost( int facenum )
+{
+	dface_t* f = &g_pFaces[facenum];
+	if( texinfo[f->texinfo].flags & TEX_SPECIAL )
+	{
+		return 1;
+	}
+
+	float flLuxels = ( f->m_LightmapTextureSizeInLuxels[0] + 1 ) * ( f->m_LightmapTextureSizeInLuxels[1] + 1 );
+	if( texinfo[f->texinfo].flags & SURF_BUMPLIGHT )
+	{
+		flLuxels *= NUM_BUMP_VECTS + 1;
+	}
+	return flLuxels;
+}
+
 bool RadWorld_Go()
 {
 	g_iCurFace = 0;
 
 	InitMacroTexture( source );
 
-	if( g_pIncremental )
+	if( g_pIncremental && g_bIncrementalRelight )
+	{
+		// Every face gets relit, unchanged lights just come out of the file.
+		g_pIncremental->PrepareForLighting();
+		BuildFacesVisibleToLights( true );
+	}
+	else if( g_pIncremental )
 	{
 		g_pIncremental->PrepareForLighting();
 
@@ -2107,6 +2227,7 @@ bool RadWorld_Go()
 	}
 
 	// build initial facelights
+	PhaseProfile_Begin( "BuildFacelights" );
 #if defined ( MPI ) && defined ( _WIN32 )
 	if( g_bUseMPI )
 	{
@@ -2115,9 +2236,15 @@ bool RadWorld_Go()
 	}
 	else
 #endif // MPI && _WIN32
+	if( g_bDistributed )
 	{
-		RunThreadsOnIndividual( numfaces, true, BuildFacelights );
+		RunDistributedBuildFacelights();
 	}
+	else
+	{
+		RunThreadsOnIndividual( numfaces, true, BuildFacelights, BuildFacelightsCost );
+	}
+	PhaseProfile_End();
 
 	// Was the process interrupted?
 	if( g_pIncremental && ( g_iCurFace != numfaces ) )
@@ -2129,7 +2256,7 @@ bool RadWorld_Go()
 	PrecompLightmapOffsets();
 
 	// If we're doing incremental lighting, stop here.
-	if( g_pIncremental )
+	if( g_pIncremental && !g_bIncrementalRelight )
 	{
 		g_pIncremental->Finalize();
 	}
@@ -2156,10 +2283,27 @@ bool RadWorld_Go()
 			addlight.SetSize( g_Patches.Size() );
 			memset( addlight.Base(), 0, g_Patches.Size() * sizeof( bumplights_t ) );
 
+			PhaseProfile_Begin( "MakeAllScales" );
 			MakeAllScales();
+			PhaseProfile_End();
+
+			// the master does the bouncing
+			if( g_bDistWorker )
+			{
+				Dist_WorkerDone();
+			}
 
 			// spread light around
+			PhaseProfile_Begin( "BounceLight" );
 			BounceLight();
+			PhaseProfile_End();
+
+			FreeTransferFiles( g_bIncrementalRelight );
+		}
+
+		if( g_bDistWorker )
+		{
+			Dist_WorkerDone();
 		}
 
 		//
@@ -2171,6 +2315,7 @@ bool RadWorld_Go()
 		StaticDispMgr()->EndTimer();
 
 		// blend bounced light into direct light and save
+		PhaseProfile_Begin( "FinalLightFace" );
 #if defined ( MPI ) && defined ( _WIN32 )
 		VMPI_SetCurrentStage( "FinalLightFace" );
 		if( !g_bUseMPI || g_bMPIMaster )
@@ -2182,6 +2327,8 @@ bool RadWorld_Go()
 		VMPI_DistributeLightData();
 #endif // MPI && _WIN32
 
+		PhaseProfile_End();
+
 		Msg( "FinalLightFace Done\n" );
 		fflush( stdout );
 	}
@@ -2216,11 +2363,126 @@ void InitDumpPatchesFiles()
 	}
 }
 
+//-----------------------------------------------------------------------------
+// -incremental: the CRC of everything the saved lighting depends on, except the
+// lights themselves which are matched one by one.
+//-----------------------------------------------------------------------------
+static CRC32_t ComputeIncrementalKey( void )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, &s_IncrementalOptionsCRC, sizeof( s_IncrementalOptionsCRC ) );
+
+	CRC32_ProcessBuffer( &crc, dplanes, numplanes * sizeof( dplane_t ) );
+	CRC32_ProcessBuffer( &crc, dvertexes, numvertexes * sizeof( dvertex_t ) );
+	CRC32_ProcessBuffer( &crc, dedges, numedges * sizeof( dedge_t ) );
+	CRC32_ProcessBuffer( &crc, dsurfedges, numsurfedges * sizeof( dsurfedges[0] ) );
+	CRC32_ProcessBuffer( &crc, dmodels, nummodels * sizeof( dmodel_t ) );
+	CRC32_ProcessBuffer( &crc, dtexdata, numtexdata * sizeof( dtexdata_t ) );
+	CRC32_ProcessBuffer( &crc, texinfo.Base(), texinfo.Count() * sizeof( texinfo_t ) );
+	CRC32_ProcessBuffer( &crc, g_dispinfo.Base(), g_dispinfo.Count() * sizeof( ddispinfo_t ) );
+	CRC32_ProcessBuffer( &crc, g_DispVerts.Base(), g_DispVerts.Count() * sizeof( CDispVert ) );
+	CRC32_ProcessBuffer( &crc, dvisdata, visdatasize );
+
+	// leave out what vrad writes into the faces
+	for( int i = 0; i < numfaces; i++ )
+	{
+		dface_t face = g_pFaces[i];
+		face.lightofs = 0;
+		memset( face.styles, 0, sizeof( face.styles ) );
+		CRC32_ProcessBuffer( &crc, &face, sizeof( face ) );
+	}
+
+	// static props and brush entities cast shadows
+	GameLumpHandle_t handle = g_GameLumps.GetGameLumpHandle( GAMELUMP_STATIC_PROPS );
+	if( handle != g_GameLumps.InvalidGameLump() && g_GameLumps.GetGameLump( handle ) )
+	{
+		CRC32_ProcessBuffer( &crc, g_GameLumps.GetGameLump( handle ), g_GameLumps.GameLumpSize( handle ) );
+	}
+	StaticPropMgr()->ChecksumModels( &crc );
+
+	// lights.rad and -lights say what the texture lights emit, which the patches bounce
+	for( int i = 0; i < num_texlights; i++ )
+	{
+		CRC32_ProcessBuffer( &crc, texlights[i].name, V_strlen( texlights[i].name ) + 1 );
+		CRC32_ProcessBuffer( &crc, &texlights[i].value, sizeof( texlights[i].value ) );
+	}
+
+	for( int i = 0; i < num_entities; i++ )
+	{
+		if( !Q_strnicmp( ValueForKey( &entities[i], "classname" ), "light", 5 ) )
+		{
+			continue;
+		}
+
+		for( epair_t* ep = entities[i].epairs; ep; ep = ep->next )
+		{
+			CRC32_ProcessBuffer( &crc, ep->key, V_strlen( ep->key ) + 1 );
+			CRC32_ProcessBuffer( &crc, ep->value, V_strlen( ep->value ) + 1 );
+		}
+	}
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
+// Options that don't change the lighting don't invalidate the -incremental file
+static void ComputeIncrementalOptionsCRC( int argc, char** argv, int iMapArg )
+{
+	CRC32_Init( &s_IncrementalOptionsCRC );
+	for( int i = 1; i < iMapArg; i++ )
+	{
+		if( !Q_stricmp( argv[i], "-threads" ) )
+		{
+			++i;
+			continue;
+		}
+
+		if( !Q_stricmp( argv[i], "-incremental" ) || !Q_stricmp( argv[i], "-transferfiles" ) ||
+				!Q_stricmp( argv[i], "-v" ) || !Q_stricmp( argv[i], "-verbose" ) ||
+				!Q_stricmp( argv[i], "-low" ) || !Q_stricmp( argv[i], "-nortcache" ) )
+		{
+			continue;
+		}
+
+		CRC32_ProcessBuffer( &s_IncrementalOptionsCRC, argv[i], V_strlen( argv[i] ) + 1 );
+	}
+	CRC32_Final( &s_IncrementalOptionsCRC );
+}
+
 extern IFileSystem* g_pOriginalPassThruFileSystem;
 
 void VRAD_LoadBSP( char const* pFilename )
 {
 	ThreadSetDefault();
+	Dist_Init();
+
+	if( g_bDistWorker )
+	{
+		// the master owns the files next to the map
+		g_bTransferFiles = false;
+		g_bUseTreeCache = false;
+	}
+
+	if( g_bIncrementalRelight )
+	{
+		// the direct light has to be traced (and recorded) in this process
+		bool bOk = !g_bDistributed;
+#if defined ( MPI ) && defined ( _WIN32 )
+		bOk = bOk && !g_bUseMPI;
+#endif // MPI && _WIN32
+		if( !bOk )
+		{
+			Warning( "-incremental doesn't work with distributed compiles, relighting everything.\n" );
+			g_bIncrementalRelight = false;
+			g_pIncremental = NULL;
+		}
+		else
+		{
+			// the transfers are kept in files so the next compile can reuse them
+			g_bTransferFiles = true;
+		}
+	}
 
 	g_flStartTime = Plat_FloatTime();
 
@@ -2245,6 +2507,7 @@ void VRAD_LoadBSP( char const* pFilename )
 
 	if( !g_bUseMPI )
 #endif // MPI && _WIN32
+	if( !g_bDistWorker )
 	{
 		// Setup the logfile.
 		char logFile[512];
@@ -2294,15 +2557,19 @@ void VRAD_LoadBSP( char const* pFilename )
 	Q_DefaultExtension( incrementfile, ".r0", sizeof( incrementfile ) );
 	Q_DefaultExtension( source, ".bsp", sizeof( source ) );
 
+	PhaseProfile_Begin( "LoadBSPFile" );
 #if defined ( MPI ) && defined ( _WIN32 )
 	Msg( "Loading %s\n", source );
 	VMPI_SetCurrentStage( "LoadBSPFile" );
 	LoadBSPFile( source );
+	Dist_HashFile( source );
 #else
 	//strcpy(source, ExpandPath(source));
 	Msg( "Loading %s\n", pFilename );
 	LoadBSPFile( pFilename );
+	Dist_HashFile( pFilename );
 #endif // MPI && _WIN32
+	PhaseProfile_End();
 
 	// Add this bsp to our search path so embedded resources can be found
 #if defined ( MPI ) && defined ( _WIN32 )
@@ -2384,6 +2651,7 @@ void VRAD_LoadBSP( char const* pFilename )
 	}
 
 	// Setup ray tracer
+	PhaseProfile_Begin( "SetupRayTrace" );
 	AddBrushesForRayTrace();
 	StaticDispMgr()->AddPolysForRayTrace();
 	StaticPropMgr()->AddPolysForRayTrace();
@@ -2397,18 +2665,47 @@ void VRAD_LoadBSP( char const* pFilename )
 	// Build acceleration structure
 	printf( "Setting up ray-trace acceleration structure... " );
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
+	g_RtEnv.m_nBuildThreads = numthreads;
+	bool bCachedTree = false;
+	if( g_bUseTreeCache )
+	{
+		char treeCacheFile[MAX_PATH];
+		V_snprintf( treeCacheFile, sizeof( treeCacheFile ), "%s.rtcache", source );
+		bCachedTree = g_RtEnv.SetupAccelerationStructure( treeCacheFile );
+	}
+	else
+	{
+		g_RtEnv.SetupAccelerationStructure();
+	}
 	float end = Plat_FloatTime();
-	printf( "Done (%.2f seconds)\n", end - start );
+	printf( "Done (%.2f seconds%s)\n", end - start, bCachedTree ? ", from cache" : "" );
+	PhaseProfile_End();
+
+	if( !g_bUseAVX )
+	{
+		g_RtEnv.Flags |= RTE_FLAGS_NO_AVX;
+	}
+	qprintf( "Sky visibility traced %d rays per packet\n", g_RtEnv.CanTrace8Wide() ? 8 : 4 );
 
 #if 0  // To test only k-d build
 	exit( 0 );
 #endif
 
+	PhaseProfile_Begin( "RadWorld_Start" );
 	RadWorld_Start();
+	PhaseProfile_End();
 
 	// Setup incremental lighting.
-	if( g_pIncremental )
+	if( g_pIncremental && g_bIncrementalRelight )
+	{
+		s_IncrementalKey = ComputeIncrementalKey();
+		if( !g_pIncremental->InitRelight( source, incrementfile, s_IncrementalKey ) )
+		{
+			Error( "Unable to load incremental lighting file in %s.\n", incrementfile );
+			return;
+		}
+	}
+	else if( g_pIncremental )
 	{
 		if( !g_pIncremental->Init( source, incrementfile ) )
 		{
@@ -2421,19 +2718,35 @@ void VRAD_LoadBSP( char const* pFilename )
 
 void VRAD_ComputeOtherLighting()
 {
+	// detail props and static props gather their indirect light from the final lightmaps
+	if( !g_bNoDetailLighting || ( !do_fast && g_bStaticPropLighting ) )
+	{
+		SetupLightSurfaceTrace();
+	}
+
 	// Compute lighting for the bsp file
 	if( !g_bNoDetailLighting )
 	{
+		CPhaseProfileScope phase( "DetailPropLighting" );
 		ComputeDetailPropLighting( THREADINDEX_MAIN );
 	}
 
+	PhaseProfile_Begin( "LeafAmbientLighting" );
 	ComputePerLeafAmbientLighting();
+	PhaseProfile_End();
 
 	// bake the static props high quality vertex lighting into the bsp
 	if( !do_fast && g_bStaticPropLighting )
 	{
+		CPhaseProfileScope phase( "StaticPropLighting" );
 		StaticPropMgr()->ComputeLighting( THREADINDEX_MAIN );
 	}
+
+	// -incremental saves the direct light of each light on the faces and the static props
+	if( g_pIncremental && g_bIncrementalRelight )
+	{
+		g_pIncremental->Finalize();
+	}
 }
 
 extern void CloseDispLuxels();
@@ -2452,7 +2765,9 @@ void VRAD_Finish()
 #if defined ( MPI ) && defined ( _WIN32 )
 	VMPI_SetCurrentStage( "WriteBSPFile" );
 #endif // MPI && _WIN32
+	PhaseProfile_Begin( "WriteBSPFile" );
 	WriteBSPFile( source );
+	PhaseProfile_End();
 
 	if( g_bDumpPatches )
 	{
@@ -2545,6 +2860,26 @@ int ParseCommandLine( int argc, char** argv, bool* onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if( !Q_stricmp( argv[i], "-nortcache" ) )
+		{
+			g_bUseTreeCache = false;
+		}
+		else if( !Q_stricmp( argv[i], "-noavx" ) )
+		{
+			g_bUseAVX = false;
+		}
+		else if( !Q_stricmp( argv[i], "-transferfiles" ) )
+		{
+			g_bTransferFiles = true;
+		}
+		else if( !Q_stricmp( argv[i], "-incremental" ) )
+		{
+			g_bIncrementalRelight = true;
+			g_pIncremental = GetIncremental();
+		}
+		else if( Dist_HandleArg( argc, argv, i ) )
+		{
+		}
 		else if( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2640,6 +2975,42 @@ int ParseCommandLine( int argc, char** argv, bool* onlydetail )
 				return -1;
 			}
 		}
+		else if( !Q_stricmp( argv[i], "-extrathreshold" ) )
+		{
+			if( ++i < argc && *argv[i] )
+			{
+				g_flExtraThreshold = atof( argv[i] );
+			}
+			else
+			{
+				Warning( "Error: expected a gradient after '-extrathreshold'\n" );
+				return -1;
+			}
+		}
+		else if( !Q_stricmp( argv[i], "-denoise" ) )
+		{
+			if( ++i < argc && *argv[i] )
+			{
+				g_nDenoisePasses = clamp( atoi( argv[i] ), 0, 5 );
+			}
+			else
+			{
+				Warning( "Error: expected a number of passes after '-denoise'\n" );
+				return -1;
+			}
+		}
+		else if( !Q_stricmp( argv[i], "-denoisestrength" ) )
+		{
+			if( ++i < argc && *argv[i] )
+			{
+				g_flDenoiseStrength = atof( argv[i] );
+			}
+			else
+			{
+				Warning( "Error: expected a strength after '-denoisestrength'\n" );
+				return -1;
+			}
+		}
 		else if( !Q_stricmp( argv[i], "-centersamples" ) )
 		{
 			do_centersamples = true;
@@ -2736,6 +3107,18 @@ int ParseCommandLine( int argc, char** argv, bool* onlydetail )
 		{
 			EnableFullMinidumps( true );
 		}
+		else if( !Q_stricmp( argv[i], "-phaseprofile" ) )
+		{
+			if( ++i < argc && *argv[i] )
+			{
+				V_strncpy( g_szPhaseProfile, argv[i], sizeof( g_szPhaseProfile ) );
+			}
+			else
+			{
+				Warning( "Error: expected a filename after '-phaseprofile'\n" );
+				return -1;
+			}
+		}
 		else if( !Q_stricmp( argv[i], "-hdr" ) )
 		{
 			SetHDRMode( true );
@@ -2941,6 +3324,9 @@ void PrintUsage( int argc, char** argv )
 		"  -fastambient    : Per-leaf ambient sampling is lower quality to save compute time.\n"
 		"  -final          : High quality processing. equivalent to -extrasky 16.\n"
 		"  -extrasky n     : trace N times as many rays for indirect light and sky ambient.\n"
+		"                    Values below 1 trace fewer, pair them with -denoise.\n"
+		"  -denoise n      : Smooth the noise of sky and area light sampling out of the\n"
+		"                    lightmaps with n filter passes (1-5), keeping edges sharp.\n"
 		"  -low            : Run as an idle-priority process.\n"
 		"  -mpi            : Use VMPI to distribute computations.\n"
 		"  -rederror       : Show errors in red.\n"
@@ -2953,11 +3339,32 @@ void PrintUsage( int argc, char** argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -nortcache      : Always rebuild the ray-tracing kd-tree instead of reusing\n"
+		"                    the one cached in <mapname>.rtcache.\n"
+		"  -noavx          : Don't trace rays 8 at a time with AVX, even if the cpu\n"
+		"                    supports it.\n"
+		"  -transferfiles  : Keep the radiosity transfer lists in temporary files next\n"
+		"                    to the map instead of in memory. Slower, but lets big maps\n"
+		"                    with -extra or a small -chop fit in memory.\n"
+		"  -incremental    : Save the direct light of each light in <mapname>.r0 and\n"
+		"                    the transfers next to the map. If only lights changed since,\n"
+		"                    the next compile only traces the new or changed lights\n"
+		"                    and skips building the visibility matrix.\n"
+		"  -distmaster <port> : Listen on <port> and share BuildFacelights and\n"
+		"                    BuildVisLeafs with workers.\n"
+		"  -distworker <host>:<port> : Work for the master at <host>:<port>. Run with the same\n"
+		"                    map and options as the master, quits once it's no longer needed.\n"
+		"  -disttimeout <seconds> : Hand a work unit to someone else if its worker doesn't\n"
+		"                    answer for this long (default 900, 0 never gives up).\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
 		"                    level lights file.\n"
 		"  -noextra        : Disable supersampling.\n"
+		"  -extrathreshold # : Supersample luxels whose light changes by more than this\n"
+		"                    to their neighbors (default 0.0625). Higher is faster.\n"
+		"  -denoisestrength # : How different the light may be and still get smoothed\n"
+		"                    by -denoise (default 1.0).\n"
 		"  -debugextra     : Places debugging data in lightmaps to visualize\n"
 		"                    supersampling.\n"
 		"  -smooth #       : Set the threshold for smoothing groups, in degrees\n"
@@ -2978,6 +3385,7 @@ void PrintUsage( int argc, char** argv )
 		"                    Produces soft shadows.\n"
 		"                    Recommended values are between 0 and 5. Default is 0.\n"
 		"  -FullMinidumps  : Write large minidumps on crash.\n"
+		"  -phaseprofile <file> : Write the time and rays spent in each phase to <file> as JSON.\n"
 		"  -chop           : Smallest number of luxel widths for a bounce patch, used on edges\n"
 		"  -maxchop		   : Coarsest allowed number of luxel widths for a patch, used in face interiors\n"
 		"\n"
@@ -3052,6 +3460,16 @@ int RunVRAD( int argc, char** argv )
 		CmdLib_Exit( 1 );
 	}
 
+	if( g_szPhaseProfile[0] )
+	{
+		PhaseProfile_Init( "vrad", g_szPhaseProfile );
+	}
+
+	if( g_bIncrementalRelight )
+	{
+		ComputeIncrementalOptionsCRC( argc, argv, i );
+	}
+
 	// Initialize the filesystem, so additional commandline options can be loaded
 	Q_StripExtension( argv[ i ], source, sizeof( source ) );
 	CmdLib_InitFileSystem( argv[ i ] );
@@ -283,9 +283,13 @@ extern qboolean		g_bLowPriority;
 extern qboolean		do_fast;
 extern bool			g_bInterrupt;		// Was used with background lighting in WC. Tells VRAD to stop lighting.
 extern IIncremental* g_pIncremental;	// null if not doing incremental lighting
+extern bool			g_bIncrementalRelight;	// -incremental, g_pIncremental relights every face
 extern bool			g_bDumpPropLightmaps;
 
 extern float g_flSkySampleScale;								// extra sampling factor for indirect light
+extern float g_flExtraThreshold;								// light gradient that gets a luxel supersampled
+extern int g_nDenoisePasses;									// -denoise, 0 leaves the lightmaps alone
+extern float g_flDenoiseStrength;								// scales how different the smoothed light may be
 
 extern bool g_bLargeDispSampleRadius;
 extern bool g_bStaticPropPolys;
@@ -305,6 +309,7 @@ extern bool IsModelTextureShadowsForced( const char* pModelName );
 extern RayTracingEnvironment g_RtEnv;
 
 #include "mpivrad.h"
+#include "distrad.h"
 
 void MakeShadowSplits( void );
 
@@ -388,10 +393,17 @@ inline byte PVSCheck( const byte* pvs, int iCluster )
 // outputs 1 in fractionVisible if no occlusion, 0 if full occlusion, and in-between values
 void TestLine( FourVectors const& start, FourVectors const& stop, fltx4* pFractionVisible, int static_prop_index_to_ignore = -1 );
 
+// same as above for two sets of 4 lines, traced together as one 8 wide packet when the cpu can
+void TestLine8( FourVectors const* start, FourVectors const* stop, fltx4* pFractionVisible, int static_prop_index_to_ignore = -1 );
+
 // returns 1 if the ray sees the sky, 0 if it doesn't, and in-between values for partial coverage
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 						  fltx4* pFractionVisible, bool canRecurse = true, int static_prop_to_skip = -1, bool bDoDebug = false );
 
+// same as above for two sets of 4 lines, traced together as one 8 wide packet when the cpu can
+void TestLine_DoesHitSky8( FourVectors const* start, FourVectors const* stop,
+						   fltx4* pFractionVisible, bool canRecurse = true, int static_prop_to_skip = -1 );
+
 // converts any marked brush entities to triangles for shadow casting
 void ExtractBrushEntityShadowCasters( void );
 void AddBrushesForRayTrace( void );
@@ -401,7 +413,7 @@ void CreateDirectLights( void );
 void GetPhongNormal( int facenum, Vector const& spot, Vector& phongnormal );
 int LightForString( char* pLight, Vector& intensity );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t* all_transfers );
-void MakeScales( int ndxPatch, transfer_t* all_transfers );
+void MakeScales( int ndxPatch, transfer_t* all_transfers, int iThread );
 
 // Run startup code like initialize mathlib.
 void VRAD_Init();
@@ -461,6 +473,14 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t& out, directlight_t* dl, int
 						   int nLFlags = 0,					// GATHERLFLAGS_xxx
 						   int static_prop_to_skip = -1,
 						   float flEpsilon = 0.0 );
+
+// true for point, spot and surface lights, the lights with a single shadow ray per sample
+bool IsStandardLight( directlight_t* dl );
+
+// GatherSampleLightSSE for two standard lights at the same points, their shadow rays are traced together
+void GatherSampleLightPairSSE( SSE_sampleLightOutput_t* pOut, directlight_t** ppLights, int facenum,
+							   FourVectors const& pos, FourVectors* pNormals, int normalCount, int iThread,
+							   int nLFlags = 0, int static_prop_to_skip = -1 );
 //void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum,
 //							 FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 //							 int nLFlags = 0,
@@ -591,6 +611,10 @@ extern int patchSamplesAdded;
 //-----------------------------------------------------------------------------
 
 void ComputeDetailPropLighting( int iThread );
+
+// Builds the ray trace environment the detail and static prop indirect lighting traces
+// against. Needs the final lightmaps and is only built once.
+void SetupLightSurfaceTrace( void );
 void ComputeIndirectLightingAtPoint( Vector& position, Vector& normal, Vector& outColor,
 									 int iThread, bool force_fast = false, bool bIgnoreNormals = false );
 
@@ -613,6 +637,9 @@ public:
 	virtual void Shutdown() = 0;
 	virtual void ComputeLighting( int iThread ) = 0;
 	virtual void AddPolysForRayTrace() = 0;
+
+	// -incremental keys on the models, they aren't in the bsp
+	virtual void ChecksumModels( CRC32_t* pCRC ) = 0;
 };
 
 //extern PropTested_t s_PropTested[MAX_TOOL_THREADS+1];
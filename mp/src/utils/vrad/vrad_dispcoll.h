@@ -77,6 +77,19 @@ public:
 		return m_aLuxelCoords[iLuxel];
 	}
 
+	inline int GetTriCount( void )
+	{
+		return m_aTris.Size();
+	}
+	inline void GetTriVerts( int iTri, int* pVerts )
+	{
+		Assert( ( iTri >= 0 ) && ( iTri < m_aTris.Size() ) );
+		for( int i = 0; i < 3; i++ )
+		{
+			pVerts[i] = m_aTris[iTri].GetVert( i );
+		}
+	}
+
 	// Raytracing
 	void AddPolysForRayTrace( void );
 
@@ -8,10 +8,12 @@ set(
 	"${SRCDIR}/public/disp_common.cpp"
 	"${SRCDIR}/public/disp_powerinfo.cpp"
 	"${VRAD_DLL_DIR}/disp_vrad.cpp"
+	"${VRAD_DLL_DIR}/distrad.cpp"
 	"${VRAD_DLL_DIR}/imagepacker.cpp"
 	"${VRAD_DLL_DIR}/incremental.cpp"
 	"${VRAD_DLL_DIR}/leaf_ambient_lighting.cpp"
 	"${VRAD_DLL_DIR}/lightmap.cpp"
+	"${VRAD_DLL_DIR}/lightmapdenoise.cpp"
 	"${SRCDIR}/public/loadcmdline.cpp"
 	"${SRCDIR}/public/lumpfiles.cpp"
 	"${VRAD_DLL_DIR}/macro_texture.cpp"
@@ -19,10 +21,12 @@ set(
 	"$<${IS_WINDOWS}:${VRAD_DLL_DIR}/mpivrad.cpp>"
 	"$<${IS_WINDOWS}:${SRCDIR}/utils/common/MySqlDatabase.cpp>"
 	"${SRCDIR}/utils/common/pacifier.cpp"
+	"${SRCDIR}/utils/common/phaseprofile.cpp"
 	"${SRCDIR}/utils/common/physdll.cpp"
 	"${VRAD_DLL_DIR}/radial.cpp"
 	"${VRAD_DLL_DIR}/SampleHash.cpp"
 	"${VRAD_DLL_DIR}/trace.cpp"
+	"${VRAD_DLL_DIR}/transferfile.cpp"
 	"${SRCDIR}/utils/common/utilmatlib.cpp"
 	"${VRAD_DLL_DIR}/vismat.cpp"
 	"$<${IS_WINDOWS}:${SRCDIR}/utils/common/vmpi_tools_shared.cpp>"
@@ -41,6 +45,7 @@ set(
 	"${SRCDIR}/public/ChunkFile.cpp"
 	"${SRCDIR}/utils/common/cmdlib.cpp"
 	"${SRCDIR}/public/DispColl_Common.cpp"
+	"${SRCDIR}/utils/common/distribute.cpp"
 	"${SRCDIR}/utils/common/map_shared.cpp"
 	"${SRCDIR}/utils/common/polylib.cpp"
 	"${SRCDIR}/utils/common/scriplib.cpp"
@@ -57,6 +62,8 @@ set(
 
 	# Header Files
 	"${VRAD_DLL_DIR}/disp_vrad.h"
+	"${VRAD_DLL_DIR}/distrad.h"
+	"${SRCDIR}/utils/common/distribute.h"
 	"${VRAD_DLL_DIR}/iincremental.h"
 	"${VRAD_DLL_DIR}/imagepacker.h"
 	"${VRAD_DLL_DIR}/incremental.h"
@@ -67,6 +74,7 @@ set(
 	"${VRAD_DLL_DIR}/mpivrad.h"
 	"${VRAD_DLL_DIR}/radial.h"
 	"${SRCDIR}/public/bitmap/tgawriter.h"
+	"${VRAD_DLL_DIR}/transferfile.h"
 	"${VRAD_DLL_DIR}/vismat.h"
 	"${VRAD_DLL_DIR}/vrad.h"
 	"${VRAD_DLL_DIR}/VRAD_DispColl.h"
@@ -86,6 +94,7 @@ set(
 	"${SRCDIR}/utils/common/mpi_stats.h"
 	"${SRCDIR}/utils/common/MySqlDatabase.h"
 	"${SRCDIR}/utils/common/pacifier.h"
+	"${SRCDIR}/utils/common/phaseprofile.h"
 	"${SRCDIR}/utils/common/polylib.h"
 	"${SRCDIR}/utils/common/scriplib.h"
 	"${SRCDIR}/utils/vmpi/threadhelpers.h"
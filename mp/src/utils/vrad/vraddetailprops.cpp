@@ -21,6 +21,8 @@
 #include "mathlib/halton.h"
 #include "messbuf.h"
 #include "byteswap.h"
+#include "collisionutils.h"
+#include "phaseprofile.h"
 
 bool LoadStudioModel( char const* pModelName, CUtlBuffer& buf );
 
@@ -574,6 +576,203 @@ public:
 	bool	m_bHasLuxel;
 };
 
+//-----------------------------------------------------------------------------
+// Finds the surfaces hit by 4 rays at once
+//
+// This is a separate ray trace environment with the triangles of the world
+// faces. The triangle ids index s_LightSurfaceTris, which maps each triangle
+// back to its face, so the lightmap can be sampled where the rays hit.
+// Faces the bsp walk in CLightSurface passes through (nolight faces that
+// aren't sky) are left out.
+//-----------------------------------------------------------------------------
+
+struct LightSurfaceTri_t
+{
+	int		m_nFace;
+	int		m_nDispVerts[3];	// displacement verts for the luxel coords, -1 on brush faces
+};
+
+struct LightSurfaceHit_t
+{
+	dface_t*	m_pSurface;		// NULL if the ray didn't hit anything
+	float		m_HitFrac;
+	Vector2D	m_LuxelCoord;
+	bool		m_bHasLuxel;
+};
+
+static RayTracingEnvironment		s_LightSurfaceRtEnv;
+static CUtlVector<LightSurfaceTri_t>	s_LightSurfaceTris;
+static bool							s_bLightSurfaceRtEnvBuilt = false;
+
+static void AddLightSurfaceTriangle( int ndxFace, Vector const& v0, Vector const& v1, Vector const& v2, const int* pDispVerts )
+{
+	int iTri = s_LightSurfaceTris.AddToTail();
+	s_LightSurfaceTris[iTri].m_nFace = ndxFace;
+	for( int i = 0; i < 3; i++ )
+	{
+		s_LightSurfaceTris[iTri].m_nDispVerts[i] = pDispVerts ? pDispVerts[i] : -1;
+	}
+
+	Vector fullCoverage;
+	fullCoverage.x = 1.0f;
+	s_LightSurfaceRtEnv.AddTriangle( iTri, v0, v1, v2, fullCoverage );
+}
+
+void SetupLightSurfaceTrace( void )
+{
+	if( s_bLightSurfaceRtEnvBuilt || !nummodels )
+	{
+		return;
+	}
+	s_bLightSurfaceRtEnvBuilt = true;
+
+	double start = Plat_FloatTime();
+
+	for( int i = 0; i < dmodels[0].numfaces; i++ )
+	{
+		int ndxFace = dmodels[0].firstface + i;
+		dface_t* pFace = &g_pFaces[ndxFace];
+
+		if( pFace->dispinfo != -1 )
+		{
+			CVRADDispColl* pDispTree = NULL;
+			StaticDispMgr()->GetDispSurf( ndxFace, &pDispTree );
+			if( !pDispTree )
+			{
+				continue;
+			}
+
+			for( int iTri = 0; iTri < pDispTree->GetTriCount(); iTri++ )
+			{
+				int v[3];
+				pDispTree->GetTriVerts( iTri, v );
+
+				Vector p0, p1, p2;
+				pDispTree->GetVert( v[0], p0 );
+				pDispTree->GetVert( v[1], p1 );
+				pDispTree->GetVert( v[2], p2 );
+				AddLightSurfaceTriangle( ndxFace, p0, p1, p2, v );
+			}
+			continue;
+		}
+
+		texinfo_t* pTex = &texinfo[pFace->texinfo];
+		if( ( pTex->flags & SURF_NOLIGHT ) && !( pTex->flags & SURF_SKY ) )
+		{
+			continue;
+		}
+
+		Vector points[MAX_POINTS_ON_WINDING];
+		int nPoints = min( ( int )pFace->numedges, MAX_POINTS_ON_WINDING );
+		for( int j = 0; j < nPoints; j++ )
+		{
+			int surfEdge = dsurfedges[pFace->firstedge + j];
+			unsigned short v = ( surfEdge < 0 ) ? dedges[-surfEdge].v[1] : dedges[surfEdge].v[0];
+			points[j] = dvertexes[v].point;
+		}
+
+		for( int j = 2; j < nPoints; j++ )
+		{
+			AddLightSurfaceTriangle( ndxFace, points[0], points[j - 1], points[j], NULL );
+		}
+	}
+
+	s_LightSurfaceRtEnv.m_nBuildThreads = numthreads;
+	s_LightSurfaceRtEnv.SetupAccelerationStructure();
+
+	qprintf( "Built surface trace for indirect lighting, %d triangles (%.2f seconds)\n",
+			 s_LightSurfaceTris.Count(), Plat_FloatTime() - start );
+}
+
+// Same as CLightSurface::FindIntersection for 4 rays, the rays go from start to start + delta
+static void FindLightSurfaces4( FourVectors const& start, FourVectors const& delta, LightSurfaceHit_t* pHits )
+{
+	Assert( s_bLightSurfaceRtEnvBuilt );
+
+	FourRays rays;
+	rays.origin = start;
+	rays.direction = delta;
+	fltx4 len = rays.direction.length();
+	rays.direction *= ReciprocalSIMD( len );
+
+	RayTracingResult rt_result;
+	s_LightSurfaceRtEnv.Trace4Rays( rays, Four_Zeros, len, &rt_result );
+	PhaseProfile_AddRays( 4 );
+
+	for( int i = 0; i < 4; i++ )
+	{
+		LightSurfaceHit_t& hit = pHits[i];
+		hit.m_pSurface = NULL;
+		hit.m_HitFrac = 1.0f;
+		hit.m_bHasLuxel = false;
+
+		float flLen = FLTX4_ELEMENT( len, i );
+		float flDist = FLTX4_ELEMENT( rt_result.HitDistance, i );
+		if( rt_result.HitIds[i] == -1 || flDist >= flLen )
+		{
+			continue;
+		}
+
+		int id = s_LightSurfaceRtEnv.OptimizedTriangleList[rt_result.HitIds[i]].m_Data.m_IntersectData.m_nTriangleID;
+		const LightSurfaceTri_t& tri = s_LightSurfaceTris[id];
+		dface_t* pFace = &g_pFaces[tri.m_nFace];
+		hit.m_pSurface = pFace;
+		hit.m_HitFrac = flDist / flLen;
+
+		Vector pt;
+		VectorMA( start.Vec( i ), flDist, rays.direction.Vec( i ), pt );
+
+		if( tri.m_nDispVerts[0] != -1 )
+		{
+			CVRADDispColl* pDispTree = NULL;
+			StaticDispMgr()->GetDispSurf( tri.m_nFace, &pDispTree );
+
+			// barycentric coords of the hit in the displacement triangle
+			Vector v0, v1, v2;
+			pDispTree->GetVert( tri.m_nDispVerts[0], v0 );
+			pDispTree->GetVert( tri.m_nDispVerts[1], v1 );
+			pDispTree->GetVert( tri.m_nDispVerts[2], v2 );
+			Vector edgeU = v1 - v0;
+			Vector edgeV = v2 - v0;
+			Vector toPt = pt - v0;
+			float uu = DotProduct( edgeU, edgeU );
+			float uv = DotProduct( edgeU, edgeV );
+			float vv = DotProduct( edgeV, edgeV );
+			float det = uu * vv - uv * uv;
+			float u = 0.0f, v = 0.0f;
+			if( det > 1e-6f )
+			{
+				float pu = DotProduct( toPt, edgeU );
+				float pv = DotProduct( toPt, edgeV );
+				u = ( vv * pu - uv * pv ) / det;
+				v = ( uu * pv - uv * pu ) / det;
+			}
+
+			ComputePointFromBarycentric(
+				pDispTree->GetLuxelCoord( tri.m_nDispVerts[0] ),
+				pDispTree->GetLuxelCoord( tri.m_nDispVerts[1] ),
+				pDispTree->GetLuxelCoord( tri.m_nDispVerts[2] ),
+				u, v, hit.m_LuxelCoord );
+			hit.m_bHasLuxel = true;
+			continue;
+		}
+
+		texinfo_t* pTex = &texinfo[pFace->texinfo];
+		if( pTex->flags & SURF_SKY )
+		{
+			continue;
+		}
+
+		float s = DotProduct( pt.Base(), pTex->lightmapVecsLuxelsPerWorldUnits[0] ) +
+				  pTex->lightmapVecsLuxelsPerWorldUnits[0][3];
+		float t = DotProduct( pt.Base(), pTex->lightmapVecsLuxelsPerWorldUnits[1] ) +
+				  pTex->lightmapVecsLuxelsPerWorldUnits[1][3];
+		hit.m_LuxelCoord.x = clamp( s - pFace->m_LightmapTextureMinsInLuxels[0], 0.0f, ( float )pFace->m_LightmapTextureSizeInLuxels[0] );
+		hit.m_LuxelCoord.y = clamp( t - pFace->m_LightmapTextureMinsInLuxels[1], 0.0f, ( float )pFace->m_LightmapTextureSizeInLuxels[1] );
+		hit.m_bHasLuxel = true;
+	}
+}
+
 bool CastRayInLeaf( int iThread, const Vector& start, const Vector& end, int leafIndex, float* pFraction, Vector* pNormal )
 {
 	pFraction[0] = 1.0f;
@@ -603,6 +802,39 @@ bool CastRayInLeaf( int iThread, const Vector& start, const Vector& end, int lea
 	return pFraction[0] != 1.0f ? true : false;
 }
 
+//-----------------------------------------------------------------------------
+// Adds the lighting of the surface a ray hit.
+// flConeRadius is the radius of the ray's cone at the hit
+//-----------------------------------------------------------------------------
+static void AddSurfaceAmbientLighting( dface_t* pSurface, Vector2D const& luxelCoord, bool bHasLuxel,
+									   float flConeRadius, directlight_t* pSkyLight, Vector color[MAX_LIGHTSTYLES] )
+{
+	// until 20" we use the point sample, then blend in the average until we're covering 40"
+	// This is attempting to model the ray as a cone - in the ideal case we'd simply sample all
+	// luxels in the intersection of the cone with the surface.  Since we don't have surface
+	// neighbor information computed we'll just approximate that sampling with a blend between
+	// a point sample and the face average.
+	// This yields results that are similar in that aliasing is reduced at distance while
+	// point samples provide accuracy for intersections with near geometry
+	float scaleAvg = RemapValClamped( flConeRadius, 20, 40, 0.0f, 1.0f );
+
+	if( !bHasLuxel )
+	{
+		// don't have luxel UV, so just use average sample
+		scaleAvg = 1.0;
+	}
+	float scaleSample = 1.0f - scaleAvg;
+
+	if( scaleAvg != 0 )
+	{
+		ComputeLightmapColorFromAverage( pSurface, pSkyLight, scaleAvg, color );
+	}
+	if( scaleSample != 0 )
+	{
+		ComputeLightmapColorPointSample( pSurface, pSkyLight, luxelCoord, scaleSample, color );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Computes ambient lighting along a specified ray.
 // Ray represents a cone, tanTheta is the tan of the inner cone angle
@@ -623,32 +855,52 @@ void CalcRayAmbientLighting( int iThread, const Vector& vStart, const Vector& vE
 	// compute the approximate radius of a circle centered around the intersection point
 	float dist = ray.m_Delta.Length() * tanTheta * surfEnum.m_HitFrac;
 
-	// until 20" we use the point sample, then blend in the average until we're covering 40"
-	// This is attempting to model the ray as a cone - in the ideal case we'd simply sample all
-	// luxels in the intersection of the cone with the surface.  Since we don't have surface
-	// neighbor information computed we'll just approximate that sampling with a blend between
-	// a point sample and the face average.
-	// This yields results that are similar in that aliasing is reduced at distance while
-	// point samples provide accuracy for intersections with near geometry
-	float scaleAvg = RemapValClamped( dist, 20, 40, 0.0f, 1.0f );
+	AddSurfaceAmbientLighting( surfEnum.m_pSurface, surfEnum.m_LuxelCoord, surfEnum.m_bHasLuxel, dist, pSkyLight, color );
+}
 
-	if( !surfEnum.m_bHasLuxel )
-	{
-		// don't have luxel UV, so just use average sample
-		scaleAvg = 1.0;
-	}
-	float scaleSample = 1.0f - scaleAvg;
+//-----------------------------------------------------------------------------
+// CalcRayAmbientLighting for 4 rays, traced through the surface triangles
+// instead of the bsp tree. Ray i adds to pColors + i * nColorStride, so a
+// stride of 0 adds every ray to the same colors.
+//-----------------------------------------------------------------------------
+static void AddRayAmbientLighting4( FourVectors const& vStart, FourVectors const& vEnd, int nRays, float tanTheta, Vector* pColors, int nColorStride )
+{
+	directlight_t* pSkyLight = FindAmbientSkyLight();
 
-	if( scaleAvg != 0 )
-	{
-		ComputeLightmapColorFromAverage( surfEnum.m_pSurface, pSkyLight, scaleAvg, color );
-	}
-	if( scaleSample != 0 )
+	FourVectors delta = vEnd;
+	delta -= vStart;
+
+	LightSurfaceHit_t hits[4];
+	FindLightSurfaces4( vStart, delta, hits );
+
+	for( int i = 0; i < nRays; i++ )
 	{
-		ComputeLightmapColorPointSample( surfEnum.m_pSurface, pSkyLight, surfEnum.m_LuxelCoord, scaleSample, color );
+		if( !hits[i].m_pSurface )
+		{
+			continue;
+		}
+
+		float dist = delta.Vec( i ).Length() * tanTheta * hits[i].m_HitFrac;
+		AddSurfaceAmbientLighting( hits[i].m_pSurface, hits[i].m_LuxelCoord, hits[i].m_bHasLuxel, dist, pSkyLight, pColors + i * nColorStride );
 	}
 }
 
+//-----------------------------------------------------------------------------
+// CalcRayAmbientLighting for 4 rays. SetupLightSurfaceTrace has to be called first.
+//-----------------------------------------------------------------------------
+void CalcRayAmbientLighting4( FourVectors const& vStart, FourVectors const& vEnd, int nRays, float tanTheta, Vector color[MAX_LIGHTSTYLES] )
+{
+	AddRayAmbientLighting4( vStart, vEnd, nRays, tanTheta, color, 0 );
+}
+
+//-----------------------------------------------------------------------------
+// CalcRayAmbientLighting4, but each ray adds to its own set of colors
+//-----------------------------------------------------------------------------
+void CalcRayAmbientLighting4Separate( FourVectors const& vStart, FourVectors const& vEnd, int nRays, float tanTheta, Vector colors[4][MAX_LIGHTSTYLES] )
+{
+	AddRayAmbientLighting4( vStart, vEnd, nRays, tanTheta, colors[0], MAX_LIGHTSTYLES );
+}
+
 //-----------------------------------------------------------------------------
 // Compute ambient lighting component at specified position.
 //-----------------------------------------------------------------------------
@@ -659,23 +911,30 @@ static void ComputeAmbientLightingAtPoint( int iThread, const Vector& origin, Ve
 	// be important
 
 	// sample world by casting N rays distributed across a sphere
-	Vector upend;
-
 	int j;
 	for( j = 0; j < MAX_LIGHTSTYLES; ++j )
 	{
 		color[j].Init( 0, 0, 0 );
 	}
 
+	FourVectors start;
+	start.DuplicateVector( origin );
+
 	float tanTheta = tan( VERTEXNORMAL_CONE_INNER_ANGLE );
-	for( int i = 0; i < NUMVERTEXNORMALS; i++ )
+	for( int i = 0; i < NUMVERTEXNORMALS; i += 4 )
 	{
-		VectorMA( origin, COORD_EXTENT * 1.74, g_anorms[i], upend );
+		// the last packet repeats the last normal, CalcRayAmbientLighting4 only adds nRays of them
+		Vector upends[4];
+		for( int k = 0; k < 4; k++ )
+		{
+			VectorMA( origin, COORD_EXTENT * 1.74, g_anorms[min( i + k, NUMVERTEXNORMALS - 1 )], upends[k] );
+		}
 
-		// Now that we've got a ray, see what surface we've hit
-		CalcRayAmbientLighting( iThread, origin, upend, tanTheta, color );
+		FourVectors end;
+		end.LoadAndSwizzle( upends[0], upends[1], upends[2], upends[3] );
 
-//		DumpRayToGlView( ray, surfEnum.m_HitFrac, &color[0], "test.out" );
+		// Now that we've got the rays, see what surfaces they hit
+		CalcRayAmbientLighting4( start, end, min( 4, NUMVERTEXNORMALS - i ), tanTheta, color );
 	}
 
 	for( j = 0; j < MAX_LIGHTSTYLES; ++j )
@@ -684,6 +943,80 @@ static void ComputeAmbientLightingAtPoint( int iThread, const Vector& origin, Ve
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Adds the lightmap color where each of the rays from position along pDirs hit
+//-----------------------------------------------------------------------------
+static void GatherIndirectLighting4( Vector const& position, Vector const* pDirs, int nRays, Vector& outColor )
+{
+	FourVectors start;
+	start.DuplicateVector( position );
+
+	// unused rays repeat the first direction and are ignored
+	Vector vDeltas[4];
+	for( int i = 0; i < 4; i++ )
+	{
+		VectorScale( pDirs[i < nRays ? i : 0], MAX_TRACE_LENGTH, vDeltas[i] );
+	}
+
+	FourVectors delta;
+	delta.LoadAndSwizzle( vDeltas[0], vDeltas[1], vDeltas[2], vDeltas[3] );
+
+	LightSurfaceHit_t hits[4];
+	FindLightSurfaces4( start, delta, hits );
+
+	for( int i = 0; i < nRays; i++ )
+	{
+		LightSurfaceHit_t& hit = hits[i];
+		if( !hit.m_pSurface )
+		{
+			continue;
+		}
+
+		// get color from surface lightmap
+		texinfo_t* pTex = &texinfo[hit.m_pSurface->texinfo];
+		if( !pTex || pTex->flags & SURF_SKY )
+		{
+			// ignore contribution from sky
+			// sky ambient already accounted for during direct pass
+			continue;
+		}
+
+		if( hit.m_pSurface->styles[0] == 255 || hit.m_pSurface->lightofs < 0 )
+		{
+			// no light affects this face
+			continue;
+		}
+
+
+		Vector lightmapColor;
+		if( !hit.m_bHasLuxel )
+		{
+			ColorRGBExp32* pAvgLightmapColor = dface_AvgLightColor( hit.m_pSurface, 0 );
+			ColorRGBExp32ToVector( *pAvgLightmapColor, lightmapColor );
+		}
+		else
+		{
+			// get color from displacement
+			int smax = ( hit.m_pSurface->m_LightmapTextureSizeInLuxels[0] ) + 1;
+			int tmax = ( hit.m_pSurface->m_LightmapTextureSizeInLuxels[1] ) + 1;
+
+			// luxelcoord is in the space of the accumulated lightmap page; we need to convert
+			// it to be in the space of the surface
+			int ds = clamp( ( int )hit.m_LuxelCoord.x, 0, smax - 1 );
+			int dt = clamp( ( int )hit.m_LuxelCoord.y, 0, tmax - 1 );
+
+			ColorRGBExp32* pLightmap = ( ColorRGBExp32* ) & ( *pdlightdata )[hit.m_pSurface->lightofs];
+			pLightmap += dt * smax + ds;
+			ColorRGBExp32ToVector( *pLightmap, lightmapColor );
+		}
+
+		float invLengthSqr = 1.0f / ( 1.0f + ( vDeltas[i] * hit.m_HitFrac / 128.0 ).LengthSqr() );
+		// Include falloff using invsqrlaw.
+		VectorMultiply( lightmapColor, invLengthSqr * dtexdata[pTex->texdata].reflectivity, lightmapColor );
+		VectorAdd( outColor, lightmapColor, outColor );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Trace hemispherical rays from a vertex, accumulating indirect
 // sources at each ray termination.
@@ -691,9 +1024,6 @@ static void ComputeAmbientLightingAtPoint( int iThread, const Vector& origin, Ve
 void ComputeIndirectLightingAtPoint( Vector& position, Vector& normal, Vector& outColor,
 									 int iThread, bool force_fast, bool bIgnoreNormals )
 {
-	Ray_t			ray;
-	CLightSurface	surfEnum( iThread );
-
 	outColor.Init();
 
 
@@ -707,6 +1037,10 @@ void ComputeIndirectLightingAtPoint( Vector& position, Vector& normal, Vector& o
 		nSamples *= g_flSkySampleScale;
 	}
 
+	// the directions in front of the point are traced 4 at a time
+	Vector packetDirs[4];
+	int nPacketDirs = 0;
+
 	float totalDot = 0;
 	DirectionalSampler_t sampler;
 	for( int j = 0; j < nSamples; j++ )
@@ -731,59 +1065,17 @@ void ComputeIndirectLightingAtPoint( Vector& position, Vector& normal, Vector& o
 
 		totalDot += dot;
 
-		// trace to determine surface
-		Vector vEnd;
-		VectorScale( samplingNormal, MAX_TRACE_LENGTH, vEnd );
-		VectorAdd( position, vEnd, vEnd );
-
-		ray.Init( position, vEnd, vec3_origin, vec3_origin );
-		if( !surfEnum.FindIntersection( ray ) )
+		packetDirs[nPacketDirs++] = samplingNormal;
+		if( nPacketDirs == 4 )
 		{
-			continue;
-		}
-
-		// get color from surface lightmap
-		texinfo_t* pTex = &texinfo[surfEnum.m_pSurface->texinfo];
-		if( !pTex || pTex->flags & SURF_SKY )
-		{
-			// ignore contribution from sky
-			// sky ambient already accounted for during direct pass
-			continue;
-		}
-
-		if( surfEnum.m_pSurface->styles[0] == 255 || surfEnum.m_pSurface->lightofs < 0 )
-		{
-			// no light affects this face
-			continue;
-		}
-
-
-		Vector lightmapColor;
-		if( !surfEnum.m_bHasLuxel )
-		{
-			ColorRGBExp32* pAvgLightmapColor = dface_AvgLightColor( surfEnum.m_pSurface, 0 );
-			ColorRGBExp32ToVector( *pAvgLightmapColor, lightmapColor );
-		}
-		else
-		{
-			// get color from displacement
-			int smax = ( surfEnum.m_pSurface->m_LightmapTextureSizeInLuxels[0] ) + 1;
-			int tmax = ( surfEnum.m_pSurface->m_LightmapTextureSizeInLuxels[1] ) + 1;
-
-			// luxelcoord is in the space of the accumulated lightmap page; we need to convert
-			// it to be in the space of the surface
-			int ds = clamp( ( int )surfEnum.m_LuxelCoord.x, 0, smax - 1 );
-			int dt = clamp( ( int )surfEnum.m_LuxelCoord.y, 0, tmax - 1 );
-
-			ColorRGBExp32* pLightmap = ( ColorRGBExp32* ) & ( *pdlightdata )[surfEnum.m_pSurface->lightofs];
-			pLightmap += dt * smax + ds;
-			ColorRGBExp32ToVector( *pLightmap, lightmapColor );
+			GatherIndirectLighting4( position, packetDirs, nPacketDirs, outColor );
+			nPacketDirs = 0;
 		}
+	}
 
-		float invLengthSqr = 1.0f / ( 1.0f + ( ( vEnd - position ) * surfEnum.m_HitFrac / 128.0 ).LengthSqr() );
-		// Include falloff using invsqrlaw.
-		VectorMultiply( lightmapColor, invLengthSqr * dtexdata[pTex->texdata].reflectivity, lightmapColor );
-		VectorAdd( outColor, lightmapColor, outColor );
+	if( nPacketDirs )
+	{
+		GatherIndirectLighting4( position, packetDirs, nPacketDirs, outColor );
 	}
 
 	if( totalDot )
@@ -13,6 +13,7 @@
 
 #include "bspfile.h"
 #include "mathlib/anorms.h"
+#include "mathlib/ssemath.h"
 
 
 // Calculate the lighting at whatever surface the ray hits.
@@ -26,6 +27,25 @@ void CalcRayAmbientLighting(
 	Vector color[MAX_LIGHTSTYLES]	// The color contribution from each lightstyle.
 );
 
+// CalcRayAmbientLighting for nRays (up to 4) rays at once, traced against the triangles
+// of the world faces. SetupLightSurfaceTrace must have been called.
+void CalcRayAmbientLighting4(
+	FourVectors const& vStart,
+	FourVectors const& vEnd,
+	int nRays,
+	float tanTheta,
+	Vector color[MAX_LIGHTSTYLES]
+);
+
+// CalcRayAmbientLighting4 that keeps the colors of each ray apart
+void CalcRayAmbientLighting4Separate(
+	FourVectors const& vStart,
+	FourVectors const& vEnd,
+	int nRays,
+	float tanTheta,
+	Vector colors[4][MAX_LIGHTSTYLES]
+);
+
 bool CastRayInLeaf( int iThread, const Vector& start, const Vector& end, int leafIndex, float* pFraction, Vector* pNormal );
 
 void ComputeDetailPropLighting( int iThread );
@@ -161,8 +161,7 @@ inline Vector ComputeBarycentric( Vector2D _edgeC, Vector2D _edgeA, Vector2D _ed
 //-----------------------------------------------------------------------------
 void Rasterizer::Build()
 {
-	// For now, use the barycentric method. It's easy, I'm lazy.
-	// We can optimize later if it's a performance issue.
+	// Uses the barycentric method, four texels at a time.
 	const float baseX = mUvStepX / 2.0f;
 	const float baseY = mUvStepY / 2.0f;
 
@@ -215,21 +214,54 @@ void Rasterizer::Build()
 	float dBB = edgeB.Dot( edgeB );
 	float invDenom = 1.0f / ( dAA * dBB - dAB * dAB );
 
+	// The texels of a row go 4 at a time
+	static const ALIGN16 float s_LaneOffsets[4] ALIGN16_POST = { 0.0f, 1.0f, 2.0f, 3.0f };
+	const fltx4 laneOffsets = LoadAlignedSIMD( s_LaneOffsets );
+	const fltx4 uvStepX = ReplicateX4( mUvStepX );
+	const fltx4 uvBaseX = ReplicateX4( baseX );
+	const fltx4 t0X = ReplicateX4( mT0.x );
+	const fltx4 edgeAX = ReplicateX4( edgeA.x );
+	const fltx4 edgeAY = ReplicateX4( edgeA.y );
+	const fltx4 edgeBX = ReplicateX4( edgeB.x );
+	const fltx4 edgeBY = ReplicateX4( edgeB.y );
+	const fltx4 dAA4 = ReplicateX4( dAA );
+	const fltx4 dAB4 = ReplicateX4( dAB );
+	const fltx4 dBB4 = ReplicateX4( dBB );
+	const fltx4 invDenom4 = ReplicateX4( invDenom );
+
 	int linearPos = 0;
 	for( int j = iMinY; j <= iMaxY; ++j )
 	{
-		for( int i = iMinX; i <= iMaxX; ++i )
+		const float testY = j * mUvStepY + baseY;
+		const fltx4 edgeCY = ReplicateX4( testY - mT0.y );
+
+		for( int i = iMinX; i <= iMaxX; i += 4 )
 		{
-			Vector2D testPt( i * mUvStepX + baseX, j * mUvStepY + baseY );
-			Vector barycentric = ComputeBarycentric( testPt - mT0, edgeA, edgeB, dAA, dAB, dBB, invDenom );
+			fltx4 testX = AddSIMD( MulSIMD( AddSIMD( ReplicateX4( ( float )i ), laneOffsets ), uvStepX ), uvBaseX );
+			fltx4 edgeCX = SubSIMD( testX, t0X );
 
-			// Test whether the point is inside the triangle.
+			// Same as ComputeBarycentric
+			fltx4 dCA = AddSIMD( MulSIMD( edgeCX, edgeAX ), MulSIMD( edgeCY, edgeAY ) );
+			fltx4 dCB = AddSIMD( MulSIMD( edgeCX, edgeBX ), MulSIMD( edgeCY, edgeBY ) );
+			fltx4 baryY = MulSIMD( SubSIMD( MulSIMD( dBB4, dCA ), MulSIMD( dAB4, dCB ) ), invDenom4 );
+			fltx4 baryZ = MulSIMD( SubSIMD( MulSIMD( dAA4, dCB ), MulSIMD( dAB4, dCA ) ), invDenom4 );
+			fltx4 baryX = SubSIMD( SubSIMD( Four_Ones, baryY ), baryZ );
+
+			// Test whether the points are inside the triangle.
 			// MCJOHNTODO: Edge rules and whatnot--right now we re-rasterize points on the edge.
-			Location& newLoc = mRasterizedLocations[linearPos++];
-			newLoc.barycentric = barycentric;
-			newLoc.uv = testPt;
+			fltx4 inside = AndSIMD( AndSIMD( CmpGeSIMD( baryX, Four_Zeros ), CmpLeSIMD( baryX, Four_Ones ) ),
+									AndSIMD( CmpGeSIMD( baryY, Four_Zeros ), CmpLeSIMD( baryY, Four_Ones ) ) );
+			inside = AndSIMD( inside, AndSIMD( CmpGeSIMD( baryZ, Four_Zeros ), CmpLeSIMD( baryZ, Four_Ones ) ) );
+			int nInsideMask = TestSignSIMD( inside );
 
-			newLoc.insideTriangle = ( barycentric.x >= 0.0f && barycentric.x <= 1.0f && barycentric.y >= 0.0f && barycentric.y <= 1.0f && barycentric.z >= 0.0f && barycentric.z <= 1.0f );
+			int nTexels = min( 4, iMaxX - i + 1 );
+			for( int k = 0; k < nTexels; ++k )
+			{
+				Location& newLoc = mRasterizedLocations[linearPos++];
+				newLoc.barycentric.Init( SubFloat( baryX, k ), SubFloat( baryY, k ), SubFloat( baryZ, k ) );
+				newLoc.uv.Init( SubFloat( testX, k ), testY );
+				newLoc.insideTriangle = ( nInsideMask & ( 1 << k ) ) != 0;
+			}
 		}
 	}
 }
@@ -274,6 +306,8 @@ public:
 	// iterate all the instanced static props and compute their vertex lighting
 	void ComputeLighting( int iThread );
 
+	void ChecksumModels( CRC32_t* pCRC );
+
 private:
 #if defined ( MPI ) && defined ( _WIN32 )
 	// VMPI stuff.
@@ -372,6 +406,16 @@ IVradStaticPropMgr* StaticPropMgr()
 	return &g_StaticPropMgr;
 }
 
+// -incremental numbers the points of the prop each thread lights in the order
+// they're lit, so the direct light of lights from the file can be read back
+struct propincremental_t
+{
+	int		m_iProp;
+	int		m_iPoint;
+};
+
+static propincremental_t s_PropIncremental[MAX_TOOL_THREADS + 1];
+
 
 //-----------------------------------------------------------------------------
 // constructor, destructor
@@ -1189,38 +1233,23 @@ bool PositionInSolid( Vector& position )
 }
 
 //-----------------------------------------------------------------------------
-// Trace from a vertex to each direct light source, accumulating its contribution.
+// Trace from up to 4 points to one direct light, pDots gets the falloff * dot
+// at each of them.
 //-----------------------------------------------------------------------------
-void ComputeDirectLightingAtPoint( Vector& position, Vector& normal, Vector& outColor, int iThread,
-								   int static_prop_id_to_skip = -1, int nLFlags = 0 )
+static void GatherDirectLightAtPoints4( directlight_t* dl, const Vector* pPositions, const Vector* pNormals, int nPoints, FourVectors& normal4,
+										int iThread, int static_prop_id_to_skip, int nLFlags, float* pDots )
 {
 	SSE_sampleLightOutput_t	sampleOutput;
 
-	outColor.Init();
-
-	// Iterate over all direct lights and accumulate their contribution
-	int cluster = ClusterFromPoint( position );
-	for( directlight_t* dl = activelights; dl != NULL; dl = dl->next )
+	// push the points towards the light to avoid surface acne
+	Vector adjusted_pos[4];
+	for( int k = 0; k < 4; ++k )
 	{
-		if( dl->light.style )
-		{
-			// skip lights with style
-			continue;
-		}
-
-		// is this lights cluster visible?
-		if( !PVSCheck( dl->pvs, cluster ) )
-		{
-			continue;
-		}
-
-		// push the vertex towards the light to avoid surface acne
-		Vector adjusted_pos = position;
-		float flEpsilon = 0.0;
+		const Vector& position = pPositions[min( k, nPoints - 1 )];
+		adjusted_pos[k] = position;
 
 		if( dl->light.type != emit_skyambient )
 		{
-			// push towards the light
 			Vector fudge;
 			if( dl->light.type == emit_skylight )
 			{
@@ -1232,28 +1261,118 @@ void ComputeDirectLightingAtPoint( Vector& position, Vector& normal, Vector& out
 				VectorNormalize( fudge );
 			}
 			fudge *= 4.0;
-			adjusted_pos += fudge;
+			adjusted_pos[k] += fudge;
 		}
 		else
 		{
 			// push out along normal
-			adjusted_pos += 4.0 * normal;
-//			flEpsilon = 1.0;
+			adjusted_pos[k] += 4.0 * pNormals[min( k, nPoints - 1 )];
 		}
+	}
 
-		FourVectors adjusted_pos4;
-		FourVectors normal4;
-		adjusted_pos4.DuplicateVector( adjusted_pos );
-		normal4.DuplicateVector( normal );
+	FourVectors adjusted_pos4;
+	adjusted_pos4.LoadAndSwizzle( adjusted_pos[0], adjusted_pos[1], adjusted_pos[2], adjusted_pos[3] );
 
-		GatherSampleLightSSE( sampleOutput, dl, -1, adjusted_pos4, &normal4, 1, iThread, nLFlags | GATHERLFLAGS_FORCE_FAST,
-							  static_prop_id_to_skip, flEpsilon );
+	GatherSampleLightSSE( sampleOutput, dl, -1, adjusted_pos4, &normal4, 1, iThread, nLFlags | GATHERLFLAGS_FORCE_FAST,
+						  static_prop_id_to_skip, 0.0f );
 
-		//VectorMA( outColor, sampleOutput.m_flFalloff.m128_f32[0] * sampleOutput.m_flDot[0].m128_f32[0], dl->light.intensity, outColor );
-		VectorMA( outColor, FLTX4_ELEMENT( sampleOutput.m_flFalloff, 0 ) * FLTX4_ELEMENT( sampleOutput.m_flDot[0], 0 ), dl->light.intensity, outColor );
+	for( int k = 0; k < nPoints; ++k )
+	{
+		pDots[k] = FLTX4_ELEMENT( sampleOutput.m_flFalloff, k ) * FLTX4_ELEMENT( sampleOutput.m_flDot[0], k );
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Trace from up to 4 points to each direct light source, accumulating its
+// contribution. Each light is gathered for all of them in one SSE call.
+//-----------------------------------------------------------------------------
+static void ComputeDirectLightingAtPoints4( const Vector* pPositions, const Vector* pNormals, int nPoints, Vector* pOutColors, int iThread, int static_prop_id_to_skip, int nLFlags )
+{
+	Assert( nPoints > 0 && nPoints <= 4 );
+
+	int cluster[4];
+	for( int k = 0; k < 4; ++k )
+	{
+		// unused lanes repeat the last point
+		cluster[k] = ClusterFromPoint( pPositions[min( k, nPoints - 1 )] );
+	}
+
+	for( int k = 0; k < nPoints; ++k )
+	{
+		pOutColors[k].Init();
+	}
+
+	FourVectors normal4;
+	normal4.LoadAndSwizzle( pNormals[0], pNormals[min( 1, nPoints - 1 )], pNormals[min( 2, nPoints - 1 )], pNormals[min( 3, nPoints - 1 )] );
+
+	for( directlight_t* dl = activelights; dl != NULL; dl = dl->next )
+	{
+		if( dl->light.style )
+		{
+			// skip lights with style
+			continue;
+		}
+
+		// is this lights cluster visible from any of them?
+		bool bVisible[4];
+		bool bAnyVisible = false;
+		for( int k = 0; k < nPoints; ++k )
+		{
+			bVisible[k] = PVSCheck( dl->pvs, cluster[k] );
+			bAnyVisible |= bVisible[k];
+		}
+		if( !bAnyVisible )
+		{
+			continue;
+		}
+
+		// -incremental already has what a light from the file adds here
+		float flDots[4];
+		bool bFromFile = false;
+		propincremental_t& inc = s_PropIncremental[iThread];
+		if( g_bIncrementalRelight && g_pIncremental->IsLightFromFile( dl->m_IncrementalID ) )
+		{
+			bFromFile = g_pIncremental->GetStaticPropLightFromFile( dl->m_IncrementalID, inc.m_iProp, inc.m_iPoint, nPoints, flDots, iThread );
+		}
+
+		if( !bFromFile )
+		{
+			GatherDirectLightAtPoints4( dl, pPositions, pNormals, nPoints, normal4, iThread, static_prop_id_to_skip, nLFlags, flDots );
+			for( int k = 0; k < nPoints; ++k )
+			{
+				if( !bVisible[k] )
+				{
+					flDots[k] = 0.0f;
+				}
+			}
+
+			if( g_bIncrementalRelight )
+			{
+				g_pIncremental->AddLightToStaticProp( dl->m_IncrementalID, inc.m_iProp, inc.m_iPoint, nPoints, flDots, iThread );
+			}
+		}
+
+		for( int k = 0; k < nPoints; ++k )
+		{
+			if( bVisible[k] )
+			{
+				VectorMA( pOutColors[k], flDots[k], dl->light.intensity, pOutColors[k] );
+			}
+		}
+	}
+
+	s_PropIncremental[iThread].m_iPoint += nPoints;
+}
+
+//-----------------------------------------------------------------------------
+// Trace from a vertex to each direct light source, accumulating its contribution.
+//-----------------------------------------------------------------------------
+void ComputeDirectLightingAtPoint( Vector& position, Vector& normal, Vector& outColor, int iThread,
+								   int static_prop_id_to_skip = -1, int nLFlags = 0 )
+{
+	ComputeDirectLightingAtPoints4( &position, &normal, 1, &outColor, iThread, static_prop_id_to_skip, nLFlags );
+}
+
 //-----------------------------------------------------------------------------
 // Takes the results from a ComputeLighting call and applies it to the static prop in question.
 //-----------------------------------------------------------------------------
@@ -1285,6 +1404,14 @@ void CVradStaticPropMgr::ApplyLightingToStaticProp( int iStaticProp, CStaticProp
 			const CUtlVector<colorVertex_t>* colorVerts = pResults->m_ColorVertsArrays.Count() ? pResults->m_ColorVertsArrays[iCurColorVertsArray++] : nullptr;
 			const CUtlVector<colorTexel_t>* colorTexels = pResults->m_ColorTexelsArrays.Count() ? pResults->m_ColorTexelsArrays[iCurColorTexelsArray++] : nullptr;
 
+			// Every mesh of the model shares the same texels, so build the mips and encode them once.
+			// This runs on the prop's worker thread (on the master for VMPI).
+			CUtlMemory<byte> texelsEncoded;
+			if( colorTexels )
+			{
+				ConvertTexelDataToTexture( prop.m_LightmapImageWidth, prop.m_LightmapImageHeight, prop.m_LightmapImageFormat, ( *colorTexels ), &texelsEncoded );
+			}
+
 			for( int nLod = 0; nLod < pVtxHdr->numLODs; nLod++ )
 			{
 				OptimizedModel::ModelLODHeader_t* pVtxLOD = pVtxModel->pLOD( nLod );
@@ -1315,8 +1442,9 @@ void CVradStaticPropMgr::ApplyLightingToStaticProp( int iStaticProp, CStaticProp
 
 						if( colorTexels )
 						{
-							// TODO: Consider doing this work in the worker threads, because then we distribute it.
-							ConvertTexelDataToTexture( prop.m_LightmapImageWidth, prop.m_LightmapImageHeight, prop.m_LightmapImageFormat, ( *colorTexels ), &prop.m_MeshData[nMeshIdx].m_TexelsEncoded );
+							CUtlMemory<byte>& meshTexels = prop.m_MeshData[nMeshIdx].m_TexelsEncoded;
+							meshTexels.EnsureCapacity( texelsEncoded.Count() );
+							Q_memcpy( meshTexels.Base(), texelsEncoded.Base(), texelsEncoded.Count() );
 
 							if( g_bDumpPropLightmaps )
 							{
@@ -1807,10 +1935,21 @@ void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iStaticProp, Message
 
 void CVradStaticPropMgr::ComputeLightingForProp( int iThread, int iStaticProp )
 {
+	s_PropIncremental[iThread].m_iProp = iStaticProp;
+	s_PropIncremental[iThread].m_iPoint = 0;
+
 	// Compute the lighting.
 	CComputeStaticPropLightingResults results;
 	ComputeLighting( m_StaticProps[iStaticProp], iThread, iStaticProp, &results );
 	ApplyLightingToStaticProp( iStaticProp, m_StaticProps[iStaticProp], &results );
+
+	if( g_bIncrementalRelight )
+	{
+		for( directlight_t* dl = activelights; dl != NULL; dl = dl->next )
+		{
+			g_pIncremental->FinishStaticProp( dl->m_IncrementalID, iStaticProp, iThread );
+		}
+	}
 }
 
 void CVradStaticPropMgr::ThreadComputeStaticPropLighting( int iThread, void* pUserData )
@@ -1846,6 +1985,11 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 	// ensure any traces against us are ignored because we have no inherit lighting contribution
 	m_bIgnoreStaticPropTrace = true;
 
+	if( g_bIncrementalRelight )
+	{
+		g_pIncremental->PrepareForStaticPropLighting( count );
+	}
+
 #if defined ( MPI ) && defined ( _WIN32 )
 	if( g_bUseMPI )
 	{
@@ -1873,6 +2017,19 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 	EndPacifier( true );
 }
 
+//-----------------------------------------------------------------------------
+// The models aren't in the bsp, so -incremental keys on their checksums.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::ChecksumModels( CRC32_t* pCRC )
+{
+	for( int i = 0; i < m_StaticPropDict.Count(); i++ )
+	{
+		studiohdr_t* pStudioHdr = m_StaticPropDict[i].m_pStudioHdr;
+		int checksum = pStudioHdr ? pStudioHdr->checksum : 0;
+		CRC32_ProcessBuffer( pCRC, &checksum, sizeof( checksum ) );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Adds all static prop polys to the ray trace store.
 //-----------------------------------------------------------------------------
@@ -2478,6 +2635,7 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 	// on the other side.
 	// First attempt: Just pretend the triangle was larger and cast a ray from this new world pos
 	// as above.
+	CUtlVector<int> texelsToLight;
 	int linearPos = 0;
 	for( int j = 0; j < _lightmapResY; ++j )
 	{
@@ -2503,21 +2661,38 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 
 			if( shouldProcess )
 			{
-				Vector directColor( 0, 0, 0 ),
-					   indirectColor( 0, 0, 0 );
+				texelsToLight.AddToTail( linearPos );
+			}
 
+			++linearPos;
+		}
+	}
 
-				ComputeDirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, directColor, _iThread, _skipProp, _flags );
+	// Light the texels 4 at a time, so the shadow rays to each light go out together.
+	for( int i = 0; i < texelsToLight.Count(); i += 4 )
+	{
+		int nTexels = min( 4, texelsToLight.Count() - i );
 
-				if( numbounce >= 1 )
-				{
-					ComputeIndirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, indirectColor, _iThread, true, ( _flags & GATHERLFLAGS_IGNORE_NORMALS ) != 0 );
-				}
+		Vector positions[4], normals[4], directColors[4];
+		for( int k = 0; k < nTexels; ++k )
+		{
+			positions[k] = colorTexels[texelsToLight[i + k]].m_WorldPosition;
+			normals[k] = colorTexels[texelsToLight[i + k]].m_WorldNormal;
+		}
 
-				VectorAdd( directColor, indirectColor, colorTexels[linearPos].m_Color );
+		ComputeDirectLightingAtPoints4( positions, normals, nTexels, directColors, _iThread, _skipProp, _flags );
+
+		for( int k = 0; k < nTexels; ++k )
+		{
+			colorTexel_t& texel = colorTexels[texelsToLight[i + k]];
+
+			Vector indirectColor( 0, 0, 0 );
+			if( numbounce >= 1 )
+			{
+				ComputeIndirectLightingAtPoint( texel.m_WorldPosition, texel.m_WorldNormal, indirectColor, _iThread, true, ( _flags & GATHERLFLAGS_IGNORE_NORMALS ) != 0 );
 			}
 
-			++linearPos;
+			VectorAdd( directColors[k], indirectColor, texel.m_Color );
 		}
 	}
 }
@@ -7,9 +7,14 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "mathlib/ssemath.h"
+#include "tier1/utlbuffer.h"
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
+
+// Use the reference one-point-at-a-time plane tests instead of the SIMD ones.
+bool g_bScalarClip = false;
 /*
 
   each portal will have a list of all possible to see from first portal
@@ -33,9 +38,16 @@ int CountBits( byte* bits, int numbits )
 {
 	int		i;
 	int		c;
+	uint64	word;
 
 	c = 0;
-	for( i = 0 ; i < numbits ; i++ )
+	for( i = 0 ; i + 64 <= numbits ; i += 64 )
+	{
+		memcpy( &word, bits + ( i >> 3 ), sizeof( word ) );
+		c += VisPopCount64( word );
+	}
+
+	for( ; i < numbits ; i++ )
 		if( CheckBit( bits, i ) )
 		{
 			c++;
@@ -112,6 +124,86 @@ void FreeStackWinding( winding_t* w, pstack_t* stack )
 	stack->freewindings[i] = 1;
 }
 
+/*
+==============
+Winding plane tests
+
+Classifying winding points against a plane dominates RecursiveLeafFlow.
+The SIMD path tests four points at a time with the same float operations
+in the same order as DotProduct, so it classifies every point exactly like
+the scalar path and the PVS stays bit-identical.
+==============
+*/
+
+// Winding points transposed for 4-wide plane tests. Lanes past the last
+// point repeat it and are masked off by the callers.
+struct windingsimd_t
+{
+	int			numpoints;
+	int			numgroups;
+	FourVectors	points[( MAX_POINTS_ON_WINDING + 3 ) / 4];
+};
+
+static void LoadWindingSIMD( const winding_t* w, windingsimd_t& out )
+{
+	out.numpoints = w->numpoints;
+	out.numgroups = ( w->numpoints + 3 ) >> 2;
+
+	// LoadAndSwizzle reads four floats per point, so the last group goes through
+	// a padded copy to stay inside the winding's allocation.
+	int g;
+	for( g = 0; g < out.numgroups - 1; g++ )
+	{
+		const Vector* p = &w->points[g << 2];
+		out.points[g].LoadAndSwizzle( p[0], p[1], p[2], p[3] );
+	}
+
+	Vector tail[5];
+	int last = w->numpoints - 1;
+	for( int k = 0; k < 4; k++ )
+	{
+		tail[k] = w->points[min( ( g << 2 ) + k, last )];
+	}
+	tail[4].Init();
+	out.points[g].LoadAndSwizzle( tail[0], tail[1], tail[2], tail[3] );
+}
+
+// Fills in the distance of every point to the plane (if dists is non-NULL) and returns
+// masks of the points in front of and behind the plane, one bit per point.
+static void ClassifyWindingSIMD( const windingsimd_t& w, const plane_t* plane, vec_t* dists, uint64& front, uint64& back )
+{
+	fltx4 dist = ReplicateX4( plane->dist );
+	fltx4 epsilon = ReplicateX4( ON_VIS_EPSILON );
+	fltx4 negEpsilon = ReplicateX4( -ON_VIS_EPSILON );
+
+	front = back = 0;
+	for( int g = 0; g < w.numgroups; g++ )
+	{
+		fltx4 d = SubSIMD( w.points[g] * plane->normal, dist );
+		if( dists )
+		{
+			StoreUnalignedSIMD( dists + ( g << 2 ), d );
+		}
+		front |= ( uint64 )TestSignSIMD( CmpGtSIMD( d, epsilon ) ) << ( g << 2 );
+		back |= ( uint64 )TestSignSIMD( CmpLtSIMD( d, negEpsilon ) ) << ( g << 2 );
+	}
+
+	uint64 valid = ( w.numpoints >= 64 ) ? ~( uint64 )0 : ( ( ( uint64 )1 << w.numpoints ) - 1 );
+	front &= valid;
+	back &= valid;
+}
+
+static inline int LowestBit64( uint64 bits )
+{
+	int i = 0;
+	while( !( bits & 1 ) )
+	{
+		bits >>= 1;
+		i++;
+	}
+	return i;
+}
+
 /*
 ==============
 ChopWinding
@@ -136,24 +228,53 @@ winding_t*	ChopWinding( winding_t* in, pstack_t* stack, plane_t* split )
 	counts[0] = counts[1] = counts[2] = 0;
 
 // determine sides for each point
-	for( i = 0 ; i < in->numpoints ; i++ )
+	if( g_bScalarClip )
 	{
-		dot = DotProduct( in->points[i], split->normal );
-		dot -= split->dist;
-		dists[i] = dot;
-		if( dot > ON_VIS_EPSILON )
+		for( i = 0 ; i < in->numpoints ; i++ )
 		{
-			sides[i] = SIDE_FRONT;
-		}
-		else if( dot < -ON_VIS_EPSILON )
-		{
-			sides[i] = SIDE_BACK;
+			dot = DotProduct( in->points[i], split->normal );
+			dot -= split->dist;
+			dists[i] = dot;
+			if( dot > ON_VIS_EPSILON )
+			{
+				sides[i] = SIDE_FRONT;
+			}
+			else if( dot < -ON_VIS_EPSILON )
+			{
+				sides[i] = SIDE_BACK;
+			}
+			else
+			{
+				sides[i] = SIDE_ON;
+			}
+			counts[sides[i]]++;
 		}
-		else
+	}
+	else
+	{
+		windingsimd_t simd;
+		uint64 front, back;
+		LoadWindingSIMD( in, simd );
+		ClassifyWindingSIMD( simd, split, dists, front, back );
+
+		for( i = 0 ; i < in->numpoints ; i++ )
 		{
-			sides[i] = SIDE_ON;
+			if( front & ( ( uint64 )1 << i ) )
+			{
+				sides[i] = SIDE_FRONT;
+			}
+			else if( back & ( ( uint64 )1 << i ) )
+			{
+				sides[i] = SIDE_BACK;
+			}
+			else
+			{
+				sides[i] = SIDE_ON;
+			}
 		}
-		counts[sides[i]]++;
+		counts[SIDE_FRONT] = VisPopCount64( front );
+		counts[SIDE_BACK] = VisPopCount64( back );
+		counts[SIDE_ON] = in->numpoints - counts[SIDE_FRONT] - counts[SIDE_BACK];
 	}
 
 	if( !counts[1] )
@@ -269,6 +390,14 @@ winding_t*	ClipToSeperators( winding_t* source, winding_t* pass, winding_t* targ
 	int			counts[3];
 	bool		fliptest;
 
+	// source and pass are tested against every candidate plane, so transpose them once
+	windingsimd_t sourcesimd, passsimd;
+	if( !g_bScalarClip )
+	{
+		LoadWindingSIMD( source, sourcesimd );
+		LoadWindingSIMD( pass, passsimd );
+	}
+
 // check all combinations
 	for( i = 0 ; i < source->numpoints ; i++ )
 	{
@@ -305,6 +434,50 @@ winding_t*	ClipToSeperators( winding_t* source, winding_t* pass, winding_t* targ
 
 			plane.dist = DotProduct( pass->points[j], plane.normal );
 
+			if( !g_bScalarClip )
+			{
+				uint64 front, back;
+
+				// find out which side of the generated seperating plane has the
+				// source portal: the first off-plane point other than i and l decides
+				ClassifyWindingSIMD( sourcesimd, &plane, NULL, front, back );
+				uint64 off = ( front | back ) & ~( ( ( uint64 )1 << i ) | ( ( uint64 )1 << l ) );
+				if( !off )
+				{
+					continue;    // planar with source portal
+				}
+				if( front & ( ( uint64 )1 << LowestBit64( off ) ) )
+				{
+					VectorSubtract( vec3_origin, plane.normal, plane.normal );
+					plane.dist = -plane.dist;
+				}
+
+				// all of the pass portal points other than j must be on the positive side
+				ClassifyWindingSIMD( passsimd, &plane, NULL, front, back );
+				uint64 others = ~( ( uint64 )1 << j );
+				if( back & others )
+				{
+					continue;    // points on negative side, not a seperating plane
+				}
+				if( !( front & others ) )
+				{
+					continue;    // planar with seperating plane
+				}
+
+				if( flipclip )
+				{
+					VectorSubtract( vec3_origin, plane.normal, plane.normal );
+					plane.dist = -plane.dist;
+				}
+
+				target = ChopWinding( target, stack, &plane );
+				if( !target )
+				{
+					return NULL;    // target is not visible
+				}
+				continue;
+			}
+
 			//
 			// find out which side of the generated seperating plane has the
 			// source portal
@@ -427,10 +600,24 @@ winding_t*	ClipToSeperators( winding_t* source, winding_t* pass, winding_t* targ
 class CPortalTrace
 {
 public:
+	CPortalTrace() : m_windings( 0, 0, CUtlBuffer::TEXT_BUFFER ) {}
+
 	CUtlVector<Vector>	m_list;
+	CUtlBuffer			m_windings;	// the flow stack's windings, replayed by -clipbench
 	CThreadFastMutex	m_mutex;
 } g_PortalTrace;
 
+static void PrintTraceWinding( CUtlBuffer& buf, const char* pName, winding_t* w )
+{
+	int numpoints = w ? w->numpoints : 0;
+	buf.Printf( "%s %d\n", pName, numpoints );
+	for( int i = 0; i < numpoints; i++ )
+	{
+		// %.9g round-trips floats exactly
+		buf.Printf( "%.9g %.9g %.9g\n", w->points[i].x, w->points[i].y, w->points[i].z );
+	}
+}
+
 void WindingCenter( winding_t* w, Vector& center )
 {
 	int		i;
@@ -477,6 +664,12 @@ void DumpPortalTrace( pstack_t* pStack )
 	g_PortalTrace.m_list.AddToTail( mid );
 	for( ; pStack != NULL; pStack = pStack->next )
 	{
+		const plane_t& plane = pStack->portalplane;
+		g_PortalTrace.m_windings.Printf( "level %.9g %.9g %.9g %.9g\n", plane.normal.x, plane.normal.y, plane.normal.z, plane.dist );
+		PrintTraceWinding( g_PortalTrace.m_windings, "source", pStack->source );
+		PrintTraceWinding( g_PortalTrace.m_windings, "pass", pStack->pass );
+		PrintTraceWinding( g_PortalTrace.m_windings, "portal", pStack->portal ? pStack->portal->winding : NULL );
+
 		winding_t* w = pStack->pass ? pStack->pass : pStack->portal->winding;
 		WindingCenter( w, mid );
 		g_PortalTrace.m_list.AddToTail( mid );
@@ -522,6 +715,206 @@ void WritePortalTrace( const char* source )
 	}
 	fclose( linefile );
 	Warning( "Wrote %s!!!\n", filename );
+
+	sprintf( filename, "%s.wtr", source );
+	FILE* windingfile = fopen( filename, "w" );
+	if( !windingfile )
+	{
+		Error( "Couldn't open %s\n", filename );
+	}
+	fwrite( g_PortalTrace.m_windings.Base(), 1, g_PortalTrace.m_windings.TellPut(), windingfile );
+	fclose( windingfile );
+	Warning( "Wrote %s!!!\n", filename );
+}
+
+
+/*
+==============
+BenchmarkWindingTrace
+
+Replays the clipping done along a flow stack captured with -trace (the .wtr
+file written next to the .lin) through the SIMD and the scalar plane tests,
+checks that both produce identical windings and reports their timings.
+==============
+*/
+#define CLIPBENCH_ITERATIONS	20000
+
+struct tracelevel_t
+{
+	plane_t		plane;
+	winding_t*	source;
+	winding_t*	pass;
+	winding_t*	portal;
+};
+
+static winding_t* ReadTraceWinding( FILE* f, const char* pName )
+{
+	char name[32];
+	int numpoints;
+	if( fscanf( f, "%31s %d", name, &numpoints ) != 2 || Q_stricmp( name, pName ) || numpoints < 0 || numpoints > MAX_POINTS_ON_WINDING )
+	{
+		Error( "BenchmarkWindingTrace: bad %s winding\n", pName );
+	}
+
+	if( !numpoints )
+	{
+		return NULL;
+	}
+
+	winding_t* w = NewWinding( max( numpoints, MAX_POINTS_ON_FIXED_WINDING ) );
+	w->original = true;
+	w->numpoints = numpoints;
+	for( int i = 0; i < numpoints; i++ )
+	{
+		if( fscanf( f, "%f %f %f", &w->points[i].x, &w->points[i].y, &w->points[i].z ) != 3 )
+		{
+			Error( "BenchmarkWindingTrace: bad %s winding\n", pName );
+		}
+	}
+	return w;
+}
+
+// Runs the clips RecursiveLeafFlow does when it steps from level-1 to level.
+// Returns the pass winding, copied into out, or false if it was clipped away.
+static bool ReplayTraceLevel( CUtlVector<tracelevel_t>& levels, int level, pstack_t* stack, winding_t* out )
+{
+	tracelevel_t& prev = levels[level - 1];
+	tracelevel_t& cur = levels[level];
+
+	stack->freewindings[0] = 1;
+	stack->freewindings[1] = 1;
+	stack->freewindings[2] = 1;
+
+	plane_t backplane;
+	VectorSubtract( vec3_origin, cur.plane.normal, backplane.normal );
+	backplane.dist = -cur.plane.dist;
+
+	winding_t* pass = ChopWinding( cur.portal, stack, &levels[0].plane );
+	if( !pass )
+	{
+		return false;
+	}
+	winding_t* source = ChopWinding( prev.source, stack, &backplane );
+	if( !source )
+	{
+		return false;
+	}
+
+	if( prev.pass )
+	{
+		pass = ClipToSeperators( source, prev.pass, pass, false, stack );
+		if( !pass )
+		{
+			return false;
+		}
+		pass = ClipToSeperators( prev.pass, source, pass, true, stack );
+		if( !pass )
+		{
+			return false;
+		}
+	}
+
+	out->numpoints = pass->numpoints;
+	memcpy( out->points, pass->points, pass->numpoints * sizeof( Vector ) );
+	return true;
+}
+
+void BenchmarkWindingTrace( const char* source )
+{
+	char filename[1024];
+	sprintf( filename, "%s.wtr", source );
+	FILE* f = fopen( filename, "r" );
+	if( !f )
+	{
+		Error( "Couldn't open %s (run vvis -trace first)\n", filename );
+	}
+
+	CUtlVector<tracelevel_t> levels;
+	char token[32];
+	while( fscanf( f, "%31s", token ) == 1 )
+	{
+		if( Q_stricmp( token, "level" ) )
+		{
+			Error( "BenchmarkWindingTrace: unexpected '%s' in %s\n", token, filename );
+		}
+
+		tracelevel_t& level = levels[levels.AddToTail()];
+		if( fscanf( f, "%f %f %f %f", &level.plane.normal.x, &level.plane.normal.y, &level.plane.normal.z, &level.plane.dist ) != 4 )
+		{
+			Error( "BenchmarkWindingTrace: bad level plane in %s\n", filename );
+		}
+		level.source = ReadTraceWinding( f, "source" );
+		level.pass = ReadTraceWinding( f, "pass" );
+		level.portal = ReadTraceWinding( f, "portal" );
+	}
+	fclose( f );
+
+	if( levels.Count() < 2 || !levels[0].source )
+	{
+		Error( "BenchmarkWindingTrace: %s has no flow to replay\n", filename );
+	}
+	for( int i = 1; i < levels.Count(); i++ )
+	{
+		if( !levels[i].source || !levels[i].portal )
+		{
+			Error( "BenchmarkWindingTrace: %s level %d is incomplete\n", filename, i );
+		}
+	}
+
+	Msg( "Replaying %d flow levels from %s, %d iterations\n", levels.Count() - 1, filename, CLIPBENCH_ITERATIONS );
+
+	static pstack_t stack;
+	winding_t* simdOut = NewWinding( MAX_POINTS_ON_WINDING );
+	winding_t* scalarOut = NewWinding( MAX_POINTS_ON_WINDING );
+
+	// Validate first: both paths must agree bit for bit on every level
+	bool bSaveScalar = g_bScalarClip;
+	for( int i = 1; i < levels.Count(); i++ )
+	{
+		g_bScalarClip = false;
+		bool bSIMD = ReplayTraceLevel( levels, i, &stack, simdOut );
+		g_bScalarClip = true;
+		bool bScalar = ReplayTraceLevel( levels, i, &stack, scalarOut );
+
+		if( bSIMD != bScalar || ( bSIMD && ( simdOut->numpoints != scalarOut->numpoints ||
+											 memcmp( simdOut->points, scalarOut->points, simdOut->numpoints * sizeof( Vector ) ) ) ) )
+		{
+			Error( "BenchmarkWindingTrace: SIMD and scalar clipping differ at level %d\n", i );
+		}
+	}
+	Msg( "SIMD and scalar clipping match\n" );
+
+	double flTime[2];
+	for( int nMode = 0; nMode < 2; nMode++ )
+	{
+		g_bScalarClip = ( nMode == 1 );
+		double flStart = Plat_FloatTime();
+		for( int nIter = 0; nIter < CLIPBENCH_ITERATIONS; nIter++ )
+		{
+			for( int i = 1; i < levels.Count(); i++ )
+			{
+				ReplayTraceLevel( levels, i, &stack, simdOut );
+			}
+		}
+		flTime[nMode] = Plat_FloatTime() - flStart;
+	}
+	g_bScalarClip = bSaveScalar;
+
+	Msg( "SIMD:   %.3f seconds\n", flTime[0] );
+	Msg( "scalar: %.3f seconds\n", flTime[1] );
+	if( flTime[0] > 0.0 )
+	{
+		Msg( "speedup: %.2fx\n", flTime[1] / flTime[0] );
+	}
+
+	for( int i = 0; i < levels.Count(); i++ )
+	{
+		free( levels[i].source );
+		free( levels[i].pass );
+		free( levels[i].portal );
+	}
+	free( simdOut );
+	free( scalarOut );
 }
 
 /*
@@ -538,8 +931,8 @@ void RecursiveLeafFlow( int leafnum, threaddata_t* thread, pstack_t* prevstack )
 	portal_t*	p;
 	plane_t		backplane;
 	leaf_t*		 leaf;
-	int			i, j;
-	long*		test, *might, *vis, more;
+	int			i;
+	byte*		test;
 	int			pnum;
 
 #if defined ( MPI ) && defined ( _WIN32 )
@@ -567,9 +960,6 @@ void RecursiveLeafFlow( int leafnum, threaddata_t* thread, pstack_t* prevstack )
 	stack.leaf = leaf;
 	stack.portal = NULL;
 
-	might = ( long* )stack.mightsee;
-	vis = ( long* )thread->base->portalvis;
-
 	// check all portals for flowing into other leafs
 	for( i = 0 ; i < leaf->portals.Count() ; i++ )
 	{
@@ -577,7 +967,7 @@ void RecursiveLeafFlow( int leafnum, threaddata_t* thread, pstack_t* prevstack )
 		p = leaf->portals[i];
 		pnum = p - portals;
 
-		if( !( prevstack->mightsee[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) )
+		if( !VisBitsCheck( prevstack->mightsee, prevstack->mightbegin, prevstack->mightend, pnum ) )
 		{
 			continue;	// can't possibly see it
 		}
@@ -585,19 +975,16 @@ void RecursiveLeafFlow( int leafnum, threaddata_t* thread, pstack_t* prevstack )
 		// if the portal can't see anything we haven't allready seen, skip it
 		if( p->status == stat_done )
 		{
-			test = ( long* )p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = ( long* )p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		for( j = 0 ; j < portallongs ; j++ )
-		{
-			might[j] = ( ( long* )prevstack->mightsee )[j] & test[j];
-			more |= ( might[j] & ~vis[j] );
-		}
+		stack.mightbegin = prevstack->mightbegin;
+		stack.mightend = prevstack->mightend;
+		bool more = VisBitsAndNew( stack.mightsee, prevstack->mightsee, test, thread->base->portalvis, stack.mightbegin, stack.mightend );
 
 		if( !more && CheckBit( thread->base->portalvis, pnum ) )
 		{
@@ -703,6 +1090,10 @@ void PortalFlow( int iThread, int portalnum )
 	int				c_might, c_can;
 
 	p = sorted_portals[portalnum];
+	if( p->status == stat_done )
+	{
+		return;		// reused from the vis cache
+	}
 	p->status = stat_working;
 
 	c_might = CountBits( p->portalflood, g_numportals * 2 );
@@ -713,10 +1104,8 @@ void PortalFlow( int iThread, int portalnum )
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
-	for( i = 0 ; i < portallongs ; i++ )
-	{
-		( ( long* )data.pstack_head.mightsee )[i] = ( ( long* )p->portalflood )[i];
-	}
+	memcpy( data.pstack_head.mightsee, p->portalflood, portalbytes );
+	VisBitsRange( p->portalflood, portalbytes, data.pstack_head.mightbegin, data.pstack_head.mightend );
 
 	RecursiveLeafFlow( p->leaf, &data, &data.pstack_head );
 
@@ -799,14 +1188,9 @@ void BasePortalVis( int iThread, int portalnum )
 	//
 	// allocate memory for bitwise vis solutions for this portal
 	//
-	p->portalfront = ( byte* )malloc( portalbytes );
-	memset( p->portalfront, 0, portalbytes );
-
-	p->portalflood = ( byte* )malloc( portalbytes );
-	memset( p->portalflood, 0, portalbytes );
-
-	p->portalvis = ( byte* )malloc( portalbytes );
-	memset( p->portalvis, 0, portalbytes );
+	p->portalfront = AllocVisBits( portalbytes );
+	p->portalflood = AllocVisBits( portalbytes );
+	p->portalvis = AllocVisBits( portalbytes );
 
 	//
 	// test the given portal against all of the portals in the map
@@ -910,14 +1294,14 @@ RecursiveLeafBitFlow
 
 ==================
 */
-void RecursiveLeafBitFlow( int leafnum, byte* mightsee, byte* cansee )
+void RecursiveLeafBitFlow( int leafnum, byte* mightsee, int mightbegin, int mightend, byte* cansee )
 {
 	portal_t*	p;
 	leaf_t*		 leaf;
-	int			i, j;
-	long		more;
+	int			i;
 	int			pnum;
-	byte		newmight[MAX_PORTALS / 8];
+	ALIGN16 byte	newmight[MAX_PORTALS / 8] ALIGN16_POST;
+	int			newbegin, newend;
 
 	leaf = &leafs[leafnum];
 
@@ -928,28 +1312,22 @@ void RecursiveLeafBitFlow( int leafnum, byte* mightsee, byte* cansee )
 		pnum = p - portals;
 
 		// if some previous portal can't see it, skip
-		if( !CheckBit( mightsee, pnum ) )
+		if( !VisBitsCheck( mightsee, mightbegin, mightend, pnum ) )
 		{
 			continue;
 		}
 
 		// if this portal can see some portals we mightsee, recurse
-		more = 0;
-		for( j = 0 ; j < portallongs ; j++ )
-		{
-			( ( long* )newmight )[j] = ( ( long* )mightsee )[j]
-									   & ( ( long* )p->portalflood )[j];
-			more |= ( ( long* )newmight )[j] & ~( ( long* )cansee )[j];
-		}
-
-		if( !more )
+		newbegin = mightbegin;
+		newend = mightend;
+		if( !VisBitsAndNew( newmight, mightsee, p->portalflood, cansee, newbegin, newend ) )
 		{
 			continue;    // can't see anything new
 		}
 
 		SetBit( cansee, pnum );
 
-		RecursiveLeafBitFlow( p->leaf, newmight, cansee );
+		RecursiveLeafBitFlow( p->leaf, newmight, newbegin, newend, cansee );
 	}
 }
 
@@ -961,10 +1339,12 @@ BetterPortalVis
 void BetterPortalVis( int portalnum )
 {
 	portal_t*	p;
+	int			begin, end;
 
 	p = portals + portalnum;
 
-	RecursiveLeafBitFlow( p->leaf, p->portalflood, p->portalvis );
+	VisBitsRange( p->portalflood, portalbytes, begin, end );
+	RecursiveLeafBitFlow( p->leaf, p->portalflood, begin, end, p->portalvis );
 
 	// build leaf vis information
 	p->nummightsee = CountBits( p->portalvis, g_numportals * 2 );
@@ -198,14 +198,13 @@ void ReceiveBasePortalVis( uint64 iWorkUnit, MessageBuffer* pBuf, int iWorker )
 	//
 	// allocate memory for bitwise vis solutions for this portal
 	//
-	p->portalfront = ( byte* )malloc( portalbytes );
+	p->portalfront = AllocVisBits( portalbytes );
 	pBuf->read( p->portalfront, portalbytes );
 
-	p->portalflood = ( byte* )malloc( portalbytes );
+	p->portalflood = AllocVisBits( portalbytes );
 	pBuf->read( p->portalflood, portalbytes );
 
-	p->portalvis = ( byte* )malloc( portalbytes );
-	memset( p->portalvis, 0, portalbytes );
+	p->portalvis = AllocVisBits( portalbytes );
 
 	p->nummightsee = CountBits( p->portalflood, g_numportals * 2 );
 }
@@ -298,14 +297,13 @@ void RunMPIBasePortalVis()
 		{
 			portal_t* p = &portals[i];
 
-			p->portalfront = ( byte* )malloc( portalbytes );
+			p->portalfront = AllocVisBits( portalbytes );
 			g_pFileSystem->Read( p->portalfront, portalbytes, fp );
 
-			p->portalflood = ( byte* )malloc( portalbytes );
+			p->portalflood = AllocVisBits( portalbytes );
 			g_pFileSystem->Read( p->portalflood, portalbytes, fp );
 
-			p->portalvis = ( byte* )malloc( portalbytes );
-			memset( p->portalvis, 0, portalbytes );
+			p->portalvis = AllocVisBits( portalbytes );
 
 			p->nummightsee = CountBits( p->portalflood, g_numportals * 2 );
 		}
@@ -10,6 +10,7 @@
 #include "cmdlib.h"
 #include "mathlib/mathlib.h"
 #include "bsplib.h"
+#include "visbits.h"
 
 
 #define	MAX_PORTALS	65536
@@ -66,7 +67,8 @@ struct leaf_t
 
 struct pstack_t
 {
-	byte		mightsee[MAX_PORTALS / 8];		// bit string
+	ALIGN16 byte	mightsee[MAX_PORTALS / 8] ALIGN16_POST;		// bit string
+	int			mightbegin, mightend;	// blocks of mightsee that can have bits set
 	pstack_t*	next;
 	leaf_t*		leaf;
 	portal_t*	portal;	// portal exiting
@@ -102,8 +104,8 @@ extern	byte*	vismap, *vismap_p, *vismap_end;	// past visfile
 extern	int			testlevel;
 
 
-extern	int		leafbytes, leaflongs;
-extern	int		portalbytes, portallongs;
+extern	int		leafbytes;
+extern	int		portalbytes;
 
 
 void LeafFlow( int leafnum );
@@ -113,9 +115,14 @@ void BasePortalVis( int iThread, int portalnum );
 void BetterPortalVis( int portalnum );
 void PortalFlow( int iThread, int portalnum );
 void WritePortalTrace( const char* source );
+void BenchmarkWindingTrace( const char* source );
+
+void LoadPortalVisCache( const char* pFilename );
+void SavePortalVisCache( const char* pFilename );
 
 extern	portal_t*	sorted_portals[MAX_MAP_PORTALS * 2];
 extern int g_TraceClusterStart, g_TraceClusterStop;
+extern bool g_bScalarClip;
 
 int CountBits( byte* bits, int numbits );
 
@@ -0,0 +1,152 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Bit vectors for the portal and cluster sets vvis floods through.
+//			Rows are padded to whole 16 byte blocks and allocated on cache
+//			line boundaries so the set operations in the flow loops can work
+//			a block at a time with SSE2. The flood is bound by memory, not by
+//			the width of the set ops, so unlike the ray tracer there is no AVX
+//			path picked with CheckAVXTechnology. Rows live until vvis exits,
+//			like the portals that own them.
+//
+//=============================================================================//
+
+#ifndef VISBITS_H
+#define VISBITS_H
+#ifdef _WIN32
+	#pragma once
+#endif
+
+#include <emmintrin.h>
+#include "tier0/memalloc.h"
+
+
+#define VISBITS_BLOCK_BYTES		16
+#define VISBITS_BLOCK_BITS		( VISBITS_BLOCK_BYTES * 8 )
+#define VISBITS_ALIGN			64		// cache line
+
+
+//-----------------------------------------------------------------------------
+// Bytes needed for a row of numbits, rounded up to whole blocks
+//-----------------------------------------------------------------------------
+inline int VisBitsBytes( int numbits )
+{
+	return ( ( numbits + VISBITS_BLOCK_BITS - 1 ) & ~( VISBITS_BLOCK_BITS - 1 ) ) >> 3;
+}
+
+inline byte* AllocVisBits( int numbytes )
+{
+	byte* pBits = ( byte* )MemAlloc_AllocAligned( numbytes, VISBITS_ALIGN );
+	memset( pBits, 0, numbytes );
+	return pBits;
+}
+
+
+inline int VisPopCount64( uint64 bits )
+{
+#if defined( __GNUC__ )
+	return __builtin_popcountll( bits );
+#else
+	bits = bits - ( ( bits >> 1 ) & 0x5555555555555555ull );
+	bits = ( bits & 0x3333333333333333ull ) + ( ( bits >> 2 ) & 0x3333333333333333ull );
+	bits = ( bits + ( bits >> 4 ) ) & 0x0F0F0F0F0F0F0F0Full;
+	return ( int )( ( bits * 0x0101010101010101ull ) >> 56 );
+#endif
+}
+
+inline bool VisBlockIsZero( __m128i block )
+{
+	return _mm_movemask_epi8( _mm_cmpeq_epi8( block, _mm_setzero_si128() ) ) == 0xFFFF;
+}
+
+
+//-----------------------------------------------------------------------------
+// True if bitNumber is set in a row whose non-zero blocks all lie in [begin, end)
+//-----------------------------------------------------------------------------
+inline bool VisBitsCheck( const byte* bits, int begin, int end, int bitNumber )
+{
+	int block = bitNumber / VISBITS_BLOCK_BITS;
+	if( block < begin || block >= end )
+	{
+		return false;
+	}
+	return ( bits[bitNumber >> 3] & ( 1 << ( bitNumber & 7 ) ) ) != 0;
+}
+
+//-----------------------------------------------------------------------------
+// dest = a & b over the blocks [begin, end); a and b are zero outside of it.
+// Returns true if dest has any bits that aren't in seen. begin and end are
+// narrowed to the blocks of dest that are non-zero, anything outside the new
+// range is left as it was and must not be read.
+//-----------------------------------------------------------------------------
+inline bool VisBitsAndNew( byte* dest, const byte* a, const byte* b, const byte* seen, int& begin, int& end )
+{
+	__m128i more = _mm_setzero_si128();
+	int first = end;
+	int last = begin - 1;
+
+	for( int i = begin; i < end; i++ )
+	{
+		int ofs = i * VISBITS_BLOCK_BYTES;
+		__m128i m = _mm_and_si128( _mm_loadu_si128( ( const __m128i* )( a + ofs ) ), _mm_loadu_si128( ( const __m128i* )( b + ofs ) ) );
+		_mm_storeu_si128( ( __m128i* )( dest + ofs ), m );
+		if( VisBlockIsZero( m ) )
+		{
+			continue;
+		}
+
+		if( first == end )
+		{
+			first = i;
+		}
+		last = i;
+		more = _mm_or_si128( more, _mm_andnot_si128( _mm_loadu_si128( ( const __m128i* )( seen + ofs ) ), m ) );
+	}
+
+	if( last < first )
+	{
+		begin = end = 0;
+		return false;
+	}
+
+	begin = first;
+	end = last + 1;
+	return !VisBlockIsZero( more );
+}
+
+//-----------------------------------------------------------------------------
+// dest |= src
+//-----------------------------------------------------------------------------
+inline void VisBitsOr( byte* dest, const byte* src, int numbytes )
+{
+	Assert( ( numbytes % VISBITS_BLOCK_BYTES ) == 0 );
+	for( int ofs = 0; ofs < numbytes; ofs += VISBITS_BLOCK_BYTES )
+	{
+		__m128i d = _mm_loadu_si128( ( const __m128i* )( dest + ofs ) );
+		__m128i s = _mm_loadu_si128( ( const __m128i* )( src + ofs ) );
+		_mm_storeu_si128( ( __m128i* )( dest + ofs ), _mm_or_si128( d, s ) );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Block range [begin, end) that holds every set bit of a row
+//-----------------------------------------------------------------------------
+inline void VisBitsRange( const byte* bits, int numbytes, int& begin, int& end )
+{
+	int numblocks = numbytes / VISBITS_BLOCK_BYTES;
+	for( begin = 0; begin < numblocks; begin++ )
+	{
+		if( !VisBlockIsZero( _mm_loadu_si128( ( const __m128i* )( bits + begin * VISBITS_BLOCK_BYTES ) ) ) )
+		{
+			break;
+		}
+	}
+	for( end = numblocks; end > begin; end-- )
+	{
+		if( !VisBlockIsZero( _mm_loadu_si128( ( const __m128i* )( bits + ( end - 1 ) * VISBITS_BLOCK_BYTES ) ) ) )
+		{
+			break;
+		}
+	}
+}
+
+#endif // VISBITS_H
@@ -0,0 +1,367 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Sidecar cache of PortalFlow results. Each portal's portalvis is
+//			stored under a key built from its own winding and the windings and
+//			leaf connectivity of every portal it might see, so a recompile only
+//			has to flow the portals whose neighborhood changed.
+//
+//=============================================================================//
+
+#include "vis.h"
+#include "threads.h"
+#include "tier1/checksum_md5.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/utlmap.h"
+
+
+#define VISCACHE_ID			(('C'<<24)+('S'<<16)+('I'<<8)+'V')
+#define VISCACHE_VERSION	2
+
+struct viscacheheader_t
+{
+	int		id;
+	int		version;
+	int		numportals;		// memory portals, two per portal in the .prt file
+	int		useradius;
+	double	visradius;
+};
+
+static CUtlVector<uint64>		g_PortalHash;		// winding + plane of each portal
+static CUtlVector<uint64>		g_PortalLinkHash;	// portal hash combined with the leaf it leads into
+static CUtlVector<MD5Value_t>	g_PortalFlowKey;	// the neighborhood key PortalFlow results are stored under
+
+
+static uint64 HashToUint64( const MD5Value_t& md5 )
+{
+	uint64 val;
+	memcpy( &val, md5.bits, sizeof( val ) );
+	return val;
+}
+
+static uint64 PortalHash( portal_t* p )
+{
+	MD5Context_t ctx;
+	MD5Value_t md5;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	MD5Update( &ctx, ( unsigned char* )&p->winding->numpoints, sizeof( p->winding->numpoints ) );
+	MD5Update( &ctx, ( unsigned char* )p->winding->points, p->winding->numpoints * sizeof( Vector ) );
+	MD5Update( &ctx, ( unsigned char* )&p->plane, sizeof( p->plane ) );
+	MD5Final( md5.bits, &ctx );
+	return HashToUint64( md5 );
+}
+
+// Order independent hash of the portals leading out of a leaf
+static uint64 LeafHash( int leafnum )
+{
+	leaf_t* leaf = &leafs[leafnum];
+	uint64 sum = leaf->portals.Count();
+	uint64 mix = 0;
+	for( int i = 0; i < leaf->portals.Count(); i++ )
+	{
+		uint64 h = g_PortalHash[leaf->portals[i] - portals];
+		sum += h;
+		mix ^= h * 0x9E3779B97F4A7C15ull;
+	}
+	return sum ^ ( ( mix << 29 ) | ( mix >> 35 ) );
+}
+
+static void CalcPortalFlowKey( int iThread, int portalnum )
+{
+	portal_t* p = &portals[portalnum];
+
+	// Sum up the links of everything the flood fill says we might see. Two independent
+	// accumulators keep a swapped pair of portals from cancelling out.
+	uint64 sum = 0, mix = 0;
+	int count = 0;
+	for( int i = 0; i < portalbytes; i++ )
+	{
+		byte bits = p->portalflood[i];
+		if( !bits )
+		{
+			continue;
+		}
+
+		for( int j = 0; j < 8; j++ )
+		{
+			if( bits & ( 1 << j ) )
+			{
+				uint64 h = g_PortalLinkHash[( i << 3 ) + j];
+				sum += h;
+				mix ^= h * 0xC2B2AE3D27D4EB4Full;
+				count++;
+			}
+		}
+	}
+
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+	MD5Update( &ctx, ( unsigned char* )&g_PortalLinkHash[portalnum], sizeof( uint64 ) );
+	MD5Update( &ctx, ( unsigned char* )&count, sizeof( count ) );
+	MD5Update( &ctx, ( unsigned char* )&sum, sizeof( sum ) );
+	MD5Update( &ctx, ( unsigned char* )&mix, sizeof( mix ) );
+	MD5Final( g_PortalFlowKey[portalnum].bits, &ctx );
+}
+
+static bool MD5LessFunc( const MD5Value_t& a, const MD5Value_t& b )
+{
+	return memcmp( a.bits, b.bits, sizeof( a.bits ) ) < 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Same zero run-length scheme as CompressVis, but for an arbitrary row length
+//-----------------------------------------------------------------------------
+static void WritePortalBits( CUtlBuffer& buf, const byte* bits, int numbytes )
+{
+	for( int i = 0; i < numbytes; i++ )
+	{
+		buf.PutUnsignedChar( bits[i] );
+		if( bits[i] )
+		{
+			continue;
+		}
+
+		int rep = 1;
+		for( i++; i < numbytes; i++ )
+		{
+			if( bits[i] || rep == 255 )
+			{
+				break;
+			}
+			rep++;
+		}
+		buf.PutUnsignedChar( rep );
+		i--;
+	}
+}
+
+static bool ReadPortalBits( CUtlBuffer& buf, byte* bits, int numbytes )
+{
+	int i = 0;
+	while( i < numbytes && buf.IsValid() )
+	{
+		byte c = buf.GetUnsignedChar();
+		if( c )
+		{
+			bits[i++] = c;
+			continue;
+		}
+
+		int rep = buf.GetUnsignedChar();
+		if( !rep || i + rep > numbytes )
+		{
+			return false;
+		}
+		memset( bits + i, 0, rep );
+		i += rep;
+	}
+	return buf.IsValid();
+}
+
+
+//-----------------------------------------------------------------------------
+// Computes the neighborhood keys. Must run after BasePortalVis.
+//-----------------------------------------------------------------------------
+static void BuildPortalFlowKeys()
+{
+	int numportals = g_numportals * 2;
+
+	g_PortalHash.SetCount( numportals );
+	for( int i = 0; i < numportals; i++ )
+	{
+		g_PortalHash[i] = PortalHash( &portals[i] );
+	}
+
+	CUtlVector<uint64> leafHash;
+	leafHash.SetCount( portalclusters );
+	for( int i = 0; i < portalclusters; i++ )
+	{
+		leafHash[i] = LeafHash( i );
+	}
+
+	g_PortalLinkHash.SetCount( numportals );
+	for( int i = 0; i < numportals; i++ )
+	{
+		MD5Context_t ctx;
+		MD5Value_t md5;
+		memset( &ctx, 0, sizeof( ctx ) );
+		MD5Init( &ctx );
+		MD5Update( &ctx, ( unsigned char* )&g_PortalHash[i], sizeof( uint64 ) );
+		MD5Update( &ctx, ( unsigned char* )&leafHash[portals[i].leaf], sizeof( uint64 ) );
+		MD5Final( md5.bits, &ctx );
+		g_PortalLinkHash[i] = HashToUint64( md5 );
+	}
+
+	g_PortalFlowKey.SetCount( numportals );
+	RunThreadsOnIndividual( numportals, false, CalcPortalFlowKey );
+}
+
+
+/*
+==================
+LoadPortalVisCache
+
+Marks every portal whose neighborhood is unchanged since the cache was
+written as done, with its portalvis filled in from the cache.
+==================
+*/
+void LoadPortalVisCache( const char* pFilename )
+{
+	BuildPortalFlowKeys();
+
+	if( !FileExists( pFilename ) )
+	{
+		return;
+	}
+
+	void* pData = NULL;
+	int size = LoadFile( pFilename, &pData );
+	CUtlBuffer buf( pData, size, CUtlBuffer::READ_ONLY );
+
+	viscacheheader_t header;
+	buf.Get( &header, sizeof( header ) );
+	if( !buf.IsValid() || header.id != VISCACHE_ID || header.version != VISCACHE_VERSION ||
+			header.useradius != ( int )g_bUseRadius || header.visradius != g_VisRadius )
+	{
+		Msg( "Ignoring out of date vis cache %s\n", pFilename );
+		free( pData );
+		return;
+	}
+
+	// Portal numbers change between compiles, so map the cached ones to the current
+	// ones by winding. Windings that show up more than once are ambiguous and mapped
+	// to nothing, which forces anything that might see them to be recomputed.
+	int numportals = g_numportals * 2;
+	CUtlMap<uint64, int, int> portalFromHash( DefLessFunc( uint64 ) );
+	for( int i = 0; i < numportals; i++ )
+	{
+		int idx = portalFromHash.Find( g_PortalHash[i] );
+		if( idx == portalFromHash.InvalidIndex() )
+		{
+			portalFromHash.Insert( g_PortalHash[i], i );
+		}
+		else
+		{
+			portalFromHash[idx] = -1;
+		}
+	}
+
+	int oldportals = header.numportals;
+	int oldportalbytes = VisBitsBytes( oldportals );
+	CUtlVector<int> remap;
+	remap.SetCount( oldportals );
+	for( int i = 0; i < oldportals; i++ )
+	{
+		uint64 hash;
+		buf.Get( &hash, sizeof( hash ) );
+		int idx = portalFromHash.Find( hash );
+		remap[i] = ( idx != portalFromHash.InvalidIndex() ) ? portalFromHash[idx] : -1;
+	}
+
+	// Index the cached results by key
+	byte* oldbits = ( byte* )malloc( oldportalbytes );
+	CUtlMap<MD5Value_t, int, int> entryFromKey( MD5LessFunc );
+	for( int i = 0; i < oldportals; i++ )
+	{
+		MD5Value_t key;
+		buf.Get( &key, sizeof( key ) );
+		int offset = buf.TellGet();
+		if( !ReadPortalBits( buf, oldbits, oldportalbytes ) )
+		{
+			Warning( "Vis cache %s is corrupt, ignoring the rest of it\n", pFilename );
+			break;
+		}
+		entryFromKey.InsertOrReplace( key, offset );
+	}
+
+	int reused = 0;
+	for( int i = 0; i < numportals; i++ )
+	{
+		int idx = entryFromKey.Find( g_PortalFlowKey[i] );
+		if( idx == entryFromKey.InvalidIndex() )
+		{
+			continue;
+		}
+
+		buf.SeekGet( CUtlBuffer::SEEK_HEAD, entryFromKey[idx] );
+		ReadPortalBits( buf, oldbits, oldportalbytes );
+
+		portal_t* p = &portals[i];
+		bool bValid = true;
+		for( int j = 0; j < oldportalbytes && bValid; j++ )
+		{
+			byte bits = oldbits[j];
+			for( int k = 0; bits; k++, bits >>= 1 )
+			{
+				if( !( bits & 1 ) )
+				{
+					continue;
+				}
+
+				int oldnum = ( j << 3 ) + k;
+				if( oldnum >= oldportals || remap[oldnum] < 0 )
+				{
+					bValid = false;
+					break;
+				}
+				SetBit( p->portalvis, remap[oldnum] );
+			}
+		}
+
+		if( bValid )
+		{
+			p->status = stat_done;
+			reused++;
+		}
+		else
+		{
+			memset( p->portalvis, 0, portalbytes );
+		}
+	}
+
+	free( oldbits );
+	free( pData );
+
+	Msg( "Reused %d of %d portals from %s\n", reused, numportals, pFilename );
+}
+
+
+/*
+==================
+SavePortalVisCache
+==================
+*/
+void SavePortalVisCache( const char* pFilename )
+{
+	int numportals = g_numportals * 2;
+	if( g_PortalFlowKey.Count() != numportals )
+	{
+		return;
+	}
+
+	CUtlBuffer buf;
+
+	viscacheheader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.id = VISCACHE_ID;
+	header.version = VISCACHE_VERSION;
+	header.numportals = numportals;
+	header.useradius = g_bUseRadius;
+	header.visradius = g_VisRadius;
+	buf.Put( &header, sizeof( header ) );
+
+	buf.Put( g_PortalHash.Base(), numportals * sizeof( uint64 ) );
+
+	for( int i = 0; i < numportals; i++ )
+	{
+		portal_t* p = &portals[i];
+		Assert( p->status == stat_done );
+
+		buf.Put( &g_PortalFlowKey[i], sizeof( MD5Value_t ) );
+		WritePortalBits( buf, p->portalvis, portalbytes );
+	}
+
+	SaveFile( pFilename, buf.Base(), buf.TellPut() );
+}
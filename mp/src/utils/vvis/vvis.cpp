@@ -25,6 +25,8 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "distribute.h"
+#include "phaseprofile.h"
 
 
 int			g_numportals;
@@ -42,10 +44,9 @@ byte*		uncompressedvis;
 byte*		vismap, *vismap_p, *vismap_end;	// past visfile
 int			originalvismapsize;
 
-int			leafbytes;				// (portalclusters+63)>>3
-int			leaflongs;
+int			leafbytes;				// VisBitsBytes( portalclusters )
 
-int			portalbytes, portallongs;
+int			portalbytes;
 
 bool		fastvis;
 bool		nosort;
@@ -59,6 +60,13 @@ double		g_VisRadius = 4096.0f * 4096.0f;
 
 bool		g_bLowPriority = false;
 
+bool		g_bClipBenchmark = false;
+
+bool		g_bUseVisCache = true;
+char		g_szVisCacheFile[1024];
+
+char		g_szPhaseProfile[MAX_PATH];
+
 //=============================================================================
 
 void PlaneFromWinding( winding_t* w, plane_t* plane )
@@ -212,9 +220,9 @@ void ClusterMerge( int clusternum )
 {
 	leaf_t*		leaf;
 //	byte		portalvector[MAX_PORTALS/8];
-	byte		portalvector[MAX_PORTALS / 4];    // 4 because portal bytes is * 2
-	byte		uncompressed[MAX_MAP_LEAFS / 8];
-	int			i, j;
+	ALIGN16 byte	portalvector[MAX_PORTALS / 4] ALIGN16_POST;    // 4 because portal bytes is * 2
+	ALIGN16 byte	uncompressed[MAX_MAP_LEAFS / 8] ALIGN16_POST;
+	int			i;
 	int			numvis;
 	portal_t*	p;
 	int			pnum;
@@ -230,10 +238,7 @@ void ClusterMerge( int clusternum )
 		{
 			Error( "portal not done %d %p %p\n", i, p, portals );
 		}
-		for( j = 0 ; j < portallongs ; j++ )
-		{
-			( ( long* )portalvector )[j] |= ( ( long* )p->portalvis )[j];
-		}
+		VisBitsOr( portalvector, p->portalvis, portalbytes );
 		pnum = p - portals;
 		SetBit( portalvector, pnum );
 	}
@@ -306,6 +311,42 @@ static int CompressAndCrosscheckClusterVis( int clusternum )
 }
 
 
+/*
+==================
+PortalFlowCost
+
+The flood fill bound is a good predictor of how long PortalFlow will recurse
+==================
+*/
+static float PortalFlowCost( int portalnum )
+{
+	portal_t* p = sorted_portals[portalnum];
+	return ( p->status == stat_done ) ? 1 : p->nummightsee;
+}
+
+
+static void DistProcessPortalFlow( int iThread, int iWorkUnit, CUtlBuffer* pBuf )
+{
+	PortalFlow( iThread, iWorkUnit );
+
+	if( pBuf )
+	{
+		pBuf->Put( sorted_portals[iWorkUnit]->portalvis, portalbytes );
+	}
+}
+
+static void DistReceivePortalFlow( int iWorkUnit, CUtlBuffer& buf, int iWorker )
+{
+	portal_t* p = sorted_portals[iWorkUnit];
+	buf.Get( p->portalvis, portalbytes );
+	p->status = stat_done;
+}
+
+static bool DistPortalFlowDone( int iWorkUnit )
+{
+	return sorted_portals[iWorkUnit]->status == stat_done;
+}
+
 /*
 ==================
 CalcPortalVis
@@ -333,8 +374,14 @@ void CalcPortalVis( void )
 	}
 	else
 #endif // MPI && _WIN32
+	if( g_bDistributed )
 	{
-		RunThreadsOnIndividual( g_numportals * 2, true, PortalFlow );
+		Msg( "%-20s ", "PortalFlow:" );
+		RunDistributedWork( g_numportals * 2, DistProcessPortalFlow, DistReceivePortalFlow, DistPortalFlowDone );
+	}
+	else
+	{
+		RunThreadsOnIndividual( g_numportals * 2, true, PortalFlow, PortalFlowCost );
 	}
 }
 
@@ -365,16 +412,37 @@ void CalcVis( void )
 	else
 #endif // MPI && _WIN32
 	{
+		PhaseProfile_Begin( "BasePortalVis" );
 		RunThreadsOnIndividual( g_numportals * 2, true, BasePortalVis );
+		PhaseProfile_End();
 	}
 
 	SortPortals();
 
+	if( g_bUseVisCache && !fastvis )
+	{
+		LoadPortalVisCache( g_szVisCacheFile );
+	}
+
+	PhaseProfile_Begin( "PortalFlow" );
 	CalcPortalVis();
+	PhaseProfile_End();
+
+	// the master merges and writes everything
+	if( g_bDistWorker )
+	{
+		Dist_WorkerDone();
+	}
+
+	if( g_bUseVisCache && !fastvis )
+	{
+		SavePortalVisCache( g_szVisCacheFile );
+	}
 
 	//
 	// assemble the leaf vis lists by oring the portal lists
 	//
+	PhaseProfile_Begin( "ClusterMerge" );
 	for( i = 0; i < portalclusters; i++ )
 	{
 		ClusterMerge( i );
@@ -386,6 +454,7 @@ void CalcVis( void )
 	{
 		count += CompressAndCrosscheckClusterVis( i );
 	}
+	PhaseProfile_End();
 
 
 	Msg( "Optimized: %d visible clusters (%.2f%%)\n", count, count * 100.0 / totalvis );
@@ -512,12 +581,9 @@ void LoadPortals( char* name )
 		Error( "The map overflows the max portal count (%d of max %d)!\n", g_numportals, MAX_PORTALS / 2 );
 	}
 
-	// these counts should take advantage of 64 bit systems automatically
-	leafbytes = ( ( portalclusters + 63 ) & ~63 ) >> 3;
-	leaflongs = leafbytes / sizeof( long );
-
-	portalbytes = ( ( g_numportals * 2 + 63 ) & ~63 ) >> 3;
-	portallongs = portalbytes / sizeof( long );
+	// rows are padded to whole blocks for the SIMD set operations in visbits.h
+	leafbytes = VisBitsBytes( portalclusters );
+	portalbytes = VisBitsBytes( g_numportals * 2 );
 
 // each file portal is split into two memory portals
 	portals = ( portal_t* )malloc( 2 * g_numportals * sizeof( portal_t ) );
@@ -527,7 +593,7 @@ void LoadPortals( char* name )
 	memset( leafs, 0, portalclusters * sizeof( leaf_t ) );
 
 	originalvismapsize = portalclusters * leafbytes;
-	uncompressedvis = ( byte* )malloc( originalvismapsize );
+	uncompressedvis = AllocVisBits( originalvismapsize );
 
 	vismap = vismap_p = dvisdata;
 	dvis->numclusters = portalclusters;
@@ -621,12 +687,12 @@ by ORing together all the PVS visible from a leaf
 */
 void CalcPAS( void )
 {
-	int		i, j, k, l, index;
+	int		i, j, k, index;
 	int		bitbyte;
-	long*	dest, *src;
+	byte*	dest;
 	byte*	scan;
 	int		count;
-	byte	uncompressed[MAX_MAP_LEAFS / 8];
+	ALIGN16 byte	uncompressed[MAX_MAP_LEAFS / 8] ALIGN16_POST;
 	byte	compressed[MAX_MAP_LEAFS / 8];
 
 	Msg( "Building PAS...\n" );
@@ -655,12 +721,7 @@ void CalcPAS( void )
 				{
 					Error( "Bad bit in PVS" );    // pad bits should be 0
 				}
-				src = ( long* )( uncompressedvis + index * leafbytes );
-				dest = ( long* )uncompressed;
-				for( l = 0 ; l < leaflongs ; l++ )
-				{
-					( ( long* )uncompressed )[l] |= src[l];
-				}
+				VisBitsOr( uncompressed, uncompressedvis + index * leafbytes, leafbytes );
 			}
 		}
 		for( j = 0 ; j < portalclusters ; j++ )
@@ -676,7 +737,7 @@ void CalcPAS( void )
 		//
 		j = CompressVis( uncompressed, compressed );
 
-		dest = ( long* )vismap_p;
+		dest = vismap_p;
 		vismap_p += j;
 
 		if( vismap_p > vismap_end )
@@ -684,7 +745,7 @@ void CalcPAS( void )
 			Error( "Vismap expansion overflow" );
 		}
 
-		dvis->bitofs[i][DVIS_PAS] = ( byte* )dest - vismap;
+		dvis->bitofs[i][DVIS_PAS] = dest - vismap;
 
 		memcpy( dest, compressed, j );
 	}
@@ -1036,6 +1097,15 @@ int ParseCommandLine( int argc, char** argv )
 			i++;
 			Msg( "Tracing vis from cluster %d to %d\n", g_TraceClusterStart, g_TraceClusterStop );
 		}
+		else if( !Q_stricmp( argv[i], "-scalarclip" ) )
+		{
+			Msg( "scalarclip = true\n" );
+			g_bScalarClip = true;
+		}
+		else if( !Q_stricmp( argv[i], "-clipbench" ) )
+		{
+			g_bClipBenchmark = true;
+		}
 		else if( !Q_stricmp( argv[i], "-nosort" ) )
 		{
 			Msg( "nosort = true\n" );
@@ -1049,10 +1119,28 @@ int ParseCommandLine( int argc, char** argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-nocache" ) )
+		{
+			Msg( "nocache = true\n" );
+			g_bUseVisCache = false;
+		}
 		else if( !Q_stricmp( argv[i], "-FullMinidumps" ) )
 		{
 			EnableFullMinidumps( true );
 		}
+		else if( !Q_stricmp( argv[i], "-phaseprofile" ) )
+		{
+			if( ++i < argc )
+			{
+				V_strncpy( g_szPhaseProfile, argv[i], sizeof( g_szPhaseProfile ) );
+			}
+			else
+			{
+				Warning( "Error: expected a filename after '-phaseprofile'\n" );
+				DeleteCmdLine( argc, argv );
+				CmdLib_Exit( 1 );
+			}
+		}
 		else if( !Q_stricmp( argv[i], CMDLINEOPTION_NOVCONFIG ) )
 		{
 		}
@@ -1064,6 +1152,9 @@ int ParseCommandLine( int argc, char** argv )
 		{
 			// nothing to do here, but don't bail on this option
 		}
+		else if( Dist_HandleArg( argc, argv, i ) )
+		{
+		}
 		// NOTE: the -mpi checks must come last here because they allow the previous argument
 		// to be -mpi as well. If it game before something else like -game, then if the previous
 		// argument was -mpi and the current argument was something valid like -game, it would skip it.
@@ -1134,10 +1225,22 @@ void PrintUsage( int argc, char** argv )
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
+		"  -nocache        : Don't read or write the per-portal vis cache (<mapname>.vviscache)\n"
+		"                    that lets recompiles skip portals whose surroundings didn't change.\n"
+		"  -distmaster <port> : Listen on <port> and share the PortalFlow work with workers.\n"
+		"  -distworker <host>:<port> : Work for the master at <host>:<port>. Run with the same\n"
+		"                    map and options as the master, quits once PortalFlow is done.\n"
+		"  -disttimeout <seconds> : Hand a work unit to someone else if its worker doesn't\n"
+		"                    answer for this long (default 900, 0 never gives up).\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
+		"                    Also writes the traced windings to <mapname>.wtr for -clipbench.\n"
+		"  -clipbench      : Replay <mapname>.wtr through the SIMD and scalar winding clippers,\n"
+		"                    check that they match and time them. Doesn't touch the bsp.\n"
+		"  -scalarclip     : Use the scalar winding plane tests instead of the SIMD ones (for validation).\n"
 		"  -FullMinidumps  : Write large minidumps on crash.\n"
+		"  -phaseprofile <file> : Write the time spent in each phase to <file> as JSON.\n"
 		"  -x360		   : Generate Xbox360 version of vsp\n"
 		"  -nox360		   : Disable generation Xbox360 version of vsp (default)\n"
 		"\n"
@@ -1213,11 +1316,25 @@ int RunVVis( int argc, char** argv )
 		CmdLib_Exit( 1 );
 	}
 
+	if( g_bClipBenchmark )
+	{
+		BenchmarkWindingTrace( source );
+		DeleteCmdLine( argc, argv );
+		CmdLib_Cleanup();
+		return 0;
+	}
+
 	start = Plat_FloatTime();
 
+	if( g_szPhaseProfile[0] )
+	{
+		PhaseProfile_Init( "vvis", g_szPhaseProfile );
+	}
+
 #if defined ( MPI ) && defined ( _WIN32 )
 	if( !g_bUseMPI )
 #endif // MPI && _WIN32
+	if( !g_bDistWorker )
 	{
 		// Setup the logfile.
 		char logFile[512];
@@ -1232,9 +1349,18 @@ int RunVVis( int argc, char** argv )
 	}
 
 	ThreadSetDefault();
+	Dist_Init();
+
+	// workers share the master's files, they mustn't write the cache
+	if( g_bDistWorker )
+	{
+		g_bUseVisCache = false;
+	}
 
 	Msg( "reading %s\n", mapFile );
+	PhaseProfile_Begin( "LoadBSPFile" );
 	LoadBSPFile( mapFile );
+	PhaseProfile_End();
 	if( numnodes == 0 || numfaces == 0 )
 	{
 		Error( "Empty map" );
@@ -1268,14 +1394,26 @@ int RunVVis( int argc, char** argv )
 	}
 	strcat( portalfile, ".prt" );
 
+	V_snprintf( g_szVisCacheFile, sizeof( g_szVisCacheFile ), "%s.vviscache", source );
+
 	Msg( "reading %s\n", portalfile );
+	PhaseProfile_Begin( "LoadPortals" );
 	LoadPortals( portalfile );
+	PhaseProfile_End();
+
+	Dist_HashFile( mapFile );
+	Dist_HashFile( portalfile );
 
 	// don't write out results when simply doing a trace
 	if( g_TraceClusterStart < 0 )
 	{
+		PhaseProfile_Begin( "CalcVis" );
 		CalcVis();
+		PhaseProfile_End();
+
+		PhaseProfile_Begin( "CalcPAS" );
 		CalcPAS();
+		PhaseProfile_End();
 
 		// We need a mapping from cluster to leaves, since the PVS
 		// deals with clusters for both CalcVisibleFogVolumes and
@@ -1288,7 +1426,9 @@ int RunVVis( int argc, char** argv )
 		Msg( "visdatasize:%i  compressed from %i\n", visdatasize, originalvismapsize * 2 );
 
 		Msg( "writing %s\n", mapFile );
+		PhaseProfile_Begin( "WriteBSPFile" );
 		WriteBSPFile( mapFile );
+		PhaseProfile_End();
 	}
 	else
 	{
@@ -1302,6 +1442,10 @@ int RunVVis( int argc, char** argv )
 			Warning( "Can't compile trace in MPI mode\n" );
 		}
 #endif // MPI && _WIN32
+		if( g_bDistWorker )
+		{
+			Error( "Can't compile trace in distributed mode\n" );
+		}
 		CalcVisTrace();
 		WritePortalTrace( source );
 	}
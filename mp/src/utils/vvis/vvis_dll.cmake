@@ -7,6 +7,7 @@ set(
 	"${SRCDIR}/utils/common/bsplib.cpp"
 	"${SRCDIR}/utils/common/cmdlib.cpp"
 	"${SRCDIR}/public/collisionutils.cpp"
+	"${SRCDIR}/utils/common/distribute.cpp"
 	"${SRCDIR}/public/filesystem_init.cpp"
 	"${SRCDIR}/public/filesystem_helpers.cpp"
 	"${VVIS_DLL_DIR}/flow.cpp"
@@ -16,6 +17,7 @@ set(
 	"$<${IS_WINDOWS}:${VVIS_DLL_DIR}/mpivis.cpp>"
 	"$<${IS_WINDOWS}:${SRCDIR}/utils/common/MySqlDatabase.cpp>"
 	"${SRCDIR}/utils/common/pacifier.cpp"
+	"${SRCDIR}/utils/common/phaseprofile.cpp"
 	"${SRCDIR}/public/scratchpad3d.cpp"
 	"${SRCDIR}/utils/common/scratchpad_helpers.cpp"
 	"${SRCDIR}/utils/common/scriplib.cpp"
@@ -23,6 +25,7 @@ set(
 	"${SRCDIR}/utils/common/tools_minidump.cpp"
 	"${SRCDIR}/utils/common/tools_minidump.h"
 	"$<${IS_WINDOWS}:${SRCDIR}/utils/common/vmpi_tools_shared.cpp>"
+	"${VVIS_DLL_DIR}/viscache.cpp"
 	"${VVIS_DLL_DIR}/vvis.cpp"
 	"${VVIS_DLL_DIR}/WaterDist.cpp"
 	"${SRCDIR}/public/zip_utils.cpp"
@@ -39,6 +42,7 @@ set(
 	"${SRCDIR}/public/tier1/checksum_crc.h"
 	"${SRCDIR}/public/tier1/checksum_md5.h"
 	"${SRCDIR}/utils/common/cmdlib.h"
+	"${SRCDIR}/utils/common/distribute.h"
 	"${SRCDIR}/public/cmodel.h"
 	"${SRCDIR}/public/tier0/commonmacros.h"
 	"${SRCDIR}/public/GameBSPFile.h"
@@ -47,6 +51,7 @@ set(
 	"${VVIS_DLL_DIR}/mpivis.h"
 	"${SRCDIR}/utils/common/MySqlDatabase.h"
 	"${SRCDIR}/utils/common/pacifier.h"
+	"${SRCDIR}/utils/common/phaseprofile.h"
 	"${SRCDIR}/utils/common/scriplib.h"
 	"${SRCDIR}/public/tier1/strtools.h"
 	"${SRCDIR}/utils/common/threads.h"
@@ -60,6 +65,7 @@ set(
 	"${SRCDIR}/public/mathlib/vector.h"
 	"${SRCDIR}/public/mathlib/vector2d.h"
 	"${VVIS_DLL_DIR}/vis.h"
+	"${VVIS_DLL_DIR}/visbits.h"
 	"${SRCDIR}/utils/vmpi/vmpi_distribute_work.h"
 	"${SRCDIR}/utils/common/vmpi_tools_shared.h"
 	"${SRCDIR}/public/vstdlib/vstdlib.h"